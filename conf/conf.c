@@ -104,6 +104,8 @@ config_alloc(const byte *name)
   c->tf_route = c->tf_proto = (struct timeformat){"%T", "%F", 20*3600};
   c->tf_base = c->tf_log = (struct timeformat){"%F %T", NULL, 0};
   c->gr_wait = DEFAULT_GR_WAIT;
+  c->filter_bytecode = 1;
+  init_list(&c->filters);
 
   return c;
 }
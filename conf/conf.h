@@ -23,6 +23,7 @@ struct config {
   list tables;				/* Configured routing tables (struct rtable_config) */
   list roa_tables;			/* Configured ROA tables (struct roa_table_config) */
   list logfiles;			/* Configured log files (sysdep) */
+  list filters;				/* Named filters and functions (struct f_code) */
 
   int mrtdump_file;			/* Configured MRTDump file (sysdep, fd in unix) */
   char *syslog_name;			/* Name used for syslog (NULL -> no syslog) */
@@ -46,6 +47,8 @@ struct config {
   u32 latency_limit;			/* Events with longer duration are logged (us) */
   u32 watchdog_warning;			/* I/O loop watchdog limit for warning (us) */
   u32 watchdog_timeout;			/* Watchdog timeout (in seconds, 0 = disabled) */
+  int filter_stats;			/* Collect filter statistics */
+  int filter_bytecode;			/* Run filters compiled to bytecode */
   char *err_msg;			/* Parser error message */
   int err_lino;				/* Line containing error */
   int err_chno;				/* Character where the parser stopped */
@@ -33,16 +33,20 @@
 
 #undef LOCAL_DEBUG
 
+#include <stdlib.h>
+
 #include "nest/bird.h"
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/socket.h"
 #include "lib/string.h"
 #include "lib/unaligned.h"
+#include "lib/hash.h"
 #include "nest/route.h"
 #include "nest/protocol.h"
 #include "nest/iface.h"
 #include "nest/attrs.h"
+#include "nest/cli.h"
 #include "conf/conf.h"
 #include "filter/filter.h"
 
@@ -103,18 +107,6 @@ u64_cmp(u64 i1, u64 i2)
   return (int)(i1 > i2) - (int)(i1 < i2);
 }
 
-static inline int
-lcomm_cmp(lcomm v1, lcomm v2)
-{
-  if (v1.asn != v2.asn)
-    return (v1.asn > v2.asn) ? 1 : -1;
-  if (v1.ldp1 != v2.ldp1)
-    return (v1.ldp1 > v2.ldp1) ? 1 : -1;
-  if (v1.ldp2 != v2.ldp2)
-    return (v1.ldp2 > v2.ldp2) ? 1 : -1;
-  return 0;
-}
-
 /**
  * val_compare - compare two values
  * @v1: first value
@@ -295,6 +287,14 @@ clist_match_set(struct adata *clist, struct f_tree *set)
   u32 *l = (u32 *) clist->data;
   u32 *end = l + clist->length/4;
 
+  /* Trees of IP addresses need implicit conversion by find_tree() */
+  if (v.type == set->from.type) {
+    while (l < end)
+      if (tree_contains_int(set, *l++))
+	return 1;
+    return 0;
+  }
+
   while (l < end) {
     v.val.i = *l++;
     if (find_tree(set, v))
@@ -312,17 +312,13 @@ eclist_match_set(struct adata *list, struct f_tree *set)
   if (!eclist_set_type(set))
     return CMP_ERROR;
 
-  struct f_val v;
   u32 *l = int_set_get_data(list);
   int len = int_set_get_size(list);
   int i;
 
-  v.type = T_EC;
-  for (i = 0; i < len; i += 2) {
-    v.val.ec = ec_get(l, i);
-    if (find_tree(set, v))
+  for (i = 0; i < len; i += 2)
+    if (find_tree_ec(set, ec_get(l, i)))
       return 1;
-  }
 
   return 0;
 }
@@ -336,17 +332,13 @@ lclist_match_set(struct adata *list, struct f_tree *set)
   if (!lclist_set_type(set))
     return CMP_ERROR;
 
-  struct f_val v;
   u32 *l = int_set_get_data(list);
   int len = int_set_get_size(list);
   int i;
 
-  v.type = T_LC;
-  for (i = 0; i < len; i += 3) {
-    v.val.lc = lc_get(l, i);
-    if (find_tree(set, v))
+  for (i = 0; i < len; i += 3)
+    if (find_tree_lc(set, lc_get(l, i)))
       return 1;
-  }
 
   return 0;
 }
@@ -357,12 +349,15 @@ clist_filter(struct linpool *pool, struct adata *list, struct f_val set, int pos
   if (!list)
     return NULL;
 
-  int tree = (set.type == T_SET);	/* 1 -> set is T_SET, 0 -> set is T_CLIST */
+  if (set.type != T_SET)	/* Set is T_CLIST */
+    return int_set_filter(pool, list, set.val.ad, pos);
+
+  struct f_tree *t = set.val.t;
   struct f_val v;
-  if (tree)
-    clist_set_type(set.val.t, &v);
-  else
-    v.type = T_PAIR;
+  clist_set_type(t, &v);
+
+  /* Trees of IP addresses need implicit conversion by find_tree() */
+  int fast = (v.type == t->from.type);
 
   int len = int_set_get_size(list);
   u32 *l = int_set_get_data(list);
@@ -372,8 +367,8 @@ clist_filter(struct linpool *pool, struct adata *list, struct f_val set, int pos
 
   while (l < end) {
     v.val.i = *l++;
-    /* pos && member(val, set) || !pos && !member(val, set),  member() depends on tree */
-    if ((tree ? !!find_tree(set.val.t, v) : int_set_contains(set.val.ad, v.val.i)) == pos)
+    /* pos && member(val, set) || !pos && !member(val, set) */
+    if ((fast ? tree_contains_int(t, v.val.i) : !!find_tree(t, v)) == pos)
       *k++ = v.val.i;
   }
 
@@ -392,8 +387,8 @@ eclist_filter(struct linpool *pool, struct adata *list, struct f_val set, int po
   if (!list)
     return NULL;
 
-  int tree = (set.type == T_SET);	/* 1 -> set is T_SET, 0 -> set is T_CLIST */
-  struct f_val v;
+  if (set.type != T_SET)	/* Set is T_ECLIST */
+    return ec_set_filter(pool, list, set.val.ad, pos);
 
   int len = int_set_get_size(list);
   u32 *l = int_set_get_data(list);
@@ -401,11 +396,9 @@ eclist_filter(struct linpool *pool, struct adata *list, struct f_val set, int po
   u32 *k = tmp;
   int i;
 
-  v.type = T_EC;
   for (i = 0; i < len; i += 2) {
-    v.val.ec = ec_get(l, i);
-    /* pos && member(val, set) || !pos && !member(val, set),  member() depends on tree */
-    if ((tree ? !!find_tree(set.val.t, v) : ec_set_contains(set.val.ad, v.val.ec)) == pos) {
+    /* pos && member(val, set) || !pos && !member(val, set) */
+    if (!!find_tree_ec(set.val.t, ec_get(l, i)) == pos) {
       *k++ = l[i];
       *k++ = l[i+1];
     }
@@ -426,8 +419,8 @@ lclist_filter(struct linpool *pool, struct adata *list, struct f_val set, int po
   if (!list)
     return NULL;
 
-  int tree = (set.type == T_SET);	/* 1 -> set is T_SET, 0 -> set is T_CLIST */
-  struct f_val v;
+  if (set.type != T_SET)	/* Set is T_LCLIST */
+    return lc_set_filter(pool, list, set.val.ad, pos);
 
   int len = int_set_get_size(list);
   u32 *l = int_set_get_data(list);
@@ -435,11 +428,9 @@ lclist_filter(struct linpool *pool, struct adata *list, struct f_val set, int po
   u32 *k = tmp;
   int i;
 
-  v.type = T_LC;
   for (i = 0; i < len; i += 3) {
-    v.val.lc = lc_get(l, i);
-    /* pos && member(val, set) || !pos && !member(val, set),  member() depends on tree */
-    if ((tree ? !!find_tree(set.val.t, v) : lc_set_contains(set.val.ad, v.val.lc)) == pos)
+    /* pos && member(val, set) || !pos && !member(val, set) */
+    if (!!find_tree_lc(set.val.t, lc_get(l, i)) == pos)
       k = lc_copy(k, l+i);
   }
 
@@ -497,6 +488,10 @@ val_in_range(struct f_val v1, struct f_val v2)
   if (v2.type != T_SET)
     return CMP_ERROR;
 
+  /* Indexed sets of integers */
+  if (v2.val.t->index && (v1.type == v2.val.t->from.type))
+    return tree_contains_int(v2.val.t, v1.val.i);
+
   /* With integrated Quad<->IP implicit conversion */
   if ((v1.type == v2.val.t->from.type) ||
       ((IP_VERSION == 4) && (v1.type == T_QUAD) && (v2.val.t->from.type == T_IP)))
@@ -554,6 +549,7 @@ static struct ea_list **f_tmp_attrs;
 static struct linpool *f_pool;
 static struct buffer f_buf;
 static int f_flags;
+static int f_profile;			/* Collect statistics, see filter_show_stats() */
 
 static inline void f_rte_cow(void)
 {
@@ -611,6 +607,396 @@ static struct tbf rl_runtime_err = TBF_DEFAULT_LOG_LIMITS;
 #define BITFIELD_MASK(what) \
   (1u << (what->a2.i >> 24))
 
+/*
+ * Attribute access and list operations shared by interpret_one() and
+ * f_exec_code(). Functions that may fail return an error message to be
+ * reported by the caller as a run-time error, or NULL.
+ */
+
+static eattr *
+f_ea_find(u16 code)
+{
+  eattr *e = NULL;
+
+  if (!(f_flags & FF_FORCE_TMPATTR))
+    e = ea_find((*f_rte)->attrs->eattrs, code);
+  if (!e)
+    e = ea_find((*f_tmp_attrs), code);
+  if ((!e) && (f_flags & FF_FORCE_TMPATTR))
+    e = ea_find((*f_rte)->attrs->eattrs, code);
+
+  return e;
+}
+
+/* Get extended attribute, a2 = code, aux = type */
+static struct f_val
+f_ea_get(struct f_inst *what)
+{
+  struct f_val res = { .type = T_VOID };
+  eattr *e = f_ea_find(what->a2.i);
+
+  if (!e) {
+    /* A special case: undefined int_set looks like empty int_set */
+    if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_INT_SET) {
+      res.type = T_CLIST;
+      res.val.ad = adata_empty(f_pool, 0);
+      return res;
+    }
+
+    /* The same special case for ec_set */
+    if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_EC_SET) {
+      res.type = T_ECLIST;
+      res.val.ad = adata_empty(f_pool, 0);
+      return res;
+    }
+
+    /* The same special case for lc_set */
+    if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_LC_SET) {
+      res.type = T_LCLIST;
+      res.val.ad = adata_empty(f_pool, 0);
+      return res;
+    }
+
+    /* Undefined value */
+    return res;
+  }
+
+  switch (what->aux & EAF_TYPE_MASK) {
+  case EAF_TYPE_INT:
+    res.type = T_INT;
+    res.val.i = e->u.data;
+    break;
+  case EAF_TYPE_STRING:
+    res.type = T_STRING;
+    res.val.s = e->u.ptr->data;
+    break;
+  case EAF_TYPE_ROUTER_ID:
+    res.type = T_QUAD;
+    res.val.i = e->u.data;
+    break;
+  case EAF_TYPE_OPAQUE:
+    res.type = T_ENUM_EMPTY;
+    res.val.i = 0;
+    break;
+  case EAF_TYPE_IP_ADDRESS:
+    res.type = T_IP;
+    struct adata * ad = e->u.ptr;
+    res.val.px.ip = * (ip_addr *) ad->data;
+    break;
+  case EAF_TYPE_AS_PATH:
+    res.type = T_PATH;
+    res.val.ad = e->u.ptr;
+    break;
+  case EAF_TYPE_BITFIELD:
+    res.type = T_BOOL;
+    res.val.i = !!(e->u.data & BITFIELD_MASK(what));
+    break;
+  case EAF_TYPE_INT_SET:
+    res.type = T_CLIST;
+    res.val.ad = e->u.ptr;
+    break;
+  case EAF_TYPE_EC_SET:
+    res.type = T_ECLIST;
+    res.val.ad = e->u.ptr;
+    break;
+  case EAF_TYPE_LC_SET:
+    res.type = T_LCLIST;
+    res.val.ad = e->u.ptr;
+    break;
+  case EAF_TYPE_UNDEF:
+    res.type = T_VOID;
+    break;
+  default:
+    bug("Unknown type in e,a");
+  }
+
+  return res;
+}
+
+/* Set extended attribute to @v1, a2 = code, aux = type */
+static const char *
+f_ea_set(struct f_inst *what, struct f_val v1)
+{
+  struct ea_list *l = lp_alloc(f_pool, sizeof(struct ea_list) + sizeof(eattr));
+  u16 code = what->a2.i;
+  struct adata *ad;
+  int len;
+
+  l->next = NULL;
+  l->flags = EALF_SORTED;
+  l->count = 1;
+  l->attrs[0].id = code;
+  l->attrs[0].flags = 0;
+  l->attrs[0].type = what->aux | EAF_ORIGINATED;
+
+  switch (what->aux & EAF_TYPE_MASK) {
+  case EAF_TYPE_INT:
+    // Enums are also ints, so allow them in.
+    if (v1.type != T_INT && (v1.type < T_ENUM_LO || v1.type > T_ENUM_HI))
+      return "Setting int attribute to non-int value";
+    l->attrs[0].u.data = v1.val.i;
+    break;
+
+  case EAF_TYPE_STRING:
+    if (v1.type != T_STRING)
+      return "Setting string attribute to non-string value";
+    len = strlen(v1.val.s) + 1;
+    ad = lp_alloc(f_pool, sizeof(struct adata) + len);
+    ad->length = len;
+    strcpy(ad->data, v1.val.s);
+    l->attrs[0].u.ptr = ad;
+    break;
+
+  case EAF_TYPE_ROUTER_ID:
+#ifndef IPV6
+    /* IP->Quad implicit conversion */
+    if (v1.type == T_IP) {
+      l->attrs[0].u.data = ipa_to_u32(v1.val.px.ip);
+      break;
+    }
+#endif
+    /* T_INT for backward compatibility */
+    if ((v1.type != T_QUAD) && (v1.type != T_INT))
+      return "Setting quad attribute to non-quad value";
+    l->attrs[0].u.data = v1.val.i;
+    break;
+
+  case EAF_TYPE_OPAQUE:
+    return "Setting opaque attribute is not allowed";
+  case EAF_TYPE_IP_ADDRESS:
+    if (v1.type != T_IP)
+      return "Setting ip attribute to non-ip value";
+    len = sizeof(ip_addr);
+    ad = lp_alloc(f_pool, sizeof(struct adata) + len);
+    ad->length = len;
+    (* (ip_addr *) ad->data) = v1.val.px.ip;
+    l->attrs[0].u.ptr = ad;
+    break;
+  case EAF_TYPE_AS_PATH:
+    if (v1.type != T_PATH)
+      return "Setting path attribute to non-path value";
+    l->attrs[0].u.ptr = v1.val.ad;
+    break;
+  case EAF_TYPE_BITFIELD:
+    if (v1.type != T_BOOL)
+      return "Setting bit in bitfield attribute to non-bool value";
+    {
+      /* First, we have to find the old value */
+      eattr *e = f_ea_find(code);
+      u32 data = e ? e->u.data : 0;
+
+      if (v1.val.i)
+	l->attrs[0].u.data = data | BITFIELD_MASK(what);
+      else
+	l->attrs[0].u.data = data & ~BITFIELD_MASK(what);
+    }
+    break;
+  case EAF_TYPE_INT_SET:
+    if (v1.type != T_CLIST)
+      return "Setting clist attribute to non-clist value";
+    l->attrs[0].u.ptr = v1.val.ad;
+    break;
+  case EAF_TYPE_EC_SET:
+    if (v1.type != T_ECLIST)
+      return "Setting eclist attribute to non-eclist value";
+    l->attrs[0].u.ptr = v1.val.ad;
+    break;
+  case EAF_TYPE_LC_SET:
+    if (v1.type != T_LCLIST)
+      return "Setting lclist attribute to non-lclist value";
+    l->attrs[0].u.ptr = v1.val.ad;
+    break;
+  case EAF_TYPE_UNDEF:
+    if (v1.type != T_VOID)
+      return "Setting void attribute to non-void value";
+    l->attrs[0].u.data = 0;
+    break;
+  default: bug("Unknown type in e,S");
+  }
+
+  if (!(what->aux & EAF_TEMP) && (!(f_flags & FF_FORCE_TMPATTR))) {
+    f_rta_cow();
+    l->next = (*f_rte)->attrs->eattrs;
+    (*f_rte)->attrs->eattrs = l;
+  } else {
+    l->next = (*f_tmp_attrs);
+    (*f_tmp_attrs) = l;
+  }
+
+  return NULL;
+}
+
+/* Add, delete or filter items of path or (extended, large) community list @v1, aux = operation */
+static const char *
+f_clist_add_del(struct f_inst *what, struct f_val v1, struct f_val v2, struct f_val *res)
+{
+  if (v1.type == T_PATH)
+  {
+    struct f_tree *set = NULL;
+    u32 key = 0;
+    int pos;
+
+    if (v2.type == T_INT)
+      key = v2.val.i;
+    else if ((v2.type == T_SET) && (v2.val.t->from.type == T_INT))
+      set = v2.val.t;
+    else
+      return "Can't delete non-integer (set)";
+
+    switch (what->aux)
+    {
+    case 'a':	return "Can't add to path";
+    case 'd':	pos = 0; break;
+    case 'f':	pos = 1; break;
+    default:	bug("unknown Ca operation");
+    }
+
+    if (pos && !set)
+      return "Can't filter integer";
+
+    res->type = T_PATH;
+    res->val.ad = as_path_filter(f_pool, v1.val.ad, set, key, pos);
+  }
+  else if (v1.type == T_CLIST)
+  {
+    /* Community (or cluster) list */
+    struct f_val dummy;
+    int arg_set = 0;
+    uint n = 0;
+
+    if ((v2.type == T_PAIR) || (v2.type == T_QUAD))
+      n = v2.val.i;
+#ifndef IPV6
+    /* IP->Quad implicit conversion */
+    else if (v2.type == T_IP)
+      n = ipa_to_u32(v2.val.px.ip);
+#endif
+    else if ((v2.type == T_SET) && clist_set_type(v2.val.t, &dummy))
+      arg_set = 1;
+    else if (v2.type == T_CLIST)
+      arg_set = 2;
+    else
+      return "Can't add/delete non-pair";
+
+    res->type = T_CLIST;
+    switch (what->aux)
+    {
+    case 'a':
+      if (arg_set == 1)
+	return "Can't add set";
+      else if (!arg_set)
+	res->val.ad = int_set_add(f_pool, v1.val.ad, n);
+      else
+	res->val.ad = int_set_union(f_pool, v1.val.ad, v2.val.ad);
+      break;
+
+    case 'd':
+      if (!arg_set)
+	res->val.ad = int_set_del(f_pool, v1.val.ad, n);
+      else
+	res->val.ad = clist_filter(f_pool, v1.val.ad, v2, 0);
+      break;
+
+    case 'f':
+      if (!arg_set)
+	return "Can't filter pair";
+      res->val.ad = clist_filter(f_pool, v1.val.ad, v2, 1);
+      break;
+
+    default:
+      bug("unknown Ca operation");
+    }
+  }
+  else if (v1.type == T_ECLIST)
+  {
+    /* Extended community list */
+    int arg_set = 0;
+
+    /* v2.val is either EC or EC-set */
+    if ((v2.type == T_SET) && eclist_set_type(v2.val.t))
+      arg_set = 1;
+    else if (v2.type == T_ECLIST)
+      arg_set = 2;
+    else if (v2.type != T_EC)
+      return "Can't add/delete non-ec";
+
+    res->type = T_ECLIST;
+    switch (what->aux)
+    {
+    case 'a':
+      if (arg_set == 1)
+	return "Can't add set";
+      else if (!arg_set)
+	res->val.ad = ec_set_add(f_pool, v1.val.ad, v2.val.ec);
+      else
+	res->val.ad = ec_set_union(f_pool, v1.val.ad, v2.val.ad);
+      break;
+
+    case 'd':
+      if (!arg_set)
+	res->val.ad = ec_set_del(f_pool, v1.val.ad, v2.val.ec);
+      else
+	res->val.ad = eclist_filter(f_pool, v1.val.ad, v2, 0);
+      break;
+
+    case 'f':
+      if (!arg_set)
+	return "Can't filter ec";
+      res->val.ad = eclist_filter(f_pool, v1.val.ad, v2, 1);
+      break;
+
+    default:
+      bug("unknown Ca operation");
+    }
+  }
+  else if (v1.type == T_LCLIST)
+  {
+    /* Large community list */
+    int arg_set = 0;
+
+    /* v2.val is either LC or LC-set */
+    if ((v2.type == T_SET) && lclist_set_type(v2.val.t))
+      arg_set = 1;
+    else if (v2.type == T_LCLIST)
+      arg_set = 2;
+    else if (v2.type != T_LC)
+      return "Can't add/delete non-lc";
+
+    res->type = T_LCLIST;
+    switch (what->aux)
+    {
+    case 'a':
+      if (arg_set == 1)
+	return "Can't add set";
+      else if (!arg_set)
+	res->val.ad = lc_set_add(f_pool, v1.val.ad, v2.val.lc);
+      else
+	res->val.ad = lc_set_union(f_pool, v1.val.ad, v2.val.ad);
+      break;
+
+    case 'd':
+      if (!arg_set)
+	res->val.ad = lc_set_del(f_pool, v1.val.ad, v2.val.lc);
+      else
+	res->val.ad = lclist_filter(f_pool, v1.val.ad, v2, 0);
+      break;
+
+    case 'f':
+      if (!arg_set)
+	return "Can't filter lc";
+      res->val.ad = lclist_filter(f_pool, v1.val.ad, v2, 1);
+      break;
+
+    default:
+      bug("unknown Ca operation");
+    }
+  }
+  else
+    return "Can't add/delete to non-[e|l]clist";
+
+  return NULL;
+}
+
 /**
  * interpret
  * @what: filter to interpret
@@ -628,19 +1014,35 @@ static struct tbf rl_runtime_err = TBF_DEFAULT_LOG_LIMITS;
  * &f_val structures are copied around, so there are no problems with
  * memory managment.
  */
+static struct f_val interpret_one(struct f_inst *what);
+
 static struct f_val
 interpret(struct f_inst *what)
+{
+  struct f_val res = { .type = T_VOID };
+
+  for ( ; what; what = what->next) {
+    res = interpret_one(what);
+    if (res.type & T_RETURN)
+      return res;
+  }
+
+  return res;
+}
+
+/*
+ * Interpret one instruction, see interpret() above. Its arguments are
+ * evaluated recursively, but the rest of the chain is not.
+ */
+static struct f_val
+interpret_one(struct f_inst *what)
 {
   struct symbol *sym;
   struct f_val v1, v2, res = { .type = T_VOID }, *vp;
   unsigned u1, u2;
   int i;
   u32 as;
-  int len;
-  struct adata *ad;
 
-  for ( ; what; what = what->next) {
-  res.type = T_VOID;
   switch(what->fi_code) {
 /* Binary operators */
   case FI_ADD:
@@ -778,10 +1180,11 @@ interpret(struct f_inst *what)
       struct f_path_mask *tt = what->a1.p, *vbegin, **vv = &vbegin;
 
       while (tt) {
-	*vv = lp_alloc(f_pool, sizeof(struct f_path_mask));
+	*vv = lp_allocz(f_pool, sizeof(struct f_path_mask));
 	if (tt->kind == PM_ASN_EXPR) {
 	  struct f_val res = interpret((struct f_inst *) tt->val);
 	  (*vv)->kind = PM_ASN;
+	  (*vv)->aut = NULL;
 	  if (res.type != T_INT) {
 	    runtime( "Error resolving path mask template: value not an integer" );
 	    return (struct f_val) { .type = T_VOID };
@@ -1023,208 +1426,15 @@ interpret(struct f_inst *what)
     break;
   case FI_EA_GET:	/* Access to extended attributes */
     ACCESS_RTE;
-    {
-      eattr *e = NULL;
-      u16 code = what->a2.i;
-
-      if (!(f_flags & FF_FORCE_TMPATTR))
-	e = ea_find((*f_rte)->attrs->eattrs, code);
-      if (!e)
-	e = ea_find((*f_tmp_attrs), code);
-      if ((!e) && (f_flags & FF_FORCE_TMPATTR))
-	e = ea_find((*f_rte)->attrs->eattrs, code);
-
-      if (!e) {
-	/* A special case: undefined int_set looks like empty int_set */
-	if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_INT_SET) {
-	  res.type = T_CLIST;
-	  res.val.ad = adata_empty(f_pool, 0);
-	  break;
-	}
-
-	/* The same special case for ec_set */
-	if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_EC_SET) {
-	  res.type = T_ECLIST;
-	  res.val.ad = adata_empty(f_pool, 0);
-	  break;
-	}
-
-	/* The same special case for lc_set */
-	if ((what->aux & EAF_TYPE_MASK) == EAF_TYPE_LC_SET) {
-	  res.type = T_LCLIST;
-	  res.val.ad = adata_empty(f_pool, 0);
-	  break;
-	}
-
-	/* Undefined value */
-	res.type = T_VOID;
-	break;
-      }
-
-      switch (what->aux & EAF_TYPE_MASK) {
-      case EAF_TYPE_INT:
-	res.type = T_INT;
-	res.val.i = e->u.data;
-	break;
-      case EAF_TYPE_STRING:
-        res.type = T_STRING;
-        res.val.s = e->u.ptr->data;
-        break;
-      case EAF_TYPE_ROUTER_ID:
-	res.type = T_QUAD;
-	res.val.i = e->u.data;
-	break;
-      case EAF_TYPE_OPAQUE:
-	res.type = T_ENUM_EMPTY;
-	res.val.i = 0;
-	break;
-      case EAF_TYPE_IP_ADDRESS:
-	res.type = T_IP;
-	struct adata * ad = e->u.ptr;
-	res.val.px.ip = * (ip_addr *) ad->data;
-	break;
-      case EAF_TYPE_AS_PATH:
-        res.type = T_PATH;
-	res.val.ad = e->u.ptr;
-	break;
-      case EAF_TYPE_BITFIELD:
-	res.type = T_BOOL;
-	res.val.i = !!(e->u.data & BITFIELD_MASK(what));
-	break;
-      case EAF_TYPE_INT_SET:
-	res.type = T_CLIST;
-	res.val.ad = e->u.ptr;
-	break;
-      case EAF_TYPE_EC_SET:
-	res.type = T_ECLIST;
-	res.val.ad = e->u.ptr;
-	break;
-      case EAF_TYPE_LC_SET:
-	res.type = T_LCLIST;
-	res.val.ad = e->u.ptr;
-	break;
-      case EAF_TYPE_UNDEF:
-	res.type = T_VOID;
-	break;
-      default:
-	bug("Unknown type in e,a");
-      }
-    }
+    res = f_ea_get(what);
     break;
   case FI_EA_SET:
     ACCESS_RTE;
     ONEARG;
     {
-      struct ea_list *l = lp_alloc(f_pool, sizeof(struct ea_list) + sizeof(eattr));
-      u16 code = what->a2.i;
-
-      l->next = NULL;
-      l->flags = EALF_SORTED;
-      l->count = 1;
-      l->attrs[0].id = code;
-      l->attrs[0].flags = 0;
-      l->attrs[0].type = what->aux | EAF_ORIGINATED;
-
-      switch (what->aux & EAF_TYPE_MASK) {
-      case EAF_TYPE_INT:
-	// Enums are also ints, so allow them in.
-	if (v1.type != T_INT && (v1.type < T_ENUM_LO || v1.type > T_ENUM_HI))
-	  runtime( "Setting int attribute to non-int value" );
-	l->attrs[0].u.data = v1.val.i;
-	break;
-
-      case EAF_TYPE_STRING:
-        if (v1.type != T_STRING)
-          runtime( "Setting string attribute to non-string value" );
-        len = strlen(v1.val.s) + 1;
-	ad = lp_alloc(f_pool, sizeof(struct adata) + len);
-        ad->length = len;
-        strcpy(ad->data, v1.val.s);
-        l->attrs[0].u.ptr = ad;
-        break;
-
-      case EAF_TYPE_ROUTER_ID:
-#ifndef IPV6
-	/* IP->Quad implicit conversion */
-	if (v1.type == T_IP) {
-	  l->attrs[0].u.data = ipa_to_u32(v1.val.px.ip);
-	  break;
-	}
-#endif
-	/* T_INT for backward compatibility */
-	if ((v1.type != T_QUAD) && (v1.type != T_INT))
-	  runtime( "Setting quad attribute to non-quad value" );
-	l->attrs[0].u.data = v1.val.i;
-	break;
-
-      case EAF_TYPE_OPAQUE:
-	runtime( "Setting opaque attribute is not allowed" );
-	break;
-      case EAF_TYPE_IP_ADDRESS:
-	if (v1.type != T_IP)
-	  runtime( "Setting ip attribute to non-ip value" );
-	len = sizeof(ip_addr);
-	ad = lp_alloc(f_pool, sizeof(struct adata) + len);
-	ad->length = len;
-	(* (ip_addr *) ad->data) = v1.val.px.ip;
-	l->attrs[0].u.ptr = ad;
-	break;
-      case EAF_TYPE_AS_PATH:
-	if (v1.type != T_PATH)
-	  runtime( "Setting path attribute to non-path value" );
-	l->attrs[0].u.ptr = v1.val.ad;
-	break;
-      case EAF_TYPE_BITFIELD:
-	if (v1.type != T_BOOL)
-	  runtime( "Setting bit in bitfield attribute to non-bool value" );
-	{
-	  /* First, we have to find the old value */
-	  eattr *e = NULL;
-	  if (!(f_flags & FF_FORCE_TMPATTR))
-	    e = ea_find((*f_rte)->attrs->eattrs, code);
-	  if (!e)
-	    e = ea_find((*f_tmp_attrs), code);
-	  if ((!e) && (f_flags & FF_FORCE_TMPATTR))
-	    e = ea_find((*f_rte)->attrs->eattrs, code);
-	  u32 data = e ? e->u.data : 0;
-
-	  if (v1.val.i)
-	    l->attrs[0].u.data = data | BITFIELD_MASK(what);
-	  else
-	    l->attrs[0].u.data = data & ~BITFIELD_MASK(what);;
-	}
-	break;
-      case EAF_TYPE_INT_SET:
-	if (v1.type != T_CLIST)
-	  runtime( "Setting clist attribute to non-clist value" );
-	l->attrs[0].u.ptr = v1.val.ad;
-	break;
-      case EAF_TYPE_EC_SET:
-	if (v1.type != T_ECLIST)
-	  runtime( "Setting eclist attribute to non-eclist value" );
-	l->attrs[0].u.ptr = v1.val.ad;
-	break;
-      case EAF_TYPE_LC_SET:
-	if (v1.type != T_LCLIST)
-	  runtime( "Setting lclist attribute to non-lclist value" );
-	l->attrs[0].u.ptr = v1.val.ad;
-	break;
-      case EAF_TYPE_UNDEF:
-	if (v1.type != T_VOID)
-	  runtime( "Setting void attribute to non-void value" );
-	l->attrs[0].u.data = 0;
-	break;
-      default: bug("Unknown type in e,S");
-      }
-
-      if (!(what->aux & EAF_TEMP) && (!(f_flags & FF_FORCE_TMPATTR))) {
-	f_rta_cow();
-	l->next = (*f_rte)->attrs->eattrs;
-	(*f_rte)->attrs->eattrs = l;
-      } else {
-	l->next = (*f_tmp_attrs);
-	(*f_tmp_attrs) = l;
-      }
+      const char *err = f_ea_set(what, v1);
+      if (err)
+	runtime(err);
     }
     break;
   case FI_PREF_GET:
@@ -1358,209 +1568,1261 @@ interpret(struct f_inst *what)
 
   case FI_CLIST_ADD_DEL:	/* (Extended) Community list add or delete */
     TWOARGS;
-    if (v1.type == T_PATH)
     {
-      struct f_tree *set = NULL;
-      u32 key = 0;
-      int pos;
-
-      if (v2.type == T_INT)
-	key = v2.val.i;
-      else if ((v2.type == T_SET) && (v2.val.t->from.type == T_INT))
-	set = v2.val.t;
-      else
-	runtime("Can't delete non-integer (set)");
-
-      switch (what->aux)
-      {
-      case 'a':	runtime("Can't add to path");
-      case 'd':	pos = 0; break;
-      case 'f':	pos = 1; break;
-      default:	bug("unknown Ca operation");
-      }
+      const char *err = f_clist_add_del(what, v1, v2, &res);
+      if (err)
+	runtime(err);
+    }
+    break;
 
-      if (pos && !set)
-	runtime("Can't filter integer");
+  case FI_ROA_CHECK:	/* ROA Check */
+    if (what->arg1)
+    {
+      TWOARGS;
+      if ((v1.type != T_PREFIX) || (v2.type != T_INT))
+	runtime("Invalid argument to roa_check()");
 
-      res.type = T_PATH;
-      res.val.ad = as_path_filter(f_pool, v1.val.ad, set, key, pos);
+      as = v2.val.i;
     }
-    else if (v1.type == T_CLIST)
+    else
     {
-      /* Community (or cluster) list */
-      struct f_val dummy;
-      int arg_set = 0;
-      uint n = 0;
+      ACCESS_RTE;
+      v1.val.px.ip = (*f_rte)->net->n.prefix;
+      v1.val.px.len = (*f_rte)->net->n.pxlen;
 
-      if ((v2.type == T_PAIR) || (v2.type == T_QUAD))
-	n = v2.val.i;
-#ifndef IPV6
-      /* IP->Quad implicit conversion */
-      else if (v2.type == T_IP)
-	n = ipa_to_u32(v2.val.px.ip);
-#endif
-      else if ((v2.type == T_SET) && clist_set_type(v2.val.t, &dummy))
-	arg_set = 1;
-      else if (v2.type == T_CLIST)
-	arg_set = 2;
-      else
-	runtime("Can't add/delete non-pair");
+      /* We ignore temporary attributes, probably not a problem here */
+      /* 0x02 is a value of BA_AS_PATH, we don't want to include BGP headers */
+      eattr *e = ea_find((*f_rte)->attrs->eattrs, EA_CODE(EAP_BGP, 0x02));
 
-      res.type = T_CLIST;
-      switch (what->aux)
-      {
-      case 'a':
-	if (arg_set == 1)
-	  runtime("Can't add set");
-	else if (!arg_set)
-	  res.val.ad = int_set_add(f_pool, v1.val.ad, n);
-	else
-	  res.val.ad = int_set_union(f_pool, v1.val.ad, v2.val.ad);
-	break;
+      if (!e || ((e->type & EAF_TYPE_MASK) != EAF_TYPE_AS_PATH))
+	runtime("Missing AS_PATH attribute");
 
-      case 'd':
-	if (!arg_set)
-	  res.val.ad = int_set_del(f_pool, v1.val.ad, n);
-	else
-	  res.val.ad = clist_filter(f_pool, v1.val.ad, v2, 0);
-	break;
+      as_path_get_last(e->u.ptr, &as);
+    }
 
-      case 'f':
-	if (!arg_set)
-	  runtime("Can't filter pair");
-	res.val.ad = clist_filter(f_pool, v1.val.ad, v2, 1);
-	break;
+    struct roa_table_config *rtc = ((struct f_inst_roa_check *) what)->rtc;
+    if (!rtc->table)
+      runtime("Missing ROA table");
 
-      default:
-	bug("unknown Ca operation");
-      }
+    res.type = T_ENUM_ROA;
+    res.val.i = roa_check(rtc->table, v1.val.px.ip, v1.val.px.len, as);
+
+    /* Record dependency for re-evaluation after ROA table changes */
+    if (roa_filter_ahook)
+      roa_add_dep(rtc->table, what->arg1 && !(f_rte && (v1.val.px.len == (*f_rte)->net->n.pxlen) &&
+					     ipa_equal(v1.val.px.ip, (*f_rte)->net->n.prefix)));
+    break;
+
+  default:
+    bug( "Unknown instruction %d (%c)", what->fi_code, what->fi_code & 0xff);
+  }
+  return res;
+}
+
+/*
+ *	Filter bytecode
+ *
+ * Filter trees are compiled by f_compile() to a flat array of &f_op's
+ * run by f_exec_code() on a stack of &f_val's. Conditionals and boolean
+ * operators are translated to jumps, function and case bodies are compiled
+ * separately (once) and called. Operations on constants are folded during
+ * compilation, and comparisons and arithmetic on arguments of statically
+ * known integral type skip run-time type checks.
+ *
+ * Extended attribute access, path and list operations have native ops
+ * sharing their implementation with the tree interpreter, and matching
+ * against constant sets looks up the set directly. Other instructions fall
+ * back to interpret_one(): leaves (static attribute access and similar) are
+ * executed directly, instructions with arguments get a private copy whose
+ * arguments are replaced by %FI_CONSTANT_INDIRECT slots, filled from the
+ * stack by the VM (%FO_EXEC). All run-time errors are reported the same way
+ * as by the tree interpreter.
+ */
+
+enum f_op_code {
+  FO_CONST,			/* Push constant */
+  FO_VAR,			/* Push value of variable */
+  FO_POP,			/* Drop top of the stack */
+  FO_TREE,			/* Push result of interpret_one() */
+  FO_EXEC,			/* Pop arguments to slots, push result of interpret_one() */
+  FO_ACCESS_RTE,		/* Check that we have a route */
+  FO_ADD, FO_SUBTRACT, FO_MULTIPLY, FO_DIVIDE,
+  FO_ADD_INT, FO_SUBTRACT_INT, FO_MULTIPLY_INT, FO_DIVIDE_INT,
+  FO_EQ, FO_NEQ, FO_LT, FO_LTE,
+  FO_EQ_INT, FO_NEQ_INT, FO_LT_INT, FO_LTE_INT,
+  FO_MATCH, FO_NOT_MATCH, FO_NOT, FO_DEFINED,
+  FO_MATCH_SET, FO_NOT_MATCH_SET,	/* Match against constant set or prefix set */
+  FO_EA_GET, FO_EA_SET, FO_EMPTY,
+  FO_LENGTH, FO_PATH_FIRST, FO_PATH_LAST, FO_PATH_LAST_NAG,
+  FO_PATH_PREPEND, FO_CLIST_ADD_DEL,
+  FO_ANDOR,			/* Pop first operand, short-circuit to target */
+  FO_ANDOR_END,			/* Check second operand */
+  FO_COND,			/* Pop condition, jump to target if false */
+  FO_JUMP,
+  FO_SET, FO_PRINT, FO_DIE, FO_RETURN, FO_CALL, FO_SWITCH
+};
+
+struct f_op {
+  u8 code;			/* FO_* */
+  u8 nargs;			/* Number of arguments of FO_EXEC */
+  uint target;			/* Jump target */
+  struct f_inst *inst;		/* Source instruction, for line numbers and fallback */
+  unsigned long hits;		/* Number of executions, if profiling */
+  union {
+    struct f_val val;		/* FO_CONST, FO_MATCH_SET */
+    struct f_val *vp;		/* FO_VAR */
+    struct f_val *slots;	/* FO_EXEC */
+    struct f_code *code;	/* FO_CALL */
+    struct f_tree *tree;	/* FO_SWITCH, data point to &f_code's */
+  } u;
+};
+
+struct f_stats {
+  unsigned long runs;		/* Number of invocations */
+  unsigned long accepted, rejected, errors; /* Invocations ending with accept, reject, error */
+  btime time, max_time;		/* Total and maximal time of one invocation (us) */
+};
+
+struct f_code {
+  node n;			/* Node in config->filters, if named */
+  struct symbol *sym;		/* Named filter or function */
+  struct f_inst *root;
+  struct f_op *ops;
+  uint len;
+  uint stack;			/* Maximal stack depth */
+  struct f_stats stats;
+};
+
+struct f_code_memo {
+  struct f_code_memo *next;
+  void *body;
+  struct f_code *code;
+};
+
+struct f_compiler {
+  linpool *lp;
+  struct f_code_memo *memo;	/* Compiled function and case bodies */
+};
+
+struct f_codebuf {
+  struct f_compiler *c;
+  struct f_op *ops;
+  uint len, size;
+  uint depth, max_depth;
+  int last_type;		/* Static type of top of the stack, 0 if unknown */
+};
+
+static void f_compile_chain(struct f_codebuf *b, struct f_inst *what);
+static struct f_code *f_compile_body(struct f_compiler *c, struct f_inst *body);
+
+static struct f_op *
+f_emit(struct f_codebuf *b, uint code, struct f_inst *inst, int stack)
+{
+  if (b->len == b->size)
+  {
+    b->size = b->size ? 2 * b->size : 16;
+    b->ops = xrealloc(b->ops, b->size * sizeof(struct f_op));
+  }
+
+  struct f_op *op = &b->ops[b->len++];
+  memset(op, 0, sizeof(struct f_op));
+  op->code = code;
+  op->inst = inst;
+
+  b->depth += stack;
+  b->max_depth = MAX(b->max_depth, b->depth);
+  b->last_type = 0;
+  return op;
+}
+
+static void
+f_emit_const(struct f_codebuf *b, struct f_inst *inst, struct f_val val)
+{
+  f_emit(b, FO_CONST, inst, 1)->u.val = val;
+  b->last_type = val.type;
+}
+
+/* Return the constant if the code from @pos on is a single FO_CONST */
+static struct f_val *
+f_const_at(struct f_codebuf *b, uint pos)
+{
+  return ((pos + 1 == b->len) && (b->ops[pos].code == FO_CONST)) ? &b->ops[pos].u.val : NULL;
+}
+
+/* Replace the code from @pos on by a constant */
+static void
+f_fold(struct f_codebuf *b, uint pos, struct f_inst *inst, struct f_val val)
+{
+  b->depth -= b->len - pos;
+  b->len = pos;
+  f_emit_const(b, inst, val);
+}
+
+static inline int
+f_type_integral(int type)
+{
+  switch (type)
+  {
+  case T_INT:
+  case T_BOOL:
+  case T_PAIR:
+  case T_QUAD:
+  case T_ENUM:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int
+f_fold_arith(uint code, uint a, uint b, uint *res)
+{
+  switch (code)
+  {
+  case FI_ADD:		*res = a + b; return 1;
+  case FI_SUBTRACT:	*res = a - b; return 1;
+  case FI_MULTIPLY:	*res = a * b; return 1;
+  case FI_DIVIDE:	if (!b) return 0; *res = a / b; return 1;
+  }
+  return 0;
+}
+
+static int
+f_fold_compare(uint code, uint a, uint b)
+{
+  switch (code)
+  {
+  case FI_EQ:	return a == b;
+  case FI_NEQ:	return a != b;
+  case FI_LT:	return a < b;
+  case FI_LTE:	return a <= b;
+  }
+  return 0;
+}
+
+static void
+f_compile_binary(struct f_codebuf *b, struct f_inst *what)
+{
+  uint p1 = b->len;
+  f_compile_chain(b, what->a1.p);
+  int t1 = b->last_type;
+  uint p2 = b->len;
+  f_compile_chain(b, what->a2.p);
+  int t2 = b->last_type;
+
+  struct f_val *k1 = ((p1 + 1 == p2) && (b->ops[p1].code == FO_CONST)) ? &b->ops[p1].u.val : NULL;
+  struct f_val *k2 = f_const_at(b, p2);
+  int arith = 0, fast = 0;
+  uint code;
+
+  switch (what->fi_code)
+  {
+  case FI_ADD:		code = FO_ADD; arith = 1; break;
+  case FI_SUBTRACT:	code = FO_SUBTRACT; arith = 1; break;
+  case FI_MULTIPLY:	code = FO_MULTIPLY; arith = 1; break;
+  case FI_DIVIDE:	code = FO_DIVIDE; arith = 1; break;
+  case FI_EQ:		code = FO_EQ; break;
+  case FI_NEQ:		code = FO_NEQ; break;
+  case FI_LT:		code = FO_LT; break;
+  case FI_LTE:		code = FO_LTE; break;
+  case FI_MATCH:	code = FO_MATCH; break;
+  case FI_NOT_MATCH:	code = FO_NOT_MATCH; break;
+  default:
+    bug("Unexpected binary instruction %x", what->fi_code);
+  }
+
+  if (arith)
+    fast = (t1 == T_INT) && (t2 == T_INT);
+  else if (code != FO_MATCH && code != FO_NOT_MATCH)
+    fast = (t1 == t2) && f_type_integral(t1);
+
+  if (fast && k1 && k2)
+  {
+    struct f_val res = { .type = arith ? T_INT : T_BOOL };
+    if (!arith)
+    {
+      res.val.i = f_fold_compare(what->fi_code, k1->val.i, k2->val.i);
+      f_fold(b, p1, what, res);
+      return;
+    }
+    if (f_fold_arith(what->fi_code, k1->val.i, k2->val.i, &res.val.i))
+    {
+      f_fold(b, p1, what, res);
+      return;
     }
-    else if (v1.type == T_ECLIST)
+  }
+
+  if (((code == FO_MATCH) || (code == FO_NOT_MATCH)) && k2 &&
+      ((k2->type == T_SET) || (k2->type == T_PREFIX_SET)))
+  {
+    struct f_val set = *k2;
+    b->len--;
+    b->depth--;
+    f_emit(b, code + (FO_MATCH_SET - FO_MATCH), what, 0)->u.val = set;
+    b->last_type = T_BOOL;
+    return;
+  }
+
+  if (fast)
+    code += arith ? (FO_ADD_INT - FO_ADD) : (FO_EQ_INT - FO_EQ);
+
+  f_emit(b, code, what, -1);
+  b->last_type = arith ? T_INT : T_BOOL;
+}
+
+static void
+f_compile_andor(struct f_codebuf *b, struct f_inst *what)
+{
+  int is_or = (what->fi_code == FI_OR);
+  uint p1 = b->len;
+  f_compile_chain(b, what->a1.p);
+
+  struct f_val *k1 = f_const_at(b, p1);
+  if (k1 && (k1->type == T_BOOL))
+  {
+    /* Constant first operand; either short-circuit, or just check the second one */
+    if (!k1->val.i == !is_or)
+      return;
+
+    b->depth--;
+    b->len = p1;
+    f_compile_chain(b, what->a2.p);
+    f_emit(b, FO_ANDOR_END, what, 0);
+    b->last_type = T_BOOL;
+    return;
+  }
+
+  uint jmp = b->len;
+  f_emit(b, FO_ANDOR, what, -1);
+  f_compile_chain(b, what->a2.p);
+  f_emit(b, FO_ANDOR_END, what, 0);
+  b->ops[jmp].target = b->len;
+  b->last_type = T_BOOL;
+}
+
+static void
+f_compile_condition(struct f_codebuf *b, struct f_inst *what)
+{
+  uint p1 = b->len;
+  f_compile_chain(b, what->a1.p);
+
+  struct f_val *k1 = f_const_at(b, p1);
+  if (k1 && (k1->type == T_BOOL))
+  {
+    int cond = k1->val.i;
+    b->depth--;
+    b->len = p1;
+
+    if (cond)
     {
-      /* Extended community list */
-      int arg_set = 0;
+      f_compile_chain(b, what->a2.p);
+      f_emit(b, FO_POP, what, -1);
+    }
 
-      /* v2.val is either EC or EC-set */
-      if ((v2.type == T_SET) && eclist_set_type(v2.val.t))
-	arg_set = 1;
-      else if (v2.type == T_ECLIST)
-	arg_set = 2;
-      else if (v2.type != T_EC)
-	runtime("Can't add/delete non-ec");
+    f_emit_const(b, what, (struct f_val) { .type = T_BOOL, .val.i = !cond });
+    return;
+  }
 
-      res.type = T_ECLIST;
-      switch (what->aux)
+  uint jmp = b->len;
+  f_emit(b, FO_COND, what, -1);
+  f_compile_chain(b, what->a2.p);
+  f_emit(b, FO_POP, what, -1);
+  f_emit_const(b, what, (struct f_val) { .type = T_BOOL, .val.i = 0 });
+  uint end = b->len;
+  f_emit(b, FO_JUMP, what, -1);
+  b->ops[jmp].target = b->len;
+  f_emit_const(b, what, (struct f_val) { .type = T_BOOL, .val.i = 1 });
+  b->ops[end].target = b->len;
+}
+
+/*
+ * Compile an instruction with strict arguments: evaluate arguments by
+ * the VM and let interpret_one() run a copy of the instruction with
+ * arguments replaced by constants.
+ */
+static void
+f_compile_exec(struct f_codebuf *b, struct f_inst *what, uint nargs)
+{
+  linpool *lp = b->c->lp;
+  uint size = (what->fi_code == FI_LC_CONSTRUCT) ? sizeof(struct f_inst3) :
+    (what->fi_code == FI_ROA_CHECK) ? sizeof(struct f_inst_roa_check) : sizeof(struct f_inst);
+
+  struct f_inst *x = lp_alloc(lp, size);
+  memcpy(x, what, size);
+  x->next = NULL;
+
+  struct f_val *slots = lp_allocz(lp, nargs * sizeof(struct f_val));
+  struct f_inst *args = lp_allocz(lp, nargs * sizeof(struct f_inst));
+  for (uint i = 0; i < nargs; i++)
+  {
+    args[i].fi_code = FI_CONSTANT_INDIRECT;
+    args[i].a1.p = &slots[i];
+    args[i].lineno = what->lineno;
+  }
+
+  f_compile_chain(b, what->a1.p);
+  x->a1.p = &args[0];
+
+  if (nargs > 1)
+  {
+    f_compile_chain(b, what->a2.p);
+    x->a2.p = &args[1];
+  }
+
+  if (nargs > 2)
+  {
+    f_compile_chain(b, INST3(what).p);
+    INST3(x).p = &args[2];
+  }
+
+  struct f_op *op = f_emit(b, FO_EXEC, x, 1 - (int) nargs);
+  op->nargs = nargs;
+  op->u.slots = slots;
+}
+
+static struct f_tree *
+f_compile_switch_tree(struct f_compiler *c, struct f_tree *t)
+{
+  if (!t)
+    return NULL;
+
+  struct f_tree *n = lp_alloc(c->lp, sizeof(struct f_tree));
+  *n = *t;
+  n->left = f_compile_switch_tree(c, t->left);
+  n->right = f_compile_switch_tree(c, t->right);
+  n->data = f_compile_body(c, t->data);
+  return n;
+}
+
+/* Compile one instruction, leaving its value on the stack */
+static void
+f_compile_inst(struct f_codebuf *b, struct f_inst *what)
+{
+  struct f_val *k;
+  uint pos;
+  int type;
+
+  switch (what->fi_code)
+  {
+  case FI_CONSTANT:
+    f_emit_const(b, what, interpret_one(what));
+    break;
+
+  case FI_CONSTANT_INDIRECT:
+    /* Defined constants and constant literals are immutable */
+    f_emit_const(b, what, *((struct f_val *) what->a1.p));
+    break;
+
+  case FI_VARIABLE:
+    f_emit(b, FO_VAR, what, 1)->u.vp = what->a1.p;
+    break;
+
+  case FI_ADD:
+  case FI_SUBTRACT:
+  case FI_MULTIPLY:
+  case FI_DIVIDE:
+  case FI_EQ:
+  case FI_NEQ:
+  case FI_LT:
+  case FI_LTE:
+  case FI_MATCH:
+  case FI_NOT_MATCH:
+    f_compile_binary(b, what);
+    break;
+
+  case FI_AND:
+  case FI_OR:
+    f_compile_andor(b, what);
+    break;
+
+  case FI_NOT:
+    pos = b->len;
+    f_compile_chain(b, what->a1.p);
+    if ((k = f_const_at(b, pos)) && (k->type == T_BOOL))
+      k->val.i = !k->val.i;
+    else
+      f_emit(b, FO_NOT, what, 0);
+    b->last_type = T_BOOL;
+    break;
+
+  case FI_DEFINED:
+    pos = b->len;
+    f_compile_chain(b, what->a1.p);
+    if (k = f_const_at(b, pos))
+      f_fold(b, pos, what, (struct f_val) { .type = T_BOOL, .val.i = (k->type != T_VOID) });
+    else
+      f_emit(b, FO_DEFINED, what, 0);
+    b->last_type = T_BOOL;
+    break;
+
+  case FI_CONDITION:
+    f_compile_condition(b, what);
+    break;
+
+  case FI_SET:
+    f_compile_chain(b, what->a2.p);
+    f_emit(b, FO_SET, what, 0);
+    break;
+
+  case FI_PRINT:
+    f_compile_chain(b, what->a1.p);
+    f_emit(b, FO_PRINT, what, 0);
+    break;
+
+  case FI_PRINT_AND_DIE:
+    f_compile_chain(b, what->a1.p);
+    f_emit(b, FO_DIE, what, 0);
+    break;
+
+  case FI_RETURN:
+    f_compile_chain(b, what->a1.p);
+    f_emit(b, FO_RETURN, what, 0);
+    break;
+
+  case FI_CALL:
+    if (what->a1.p)
+    {
+      f_compile_chain(b, what->a1.p);
+      f_emit(b, FO_POP, what, -1);
+    }
+    f_emit(b, FO_CALL, what, 1)->u.code = f_compile_body(b->c, what->a2.p);
+    break;
+
+  case FI_SWITCH:
+    f_compile_chain(b, what->a1.p);
+    f_emit(b, FO_SWITCH, what, 0)->u.tree = f_compile_switch_tree(b->c, what->a2.p);
+    break;
+
+  case FI_RTA_SET:
+  case FI_PREF_SET:
+    f_emit(b, FO_ACCESS_RTE, what, 0);
+    f_compile_exec(b, what, 1);
+    break;
+
+  case FI_EA_GET:
+    f_emit(b, FO_EA_GET, what, 1);
+    /* Undefined lists are empty, other attributes may be void */
+    switch (what->aux & EAF_TYPE_MASK)
+    {
+    case EAF_TYPE_INT_SET:	b->last_type = T_CLIST; break;
+    case EAF_TYPE_EC_SET:	b->last_type = T_ECLIST; break;
+    case EAF_TYPE_LC_SET:	b->last_type = T_LCLIST; break;
+    }
+    break;
+
+  case FI_EA_SET:
+    f_emit(b, FO_ACCESS_RTE, what, 0);
+    f_compile_chain(b, what->a1.p);
+    f_emit(b, FO_EA_SET, what, 0);
+    break;
+
+  case FI_EMPTY:
+    f_emit(b, FO_EMPTY, what, 1);
+    b->last_type = what->aux;
+    break;
+
+  case FI_LENGTH:
+  case FI_AS_PATH_FIRST:
+  case FI_AS_PATH_LAST:
+  case FI_AS_PATH_LAST_NAG:
+    f_compile_chain(b, what->a1.p);
+    f_emit(b, (what->fi_code == FI_LENGTH) ? FO_LENGTH :
+	   (what->fi_code == FI_AS_PATH_FIRST) ? FO_PATH_FIRST :
+	   (what->fi_code == FI_AS_PATH_LAST) ? FO_PATH_LAST : FO_PATH_LAST_NAG, what, 0);
+    b->last_type = T_INT;
+    break;
+
+  case FI_PATH_PREPEND:
+    f_compile_chain(b, what->a1.p);
+    f_compile_chain(b, what->a2.p);
+    f_emit(b, FO_PATH_PREPEND, what, -1);
+    b->last_type = T_PATH;
+    break;
+
+  case FI_CLIST_ADD_DEL:
+    f_compile_chain(b, what->a1.p);
+    type = b->last_type;
+    f_compile_chain(b, what->a2.p);
+    f_emit(b, FO_CLIST_ADD_DEL, what, -1);
+    b->last_type = type;	/* Same as the list, if successful */
+    break;
+
+  case FI_IP:
+    f_compile_exec(b, what, 1);
+    break;
+
+  case FI_PAIR_CONSTRUCT:
+  case FI_EC_CONSTRUCT:
+  case FI_IP_MASK:
+    f_compile_exec(b, what, 2);
+    break;
+
+  case FI_LC_CONSTRUCT:
+    f_compile_exec(b, what, 3);
+    break;
+
+  case FI_ROA_CHECK:
+    if (what->arg1)
+      f_compile_exec(b, what, 2);
+    else
+      f_emit(b, FO_TREE, what, 1);
+    break;
+
+  case FI_RTA_GET:
+    f_emit(b, FO_TREE, what, 1);
+    b->last_type = what->aux;
+    break;
+
+  case FI_PREF_GET:
+    f_emit(b, FO_TREE, what, 1);
+    b->last_type = T_INT;
+    break;
+
+  default:
+    /* Leaves like FI_PATHMASK_CONSTRUCT, and anything else */
+    f_emit(b, FO_TREE, what, 1);
+  }
+}
+
+/* Compile a chain of instructions, leaving value of the last one on the stack */
+static void
+f_compile_chain(struct f_codebuf *b, struct f_inst *what)
+{
+  if (!what)
+  {
+    f_emit_const(b, NULL, (struct f_val) { .type = T_VOID });
+    return;
+  }
+
+  for (; what; what = what->next)
+  {
+    f_compile_inst(b, what);
+
+    if (what->next)
+      f_emit(b, FO_POP, what, -1);
+  }
+}
+
+static void
+f_compile_code(struct f_compiler *c, struct f_code *code, struct f_inst *what)
+{
+  struct f_codebuf b = { .c = c };
+
+  f_compile_chain(&b, what);
+
+  code->root = what;
+  code->len = b.len;
+  code->stack = b.max_depth;
+  code->ops = lp_alloc(c->lp, b.len * sizeof(struct f_op));
+  memcpy(code->ops, b.ops, b.len * sizeof(struct f_op));
+  xfree(b.ops);
+}
+
+static struct f_code *
+f_compile_body(struct f_compiler *c, struct f_inst *body)
+{
+  struct f_code_memo *m;
+
+  /* Named functions are compiled when defined */
+  if (new_config)
+  {
+    struct f_code *fc;
+    WALK_LIST(fc, new_config->filters)
+      if ((fc->root == body) && (fc->sym->class == SYM_FUNCTION))
+	return fc;
+  }
+
+  for (m = c->memo; m; m = m->next)
+    if (m->body == body)
+      return m->code;
+
+  /* Register before compiling, so recursive calls find it */
+  m = lp_alloc(c->lp, sizeof(struct f_code_memo));
+  m->body = body;
+  m->code = lp_allocz(c->lp, sizeof(struct f_code));
+  m->next = c->memo;
+  c->memo = m;
+
+  f_compile_code(c, m->code, body);
+  return m->code;
+}
+
+/**
+ * f_compile - compile filter instructions to bytecode
+ * @what: chain of instructions
+ * @lp: linpool for the result
+ *
+ * Translates the tree of instructions to a form suitable for
+ * f_exec_code(). The instruction tree itself is not modified and
+ * must stay around, as the bytecode still refers to it.
+ */
+struct f_code *
+f_compile(struct f_inst *what, linpool *lp)
+{
+  struct f_compiler c = { .lp = lp };
+  struct f_code *code = lp_allocz(lp, sizeof(struct f_code));
+
+  f_compile_code(&c, code, what);
+  return code;
+}
+
+/**
+ * f_register_code - register compiled named filter or function
+ * @code: compiled code
+ * @sym: symbol of the filter or function
+ *
+ * Adds @code to the list of named filters and functions of the
+ * configuration being parsed. Calls of registered functions from code
+ * compiled later use their code directly, and statistics are reported
+ * for them by 'show filter stats'.
+ */
+void
+f_register_code(struct f_code *code, struct symbol *sym)
+{
+  code->sym = sym;
+  add_tail(&new_config->filters, &code->n);
+}
+
+#undef runtime
+#define runtime(x) do { \
+    if (!(f_flags & FF_SILENT)) \
+      log_rl(&rl_runtime_err, L_ERR "filters, line %d: %s", op->inst->lineno, x); \
+    return (struct f_val) { .type = T_RETURN, .val.i = F_ERROR }; \
+  } while(0)
+
+#define PUSH(v) (*sp++ = (v))
+#define POP() (*--sp)
+#define TOP (sp[-1])
+#define PUSH_BOOL(x) PUSH(((struct f_val) { .type = T_BOOL, .val.i = (x) }))
+#define PUSH_VOID PUSH(((struct f_val) { .type = T_VOID }))
+
+/**
+ * f_exec_code - run compiled filter code
+ * @code: code to run
+ *
+ * Runs the code in the same context as interpret() and returns the
+ * same result as interpret() on the source instructions would.
+ */
+static struct f_val f_exec_code_profiled(struct f_code *code);
+
+static struct f_val
+f_exec_code(struct f_code *code)
+{
+  struct f_val *stack = alloca(code->stack * sizeof(struct f_val));
+  struct f_val *sp = stack;
+  struct f_val v1, v2, res;
+  struct f_op *op;
+  struct f_tree *t;
+  struct symbol *sym;
+  const char *err;
+  int profile = f_profile;
+  int i;
+  u32 as;
+
+  for (uint pc = 0; pc < code->len; pc++)
+  {
+    op = &code->ops[pc];
+
+    if (profile)
+      op->hits++;
+
+    switch (op->code)
+    {
+    case FO_CONST:
+      PUSH(op->u.val);
+      break;
+
+    case FO_VAR:
+      PUSH(*op->u.vp);
+      break;
+
+    case FO_POP:
+      sp--;
+      break;
+
+    case FO_TREE:
+      res = interpret_one(op->inst);
+      if (res.type & T_RETURN)
+	return res;
+      PUSH(res);
+      break;
+
+    case FO_EXEC:
+      sp -= op->nargs;
+      memcpy(op->u.slots, sp, op->nargs * sizeof(struct f_val));
+      res = interpret_one(op->inst);
+      if (res.type & T_RETURN)
+	return res;
+      PUSH(res);
+      break;
+
+    case FO_ACCESS_RTE:
+      if (!f_rte)
+	runtime("No route to access");
+      break;
+
+    case FO_ADD:
+    case FO_SUBTRACT:
+    case FO_MULTIPLY:
+    case FO_DIVIDE:
+      v2 = POP();
+      v1 = POP();
+      if (v1.type != v2.type)
+	runtime( "Can't operate with values of incompatible types" );
+
+      switch (v1.type)
       {
-      case 'a':
-	if (arg_set == 1)
-	  runtime("Can't add set");
-	else if (!arg_set)
-	  res.val.ad = ec_set_add(f_pool, v1.val.ad, v2.val.ec);
-	else
-	  res.val.ad = ec_set_union(f_pool, v1.val.ad, v2.val.ad);
-	break;
+      case T_VOID: runtime( "Can't operate with values of type void" );
+      case T_INT: break;
+      default: runtime( "Usage of unknown type" );
+      }
 
-      case 'd':
-	if (!arg_set)
-	  res.val.ad = ec_set_del(f_pool, v1.val.ad, v2.val.ec);
-	else
-	  res.val.ad = eclist_filter(f_pool, v1.val.ad, v2, 0);
+      switch (op->code)
+      {
+      case FO_ADD:	v1.val.i += v2.val.i; break;
+      case FO_SUBTRACT:	v1.val.i -= v2.val.i; break;
+      case FO_MULTIPLY:	v1.val.i *= v2.val.i; break;
+      case FO_DIVIDE:
+	if (v2.val.i == 0)
+	  runtime( "Mother told me not to divide by 0" );
+	v1.val.i /= v2.val.i;
 	break;
+      }
+      PUSH(v1);
+      break;
 
-      case 'f':
-	if (!arg_set)
-	  runtime("Can't filter ec");
-	res.val.ad = eclist_filter(f_pool, v1.val.ad, v2, 1);
-	break;
+    case FO_ADD_INT:		sp--; TOP.val.i += sp->val.i; break;
+    case FO_SUBTRACT_INT:	sp--; TOP.val.i -= sp->val.i; break;
+    case FO_MULTIPLY_INT:	sp--; TOP.val.i *= sp->val.i; break;
+    case FO_DIVIDE_INT:
+      sp--;
+      if (sp->val.i == 0)
+	runtime( "Mother told me not to divide by 0" );
+      TOP.val.i /= sp->val.i;
+      break;
+
+    case FO_EQ:
+    case FO_NEQ:
+      v2 = POP();
+      v1 = POP();
+      i = val_same(v1, v2);
+      PUSH_BOOL((op->code == FO_EQ) ? i : !i);
+      break;
+
+    case FO_LT:
+    case FO_LTE:
+      v2 = POP();
+      v1 = POP();
+      i = val_compare(v1, v2);
+      if (i == CMP_ERROR)
+	runtime( "Can't compare values of incompatible types" );
+      PUSH_BOOL((op->code == FO_LT) ? (i == -1) : (i != 1));
+      break;
+
+    case FO_EQ_INT:  sp--; TOP = (struct f_val) { .type = T_BOOL, .val.i = (TOP.val.i == sp->val.i) }; break;
+    case FO_NEQ_INT: sp--; TOP = (struct f_val) { .type = T_BOOL, .val.i = (TOP.val.i != sp->val.i) }; break;
+    case FO_LT_INT:  sp--; TOP = (struct f_val) { .type = T_BOOL, .val.i = (TOP.val.i < sp->val.i) }; break;
+    case FO_LTE_INT: sp--; TOP = (struct f_val) { .type = T_BOOL, .val.i = (TOP.val.i <= sp->val.i) }; break;
+
+    case FO_MATCH:
+    case FO_NOT_MATCH:
+      v2 = POP();
+      v1 = POP();
+      i = val_in_range(v1, v2);
+      if (i == CMP_ERROR)
+	runtime( (op->code == FO_MATCH) ? "~ applied on unknown type pair" : "!~ applied on unknown type pair" );
+      PUSH_BOOL((op->code == FO_MATCH) ? !!i : !i);
+      break;
 
+    case FO_MATCH_SET:
+    case FO_NOT_MATCH_SET:
+      v2 = op->u.val;
+      if ((v2.type == T_SET) && (TOP.type == v2.val.t->from.type) &&
+	  ((TOP.type == T_INT) || (TOP.type == T_PAIR) || (TOP.type == T_QUAD)))
+	i = tree_contains_int(v2.val.t, TOP.val.i);
+      else if ((v2.type == T_PREFIX_SET) && (TOP.type == T_PREFIX))
+	i = trie_match_fprefix(v2.val.ti, &TOP.val.px);
+      else if ((i = val_in_range(TOP, v2)) == CMP_ERROR)
+	runtime( (op->code == FO_MATCH_SET) ? "~ applied on unknown type pair" : "!~ applied on unknown type pair" );
+      TOP = (struct f_val) { .type = T_BOOL, .val.i = (op->code == FO_MATCH_SET) ? !!i : !i };
+      break;
+
+    case FO_EA_GET:
+      if (!f_rte)
+	runtime("No route to access");
+      PUSH(f_ea_get(op->inst));
+      break;
+
+    case FO_EA_SET:
+      if (err = f_ea_set(op->inst, TOP))
+	runtime(err);
+      TOP = (struct f_val) { .type = T_VOID };
+      break;
+
+    case FO_EMPTY:
+      res.type = op->inst->aux;
+      res.val.ad = adata_empty(f_pool, 0);
+      PUSH(res);
+      break;
+
+    case FO_LENGTH:
+      switch (TOP.type)
+      {
+      case T_PREFIX: i = TOP.val.px.len; break;
+      case T_PATH:   i = as_path_getlen(TOP.val.ad); break;
+      case T_CLIST:  i = int_set_get_size(TOP.val.ad); break;
+      case T_ECLIST: i = ec_set_get_size(TOP.val.ad); break;
+      case T_LCLIST: i = lc_set_get_size(TOP.val.ad); break;
+      default: runtime( "Prefix, path, clist or eclist expected" );
+      }
+      TOP = (struct f_val) { .type = T_INT, .val.i = i };
+      break;
+
+    case FO_PATH_FIRST:
+    case FO_PATH_LAST:
+    case FO_PATH_LAST_NAG:
+      if (TOP.type != T_PATH)
+	runtime( "AS path expected" );
+
+      as = 0;
+      if (op->code == FO_PATH_FIRST)
+	as_path_get_first(TOP.val.ad, &as);
+      else if (op->code == FO_PATH_LAST)
+	as_path_get_last(TOP.val.ad, &as);
+      else
+	as = as_path_get_last_nonaggregated(TOP.val.ad);
+      TOP = (struct f_val) { .type = T_INT, .val.i = as };
+      break;
+
+    case FO_PATH_PREPEND:
+      v2 = POP();
+      if (TOP.type != T_PATH)
+	runtime("Can't prepend to non-path");
+      if (v2.type != T_INT)
+	runtime("Can't prepend non-integer");
+      TOP.val.ad = as_path_prepend(f_pool, TOP.val.ad, v2.val.i);
+      break;
+
+    case FO_CLIST_ADD_DEL:
+      v2 = POP();
+      v1 = POP();
+      if (err = f_clist_add_del(op->inst, v1, v2, &res))
+	runtime(err);
+      PUSH(res);
+      break;
+
+    case FO_NOT:
+      if (TOP.type != T_BOOL)
+	runtime( "Not applied to non-boolean" );
+      TOP.val.i = !TOP.val.i;
+      break;
+
+    case FO_DEFINED:
+      TOP = (struct f_val) { .type = T_BOOL, .val.i = (TOP.type != T_VOID) };
+      break;
+
+    case FO_ANDOR:
+      v1 = POP();
+      if (v1.type != T_BOOL)
+	runtime( "Can't do boolean operation on non-booleans" );
+      if (!v1.val.i == !(op->inst->fi_code == FI_OR))
+      {
+	PUSH(v1);
+	pc = op->target - 1;
+      }
+      break;
+
+    case FO_ANDOR_END:
+      if (TOP.type != T_BOOL)
+	runtime( "Can't do boolean operation on non-booleans" );
+      break;
+
+    case FO_COND:
+      v1 = POP();
+      if (v1.type != T_BOOL)
+	runtime( "If requires boolean expression" );
+      if (!v1.val.i)
+	pc = op->target - 1;
+      break;
+
+    case FO_JUMP:
+      pc = op->target - 1;
+      break;
+
+    case FO_SET:
+      v2 = POP();
+      PUSH_VOID;
+      sym = op->inst->a1.p;
+      if ((sym->class != (SYM_VARIABLE | v2.type)) && (v2.type != T_VOID)) {
+#ifndef IPV6
+	/* IP->Quad implicit conversion */
+	if ((sym->class == (SYM_VARIABLE | T_QUAD)) && (v2.type == T_IP)) {
+	  struct f_val *vp = sym->def;
+	  vp->type = T_QUAD;
+	  vp->val.i = ipa_to_u32(v2.val.px.ip);
+	  break;
+	}
+#endif
+	runtime( "Assigning to variable of incompatible type" );
+      }
+      *((struct f_val *) sym->def) = v2;
+      break;
+
+    case FO_PRINT:
+      val_format(POP(), &f_buf);
+      PUSH_VOID;
+      break;
+
+    case FO_DIE:
+      sp--;
+      if ((op->inst->a2.i == F_NOP || (op->inst->a2.i != F_NONL && op->inst->a1.p)) &&
+	  !(f_flags & FF_SILENT))
+	log_commit(*L_INFO, &f_buf);
+
+      switch (op->inst->a2.i) {
+      case F_QUITBIRD:
+	die( "Filter asked me to die" );
+      case F_ACCEPT:
+      case F_ERROR:
+      case F_REJECT:
+	return (struct f_val) { .type = T_RETURN, .val.i = op->inst->a2.i };
+      case F_NONL:
+      case F_NOP:
+	break;
       default:
-	bug("unknown Ca operation");
+	bug( "unknown return type: Can't happen");
+      }
+      PUSH_VOID;
+      break;
+
+    case FO_RETURN:
+      res = POP();
+      res.type |= T_RETURN;
+      return res;
+
+    case FO_CALL:
+      res = profile ? f_exec_code_profiled(op->u.code) : f_exec_code(op->u.code);
+      if (res.type == T_RETURN)
+	return res;
+      res.type &= ~T_RETURN;
+      PUSH(res);
+      break;
+
+    case FO_SWITCH:
+      v1 = POP();
+      t = find_tree(op->u.tree, v1);
+      if (!t) {
+	v1.type = T_VOID;
+	t = find_tree(op->u.tree, v1);
+	if (!t) {
+	  debug( "No else statement?\n");
+	  PUSH_VOID;
+	  break;
+	}
       }
+
+      res = f_exec_code(t->data);
+      if (res.type & T_RETURN)
+	return res;
+      PUSH(res);
+      break;
+
+    default:
+      bug("Unknown filter op %d", op->code);
+    }
+  }
+
+  return POP();
+}
+
+#undef PUSH
+#undef POP
+#undef TOP
+#undef PUSH_BOOL
+#undef PUSH_VOID
+
+static struct f_val
+f_exec_code_profiled(struct f_code *code)
+{
+  struct f_stats *st = &code->stats;
+  btime start = tm_monotonic_time();
+
+  struct f_val res = f_exec_code(code);
+
+  btime dur = tm_monotonic_time() - start;
+  st->runs++;
+  st->time += dur;
+  st->max_time = MAX(st->max_time, dur);
+
+  if (res.type == T_RETURN)
+    switch (res.val.i)
+    {
+    case F_ACCEPT:	st->accepted++; break;
+    case F_REJECT:	st->rejected++; break;
+    case F_ERROR:	st->errors++; break;
     }
-    else if (v1.type == T_LCLIST)
+
+  return res;
+}
+
+/* Run compiled code, or its source instructions if bytecode is disabled by the 'filter bytecode' option */
+static struct f_val
+f_exec(struct f_code *code, int bytecode)
+{
+  if (!bytecode)
+    return interpret(code->root);
+
+  return f_profile ? f_exec_code_profiled(code) : f_exec_code(code);
+}
+
+struct f_line_hits {
+  struct f_code *code;		/* Named filter or function */
+  int lineno;
+  unsigned long hits;
+};
+
+struct f_hits_buf {
+  struct f_line_hits *data;
+  uint len, size;
+};
+
+/* Collect executed ops of @code and its case bodies, attributed to @owner */
+static void f_collect_switch_hits(struct f_hits_buf *b, struct f_code *owner, struct f_tree *t);
+
+static void
+f_collect_hits(struct f_hits_buf *b, struct f_code *owner, struct f_code *code)
+{
+  for (uint i = 0; i < code->len; i++)
+  {
+    struct f_op *op = &code->ops[i];
+
+    if ((op->code == FO_CALL) && !op->u.code->sym)
+      f_collect_hits(b, owner, op->u.code);
+
+    if (op->code == FO_SWITCH)
+      f_collect_switch_hits(b, owner, op->u.tree);
+
+    if (!op->hits || !op->inst)
+      continue;
+
+    if (b->len == b->size)
     {
-      /* Large community list */
-      int arg_set = 0;
+      b->size = b->size ? 2 * b->size : 64;
+      b->data = xrealloc(b->data, b->size * sizeof(struct f_line_hits));
+    }
+
+    b->data[b->len++] = (struct f_line_hits) { owner, op->inst->lineno, op->hits };
+  }
+}
 
-      /* v2.val is either LC or LC-set */
-      if ((v2.type == T_SET) && lclist_set_type(v2.val.t))
-	arg_set = 1;
-      else if (v2.type == T_LCLIST)
-	arg_set = 2;
-      else if (v2.type != T_LC)
-	runtime("Can't add/delete non-lc");
+static void
+f_collect_switch_hits(struct f_hits_buf *b, struct f_code *owner, struct f_tree *t)
+{
+  if (!t)
+    return;
 
-      res.type = T_LCLIST;
-      switch (what->aux)
-      {
-      case 'a':
-	if (arg_set == 1)
-	  runtime("Can't add set");
-	else if (!arg_set)
-	  res.val.ad = lc_set_add(f_pool, v1.val.ad, v2.val.lc);
-	else
-	  res.val.ad = lc_set_union(f_pool, v1.val.ad, v2.val.ad);
-	break;
+  f_collect_hits(b, owner, t->data);
+  f_collect_switch_hits(b, owner, t->left);
+  f_collect_switch_hits(b, owner, t->right);
+}
 
-      case 'd':
-	if (!arg_set)
-	  res.val.ad = lc_set_del(f_pool, v1.val.ad, v2.val.lc);
-	else
-	  res.val.ad = lclist_filter(f_pool, v1.val.ad, v2, 0);
-	break;
+static int
+f_line_cmp(const void *x, const void *y)
+{
+  const struct f_line_hits *a = x, *b = y;
+
+  if (a->code != b->code)
+    return (a->code < b->code) ? -1 : 1;
+
+  return (a->lineno > b->lineno) - (a->lineno < b->lineno);
+}
+
+static int
+f_hits_cmp(const void *x, const void *y)
+{
+  const struct f_line_hits *a = x, *b = y;
+  return (a->hits < b->hits) - (a->hits > b->hits);
+}
+
+#define F_HOT_LINES 10
+
+static void f_cache_show(char *name, struct f_cache *c);
+
+/**
+ * filter_show_stats - show filter profiling statistics
+ * @sym: filter or function to show, or NULL for all
+ *
+ * Prints invocation counts and run times of named filters and
+ * functions of the current configuration, followed by source lines
+ * with the most executed instructions, as a reply to the 'show filter
+ * stats' CLI command. Statistics are collected only if enabled by the
+ * 'filter stats' option.
+ */
+void
+filter_show_stats(struct symbol *sym)
+{
+  struct f_hits_buf b = {};
+  struct f_code *fc;
+
+  if (!config->filter_stats)
+    cli_msg(-1027, "Filter statistics are disabled");
 
-      case 'f':
-	if (!arg_set)
-	  runtime("Can't filter lc");
-	res.val.ad = lclist_filter(f_pool, v1.val.ad, v2, 1);
-	break;
+  cli_msg(-1027, "%-16s %-8s %10s %10s %10s %8s %12s %10s", "Name", "Type",
+	  "Runs", "Accepted", "Rejected", "Errors", "Time [us]", "Max [us]");
 
-      default:
-	bug("unknown Ca operation");
-      }
-    }
-    else
-      runtime("Can't add/delete to non-[e|l]clist");
+  WALK_LIST(fc, config->filters)
+  {
+    struct f_stats *st = &fc->stats;
 
-    break;
+    if (sym && (fc->sym != sym))
+      continue;
 
-  case FI_ROA_CHECK:	/* ROA Check */
-    if (what->arg1)
-    {
-      TWOARGS;
-      if ((v1.type != T_PREFIX) || (v2.type != T_INT))
-	runtime("Invalid argument to roa_check()");
+    cli_msg(-1027, "%-16s %-8s %10lu %10lu %10lu %8lu %12lu %10lu", fc->sym->name,
+	    (fc->sym->class == SYM_FUNCTION) ? "function" : "filter",
+	    st->runs, st->accepted, st->rejected, st->errors,
+	    (unsigned long) st->time, (unsigned long) st->max_time);
 
-      as = v2.val.i;
-    }
-    else
-    {
-      ACCESS_RTE;
-      v1.val.px.ip = (*f_rte)->net->n.prefix;
-      v1.val.px.len = (*f_rte)->net->n.pxlen;
+    f_collect_hits(&b, fc, fc);
+  }
 
-      /* We ignore temporary attributes, probably not a problem here */
-      /* 0x02 is a value of BA_AS_PATH, we don't want to include BGP headers */
-      eattr *e = ea_find((*f_rte)->attrs->eattrs, EA_CODE(EAP_BGP, 0x02));
+  int header = 0;
+  WALK_LIST(fc, config->filters)
+  {
+    struct filter *f = fc->sym->def;
 
-      if (!e || ((e->type & EAF_TYPE_MASK) != EAF_TYPE_AS_PATH))
-	runtime("Missing AS_PATH attribute");
+    if ((sym && (fc->sym != sym)) || (fc->sym->class != SYM_FILTER) || !f->cache)
+      continue;
 
-      as_path_get_last(e->u.ptr, &as);
+    if (!header++)
+    {
+      cli_msg(-1027, "");
+      cli_msg(-1027, "%-16s %10s %10s %10s %10s", "Result cache", "Entries", "Hits", "Misses", "Evictions");
     }
 
-    struct roa_table_config *rtc = ((struct f_inst_roa_check *) what)->rtc;
-    if (!rtc->table)
-      runtime("Missing ROA table");
+    f_cache_show(fc->sym->name, f->cache);
+  }
 
-    res.type = T_ENUM_ROA;
-    res.val.i = roa_check(rtc->table, v1.val.px.ip, v1.val.px.len, as);
-    break;
+  if (b.len)
+  {
+    /* Merge ops of the same line, then sort by the number of executions */
+    uint n = 0;
+    qsort(b.data, b.len, sizeof(struct f_line_hits), f_line_cmp);
+    for (uint i = 0; i < b.len; i++)
+      if (n && !f_line_cmp(&b.data[n-1], &b.data[i]))
+	b.data[n-1].hits += b.data[i].hits;
+      else
+	b.data[n++] = b.data[i];
+    qsort(b.data, n, sizeof(struct f_line_hits), f_hits_cmp);
+
+    cli_msg(-1027, "");
+    cli_msg(-1027, "%-16s %6s %12s", "Hot lines", "Line", "Executed");
+    for (uint i = 0; i < MIN(n, F_HOT_LINES); i++)
+      cli_msg(-1027, "%-16s %6d %12lu", b.data[i].code->sym->name,
+	      b.data[i].lineno, b.data[i].hits);
+  }
 
-  default:
-    bug( "Unknown instruction %d (%c)", what->fi_code, what->fi_code & 0xff);
-  }}
-  return res;
+  xfree(b.data);
+  cli_msg(0, "");
 }
 
 #undef ARG
@@ -1745,10 +3007,12 @@ f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struc
   f_tmp_attrs = tmp_attrs;
   f_pool = tmp_pool;
   f_flags = flags;
+  f_profile = config->filter_stats;
 
   LOG_BUFFER_INIT(f_buf);
 
-  struct f_val res = interpret(filter->root);
+  struct f_val res = filter->code ?
+    f_exec(filter->code, config->filter_bytecode) : interpret(filter->root);
 
   if (f_old_rta) {
     /*
@@ -1779,10 +3043,478 @@ f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struc
   return res.val.i;
 }
 
+/*
+ *	Filter result cache
+ *
+ * Export filters are often run for many routes sharing the same cached
+ * &rta. If the result of a filter depends only on route attributes and
+ * the filter has no side effects other than setting (temporary)
+ * attributes, the verdict and the attributes it sets are determined by
+ * the &rta and temporary attributes of the route. f_classify() finds such
+ * filters during configuration and f_run_cached() memoizes their results.
+ * Caches belong to filters, therefore they are dropped with the
+ * configuration.
+ */
+
+struct f_classify_state {
+  void **seen;				/* Already classified function and case bodies */
+  uint len, size;
+  uint roa;				/* FP_ROA_CHECK if roa_check() was found */
+};
+
+static uint f_classify_chain(struct f_classify_state *s, struct f_inst *what);
+
+static uint
+f_classify_body(struct f_classify_state *s, struct f_inst *body)
+{
+  for (uint i = 0; i < s->len; i++)
+    if (s->seen[i] == body)
+      return FP_CACHEABLE;
+
+  if (s->len == s->size)
+  {
+    s->size = s->size ? 2 * s->size : 16;
+    s->seen = xrealloc(s->seen, s->size * sizeof(void *));
+  }
+
+  s->seen[s->len++] = body;
+  return f_classify_chain(s, body);
+}
+
+static uint
+f_classify_tree(struct f_classify_state *s, struct f_tree *t)
+{
+  if (!t)
+    return FP_CACHEABLE;
+
+  return f_classify_body(s, t->data) &
+    f_classify_tree(s, t->left) & f_classify_tree(s, t->right);
+}
+
+static uint
+f_classify_inst(struct f_classify_state *s, struct f_inst *what)
+{
+  struct f_path_mask *pm;
+  uint props;
+
+  switch (what->fi_code)
+  {
+  case FI_CONSTANT:
+  case FI_VARIABLE:
+  case FI_CONSTANT_INDIRECT:
+  case FI_EA_GET:
+  case FI_EMPTY:
+  case FI_CLEAR_LOCAL_VARS:
+    return FP_CACHEABLE;
+
+  case FI_RTA_GET:
+    return (what->a2.i == SA_NET) ? FP_NO_SIDE_EFFECTS : FP_CACHEABLE;
+
+  case FI_PREF_GET:
+    return FP_NO_SIDE_EFFECTS;
+
+  case FI_ROA_CHECK:
+    /* Depends on the prefix or the contents of the ROA table */
+    s->roa = FP_ROA_CHECK;
+    if (!what->arg1)
+      return FP_NO_SIDE_EFFECTS;
+    return FP_NO_SIDE_EFFECTS & f_classify_chain(s, what->a1.p) & f_classify_chain(s, what->a2.p);
+
+  case FI_NOP:
+    return FP_PREFIX_INDEPENDENT;
+
+  case FI_PRINT:
+  case FI_RTA_SET:
+  case FI_PREF_SET:
+    return FP_PREFIX_INDEPENDENT & f_classify_chain(s, what->a1.p);
+
+  case FI_PRINT_AND_DIE:
+    props = f_classify_chain(s, what->a1.p);
+    if (what->a1.p || (what->a2.i == F_NOP) || (what->a2.i == F_QUITBIRD))
+      props &= ~FP_NO_SIDE_EFFECTS;
+    return props;
+
+  case FI_NOT:
+  case FI_DEFINED:
+  case FI_RETURN:
+  case FI_EA_SET:
+  case FI_LENGTH:
+  case FI_IP:
+  case FI_AS_PATH_FIRST:
+  case FI_AS_PATH_LAST:
+  case FI_AS_PATH_LAST_NAG:
+    return f_classify_chain(s, what->a1.p);
+
+  case FI_ADD:
+  case FI_SUBTRACT:
+  case FI_MULTIPLY:
+  case FI_DIVIDE:
+  case FI_AND:
+  case FI_OR:
+  case FI_EQ:
+  case FI_NEQ:
+  case FI_LT:
+  case FI_LTE:
+  case FI_MATCH:
+  case FI_NOT_MATCH:
+  case FI_PAIR_CONSTRUCT:
+  case FI_EC_CONSTRUCT:
+  case FI_IP_MASK:
+  case FI_PATH_PREPEND:
+  case FI_CLIST_ADD_DEL:
+  case FI_CONDITION:
+    return f_classify_chain(s, what->a1.p) & f_classify_chain(s, what->a2.p);
+
+  case FI_LC_CONSTRUCT:
+    return f_classify_chain(s, what->a1.p) & f_classify_chain(s, what->a2.p) &
+      f_classify_chain(s, INST3(what).p);
+
+  case FI_SET:
+    return f_classify_chain(s, what->a2.p);
+
+  case FI_CALL:
+    return f_classify_chain(s, what->a1.p) & f_classify_body(s, what->a2.p);
+
+  case FI_SWITCH:
+    return f_classify_chain(s, what->a1.p) & f_classify_tree(s, what->a2.p);
+
+  case FI_PATHMASK_CONSTRUCT:
+    props = FP_CACHEABLE;
+    for (pm = what->a1.p; pm; pm = pm->next)
+      if (pm->kind == PM_ASN_EXPR)
+	props &= f_classify_chain(s, (struct f_inst *) pm->val);
+    return props;
+
+  default:
+    return 0;
+  }
+}
+
+static uint
+f_classify_chain(struct f_classify_state *s, struct f_inst *what)
+{
+  uint props = FP_CACHEABLE;
+
+  for (; what; what = what->next)
+    props &= f_classify_inst(s, what);
+
+  return props;
+}
+
+/**
+ * f_classify - find properties of filter code
+ * @what: filter instructions
+ *
+ * Returns a combination of %FP_PREFIX_INDEPENDENT (the result depends
+ * only on the route attributes, not on the prefix, preference or ROA
+ * tables) and %FP_NO_SIDE_EFFECTS (the filter does not log and does not
+ * change the route except for setting extended attributes), and
+ * %FP_ROA_CHECK if the filter may call roa_check().
+ */
+uint
+f_classify(struct f_inst *what)
+{
+  struct f_classify_state s = {};
+  uint props = f_classify_chain(&s, what);
+
+  xfree(s.seen);
+  return props | s.roa;
+}
+
+/*
+ * The cache is a set-associative table. Each set has F_CACHE_WAYS entries,
+ * the most recently used first. A new entry replaces the least recently used
+ * one of its set. The number of sets grows with the number of cached rta, so
+ * the cache can hold entries for all routes of the tables.
+ */
+
+#define F_CACHE_WAYS		4
+#define F_CACHE_MIN_ORDER	8
+#define F_CACHE_MAX_ORDER	18
+
+struct f_cache_entry {
+  rta *attrs;				/* Cached route attributes, referenced */
+  u32 hash;				/* Hash of @attrs and @tmp_in */
+  int result;				/* F_ACCEPT or F_REJECT */
+  ea_list *tmp_in;			/* Temporary attributes before the run */
+  ea_list *tmp_out;			/* Temporary attributes set by the filter */
+  byte data[0];				/* Copies of @tmp_in and @tmp_out */
+};
+
+struct f_cache {
+  resource r;
+  pool *pool;				/* Private pool, not part of the config pool */
+  struct f_cache_entry **sets;		/* 2^order sets of F_CACHE_WAYS entries */
+  uint order;
+  uint count;				/* Number of entries */
+  unsigned long hits, misses, evictions;
+};
+
+#define F_CACHE_SIZE(order)	((uint) F_CACHE_WAYS << (order))
+
+static inline struct f_cache_entry **
+f_cache_set(struct f_cache *c, u32 hash)
+{
+  return c->sets + F_CACHE_WAYS * (hash >> (32 - c->order));
+}
+
+static void
+f_cache_free_entry(struct f_cache_entry *e)
+{
+  rta_free(e->attrs);
+  mb_free(e);
+}
+
+static void
+f_cache_insert(struct f_cache *c, struct f_cache_entry *e)
+{
+  struct f_cache_entry **s = f_cache_set(c, e->hash);
+
+  if (s[F_CACHE_WAYS - 1])
+  {
+    f_cache_free_entry(s[F_CACHE_WAYS - 1]);
+    c->count--;
+    c->evictions++;
+  }
+
+  memmove(s + 1, s, (F_CACHE_WAYS - 1) * sizeof(struct f_cache_entry *));
+  s[0] = e;
+  c->count++;
+}
+
+static void
+f_cache_resize(struct f_cache *c, uint order)
+{
+  struct f_cache_entry **old = c->sets;
+  uint old_size = old ? F_CACHE_SIZE(c->order) : 0;
+
+  c->sets = mb_allocz(c->pool, F_CACHE_SIZE(order) * sizeof(struct f_cache_entry *));
+  c->order = order;
+  c->count = 0;
+
+  /* Least recently used first, to keep the order within sets */
+  for (uint i = old_size; i > 0; i--)
+    if (old[i - 1])
+      f_cache_insert(c, old[i - 1]);
+
+  mb_free(old);
+}
+
+static void
+f_cache_free(resource *r)
+{
+  struct f_cache *c = (struct f_cache *) r;
+
+  for (uint i = 0; i < F_CACHE_SIZE(c->order); i++)
+    if (c->sets[i])
+      rta_free(c->sets[i]->attrs);
+
+  rfree(c->pool);
+}
+
+static void
+f_cache_dump(resource *r)
+{
+  struct f_cache *c = (struct f_cache *) r;
+
+  debug("(%u entries, %lu hits, %lu misses)\n", c->count, c->hits, c->misses);
+}
+
+static struct resclass f_cache_class = {
+  "Filter cache",
+  sizeof(struct f_cache),
+  f_cache_free,
+  f_cache_dump,
+  NULL,
+  NULL
+};
+
+/**
+ * f_new_cache - create a filter result cache
+ * @p: pool the cache belongs to
+ *
+ * The cache is used by f_run_cached() for filters with %FP_CACHEABLE
+ * properties and it is freed together with @p.
+ */
+struct f_cache *
+f_new_cache(pool *p)
+{
+  struct f_cache *c = ralloc(p, &f_cache_class);
+
+  c->pool = rp_new(&root_pool, "Filter cache");
+  f_cache_resize(c, F_CACHE_MIN_ORDER);
+  return c;
+}
+
+static void
+f_cache_show(char *name, struct f_cache *c)
+{
+  cli_msg(-1027, "%-16s %10u %10lu %10lu %10lu", name, c->count, c->hits, c->misses, c->evictions);
+}
+
+/* Merge chain of temporary attributes to one list, preserving order of lookup */
+static ea_list *
+f_flatten_attrs(ea_list *l, ea_list *end, linpool *lp)
+{
+  ea_list *x;
+  uint n = 0;
+
+  for (x = l; x != end; x = x->next)
+    n += x->count;
+
+  if (!n)
+    return NULL;
+
+  ea_list *r = lp_alloc(lp, sizeof(ea_list) + n * sizeof(eattr));
+  r->next = NULL;
+  r->flags = 0;
+  r->count = 0;
+
+  for (x = l; x != end; x = x->next)
+  {
+    memcpy(&r->attrs[r->count], x->attrs, x->count * sizeof(eattr));
+    r->count += x->count;
+  }
+
+  return r;
+}
+
+/* Size of a copy of attributes including their data */
+static uint
+f_attrs_size(ea_list *l)
+{
+  if (!l)
+    return 0;
+
+  uint size = BIRD_ALIGN(sizeof(ea_list) + l->count * sizeof(eattr), CPU_STRUCT_ALIGN);
+
+  for (uint i = 0; i < l->count; i++)
+    if (!(l->attrs[i].type & EAF_EMBEDDED))
+      size += BIRD_ALIGN(sizeof(struct adata) + l->attrs[i].u.ptr->length, CPU_STRUCT_ALIGN);
+
+  return size;
+}
+
+/* Copy list of attributes including their data to a buffer of f_attrs_size() */
+static ea_list *
+f_store_attrs(byte *buf, ea_list *l)
+{
+  if (!l)
+    return NULL;
+
+  uint size = sizeof(ea_list) + l->count * sizeof(eattr);
+  ea_list *n = (void *) buf;
+  memcpy(n, l, size);
+  buf += BIRD_ALIGN(size, CPU_STRUCT_ALIGN);
+
+  for (uint i = 0; i < n->count; i++)
+  {
+    eattr *a = &n->attrs[i];
+    if (!(a->type & EAF_EMBEDDED))
+    {
+      size = sizeof(struct adata) + a->u.ptr->length;
+      memcpy(buf, a->u.ptr, size);
+      a->u.ptr = (void *) buf;
+      buf += BIRD_ALIGN(size, CPU_STRUCT_ALIGN);
+    }
+  }
+
+  return n;
+}
+
+static inline ea_list *
+f_copy_attrs(linpool *lp, ea_list *l)
+{
+  return l ? f_store_attrs(lp_alloc(lp, f_attrs_size(l)), l) : NULL;
+}
+
+/**
+ * f_run_cached - run a filter, reusing results for the same attributes
+ * @filter: filter to run
+ * @rte: route being filtered, may be modified
+ * @tmp_attrs: temporary attributes, prepared by caller or generated by f_run()
+ * @tmp_pool: all filter allocations go from this pool
+ * @flags: flags
+ *
+ * Same as f_run(), but if the filter has a result cache and the route
+ * has cached attributes, the verdict and the temporary attributes set by
+ * the filter are looked up by the &rta and @tmp_attrs of the route first.
+ * Only accept and reject verdicts of runs with %FF_FORCE_TMPATTR are
+ * cached, as the route itself is not modified by such runs.
+ */
+int
+f_run_cached(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, int flags)
+{
+  if ((filter == FILTER_ACCEPT) || (filter == FILTER_REJECT) || !filter->cache ||
+      !(flags & FF_FORCE_TMPATTR) || !((*rte)->attrs->aflags & RTAF_CACHED))
+    return f_run(filter, rte, tmp_attrs, tmp_pool, flags);
+
+  struct f_cache *c = filter->cache;
+  struct f_cache_entry *e;
+  struct rte *rt = *rte;
+  rta *a = rt->attrs;
+  ea_list *tmp = *tmp_attrs;
+  ea_list *tmp_in = f_flatten_attrs(tmp, NULL, tmp_pool);
+  u32 hash = a->hash_key ^ ea_hash(tmp_in);
+  struct f_cache_entry **s = f_cache_set(c, hash);
+
+  for (uint i = 0; (i < F_CACHE_WAYS) && (e = s[i]); i++)
+    if ((e->attrs == a) && (e->hash == hash) && ea_same(e->tmp_in, tmp_in))
+    {
+      c->hits++;
+
+      memmove(s + 1, s, i * sizeof(struct f_cache_entry *));
+      s[0] = e;
+
+      if (e->tmp_out)
+      {
+	/* The entry may be evicted while the route is still being exported */
+	ea_list *l = f_copy_attrs(tmp_pool, e->tmp_out);
+	l->next = *tmp_attrs;
+	*tmp_attrs = l;
+      }
+
+      return e->result;
+    }
+
+  c->misses++;
+  int res = f_run(filter, rte, tmp_attrs, tmp_pool, flags);
+
+  if (((res != F_ACCEPT) && (res != F_REJECT)) || (*rte != rt) || (rt->attrs != a))
+    return res;
+
+  ea_list *tmp_out = (res == F_ACCEPT) ? f_flatten_attrs(*tmp_attrs, tmp, tmp_pool) : NULL;
+  uint in_size = f_attrs_size(tmp_in);
+
+  e = mb_alloc(c->pool, sizeof(struct f_cache_entry) + in_size + f_attrs_size(tmp_out));
+  e->attrs = rta_clone(a);
+  e->hash = hash;
+  e->result = res;
+  e->tmp_in = f_store_attrs(e->data, tmp_in);
+  e->tmp_out = f_store_attrs(e->data + in_size, tmp_out);
+
+  /* Keep sets mostly empty to avoid evictions, as long as there are enough rta */
+  uint size = F_CACHE_SIZE(c->order);
+  if ((c->order < F_CACHE_MAX_ORDER) && (4 * c->count >= size) && (size < 4 * rta_cache_count))
+    f_cache_resize(c, c->order + 1);
+
+  f_cache_insert(c, e);
+  return res;
+}
+
 /* TODO: perhaps we could integrate f_eval(), f_eval_rte() and f_run() */
 
+/**
+ * f_eval_rte - run compiled commands on a route
+ * @code: commands compiled by f_compile() when the configuration was parsed
+ * @rte: route with private (uncached) &rta
+ * @tmp_pool: all allocations go from this pool
+ *
+ * Used to set attributes of static routes. Attributes set as temporary
+ * ones are added to the route attributes.
+ */
 struct f_val
-f_eval_rte(struct f_inst *expr, struct rte **rte, struct linpool *tmp_pool)
+f_eval_rte(struct f_code *code, struct rte **rte, struct linpool *tmp_pool)
 {
   struct ea_list *tmp_attrs = NULL;
 
@@ -1791,11 +3523,12 @@ f_eval_rte(struct f_inst *expr, struct rte **rte, struct linpool *tmp_pool)
   f_tmp_attrs = &tmp_attrs;
   f_pool = tmp_pool;
   f_flags = 0;
+  f_profile = 0;
 
   LOG_BUFFER_INIT(f_buf);
 
   /* Note that in this function we assume that rte->attrs is private / uncached */
-  struct f_val res = interpret(expr);
+  struct f_val res = f_exec(code, config->filter_bytecode);
 
   /* Hack to include EAF_TEMP attributes to the main list */
   (*rte)->attrs->eattrs = ea_append(tmp_attrs, (*rte)->attrs->eattrs);
@@ -1803,19 +3536,52 @@ f_eval_rte(struct f_inst *expr, struct rte **rte, struct linpool *tmp_pool)
   return res;
 }
 
-struct f_val
-f_eval(struct f_inst *expr, struct linpool *tmp_pool)
+static void
+f_eval_init(struct linpool *tmp_pool)
 {
   f_flags = 0;
+  f_profile = 0;
   f_tmp_attrs = NULL;
   f_rte = NULL;
   f_pool = tmp_pool;
+}
 
+/**
+ * f_eval - evaluate an expression once
+ * @expr: expression
+ * @tmp_pool: all allocations go from this pool
+ *
+ * One-shot evaluations (constants in the configuration, the 'eval' CLI
+ * command) are not worth compiling, so @expr is run by the tree
+ * interpreter.
+ */
+struct f_val
+f_eval(struct f_inst *expr, struct linpool *tmp_pool)
+{
+  f_eval_init(tmp_pool);
   LOG_BUFFER_INIT(f_buf);
 
   return interpret(expr);
 }
 
+/**
+ * f_eval_code - run compiled code during parsing
+ * @code: code compiled by f_compile()
+ * @tmp_pool: all allocations go from this pool
+ *
+ * Used by the 'eval' statement of the configuration, which runs the code
+ * by the engine chosen by the 'filter bytecode' option of the configuration
+ * being parsed, so both engines can be tested on the same code.
+ */
+struct f_val
+f_eval_code(struct f_code *code, struct linpool *tmp_pool)
+{
+  f_eval_init(tmp_pool);
+  LOG_BUFFER_INIT(f_buf);
+
+  return f_exec(code, new_config->filter_bytecode);
+}
+
 uint
 f_eval_int(struct f_inst *expr)
 {
@@ -145,11 +145,23 @@ struct f_static_attr {
   int readonly;
 };
 
+struct f_code;
+
+struct f_cache;
+
 struct filter {
   char *name;
   struct f_inst *root;
+  struct f_code *code;			/* Compiled root, see f_compile() */
+  uint props;				/* FP_* properties, see f_classify() */
+  struct f_cache *cache;		/* Result cache, see f_run_cached() */
 };
 
+#define FP_PREFIX_INDEPENDENT	1	/* Result depends only on route attributes */
+#define FP_NO_SIDE_EFFECTS	2	/* Filter only sets extended attributes */
+#define FP_CACHEABLE		(FP_PREFIX_INDEPENDENT | FP_NO_SIDE_EFFECTS)
+#define FP_ROA_CHECK		4	/* Filter may call roa_check() */
+
 struct f_inst *f_new_inst(enum f_instruction_code fi_code);
 struct f_inst *f_new_inst_da(enum f_instruction_code fi_code, struct f_dynamic_attr da);
 struct f_inst *f_new_inst_sa(enum f_instruction_code fi_code, struct f_static_attr sa);
@@ -160,10 +172,20 @@ static inline struct f_static_attr f_new_static_attr(int f_type, int code, int r
 struct f_tree *f_new_tree(void);
 struct f_inst *f_generate_complex(int operation, int operation_aux, struct f_dynamic_attr da, struct f_inst *argument);
 struct f_inst *f_generate_roa_check(struct symbol *sym, struct f_inst *prefix, struct f_inst *asn);
+struct f_code *f_compile(struct f_inst *what, linpool *lp);
+void f_register_code(struct f_code *code, struct symbol *sym);
+uint f_classify(struct f_inst *what);
+struct f_cache *f_new_cache(pool *p);
+void filter_show_stats(struct symbol *sym);
 
 
 struct f_tree *build_tree(struct f_tree *);
 struct f_tree *find_tree(struct f_tree *t, struct f_val val);
+struct f_tree *find_tree_int(struct f_tree *t, u32 val);
+struct f_tree *find_tree_ec(struct f_tree *t, u64 val);
+struct f_tree *find_tree_lc(struct f_tree *t, lcomm val);
+void build_tree_index(struct f_tree *t);
+int tree_contains_int(struct f_tree *t, u32 val);
 int same_tree(struct f_tree *t1, struct f_tree *t2);
 void tree_format(struct f_tree *t, buffer *buf);
 
@@ -194,8 +216,10 @@ struct ea_list;
 struct rte;
 
 int f_run(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, int flags);
-struct f_val f_eval_rte(struct f_inst *expr, struct rte **rte, struct linpool *tmp_pool);
+int f_run_cached(struct filter *filter, struct rte **rte, struct ea_list **tmp_attrs, struct linpool *tmp_pool, int flags);
+struct f_val f_eval_rte(struct f_code *code, struct rte **rte, struct linpool *tmp_pool);
 struct f_val f_eval(struct f_inst *expr, struct linpool *tmp_pool);
+struct f_val f_eval_code(struct f_code *code, struct linpool *tmp_pool);
 uint f_eval_int(struct f_inst *expr);
 
 char *filter_name(struct filter *filter);
@@ -219,6 +243,12 @@ void val_format(struct f_val v, buffer *buf);
 #define FILTER_ACCEPT NULL
 #define FILTER_REJECT ((void *) 1)
 
+static inline int
+filter_uses_roa(struct filter *f)
+{
+  return (f != FILTER_ACCEPT) && (f != FILTER_REJECT) && (f->props & FP_ROA_CHECK);
+}
+
 /* Type numbers must be in 0..0xff range */
 #define T_MASK 0xff
 
@@ -281,6 +311,7 @@ struct f_tree {
   struct f_tree *left, *right;
   struct f_val from, to;
   void *data;
+  struct f_tree_index *index;		/* Lookup index of large integer sets, in the root only */
 };
 
 struct f_trie_node
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+#	BIRD -- Compare filter engines on the test configurations
+#
+#	Parses each filter test configuration twice, once running the eval
+#	statements by the bytecode VM and once by the tree interpreter (see
+#	the 'filter bytecode' option), and compares the output of both runs.
+#
+#	Usage: filter/test-engines.sh [bird binary] [test config ...]
+#
+#	Can be freely distributed and used under the terms of the GNU GPL.
+#
+
+dir=$(cd "$(dirname "$0")" && pwd)
+bird=${1:-./bird}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] || set -- "$dir/test.conf" "$dir/test.conf2" "$dir/test6.conf"
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+run()
+{
+  printf 'filter bytecode %s;\ninclude "%s";\n' "$2" "$1" > "$tmp/test.conf"
+  "$bird" -p -c "$tmp/test.conf" > "$tmp/$2.out" 2>&1
+  echo "exit status $?" >> "$tmp/$2.out"
+}
+
+fail=0
+for t in "$@"; do
+  case "$t" in /*) ;; *) t="$(pwd)/$t" ;; esac
+  run "$t" on
+  run "$t" off
+  if cmp -s "$tmp/on.out" "$tmp/off.out"; then
+    echo "OK $t ($(grep -c . "$tmp/on.out") lines)"
+  else
+    echo "FAILED $t"
+    diff "$tmp/off.out" "$tmp/on.out"
+    fail=1
+  fi
+done
+
+exit $fail
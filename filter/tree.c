@@ -37,6 +37,183 @@ find_tree(struct f_tree *t, struct f_val val)
     return find_tree(t->left, val);
 }
 
+/**
+ * find_tree_int - find an integer in a tree
+ * @t: tree of %T_INT values
+ * @val: value to find
+ *
+ * Like find_tree(), but specialized for integer sets (e.g. sets of ASNs), so
+ * it avoids building &f_val and generic value comparison in each step.
+ */
+struct f_tree *
+find_tree_int(struct f_tree *t, u32 val)
+{
+  while (t)
+    {
+      if (val < t->from.val.i)
+	t = t->left;
+      else if (val > t->to.val.i)
+	t = t->right;
+      else
+	return t;
+    }
+
+  return NULL;
+}
+
+/* Like find_tree_int(), for trees of %T_EC values */
+struct f_tree *
+find_tree_ec(struct f_tree *t, u64 val)
+{
+  while (t)
+    {
+      if (val < t->from.val.ec)
+	t = t->left;
+      else if (val > t->to.val.ec)
+	t = t->right;
+      else
+	return t;
+    }
+
+  return NULL;
+}
+
+/* Like find_tree_int(), for trees of %T_LC values */
+struct f_tree *
+find_tree_lc(struct f_tree *t, lcomm val)
+{
+  while (t)
+    {
+      if (lcomm_cmp(val, t->from.val.lc) < 0)
+	t = t->left;
+      else if (lcomm_cmp(val, t->to.val.lc) > 0)
+	t = t->right;
+      else
+	return t;
+    }
+
+  return NULL;
+}
+
+/*
+ * Large sets of integers (e.g. sets of ASNs) have an index in the root node
+ * of their tree. Values below 2^16, which include all 16-bit ASNs, are
+ * looked up in a bitmap. Larger values are found by binary search in a
+ * sorted array of disjoint ranges, which is more compact than the tree.
+ */
+
+#define TREE_INDEX_MIN		16		/* Smaller sets are searched in the tree */
+#define TREE_INDEX_BITMAP	(1 << 16)	/* Values covered by the bitmap */
+
+struct f_tree_index {
+  u32 *bitmap;				/* Values below TREE_INDEX_BITMAP, may be NULL */
+  u32 *bounds;				/* Other values, sorted pairs of range bounds */
+  uint count;				/* Number of ranges */
+};
+
+static uint
+tree_count(struct f_tree *t)
+{
+  return t ? 1 + tree_count(t->left) + tree_count(t->right) : 0;
+}
+
+static void
+tree_index_node(struct f_tree_index *x, struct f_tree *t)
+{
+  if (!t)
+    return;
+
+  tree_index_node(x, t->left);
+
+  u32 from = t->from.val.i;
+  u32 to = t->to.val.i;
+
+  if (from < TREE_INDEX_BITMAP)
+  {
+    if (!x->bitmap)
+      x->bitmap = cfg_allocz(TREE_INDEX_BITMAP / 8);
+
+    for (u32 v = from; (v <= to) && (v < TREE_INDEX_BITMAP); v++)
+      x->bitmap[v / 32] |= 1U << (v % 32);
+
+    from = TREE_INDEX_BITMAP;
+  }
+
+  if (from <= to)
+  {
+    u32 *b = x->bounds + 2 * x->count;
+
+    /* Nodes are visited in order, so only the last range may be extended */
+    if (x->count && (from - 1 <= b[-1]))
+      b[-1] = MAX(b[-1], to);
+    else
+    {
+      b[0] = from;
+      b[1] = to;
+      x->count++;
+    }
+  }
+
+  tree_index_node(x, t->right);
+}
+
+/**
+ * build_tree_index - index a set of integers
+ * @t: tree built by build_tree()
+ *
+ * Large sets of %T_INT, %T_PAIR or %T_QUAD values get a lookup index for
+ * tree_contains_int(), stored in the root node. Other trees are left as
+ * they are.
+ */
+void
+build_tree_index(struct f_tree *t)
+{
+  if (!t || ((t->from.type != T_INT) && (t->from.type != T_PAIR) && (t->from.type != T_QUAD)))
+    return;
+
+  uint n = tree_count(t);
+  if (n < TREE_INDEX_MIN)
+    return;
+
+  struct f_tree_index *x = cfg_allocz(sizeof(struct f_tree_index));
+  x->bounds = cfg_alloc(2 * n * sizeof(u32));
+  tree_index_node(x, t);
+  t->index = x;
+}
+
+/**
+ * tree_contains_int - test whether a set contains an integer
+ * @t: tree of %T_INT, %T_PAIR or %T_QUAD values
+ * @val: value to find
+ *
+ * Like find_tree_int(), but uses the index of large sets built by
+ * build_tree_index().
+ */
+int
+tree_contains_int(struct f_tree *t, u32 val)
+{
+  struct f_tree_index *x = t ? t->index : NULL;
+
+  if (!x)
+    return !!find_tree_int(t, val);
+
+  if (val < TREE_INDEX_BITMAP)
+    return x->bitmap && (x->bitmap[val / 32] & (1U << (val % 32)));
+
+  /* Find the last range starting at or below val */
+  uint l = 0, h = x->count;
+  while (l < h)
+  {
+    uint m = (l + h) / 2;
+    if (x->bounds[2 * m] <= val)
+      l = m + 1;
+    else
+      h = m;
+  }
+
+  return l && (val <= x->bounds[2 * l - 1]);
+}
+
 static struct f_tree *
 build_tree_rec(struct f_tree **buf, int l, int h)
 {
@@ -108,6 +285,7 @@ f_new_tree(void)
   ret->from.type = ret->to.type = T_VOID;
   ret->from.val.i = ret->to.val.i = 0;
   ret->data = NULL;
+  ret->index = NULL;
   return ret;
 }
 
@@ -25,6 +25,8 @@ u32 u32_log2(u32 v);
 
 static inline u32 u32_hash(u32 v) { return v * 2902958171u; }
 
+static inline u32 u32_rol(u32 v, uint n) { return (v << n) | (v >> (32 - n)); }
+
 static inline u8 u32_popcount(u32 v) { return __builtin_popcount(v); }
 
 #endif
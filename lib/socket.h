@@ -49,6 +49,9 @@ typedef struct birdsock {
   int af;				/* Address family (AF_INET, AF_INET6 or 0 for non-IP) of fd */
   int fd;				/* System-dependent data */
   int index;				/* Index in poll buffer */
+  uint io_events;			/* Events registered in epoll set */
+  node io_parked_node;			/* Node in list of sockets rechecked before epoll_wait() */
+  node io_rx_node;			/* Node in queue of sockets waiting for slow RX */
   int rcv_ttl;				/* TTL of last received datagram */
   node n;
   void *rbuf_alloc, *tbuf_alloc;
@@ -66,6 +69,7 @@ int sk_send_to(sock *, uint len, ip_addr to, uint port); /* sk_send to given des
 void sk_reallocate(sock *);		/* Free and allocate tbuf & rbuf */
 void sk_set_rbsize(sock *s, uint val);	/* Resize RX buffer */
 void sk_set_tbsize(sock *s, uint val);	/* Resize TX buffer, keeping content */
+void sk_grow_rbsize(sock *s, uint val);	/* Enlarge RX buffer, keeping content */
 void sk_set_tbuf(sock *s, void *tbuf);	/* Switch TX buffer, NULL-> return to internal */
 void sk_dump_all(void);
 
@@ -106,6 +110,7 @@ extern int sk_priority_control;		/* Suggested priority for control traffic, shou
 #define SKF_TTL_RX	0x08	/* Report TTL / Hop Limit for RX packets */
 #define SKF_BIND	0x10	/* Bind datagram socket to given source address */
 #define SKF_HIGH_PORT	0x20	/* Choose port from high range if possible */
+#define SKF_TX_MORE	0x40	/* More TCP data follows soon, do not push partial segments */
 
 #define SKF_THREAD	0x100	/* Socked used in thread, Do not add to main loop */
 #define SKF_TRUNCATED	0x200	/* Received packet was truncated, set by IO layer */
@@ -7,6 +7,8 @@
  *	Can be freely distributed and used under the terms of the GNU GPL.
  */
 
+#include <stdlib.h>
+
 #include "nest/bird.h"
 #include "nest/route.h"
 #include "nest/attrs.h"
@@ -302,14 +304,17 @@ as_path_match_set(struct adata *path, struct f_tree *set)
   u8 *q = p+path->length;
   int i, n;
 
+  /* Sets of other types are compared by find_tree() */
+  int fast = set && (set->from.type == T_INT);
+
   while (p<q)
     {
       n = p[1];
       p += 2;
       for (i=0; i<n; i++)
 	{
-	  struct f_val v = {T_INT, .val.i = get_as(p)};
-	  if (find_tree(set, v))
+	  u32 as = get_as(p);
+	  if (fast ? tree_contains_int(set, as) : !!find_tree(set, (struct f_val){T_INT, .val.i = as}))
 	    return 1;
 	  p += BS;
 	}
@@ -346,7 +351,9 @@ as_path_filter(struct linpool *pool, struct adata *path, struct f_tree *set, u32
 	  u32 as = get_as(p);
 	  int match;
 
-	  if (set)
+	  if (set && (set->from.type == T_INT))
+	    match = tree_contains_int(set, as);
+	  else if (set)
 	    match = !!find_tree(set, (struct f_val){T_INT, .val.i = as});
 	  else
 	    match = (as == key);
@@ -501,7 +508,7 @@ pm_mark(struct pm_pos *pos, int i, int plen, int *nl, int *nh)
  */
 
 int
-as_path_match(struct adata *path, struct f_path_mask *mask)
+as_path_match_nfa(struct adata *path, struct f_path_mask *mask)
 {
   struct pm_pos pos[2048 + 1];
   int plen = parse_path(path, pos);
@@ -564,3 +571,518 @@ as_path_match(struct adata *path, struct f_path_mask *mask)
 
   return pos[plen].mark;
 }
+
+
+/*
+ * Compiled path masks
+ *
+ * The matcher above simulates the automaton with AS path positions as states
+ * and mask items as input, so it has to unpack the AS path first. A constant
+ * path mask is compiled to the reverse automaton instead - states are mask
+ * items and the AS path is the input, read directly in its wire format. The
+ * set of active states is kept as a bit vector, so each AS path position is
+ * processed by a few bit operations (as in Shift-And string matching).
+ *
+ * State k means that the first k items of the mask were matched. A matching
+ * position moves the state k to k+1, PM_ASTERISK item k adds the state k+1
+ * to any state k (it matches the empty sequence) and the state k+1 then stays
+ * for any number of positions.
+ *
+ * ASN ranges of mask items split the ASN space into classes of ASNs matched
+ * by the same items. The compiled mask keeps a sorted array of class bounds
+ * with item bit vectors, so items matched by an ASN are found by one binary
+ * search.
+ *
+ * AS sets in the path follow semantics of as_path_match_nfa() - a set may
+ * match several consecutive items (each matching some of its ASNs), and sets
+ * following a matched position may be skipped. States reached by matching
+ * (kept in step) are therefore also carried over sets.
+ */
+
+static int
+pm_bound_cmp(const void *A, const void *B)
+{
+  u32 a = *(const u32 *) A;
+  u32 b = *(const u32 *) B;
+  return (a < b) ? -1 : (a > b);
+}
+
+/**
+ * as_path_compile - compile a path mask
+ * @pool: linear pool to allocate the compiled mask from
+ * @mask: path mask
+ *
+ * The function compiles the path mask for as_path_match_auto(). It returns
+ * %NULL if the mask cannot be compiled - when it contains expressions or has
+ * more than %PM_AUTO_MAX_ITEMS items.
+ */
+struct pm_auto *
+as_path_compile(struct linpool *pool, struct f_path_mask *mask)
+{
+  struct f_path_mask *m;
+  uint len = 0, num = 0, i, j;
+
+  for (m = mask; m; m = m->next, len++)
+    if ((m->kind == PM_ASN_EXPR) || (len >= PM_AUTO_MAX_ITEMS))
+      return NULL;
+
+  u32 bounds[2 * len + 1];
+  bounds[num++] = 0;
+
+  for (m = mask; m; m = m->next)
+    if ((m->kind == PM_ASN) || ((m->kind == PM_ASN_RANGE) && (m->val <= m->val2)))
+      {
+	u32 hi = (m->kind == PM_ASN) ? m->val : m->val2;
+
+	bounds[num++] = m->val;
+	if (hi != 0xffffffff)
+	  bounds[num++] = hi + 1;
+      }
+
+  qsort(bounds, num, sizeof(u32), pm_bound_cmp);
+  for (i = j = 1; i < num; i++)
+    if (bounds[i] != bounds[j-1])
+      bounds[j++] = bounds[i];
+  num = j;
+
+  struct pm_auto *a = lp_allocz(pool, sizeof(struct pm_auto));
+  a->len = len;
+  a->num = num;
+  a->bounds = lp_alloc(pool, num * sizeof(u32));
+  a->match = lp_allocz(pool, num * sizeof(u64));
+  memcpy(a->bounds, bounds, num * sizeof(u32));
+
+  for (m = mask, i = 0; m; m = m->next, i++)
+    switch (m->kind)
+      {
+      case PM_ASTERISK:
+	a->eps |= 1ULL << i;
+	a->loop |= 2ULL << i;
+	break;
+
+      case PM_QUESTION:
+	a->any |= 1ULL << i;
+	break;
+
+      case PM_ASN:
+      case PM_ASN_RANGE:
+	{
+	  u32 hi = (m->kind == PM_ASN) ? m->val : m->val2;
+
+	  for (j = 0; j < num; j++)
+	    if ((a->bounds[j] >= m->val) && (a->bounds[j] <= hi))
+	      a->match[j] |= 1ULL << i;
+	}
+	break;
+      }
+
+  a->done = a->loop & (1ULL << len);
+  a->chain = !!(a->eps & (a->eps >> 1));
+
+  return a;
+}
+
+/* Items matching the ASN */
+static inline u64
+pm_class(struct pm_auto *a, u32 asn)
+{
+  const u32 *b = a->bounds;
+  uint n = a->num, lo = 0;
+
+  /* Branch-free binary search, class bounds are hard to predict */
+  while (n > 1)
+    {
+      uint half = n / 2;
+      lo = (b[lo + half] <= asn) ? lo + half : lo;
+      n -= half;
+    }
+
+  return a->match[lo] | a->any;
+}
+
+/* Add states reachable by PM_ASTERISK items matching nothing */
+static inline u64
+pm_closure(struct pm_auto *a, u64 s)
+{
+  u64 o;
+
+  if (!a->chain)
+    return s | ((s & a->eps) << 1);
+
+  do
+    {
+      o = s;
+      s |= (s & a->eps) << 1;
+    }
+  while (s != o);
+
+  return s;
+}
+
+/**
+ * as_path_match_auto - match an AS path by a compiled path mask
+ * @path: AS path
+ * @a: compiled path mask, see as_path_compile()
+ *
+ * The function gives the same result as as_path_match_nfa() for the mask
+ * @a was compiled from, in one pass over @path and without allocation.
+ */
+int
+as_path_match_auto(struct adata *path, struct pm_auto *a)
+{
+  u8 *p = path->data;
+  u8 *q = p + path->length;
+  u64 state = pm_closure(a, 1);
+  u64 step = 0, match, o;
+  int i, len;
+
+  while (p < q)
+    {
+      int type = *p++;
+      len = *p++;
+
+      switch (type)
+	{
+	case AS_PATH_SET:
+	  match = a->any;
+	  for (i = 0; i < len; i++, p += BS)
+	    match |= pm_class(a, get_as(p));
+
+	  /* The set may match several consecutive items */
+	  do
+	    {
+	      o = state;
+	      step |= (state & match) << 1;
+	      state = pm_closure(a, state | step);
+	    }
+	  while (state != o);
+
+	  state = pm_closure(a, step | (state & a->loop));
+	  break;
+
+	case AS_PATH_SEQUENCE:
+	  for (i = 0; (i < len) && state; i++, p += BS)
+	    {
+	      step = (state & pm_class(a, get_as(p))) << 1;
+	      state = pm_closure(a, step | (state & a->loop));
+	    }
+	  p += (len - i) * BS;
+	  break;
+
+	default:
+	  bug("as_path_match: Invalid path component");
+	}
+
+      if (!state)
+	return 0;
+
+      /* The final state cannot be left */
+      if (state & a->done)
+	return 1;
+    }
+
+  return (state >> a->len) & 1;
+}
+
+/**
+ * as_path_match - match an AS path by a path mask
+ * @path: AS path
+ * @mask: path mask
+ *
+ * Uses the compiled form of the mask if there is one (see
+ * as_path_compile()), otherwise as_path_match_nfa().
+ */
+int
+as_path_match(struct adata *path, struct f_path_mask *mask)
+{
+  if (mask && mask->aut)
+    return as_path_match_auto(path, mask->aut);
+
+  return as_path_match_nfa(path, mask);
+}
+
+
+#ifdef TEST
+
+#include <time.h>
+#include "conf/conf.h"
+
+/*
+ * Compares as_path_match_auto() with as_path_match_nfa() - on random masks
+ * and AS paths (with AS sets) for equal results, then speed on a set of
+ * typical path masks and AS paths. Then the same for as_path_match_set()
+ * with large ASN sets, with and without the index of the set.
+ */
+
+#define TEST_RUNS	200000
+#define BENCH_PATHS	1000
+#define BENCH_LOOPS	200
+
+static u32
+test_random(void)
+{
+  static u32 x = 2463534242;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+static double
+bench_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct adata *
+test_path(struct linpool *lp, u32 *asns, int len, int sets)
+{
+  struct adata *path = lp_alloc(lp, sizeof(struct adata) + 2 * len + BS * len);
+  u8 *p = path->data;
+  int i = 0, n;
+
+  while (i < len)
+    {
+      int set = sets && !(test_random() % 4);
+      n = set ? 1 + test_random() % 3 : 1 + test_random() % 6;
+      n = MIN(n, len - i);
+
+      *p++ = set ? AS_PATH_SET : AS_PATH_SEQUENCE;
+      *p++ = n;
+      for (; n; n--, p += BS)
+	put_as(p, asns[i++]);
+    }
+
+  path->length = p - path->data;
+  return path;
+}
+
+static struct f_path_mask *
+test_mask(struct linpool *lp, int len)
+{
+  struct f_path_mask *mask = NULL, *m;
+
+  while (len--)
+    {
+      m = lp_allocz(lp, sizeof(struct f_path_mask));
+      m->kind = test_random() % 4;
+      if (m->kind == PM_ASN_EXPR)
+	m->kind = PM_ASN_RANGE;
+      m->val = 1 + test_random() % 6;
+      m->val2 = m->val + test_random() % 3;
+      m->next = mask;
+      mask = m;
+    }
+
+  return mask;
+}
+
+static void
+test_random_masks(struct linpool *lp)
+{
+  u32 asns[32];
+  int i, j, len, matches = 0;
+
+  for (i = 0; i < TEST_RUNS; i++)
+    {
+      lp_flush(lp);
+
+      len = test_random() % 12;
+      for (j = 0; j < len; j++)
+	asns[j] = 1 + test_random() % 6;
+
+      struct adata *path = test_path(lp, asns, len, i % 2);
+      struct f_path_mask *mask = test_mask(lp, test_random() % 8);
+      struct pm_auto *a = as_path_compile(lp, mask);
+
+      int x = as_path_match_nfa(path, mask);
+      int y = as_path_match_auto(path, a);
+
+      if (x != y)
+	{
+	  byte buf[256];
+	  as_path_format(path, buf, sizeof(buf));
+	  bug("Path %s: as_path_match_nfa %d, as_path_match_auto %d", buf, x, y);
+	}
+
+      matches += x;
+    }
+
+  debug("Random masks: %d runs, %d matches, no difference\n", TEST_RUNS, matches);
+}
+
+struct bench_mask {
+  const char *name;
+  int len;
+  struct f_path_mask items[8];
+};
+
+static struct bench_mask bench_masks[] = {
+  { "* 3356 *",			3, { { .kind = PM_ASTERISK }, { .kind = PM_ASN, .val = 3356 }, { .kind = PM_ASTERISK } } },
+  { "174 *",			2, { { .kind = PM_ASN, .val = 174 }, { .kind = PM_ASTERISK } } },
+  { "* 64512..65534 *",		3, { { .kind = PM_ASTERISK }, { .kind = PM_ASN_RANGE, .val = 64512, .val2 = 65534 }, { .kind = PM_ASTERISK } } },
+  { "? ? ? ? ? ? *",		7, { { .kind = PM_QUESTION }, { .kind = PM_QUESTION }, { .kind = PM_QUESTION }, { .kind = PM_QUESTION },
+			     { .kind = PM_QUESTION }, { .kind = PM_QUESTION }, { .kind = PM_ASTERISK } } },
+  { "* 3356 * 2914 * 1299 *",	7, { { .kind = PM_ASTERISK }, { .kind = PM_ASN, .val = 3356 }, { .kind = PM_ASTERISK },
+			     { .kind = PM_ASN, .val = 2914 }, { .kind = PM_ASTERISK }, { .kind = PM_ASN, .val = 1299 },
+			     { .kind = PM_ASTERISK } } },
+  { NULL }
+};
+
+static void
+bench_masks_run(struct linpool *lp)
+{
+  static u32 transit[] = { 174, 1299, 2914, 3356, 6453, 6939 };
+  struct adata *paths[BENCH_PATHS];
+  u32 asns[16];
+  int i, j, k, len;
+
+  for (i = 0; i < BENCH_PATHS; i++)
+    {
+      len = 2 + test_random() % 6;
+      for (j = 0; j < len; j++)
+	asns[j] = (j < 2) ? transit[test_random() % 6] : 1 + test_random() % 70000;
+      paths[i] = test_path(lp, asns, len, 0);
+    }
+
+  for (struct bench_mask *b = bench_masks; b->name; b++)
+    {
+      struct f_path_mask *mask = b->items;
+      for (k = 0; k < b->len - 1; k++)
+	b->items[k].next = &b->items[k+1];
+
+      struct pm_auto *a = as_path_compile(lp, mask);
+      int m1 = 0, m2 = 0;
+      double t0, t1, t2;
+
+      t0 = bench_time();
+      for (j = 0; j < BENCH_LOOPS; j++)
+	for (i = 0; i < BENCH_PATHS; i++)
+	  m1 += as_path_match_nfa(paths[i], mask);
+      t1 = bench_time();
+      for (j = 0; j < BENCH_LOOPS; j++)
+	for (i = 0; i < BENCH_PATHS; i++)
+	  m2 += as_path_match_auto(paths[i], a);
+      t2 = bench_time();
+
+      if (m1 != m2)
+	bug("Mask [= %s =]: %d and %d matches", b->name, m1, m2);
+
+      debug("[= %s =]: %d matches, %d ns by as_path_match_nfa(), %d ns by as_path_match_auto()\n",
+	    b->name, m1 / BENCH_LOOPS,
+	    (int) ((t1 - t0) * 1e9 / (BENCH_LOOPS * BENCH_PATHS)),
+	    (int) ((t2 - t1) * 1e9 / (BENCH_LOOPS * BENCH_PATHS)));
+    }
+}
+
+#define BENCH_SET_SIZE	1000
+
+/* Set of ASNs, every eighth item is a range (possibly over 65535) */
+#define TEST_SET_TO(asns, i)	((asns)[i] + (((i) % 8) ? 0 : (asns)[i] % 200))
+
+static struct f_tree *
+test_set(struct linpool *lp, u32 *asns, int len)
+{
+  struct f_tree *list = NULL;
+
+  for (int i = 0; i < len; i++)
+    {
+      struct f_tree *n = lp_allocz(lp, sizeof(struct f_tree));
+      n->from = n->to = (struct f_val) { .type = T_INT, .val.i = asns[i] };
+      n->to.val.i = TEST_SET_TO(asns, i);
+      n->left = list;
+      list = n;
+    }
+
+  return build_tree(list);
+}
+
+static int
+test_set_contains(u32 *asns, int len, u32 as)
+{
+  for (int i = 0; i < len; i++)
+    if ((as >= asns[i]) && (as <= TEST_SET_TO(asns, i)))
+      return 1;
+
+  return 0;
+}
+
+static void
+bench_sets_run(struct linpool *lp)
+{
+  struct adata *paths[BENCH_PATHS];
+  u32 set[BENCH_SET_SIZE], asns[16];
+  int i, j;
+
+  /* Customer cone like set, ASNs of both sizes */
+  for (i = 0; i < BENCH_SET_SIZE; i++)
+    set[i] = (i % 4) ? 1 + test_random() % 65000 : 131072 + test_random() % 300000;
+
+  set[0] = 65500;
+  struct f_tree *plain = test_set(lp, set, BENCH_SET_SIZE);
+  struct f_tree *indexed = test_set(lp, set, BENCH_SET_SIZE);
+  build_tree_index(indexed);
+
+  /* The tree may miss values of overlapping ranges, the index must not */
+  int misses = 0;
+  for (i = 0; i < TEST_RUNS; i++)
+    {
+      u32 as = (i % 2) ? test_random() % 65700 : 131072 + test_random() % 300000;
+      int x = test_set_contains(set, BENCH_SET_SIZE, as);
+
+      if (tree_contains_int(indexed, as) != x)
+	bug("Set lookup of %u differs", as);
+
+      misses += (!!find_tree_int(plain, as) != x);
+    }
+
+  debug("Random set lookups: %d runs, no difference, %d misses of tree search\n", TEST_RUNS, misses);
+
+  for (i = 0; i < BENCH_PATHS; i++)
+    {
+      int len = 2 + test_random() % 6;
+      for (j = 0; j < len; j++)
+	asns[j] = (test_random() % 2) ? 1 + test_random() % 65000 : 131072 + test_random() % 300000;
+      paths[i] = test_path(lp, asns, len, 0);
+    }
+
+  int m1 = 0, m2 = 0;
+  double t0, t1, t2;
+
+  t0 = bench_time();
+  for (j = 0; j < BENCH_LOOPS; j++)
+    for (i = 0; i < BENCH_PATHS; i++)
+      m1 += as_path_match_set(paths[i], plain);
+  t1 = bench_time();
+  for (j = 0; j < BENCH_LOOPS; j++)
+    for (i = 0; i < BENCH_PATHS; i++)
+      m2 += as_path_match_set(paths[i], indexed);
+  t2 = bench_time();
+
+  debug("Set of %d ASNs: %d and %d matches, %d ns by tree, %d ns by index\n",
+	BENCH_SET_SIZE, m1 / BENCH_LOOPS, m2 / BENCH_LOOPS,
+	(int) ((t1 - t0) * 1e9 / (BENCH_LOOPS * BENCH_PATHS)),
+	(int) ((t2 - t1) * 1e9 / (BENCH_LOOPS * BENCH_PATHS)));
+}
+
+int main(void)
+{
+  log_init_debug("");
+  resource_init();
+
+  struct linpool *lp = lp_new(&root_pool, 4096);
+  cfg_mem = lp;
+  test_random_masks(lp);
+
+  lp_flush(lp);
+  bench_masks_run(lp);
+
+  lp_flush(lp);
+  bench_sets_run(lp);
+
+  return 0;
+}
+
+#endif
@@ -7,6 +7,8 @@
  *	Can be freely distributed and used under the terms of the GNU GPL.
  */
 
+#include <stdlib.h>
+
 #include "nest/bird.h"
 #include "nest/route.h"
 #include "nest/attrs.h"
@@ -178,23 +180,60 @@ lc_set_format(struct adata *set, int from, byte *buf, uint bufsize)
   return 0;
 }
 
-int
-int_set_contains(struct adata *list, u32 val)
+/*
+ * Community lists keep the order of their items, which is visible to users
+ * (and to int_set_prepend()), so they are not sorted. Membership tests of
+ * plain communities scan the list by a compare kernel, which tests eight
+ * items at once (using vectors of the compiler) without a branch for each
+ * item. Extended and large communities are scanned item by item, as their
+ * multi-word compares gained nothing from vectors.
+ *
+ * Operations with two lists (union, filter by another list) would need the
+ * membership test for each item of the other list. When both lists are long,
+ * a sorted copy of one of them is made instead, so each item is found by
+ * binary search.
+ */
+
+typedef u32 u32x4 __attribute__((vector_size(16)));
+typedef u64 u64x2 __attribute__((vector_size(16)));
+
+#define INT_SET_LINEAR_MAX	(1 << 18) /* Max product of list lengths for linear scans */
+
+static inline int
+vec_any(u64x2 m)
+{ return !!(m[0] | m[1]); }
+
+static int
+u32_find(const u32 *l, uint len, u32 val)
 {
-  if (!list)
-    return 0;
+  u32x4 key = { val, val, val, val };
+  u32x4 a, b;
+  uint i;
 
-  u32 *l = (u32 *) list->data;
-  int len = int_set_get_size(list);
-  int i;
+  for (i = 0; i + 8 <= len; i += 8)
+    {
+      memcpy(&a, l + i, sizeof(a));
+      memcpy(&b, l + i + 4, sizeof(b));
+      if (vec_any((u64x2) ((a == key) | (b == key))))
+	return 1;
+    }
 
-  for (i = 0; i < len; i++)
-    if (*l++ == val)
+  for (; i < len; i++)
+    if (l[i] == val)
       return 1;
 
   return 0;
 }
 
+int
+int_set_contains(struct adata *list, u32 val)
+{
+  if (!list)
+    return 0;
+
+  return u32_find(int_set_get_data(list), int_set_get_size(list), val);
+}
+
 int
 ec_set_contains(struct adata *list, u64 val)
 {
@@ -202,12 +241,12 @@ ec_set_contains(struct adata *list, u64 val)
     return 0;
 
   u32 *l = int_set_get_data(list);
-  int len = int_set_get_size(list);
+  uint len = int_set_get_size(list);
   u32 eh = ec_hi(val);
   u32 el = ec_lo(val);
-  int i;
+  uint i;
 
-  for (i=0; i < len; i += 2)
+  for (i = 0; i < len; i += 2)
     if (l[i] == eh && l[i+1] == el)
       return 1;
 
@@ -221,8 +260,8 @@ lc_set_contains(struct adata *list, lcomm val)
     return 0;
 
   u32 *l = int_set_get_data(list);
-  int len = int_set_get_size(list);
-  int i;
+  uint len = int_set_get_size(list);
+  uint i;
 
   for (i = 0; i < len; i += 3)
     if (lc_match(l, i, val))
@@ -231,6 +270,94 @@ lc_set_contains(struct adata *list, lcomm val)
   return 0;
 }
 
+/* Sorted copies of lists */
+
+static int
+u32_cmp(const void *A, const void *B)
+{
+  u32 a = *(const u32 *) A;
+  u32 b = *(const u32 *) B;
+  return (a < b) ? -1 : (a > b);
+}
+
+static int
+u64_cmp(const void *A, const void *B)
+{
+  u64 a = *(const u64 *) A;
+  u64 b = *(const u64 *) B;
+  return (a < b) ? -1 : (a > b);
+}
+
+static int
+lc_cmp(const void *A, const void *B)
+{
+  return lcomm_cmp(lc_get(A, 0), lc_get(B, 0));
+}
+
+static int
+u32_bsearch(const u32 *a, uint n, u32 val)
+{
+  const u32 *b = a;
+
+  /* Branch-free lower bound */
+  while (n > 1)
+    {
+      uint half = n / 2;
+      b = (b[half] <= val) ? b + half : b;
+      n -= half;
+    }
+
+  return n && (*b == val);
+}
+
+static int
+u64_bsearch(const u64 *a, uint n, u64 val)
+{
+  const u64 *b = a;
+
+  while (n > 1)
+    {
+      uint half = n / 2;
+      b = (b[half] <= val) ? b + half : b;
+      n -= half;
+    }
+
+  return n && (*b == val);
+}
+
+static int
+lc_bsearch(const u32 *a, uint n, const u32 *val)
+{
+  uint lo = 0, hi = n;
+
+  while (lo < hi)
+    {
+      uint mid = (lo + hi) / 2;
+      int x = lc_cmp(a + 3 * mid, val);
+
+      if (!x)
+	return 1;
+      if (x < 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return 0;
+}
+
+/* Extended communities as u64 values, so they are sorted by ec_get() order */
+static void
+ec_sorted_copy(u64 *dst, const u32 *l, uint len)
+{
+  uint i;
+
+  for (i = 0; i < len; i += 2)
+    dst[i / 2] = ec_get(l, i);
+
+  qsort(dst, len / 2, sizeof(u64), u64_cmp);
+}
+
 struct adata *
 int_set_prepend(struct linpool *pool, struct adata *list, u32 val)
 {
@@ -382,6 +509,17 @@ lc_set_del(struct linpool *pool, struct adata *list, lcomm val)
   return res;
 }
 
+/**
+ * int_set_union - merge two community lists
+ * @pool: pool to allocate the result from
+ * @l1: first community list
+ * @l2: second community list
+ *
+ * The result contains items of @l1 followed by items of @l2 that are not
+ * in @l1, both in their original order. The function returns @l1 if no
+ * item is added. ec_set_union() and lc_set_union() do the same for
+ * extended and large community lists.
+ */
 struct adata *
 int_set_union(struct linpool *pool, struct adata *l1, struct adata *l2)
 {
@@ -397,9 +535,21 @@ int_set_union(struct linpool *pool, struct adata *l1, struct adata *l2)
   u32 *k = tmp;
   int i;
 
-  for (i = 0; i < len; i++)
-    if (!int_set_contains(l1, l[i]))
-      *k++ = l[i];
+  int len1 = int_set_get_size(l1);
+  if ((u64) len1 * len > INT_SET_LINEAR_MAX)
+    {
+      u32 s1[len1];
+      memcpy(s1, l1->data, l1->length);
+      qsort(s1, len1, sizeof(u32), u32_cmp);
+
+      for (i = 0; i < len; i++)
+	if (!u32_bsearch(s1, len1, l[i]))
+	  *k++ = l[i];
+    }
+  else
+    for (i = 0; i < len; i++)
+      if (!int_set_contains(l1, l[i]))
+	*k++ = l[i];
 
   if (k == tmp)
     return l1;
@@ -427,12 +577,26 @@ ec_set_union(struct linpool *pool, struct adata *l1, struct adata *l2)
   u32 *k = tmp;
   int i;
 
-  for (i = 0; i < len; i += 2)
-    if (!ec_set_contains(l1, ec_get(l, i)))
-      {
-	*k++ = l[i];
-	*k++ = l[i+1];
-      }
+  int len1 = int_set_get_size(l1);
+  if ((u64) len1 * len > 4 * INT_SET_LINEAR_MAX)
+    {
+      u64 s1[len1 / 2];
+      ec_sorted_copy(s1, int_set_get_data(l1), len1);
+
+      for (i = 0; i < len; i += 2)
+	if (!u64_bsearch(s1, len1 / 2, ec_get(l, i)))
+	  {
+	    *k++ = l[i];
+	    *k++ = l[i+1];
+	  }
+    }
+  else
+    for (i = 0; i < len; i += 2)
+      if (!ec_set_contains(l1, ec_get(l, i)))
+	{
+	  *k++ = l[i];
+	  *k++ = l[i+1];
+	}
 
   if (k == tmp)
     return l1;
@@ -460,9 +624,21 @@ lc_set_union(struct linpool *pool, struct adata *l1, struct adata *l2)
   u32 *k = tmp;
   int i;
 
-  for (i = 0; i < len; i += 3)
-    if (!lc_set_contains(l1, lc_get(l, i)))
-      k = lc_copy(k, l+i);
+  int len1 = int_set_get_size(l1);
+  if ((u64) len1 * len > 9 * INT_SET_LINEAR_MAX)
+    {
+      u32 s1[len1];
+      memcpy(s1, l1->data, l1->length);
+      qsort(s1, len1 / 3, LCOMM_LENGTH, lc_cmp);
+
+      for (i = 0; i < len; i += 3)
+	if (!lc_bsearch(s1, len1 / 3, l + i))
+	  k = lc_copy(k, l+i);
+    }
+  else
+    for (i = 0; i < len; i += 3)
+      if (!lc_set_contains(l1, lc_get(l, i)))
+	k = lc_copy(k, l+i);
 
   if (k == tmp)
     return l1;
@@ -474,3 +650,370 @@ lc_set_union(struct linpool *pool, struct adata *l1, struct adata *l2)
   memcpy(res->data + l1->length, tmp, len);
   return res;
 }
+
+/**
+ * int_set_filter - filter a community list by another list
+ * @pool: pool to allocate the result from
+ * @list: community list to be filtered
+ * @set: community list of items to keep (@pos is 1) or remove (@pos is 0)
+ * @pos: whether items found in @set are kept or removed
+ *
+ * Remaining items keep their order. The function returns @list if nothing
+ * is removed. ec_set_filter() and
+ * lc_set_filter() do the same for extended and large community lists.
+ */
+struct adata *
+int_set_filter(struct linpool *pool, struct adata *list, struct adata *set, int pos)
+{
+  if (!list)
+    return NULL;
+
+  int len = int_set_get_size(list);
+  int slen = set ? int_set_get_size(set) : 0;
+  u32 *l = int_set_get_data(list);
+  u32 tmp[len];
+  u32 *k = tmp;
+  int i;
+
+  if ((u64) len * slen > INT_SET_LINEAR_MAX)
+    {
+      u32 s[slen];
+      memcpy(s, set->data, set->length);
+      qsort(s, slen, sizeof(u32), u32_cmp);
+
+      for (i = 0; i < len; i++)
+	if (u32_bsearch(s, slen, l[i]) == pos)
+	  *k++ = l[i];
+    }
+  else
+    for (i = 0; i < len; i++)
+      if (int_set_contains(set, l[i]) == pos)
+	*k++ = l[i];
+
+  uint nl = (k - tmp) * sizeof(u32);
+  if (nl == list->length)
+    return list;
+
+  struct adata *res = lp_alloc(pool, sizeof(struct adata) + nl);
+  res->length = nl;
+  memcpy(res->data, tmp, nl);
+  return res;
+}
+
+struct adata *
+ec_set_filter(struct linpool *pool, struct adata *list, struct adata *set, int pos)
+{
+  if (!list)
+    return NULL;
+
+  int len = int_set_get_size(list);
+  int slen = set ? int_set_get_size(set) : 0;
+  u32 *l = int_set_get_data(list);
+  u32 tmp[len];
+  u32 *k = tmp;
+  int i;
+
+  if ((u64) len * slen > 4 * INT_SET_LINEAR_MAX)
+    {
+      u64 s[slen / 2];
+      ec_sorted_copy(s, int_set_get_data(set), slen);
+
+      for (i = 0; i < len; i += 2)
+	if (u64_bsearch(s, slen / 2, ec_get(l, i)) == pos)
+	  {
+	    *k++ = l[i];
+	    *k++ = l[i+1];
+	  }
+    }
+  else
+    for (i = 0; i < len; i += 2)
+      if (ec_set_contains(set, ec_get(l, i)) == pos)
+	{
+	  *k++ = l[i];
+	  *k++ = l[i+1];
+	}
+
+  uint nl = (k - tmp) * sizeof(u32);
+  if (nl == list->length)
+    return list;
+
+  struct adata *res = lp_alloc(pool, sizeof(struct adata) + nl);
+  res->length = nl;
+  memcpy(res->data, tmp, nl);
+  return res;
+}
+
+struct adata *
+lc_set_filter(struct linpool *pool, struct adata *list, struct adata *set, int pos)
+{
+  if (!list)
+    return NULL;
+
+  int len = int_set_get_size(list);
+  int slen = set ? int_set_get_size(set) : 0;
+  u32 *l = int_set_get_data(list);
+  u32 tmp[len];
+  u32 *k = tmp;
+  int i;
+
+  if ((u64) len * slen > 9 * INT_SET_LINEAR_MAX)
+    {
+      u32 s[slen];
+      memcpy(s, set->data, set->length);
+      qsort(s, slen / 3, LCOMM_LENGTH, lc_cmp);
+
+      for (i = 0; i < len; i += 3)
+	if (lc_bsearch(s, slen / 3, l + i) == pos)
+	  k = lc_copy(k, l+i);
+    }
+  else
+    for (i = 0; i < len; i += 3)
+      if (lc_set_contains(set, lc_get(l, i)) == pos)
+	k = lc_copy(k, l+i);
+
+  uint nl = (k - tmp) * sizeof(u32);
+  if (nl == list->length)
+    return list;
+
+  struct adata *res = lp_alloc(pool, sizeof(struct adata) + nl);
+  res->length = nl;
+  memcpy(res->data, tmp, nl);
+  return res;
+}
+
+
+#ifdef TEST
+
+#include <time.h>
+
+/*
+ * Checks compare kernels and sorted operations with plain scans on random
+ * lists and measures them. The lists have items from a small range, so
+ * there are both hits and misses.
+ */
+
+#define TEST_RUNS	20000
+#define BENCH_LOOKUPS	2000000
+
+static u32
+test_random(void)
+{
+  static u32 x = 2463534242;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+static double
+bench_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct adata *
+test_list(struct linpool *lp, uint len, uint range)
+{
+  struct adata *l = lp_alloc(lp, sizeof(struct adata) + 4 * len);
+  u32 *d = int_set_get_data(l);
+  uint i;
+
+  l->length = 4 * len;
+  for (i = 0; i < len; i++)
+    d[i] = test_random() % range;
+
+  return l;
+}
+
+/* Plain scan for item of @step words */
+static int
+test_contains(struct adata *list, const u32 *val, uint step)
+{
+  u32 *l = int_set_get_data(list);
+  uint len = int_set_get_size(list);
+  uint i;
+
+  switch (step)
+    {
+    case 1:
+      for (i = 0; i < len; i++)
+	if (l[i] == val[0])
+	  return 1;
+      return 0;
+
+    case 2:
+      for (i = 0; i < len; i += 2)
+	if (l[i] == val[0] && l[i+1] == val[1])
+	  return 1;
+      return 0;
+
+    default:
+      for (i = 0; i < len; i += 3)
+	if (lc_match(l, i, lc_get(val, 0)))
+	  return 1;
+      return 0;
+    }
+}
+
+static struct adata *
+test_filter(struct linpool *lp, struct adata *list, struct adata *set, int pos, uint step)
+{
+  struct adata *res = lp_alloc(lp, sizeof(struct adata) + list->length);
+  u32 *l = int_set_get_data(list);
+  u32 *k = int_set_get_data(res);
+  uint len = int_set_get_size(list);
+  uint i;
+
+  for (i = 0; i < len; i += step)
+    if (test_contains(set, l + i, step) == pos)
+      {
+	memcpy(k, l + i, 4 * step);
+	k += step;
+      }
+
+  res->length = (byte *) k - res->data;
+  return res;
+}
+
+static void
+test_check(struct linpool *lp)
+{
+  uint i, j, step, len, slen, max, range;
+
+  for (i = 0; i < TEST_RUNS; i++)
+    {
+      lp_flush(lp);
+      step = 1 + i % 3;
+
+      /* Every eighth run has lists long enough for sorted copies (INT_SET_LINEAR_MAX) */
+      max = !(i % 8) ? 1500 : 200;
+      len = step * (test_random() % max);
+      slen = step * (test_random() % max);
+
+      /* Few values in each word for matches of multi-word items */
+      range = (max > 200) ? ((step == 1) ? 1024 : 16) : 4;
+      struct adata *l1 = test_list(lp, len, range);
+      struct adata *l2 = test_list(lp, slen, range);
+      u32 *d = int_set_get_data(l1);
+
+      for (j = 0; j < len; j += step)
+	{
+	  int x = test_contains(l2, d + j, step);
+	  int y = (step == 1) ? int_set_contains(l2, d[j]) :
+	    (step == 2) ? ec_set_contains(l2, ec_get(d, j)) :
+	    lc_set_contains(l2, lc_get(d, j));
+
+	  if (x != y)
+	    bug("Contains mismatch (%u words)", step);
+	}
+
+      for (j = 0; j < 2; j++)
+	{
+	  struct adata *x = test_filter(lp, l1, l2, j, step);
+	  struct adata *y = (step == 1) ? int_set_filter(lp, l1, l2, j) :
+	    (step == 2) ? ec_set_filter(lp, l1, l2, j) :
+	    lc_set_filter(lp, l1, l2, j);
+
+	  if (!adata_same(x, y))
+	    bug("Filter mismatch (%u words)", step);
+	}
+
+      struct adata *u = (step == 1) ? int_set_union(lp, l1, l2) :
+	(step == 2) ? ec_set_union(lp, l1, l2) :
+	lc_set_union(lp, l1, l2);
+      struct adata *n = test_filter(lp, l2, l1, 0, step);
+
+      if ((u->length != l1->length + n->length) ||
+	  memcmp(u->data, l1->data, l1->length) ||
+	  memcmp(u->data + l1->length, n->data, n->length))
+	bug("Union mismatch (%u words)", step);
+    }
+
+  debug("Random lists: %d runs, no difference\n", TEST_RUNS);
+}
+
+static void
+bench_contains(struct linpool *lp, uint items)
+{
+  struct adata *list = test_list(lp, items, 1 << 16);
+  u32 *l = int_set_get_data(list);
+  u32 keys[1024];
+  uint i, n, m1 = 0, m2 = 0;
+  double t0, t1, t2;
+
+  /* Half of keys are items of the list */
+  for (i = 0; i < 1024; i++)
+    keys[i] = (i % 2) ? l[test_random() % items] : test_random() % (1 << 16);
+
+  n = BENCH_LOOKUPS / items;
+
+  t0 = bench_time();
+  for (i = 0; i < n; i++)
+    m1 += test_contains(list, keys + (i % 1024), 1);
+  t1 = bench_time();
+  for (i = 0; i < n; i++)
+    m2 += int_set_contains(list, keys[i % 1024]);
+  t2 = bench_time();
+
+  if (m1 != m2)
+    bug("bench_contains: mismatch");
+
+  debug("int_set_contains(), %4u items: %5d ns by plain scan, %5d ns by compare kernel\n",
+	items, (int) ((t1 - t0) * 1e9 / n), (int) ((t2 - t1) * 1e9 / n));
+}
+
+static void
+bench_filter(struct linpool *lp, struct linpool *tmp, uint items)
+{
+  struct adata *list = test_list(lp, items, 1 << 16);
+  struct adata *set = test_list(lp, items, 1 << 16);
+  uint i, n = BENCH_LOOKUPS / items / items + 1;
+  double t0, t1, t2;
+
+  t0 = bench_time();
+  for (i = 0; i < n; i++)
+    {
+      lp_flush(tmp);
+      test_filter(tmp, list, set, 0, 1);
+    }
+  t1 = bench_time();
+  for (i = 0; i < n; i++)
+    {
+      lp_flush(tmp);
+      int_set_filter(tmp, list, set, 0);
+    }
+  t2 = bench_time();
+
+  debug("int_set_filter(), %4u x %4u items: %7d ns by plain scans, %7d ns by int_set_filter()\n",
+	items, items, (int) ((t1 - t0) * 1e9 / n), (int) ((t2 - t1) * 1e9 / n));
+}
+
+int main(void)
+{
+  uint items;
+
+  log_init_debug("");
+  resource_init();
+
+  struct linpool *lp = lp_new(&root_pool, 4096);
+  test_check(lp);
+
+  for (items = 8; items <= 512; items *= 4)
+    {
+      lp_flush(lp);
+      bench_contains(lp, items);
+    }
+
+  struct linpool *tmp = lp_new(&root_pool, 4096);
+  for (items = 8; items <= 2048; items *= 4)
+    {
+      lp_flush(lp);
+      bench_filter(lp, tmp, items);
+    }
+
+  return 0;
+}
+
+#endif
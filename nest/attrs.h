@@ -47,14 +47,34 @@ struct adata *as_path_filter(struct linpool *pool, struct adata *path, struct f_
 #define PM_ASN_EXPR	3
 #define PM_ASN_RANGE	4
 
+struct pm_auto;
+
 struct f_path_mask {
   struct f_path_mask *next;
   int kind;
   uintptr_t val;
   uintptr_t val2;
+  struct pm_auto *aut;			/* Compiled mask, only in the first item, may be NULL */
+};
+
+#define PM_AUTO_MAX_ITEMS	63	/* States of compiled masks must fit in u64 */
+
+struct pm_auto {
+  u64 any;				/* Items matching any position (PM_QUESTION) */
+  u64 eps;				/* Items matching empty sequence (PM_ASTERISK) */
+  u64 loop;				/* States after PM_ASTERISK items */
+  u64 done;				/* Final state if kept by trailing PM_ASTERISK */
+  int chain;				/* There are consecutive PM_ASTERISK items */
+  uint len;				/* Number of items, the final state */
+  uint num;				/* Number of ASN classes */
+  u32 *bounds;				/* First ASN of each class, ascending, bounds[0] == 0 */
+  u64 *match;				/* Items matching ASNs of each class */
 };
 
+struct pm_auto *as_path_compile(struct linpool *pool, struct f_path_mask *mask);
 int as_path_match(struct adata *path, struct f_path_mask *mask);
+int as_path_match_auto(struct adata *path, struct pm_auto *a);
+int as_path_match_nfa(struct adata *path, struct f_path_mask *mask);
 
 /* a-set.c */
 
@@ -123,6 +143,17 @@ static inline int lc_match(const u32 *l, int i, lcomm v)
 static inline u32 *lc_copy(u32 *dst, const u32 *src)
 { memcpy(dst, src, LCOMM_LENGTH); return dst + 3; }
 
+static inline int lcomm_cmp(lcomm v1, lcomm v2)
+{
+  if (v1.asn != v2.asn)
+    return (v1.asn > v2.asn) ? 1 : -1;
+  if (v1.ldp1 != v2.ldp1)
+    return (v1.ldp1 > v2.ldp1) ? 1 : -1;
+  if (v1.ldp2 != v2.ldp2)
+    return (v1.ldp2 > v2.ldp2) ? 1 : -1;
+  return 0;
+}
+
 
 int int_set_format(struct adata *set, int way, int from, byte *buf, uint size);
 int ec_format(byte *buf, u64 ec);
@@ -142,6 +173,9 @@ struct adata *lc_set_del(struct linpool *pool, struct adata *list, lcomm val);
 struct adata *int_set_union(struct linpool *pool, struct adata *l1, struct adata *l2);
 struct adata *ec_set_union(struct linpool *pool, struct adata *l1, struct adata *l2);
 struct adata *lc_set_union(struct linpool *pool, struct adata *l1, struct adata *l2);
+struct adata *int_set_filter(struct linpool *pool, struct adata *list, struct adata *set, int pos);
+struct adata *ec_set_filter(struct linpool *pool, struct adata *list, struct adata *set, int pos);
+struct adata *lc_set_filter(struct linpool *pool, struct adata *list, struct adata *set, int pos);
 
 
 #endif
@@ -31,12 +31,70 @@
 #include "nest/cli.h"
 #include "lib/resource.h"
 #include "lib/string.h"
+#include "lib/hash.h"
 #include "conf/conf.h"
 
 static pool *if_pool;
 
 list iface_list;
 
+/*
+ * All interfaces in &iface_list are also indexed by name and by OS index,
+ * so that if_find_by_name() and if_find_by_index() do not have to walk
+ * the list. Names are unique within the list, indices need not be (e.g.
+ * a renamed interface is present under both names until the next scan).
+ */
+
+#define IFN_KEY(n)		n->name
+#define IFN_NEXT(n)		n->next_name
+#define IFN_EQ(a,b)		!strcmp(a,b)
+#define IFN_FN(k)		if_name_hash(k)
+
+#define IFN_REHASH		if_name_rehash
+#define IFN_PARAMS		/2, *2, 1, 1, 6, 20
+
+#define IFX_KEY(n)		n->index
+#define IFX_NEXT(n)		n->next_index
+#define IFX_EQ(a,b)		a == b
+#define IFX_FN(k)		u32_hash(k)
+
+#define IFX_REHASH		if_index_rehash
+#define IFX_PARAMS		/2, *2, 1, 1, 6, 20
+
+#define IF_HASH_INIT_ORDER	6
+
+static HASH(struct iface) if_name_hash_table;
+static HASH(struct iface) if_index_hash_table;
+
+static inline u32
+if_name_hash(const char *c)
+{
+  u32 h = 13 << 24;
+
+  while (*c)
+    h = h + (h >> 2) + (h >> 5) + ((u32) (byte) *c++ << 24);
+  return h;
+}
+
+HASH_DEFINE_REHASH_FN(IFN, struct iface)
+HASH_DEFINE_REHASH_FN(IFX, struct iface)
+
+static void
+if_link(struct iface *i)
+{
+  add_tail(&iface_list, &i->n);
+  HASH_INSERT2(if_name_hash_table, IFN, if_pool, i);
+  HASH_INSERT2(if_index_hash_table, IFX, if_pool, i);
+}
+
+static void
+if_unlink(struct iface *i)
+{
+  rem_node(&i->n);
+  HASH_REMOVE2(if_name_hash_table, IFN, if_pool, i);
+  HASH_REMOVE2(if_index_hash_table, IFX, if_pool, i);
+}
+
 /**
  * ifa_dump - dump interface address
  * @a: interface address descriptor
@@ -298,44 +356,43 @@ if_update(struct iface *new)
   struct iface *i;
   unsigned c;
 
-  WALK_LIST(i, iface_list)
-    if (!strcmp(new->name, i->name))
+  if (i = HASH_FIND(if_name_hash_table, IFN, new->name))
+    {
+      /* if interface need to be deleted, delete from list and return */
+      if(new->flags & IF_SHUTDOWN)
       {
-        /* if interface need to be deleted, delete from list and return */
-        if(new->flags & IF_SHUTDOWN)
-        {
-          rem_node(&i->n);
-          return i;
-        }
-	new->addr = i->addr;
-	new->flags = if_recalc_flags(new, new->flags);
-	c = if_what_changed(i, new);
-	if (c & IF_CHANGE_TOO_MUCH)	/* Changed a lot, convert it to down/up */
-	  {
-	    DBG("Interface %s changed too much -- forcing down/up transition\n", i->name);
-	    if_change_flags(i, i->flags | IF_TMP_DOWN);
-	    rem_node(&i->n);
-	    new->addr = i->addr;
-	    memcpy(&new->addrs, &i->addrs, sizeof(i->addrs));
-	    memcpy(i, new, sizeof(*i));
-	    i->flags &= ~IF_UP; /* IF_TMP_DOWN will be added later */
-	    goto newif;
-	  }
-
-	if_copy(i, new);
-	if (c)
-	  if_notify_change(c, i);
-
-	i->flags |= IF_UPDATED;
+	if_unlink(i);
 	return i;
       }
+      new->addr = i->addr;
+      new->flags = if_recalc_flags(new, new->flags);
+      c = if_what_changed(i, new);
+      if (c & IF_CHANGE_TOO_MUCH)	/* Changed a lot, convert it to down/up */
+	{
+	  DBG("Interface %s changed too much -- forcing down/up transition\n", i->name);
+	  if_change_flags(i, i->flags | IF_TMP_DOWN);
+	  if_unlink(i);
+	  new->addr = i->addr;
+	  memcpy(&new->addrs, &i->addrs, sizeof(i->addrs));
+	  memcpy(i, new, sizeof(*i));
+	  i->flags &= ~IF_UP; /* IF_TMP_DOWN will be added later */
+	  goto newif;
+	}
+
+      if_copy(i, new);
+      if (c)
+	if_notify_change(c, i);
+
+      i->flags |= IF_UPDATED;
+      return i;
+    }
   i = mb_alloc(if_pool, sizeof(struct iface));
   memcpy(i, new, sizeof(*i));
   init_list(&i->addrs);
 newif:
   init_list(&i->neighbors);
   i->flags |= IF_UPDATED | IF_TMP_DOWN;		/* Tmp down as we don't have addresses yet */
-  add_tail(&iface_list, &i->n);
+  if_link(i);
   return i;
 }
 
@@ -370,7 +427,7 @@ if_end_update(void)
     {
       if (!(i->flags & IF_UPDATED)) {
 	if_change_flags(i, (i->flags & ~IF_ADMIN_UP) | IF_SHUTDOWN);
-        rem_node(&i->n);
+        if_unlink(i);
       }
       else
 	{
@@ -429,7 +486,7 @@ if_find_by_index(unsigned idx)
 {
   struct iface *i;
 
-  WALK_LIST(i, iface_list)
+  for (i = HASH_FIND(if_index_hash_table, IFX, idx); i; i = i->next_index)
     if (i->index == idx && !(i->flags & IF_SHUTDOWN))
       return i;
   return NULL;
@@ -446,12 +503,9 @@ if_find_by_index(unsigned idx)
 struct iface *
 if_find_by_name(char *name)
 {
-  struct iface *i;
+  struct iface *i = HASH_FIND(if_name_hash_table, IFN, name);
 
-  WALK_LIST(i, iface_list)
-    if (!strcmp(i->name, name) && !(i->flags & IF_SHUTDOWN))
-      return i;
-  return NULL;
+  return (i && !(i->flags & IF_SHUTDOWN)) ? i : NULL;
 }
 
 struct iface *
@@ -459,9 +513,8 @@ if_get_by_name(char *name)
 {
   struct iface *i;
 
-  WALK_LIST(i, iface_list)
-    if (!strcmp(i->name, name))
-      return i;
+  if (i = HASH_FIND(if_name_hash_table, IFN, name))
+    return i;
 
   /* No active iface, create a dummy */
   i = mb_allocz(if_pool, sizeof(struct iface));
@@ -469,7 +522,7 @@ if_get_by_name(char *name)
   i->flags = IF_SHUTDOWN;
   init_list(&i->addrs);
   init_list(&i->neighbors);
-  add_tail(&iface_list, &i->n);
+  if_link(i);
   return i;
 }
 
@@ -666,6 +719,8 @@ if_init(void)
 {
   if_pool = rp_new(&root_pool, "Interfaces");
   init_list(&iface_list);
+  HASH_INIT(if_name_hash_table, if_pool, IF_HASH_INIT_ORDER);
+  HASH_INIT(if_index_hash_table, if_pool, IF_HASH_INIT_ORDER);
   neigh_init(if_pool);
 }
 
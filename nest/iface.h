@@ -42,6 +42,8 @@ struct iface {
 #endif
   struct iface *master;			/* Master iface (e.g. for VRF) */
   list neighbors;			/* All neighbors on this interface */
+  struct iface *next_name;		/* Next in name hash chain */
+  struct iface *next_index;		/* Next in index hash chain */
 };
 
 #define IF_UP 1				/* IF_ADMIN_UP and IP address known */
@@ -234,6 +234,7 @@ proto_free_ahooks(struct proto *p)
   for(h = p->ahooks; h; h = hn)
   {
     hn = h->next;
+    roa_unlink_ahook(h);
     mb_free(h);
   }
 
@@ -276,6 +277,8 @@ proto_config_new(struct protocol *pr, int class)
   c->table = c->global->master_rtc;
   c->debug = new_config->proto_default_debug;
   c->mrtdump = new_config->proto_default_mrtdump;
+  c->feed_chunk = PROTO_FEED_CHUNK;
+  c->feed_time = PROTO_FEED_TIME;
   return c;
 }
 
@@ -455,6 +458,11 @@ proto_reconfigure(struct proto *p, struct proto_config *oc, struct proto_config
       ah->in_keep_filtered = nc->in_keep_filtered;
       proto_verify_limits(ah);
 
+      /* Kept originals are needed only by import filters using ROA tables */
+      if (ah->in_keep_original && !filter_uses_roa(nc->in_filter))
+	rt_flush_originals(ah->table, ah);
+      ah->in_keep_original = filter_uses_roa(nc->in_filter);
+
       if (export_changed)
 	ah->last_out_filter_change = now;
     }
@@ -950,7 +958,16 @@ proto_feed_more(void *P)
   if (p->export_state != ES_FEEDING)
     return;
 
+  if (p->feed_busy && p->feed_busy(p))
+    {
+      DBG("Feeding protocol %s paused\n", p->name);
+      p->feed_paused = 1;
+      p->feed_pauses++;
+      return;				/* Will continue in proto_feed_resume() */
+    }
+
   DBG("Feeding protocol %s continued\n", p->name);
+  p->feed_passes++;
   if (rt_feed_baby(p))
     {
       DBG("Feeding protocol %s finished\n", p->name);
@@ -981,6 +998,31 @@ proto_feed_initial(void *P)
   proto_feed_more(P);
 }
 
+/**
+ * proto_feed_resume - continue paused feeding
+ * @p: protocol instance
+ *
+ * Protocols implementing the feed_busy() hook call this function when
+ * they are able to accept routes again (e.g. when their output queue
+ * drains). If feeding was paused because of feed_busy(), it is scheduled
+ * to continue, otherwise nothing happens.
+ */
+void
+proto_feed_resume(struct proto *p)
+{
+  if (!p->feed_paused)
+    return;
+
+  p->feed_paused = 0;
+
+  if (p->export_state != ES_FEEDING)
+    return;
+
+  DBG("Feeding protocol %s resumed\n", p->name);
+  p->attn->hook = proto_feed_more;
+  ev_schedule(p->attn);
+}
+
 static void
 proto_schedule_feed(struct proto *p, int initial)
 {
@@ -988,6 +1030,8 @@ proto_schedule_feed(struct proto *p, int initial)
 
   p->export_state = ES_FEEDING;
   p->refeeding = !initial;
+  p->feed_paused = 0;
+  p->feed_passes = p->feed_pauses = 0;
 
   p->attn->hook = initial ? proto_feed_initial : proto_feed_more;
   ev_schedule(p->attn);
@@ -1278,6 +1322,7 @@ proto_want_core_up(struct proto *p)
       p->main_ahook->in_limit = p->cf->in_limit;
       p->main_ahook->out_limit = p->cf->out_limit;
       p->main_ahook->in_keep_filtered = p->cf->in_keep_filtered;
+      p->main_ahook->in_keep_original = filter_uses_roa(p->cf->in_filter);
 
       proto_reset_limit(p->main_ahook->rx_limit);
       proto_reset_limit(p->main_ahook->in_limit);
@@ -1308,6 +1353,7 @@ proto_want_export_down(struct proto *p)
     rt_feed_baby_abort(p);
 
   p->export_state = ES_DOWN;
+  p->feed_paused = 0;
   p->stats.exp_routes = 0;
   proto_unlink_ahooks(p);
 }
@@ -1534,6 +1580,14 @@ proto_show_basic_info(struct proto *p)
   proto_show_limit(p->cf->in_limit, "Import limit:");
   proto_show_limit(p->cf->out_limit, "Export limit:");
 
+  cli_msg(-1006, "  Feed budget:    %u routes per check, %u.%03u ms per pass",
+	  p->cf->feed_chunk, p->cf->feed_time / 1000, p->cf->feed_time % 1000);
+
+  if (p->feed_passes || p->feed_pauses)
+    cli_msg(-1006, "  Last feed:      %u passes, %u pauses%s",
+	    p->feed_passes, p->feed_pauses,
+	    (p->export_state != ES_FEEDING) ? "" : p->feed_paused ? " (paused)" : " (running)");
+
   if (p->proto_state != PS_DOWN)
     proto_show_stats(&p->stats, p->cf->in_keep_filtered);
 }
@@ -103,12 +103,17 @@ struct proto_config {
 					   (relevant when in_keep_filtered is active) */
   struct proto_limit *in_limit;		/* Limit for importing routes from protocol */
   struct proto_limit *out_limit;	/* Limit for exporting routes to protocol */
+  uint feed_chunk;			/* Routes fed between checks of the feed budget */
+  u32 feed_time;			/* Time budget for one feeding pass (in usec) */
 
   /* Check proto_reconfigure() and proto_copy_config() after changing struct proto_config */
 
   /* Protocol-specific data follow... */
 };
 
+#define PROTO_FEED_CHUNK	64	/* Default feed_chunk: routes between budget checks */
+#define PROTO_FEED_TIME		(5 MS)	/* Default feed_time: time budget of one feeding pass */
+
 /* Protocol statistics */
 struct proto_stats {
   /* Import - from protocol to core */
@@ -163,11 +168,14 @@ struct proto {
   byte down_sched;			/* Shutdown is scheduled for later (PDS_*) */
   byte down_code;			/* Reason for shutdown (PDC_* codes) */
   byte merge_limit;			/* Maximal number of nexthops for RA_MERGED */
+  byte feed_paused;			/* Feeding waits for the protocol to call proto_feed_resume() */
   u32 hash_key;				/* Random key used for hashing of neighbors */
   bird_clock_t last_state_change;	/* Time of last state transition */
   char *last_state_name_announced;	/* Last state name we've announced to the user */
   char *message;			/* State-change message, allocated from proto_pool */
   struct proto_stats stats;		/* Current protocol statistics */
+  u32 feed_passes;			/* Number of feeding passes (event runs) */
+  u32 feed_pauses;			/* Number of times feeding was paused by feed_busy() */
 
   /*
    *	General protocol hooks:
@@ -187,6 +195,9 @@ struct proto {
    *			1= reload is scheduled and will happen (asynchronously).
    *	   feed_begin	Notify protocol about beginning of route feeding.
    *	   feed_end	Notify protocol about finish of route feeding.
+   *	   feed_busy	Ask protocol whether it can accept more routes from
+   *			feeding. Returns: 0=continue, 1=pause feeding until
+   *			the protocol calls proto_feed_resume().
    */
 
   void (*if_notify)(struct proto *, unsigned flags, struct iface *i);
@@ -199,6 +210,7 @@ struct proto {
   int (*reload_routes)(struct proto *);
   void (*feed_begin)(struct proto *, int initial);
   void (*feed_end)(struct proto *);
+  int (*feed_busy)(struct proto *);
 
   /*
    *	Routing entry hooks (called only for routes belonging to this protocol):
@@ -256,6 +268,7 @@ void *proto_config_new(struct protocol *, int class);
 void proto_copy_config(struct proto_config *dest, struct proto_config *src);
 void proto_set_message(struct proto *p, char *msg, int len);
 void proto_request_feeding(struct proto *p);
+void proto_feed_resume(struct proto *p);
 
 static inline void
 proto_copy_rest(struct proto_config *dest, struct proto_config *src, unsigned size)
@@ -474,7 +487,9 @@ struct announce_hook {
   struct proto_stats *stats;		/* Per-table protocol statistics */
   struct announce_hook *next;		/* Next hook for the same protocol */
   int in_keep_filtered;			/* Routes rejected in import filter are kept */
+  int in_keep_original;			/* Routes are kept before import filtering (in net->in_routes) */
   bird_clock_t last_out_filter_change;	/* Last time when out_filter _changed_ */
+  struct roa_dep *roa_deps;		/* ROA tables used by filters of this hook */
 };
 
 struct announce_hook *proto_add_announce_hook(struct proto *p, struct rtable *t, struct proto_stats *stats);
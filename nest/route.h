@@ -51,6 +51,14 @@ struct fib_iterator {			/* See lib/slists.h for an explanation */
   uint hash;
 };
 
+struct fib_trie_node {
+  struct fib_trie_node *parent;		/* Parent node or NULL for the root */
+  struct fib_trie_node *child[2];	/* Subtries for next bit 0 and 1 */
+  struct fib_node *node;		/* FIB node for this prefix or NULL */
+  ip_addr prefix;
+  byte pxlen;
+};
+
 typedef void (*fib_init_func)(struct fib_node *);
 
 struct fib {
@@ -63,12 +71,19 @@ struct fib {
   uint entries;				/* Number of entries */
   uint entries_min, entries_max;	/* Entry count limits (else start rehashing) */
   fib_init_func init;			/* Constructor */
+  struct fib_trie_node *trie;		/* Root of LPM index, see fib_lpm_init() */
+  slab *trie_slab;			/* Slab holding trie nodes, NULL if no index */
+  byte ordered;				/* Ordered FIB, see fib_init_ordered() */
 };
 
 void fib_init(struct fib *, pool *, unsigned node_size, unsigned hash_order, fib_init_func init);
+void fib_init_ordered(struct fib *, pool *, unsigned node_size, fib_init_func init);
 void *fib_find(struct fib *, ip_addr *, int);	/* Find or return NULL if doesn't exist */
 void *fib_get(struct fib *, ip_addr *, int); 	/* Find or create new if nonexistent */
 void *fib_route(struct fib *, ip_addr, int);	/* Longest-match routing lookup */
+void fib_walk_in(struct fib *, ip_addr, int, void (*)(struct fib_node *, void *), void *); /* Walk nodes within a prefix */
+int fib_route_all(struct fib *, ip_addr, int, void **); /* Find all covering nodes */
+void fib_lpm_init(struct fib *);		/* Enable index for fast fib_route() */
 void fib_delete(struct fib *, void *);	/* Remove fib entry */
 void fib_free(struct fib *);		/* Destroy the fib */
 void fib_check(struct fib *);		/* Consistency check for debugging */
@@ -130,6 +145,7 @@ struct rtable_config {
   int gc_max_ops;			/* Maximum number of operations before GC is run */
   int gc_min_time;			/* Minimum time between two consecutive GC runs */
   byte sorted;				/* Routes of network are sorted according to rte_better() */
+  byte ordered;				/* Networks are kept ordered by prefix (ordered FIB) */
 };
 
 typedef struct rtable {
@@ -151,9 +167,8 @@ typedef struct rtable {
   byte gc_scheduled;			/* GC is scheduled */
   byte prune_state;			/* Table prune state, 1 -> scheduled, 2-> running */
   byte hcu_scheduled;			/* Hostcache update is scheduled */
-  byte nhu_state;			/* Next Hop Update state */
   struct fib_iterator prune_fit;	/* Rtable prune FIB iterator */
-  struct fib_iterator nhu_fit;		/* Next Hop Update FIB iterator */
+  list nhu_queue;			/* Hostentries with changed next hop, waiting for Next Hop Update */
 } rtable;
 
 #define RPS_NONE	0
@@ -163,8 +178,11 @@ typedef struct rtable {
 typedef struct network {
   struct fib_node n;			/* FIB flags reserved for kernel syncer */
   struct rte *routes;			/* Available routes for this network */
+  struct rte *in_routes;		/* Routes before import filtering, see rt_reimport_net() */
 } net;
 
+#define HC_MAX_CHANGES 16
+
 struct hostcache {
   slab *slab;				/* Slab holding all hostentries */
   struct hostentry **hash_table;	/* Hash table for hostentries */
@@ -175,6 +193,9 @@ struct hostcache {
   struct f_trie *trie;			/* Trie of prefixes that might affect hostentries */
   list hostentries;			/* List of all hostentries */
   byte update_hostcache;
+  byte update_all;			/* Changes not tracked, update all hostentries */
+  uint num_changes;			/* Number of prefixes in changes[] */
+  struct prefix changes[HC_MAX_CHANGES];	/* Changed prefixes affecting some hostentries */
 };
 
 struct hostentry {
@@ -190,6 +211,10 @@ struct hostentry {
   ip_addr gw;				/* Chosen next hop */
   byte dest;				/* Chosen route destination type (RTD_...) */
   u32 igp_metric;			/* Chosen route IGP metric */
+  byte pxlen;				/* Prefix length of the resolving route */
+  node nhu_node;			/* Node in dependent table's nhu_queue */
+  list deps;				/* Routes in dependent table using this hostentry */
+  list outdated;			/* Dependent routes waiting for Next Hop Update */
 };
 
 typedef struct rte {
@@ -197,6 +222,7 @@ typedef struct rte {
   net *net;				/* Network this RTE belongs to */
   struct announce_hook *sender;		/* Announce hook used to send the route to the routing table */
   struct rta *attrs;			/* Attributes of this route */
+  node hn;				/* Node in hostentry dependency list (if attrs->hostentry) */
   byte flags;				/* Flags (REF_...) */
   byte pflags;				/* Protocol-specific flags */
   word pref;				/* Route preference */
@@ -291,6 +317,9 @@ rte *rte_cow_rta(rte *r, linpool *lp);
 void rt_dump(rtable *);
 void rt_dump_all(void);
 int rt_feed_baby(struct proto *p);
+void rt_refeed_net(struct announce_hook *h, net *n);
+void rt_reimport_net(struct announce_hook *h, net *n);
+void rt_flush_originals(rtable *t, struct announce_hook *h);
 void rt_feed_baby_abort(struct proto *p);
 int rt_prune_loop(void);
 struct rtable_config *rt_new_table(struct symbol *s);
@@ -361,7 +390,7 @@ typedef struct rta {
   byte dest;				/* Route destination type (RTD_...) */
   byte flags;				/* Route flags (RTF_...), now unused */
   byte aflags;				/* Attribute cache flags (RTAF_...) */
-  u16 hash_key;				/* Hash over important fields */
+  u32 hash_key;				/* Hash over important fields */
   u32 igp_metric;			/* IGP metric to next hop (for iBGP routes) */
   ip_addr gw;				/* Next hop */
   ip_addr from;				/* Advertising router */
@@ -505,7 +534,7 @@ void ea_sort(ea_list *);		/* Sort entries in all sub-lists */
 unsigned ea_scan(ea_list *);		/* How many bytes do we need for merged ea_list */
 void ea_merge(ea_list *from, ea_list *to); /* Merge sub-lists to allocated buffer */
 int ea_same(ea_list *x, ea_list *y);	/* Test whether two ea_lists are identical */
-uint ea_hash(ea_list *e);	/* Calculate 16-bit hash value */
+uint ea_hash(ea_list *e);	/* Calculate 32-bit hash value */
 ea_list *ea_append(ea_list *to, ea_list *what);
 void ea_format_bitfield(struct eattr *a, byte *buf, int bufsize, const char **names, int min, int max);
 
@@ -516,6 +545,8 @@ struct mpnh *mpnh_merge(struct mpnh *x, struct mpnh *y, int rx, int ry, int max,
 void mpnh_insert(struct mpnh **n, struct mpnh *y);
 int mpnh_is_sorted(struct mpnh *x);
 
+extern uint rta_cache_count;		/* Number of cached rta */
+
 void rta_init(void);
 rta *rta_lookup(rta *);			/* Get rta equivalent to this one, uc++ */
 static inline int rta_is_cached(rta *r) { return r->aflags & RTAF_CACHED; }
@@ -526,6 +557,7 @@ rta *rta_do_cow(rta *o, linpool *lp);
 static inline rta * rta_cow(rta *r, linpool *lp) { return rta_is_cached(r) ? rta_do_cow(r, lp) : r; }
 void rta_dump(rta *);
 void rta_dump_all(void);
+void rta_show_stats(void);
 void rta_show(struct cli *, rta *, ea_list *);
 void rta_set_recursive_next_hop(rtable *dep, rta *a, rtable *tab, ip_addr *gw, ip_addr *ll);
 
@@ -579,13 +611,33 @@ struct roa_item {
   u32 asn;
   byte maxlen;
   byte src;
-  struct roa_item *next;
 };
 
 struct roa_node {
   struct fib_node n;
-  struct roa_item *items;
-  // u32 cached_asn;
+  struct roa_item *items;		/* Array sorted by ASN and decreasing maxlen */
+  uint num_items;
+  struct roa_item *prev_items;		/* Items before pending changes, see roa_save_node() */
+  uint prev_num;
+  struct roa_node *next_saved;		/* Next node in roa_table->saved */
+  byte saved;				/* Node has pending changes, prev_items are valid */
+};
+
+struct roa_cache_entry {
+  ip_addr prefix;
+  u32 asn;
+  u32 gen;				/* Table generation of the result, 0 -> unused */
+  byte pxlen;
+  byte result;				/* ROA_* result of roa_check() */
+};
+
+struct roa_dep {
+  node n;				/* Node in roa_table->deps */
+  struct roa_table *table;
+  struct announce_hook *ah;		/* Hook which filter called roa_check() */
+  struct roa_dep *next;			/* Next dependency of the same hook */
+  byte dir;				/* ROA_DEP_IMPORT or ROA_DEP_EXPORT */
+  byte other_nets;			/* Checked also prefixes other than the route's one */
 };
 
 struct roa_table {
@@ -593,6 +645,15 @@ struct roa_table {
   struct fib fib;
   char *name;				/* Name of this ROA table */
   struct roa_table_config *cf;		/* Configuration of this ROA table */
+  struct roa_cache_entry *cache;	/* Cache of roa_check() results, NULL if disabled */
+  uint cache_order;			/* Binary logarithm of the cache size */
+  u32 gen;				/* Generation, increased on each change */
+  list deps;				/* Filters depending on this table (struct roa_dep) */
+  struct event *deps_event;		/* Re-evaluation of dependent routes */
+  struct prefix *changes;		/* Changed prefixes since the last re-evaluation */
+  uint num_changes, max_changes;
+  byte changes_all;			/* Too many changes, re-evaluate everything */
+  struct roa_node *saved;		/* Nodes with pending changes */
 };
 
 struct roa_item_config {
@@ -608,6 +669,7 @@ struct roa_table_config {
   struct roa_table *table;
 
   struct roa_item_config *roa_items;	/* Preconfigured ROA items */
+  uint cache_size;			/* Number of cached roa_check() results, 0 -> no cache */
 
   // char *filename;
   // int gc_max_ops;			/* Maximum number of operations before GC is run */
@@ -631,17 +693,25 @@ struct roa_show_data {
 #define ROA_SRC_CONFIG	1
 #define ROA_SRC_DYNAMIC	2
 
+#define ROA_DEP_IMPORT	1
+#define ROA_DEP_EXPORT	2
+
 #define ROA_SHOW_ALL	0
 #define ROA_SHOW_PX	1
 #define ROA_SHOW_IN	2
 #define ROA_SHOW_FOR	3
 
 extern struct roa_table *roa_table_default;
+extern struct announce_hook *roa_filter_ahook;
+extern byte roa_filter_dir;
+extern byte roa_filter_prev;
 
 void roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src);
 void roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 asn, byte src);
 void roa_flush(struct roa_table *t, byte src);
 byte roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn);
+void roa_add_dep(struct roa_table *t, int other_net);
+void roa_unlink_ahook(struct announce_hook *ah);
 struct roa_table_config * roa_new_table_config(struct symbol *s);
 void roa_add_item_config(struct roa_table_config *rtc, ip_addr prefix, byte pxlen, byte maxlen, u32 asn);
 void roa_init(void);
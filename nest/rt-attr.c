@@ -42,6 +42,12 @@
  * and they are provided with a use count to allow sharing.
  *
  * Routing tables always contain only cached &rta's.
+ *
+ * Attribute payloads (&adata) referenced from cached attribute lists are
+ * interned, too: identical payloads (e.g. the same AS path received from
+ * many peers) are stored only once, with a use count and a precomputed
+ * hash. Payloads of two cached lists are therefore equal iff they are the
+ * same pointer.
  */
 
 #include "nest/bird.h"
@@ -191,6 +197,19 @@ rt_prune_sources(void)
 }
 
 
+/* Final avalanche step for attribute hashes, all 32 bits are usable */
+static inline u32
+rta_mix_hash(u32 h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+
 /*
  *	Multipath Next Hop
  */
@@ -200,7 +219,7 @@ mpnh_hash(struct mpnh *x)
 {
   uint h = 0;
   for (; x; x = x->next)
-    h ^= ipa_hash(x->gw);
+    h = h * 31 + ipa_hash32(x->gw);
 
   return h;
 }
@@ -666,6 +685,111 @@ ea_merge(ea_list *e, ea_list *t)
     }
 }
 
+/*
+ *	Interned attribute payloads
+ */
+
+struct adata_entry {
+  struct adata_entry *next;		/* Hash chain */
+  u32 hash;				/* Hash of the payload, see adata_hash() */
+  uint uc;				/* Use count */
+  struct adata ad;			/* The payload itself, must be last */
+};
+
+#define ADH_KEY(n)		n->hash, &n->ad
+#define ADH_NEXT(n)		n->next
+#define ADH_EQ(h1,a1,h2,a2)	h1 == h2 && adata_same(a1, a2)
+#define ADH_FN(h,a)		h
+
+#define ADH_REHASH		adata_rehash
+#define ADH_PARAMS		/2, *2, 1, 1, 8, 24
+#define ADH_INIT_ORDER		8
+
+static HASH(struct adata_entry) adata_hash_table;
+static u64 adata_bytes;			/* Payload bytes stored */
+static u64 adata_ref_bytes;		/* Payload bytes referenced, i.e. stored without sharing */
+static u64 adata_refs;
+
+HASH_DEFINE_REHASH_FN(ADH, struct adata_entry)
+
+static inline struct adata_entry *
+adata_entry(struct adata *a)
+{
+  return SKIP_BACK(struct adata_entry, ad, a);
+}
+
+static u32
+adata_compute_hash(struct adata *d)
+{
+  u32 h = d->length;
+  int size = d->length;
+  byte *z = d->data;
+
+  while (size >= 4)
+    {
+      /* Rotate, so that repeated words (e.g. AS path prepends) do not cancel out */
+      h = u32_rol(h, 5) ^ *(u32 *)z;
+      z += 4;
+      size -= 4;
+    }
+  while (size--)
+    h = (h >> 24) ^ (h << 8) ^ *z++;
+
+  return rta_mix_hash(h);
+}
+
+/* Hash of a payload, precomputed for interned ones (from cached lists) */
+static inline u32
+adata_hash(ea_list *e, struct adata *d)
+{
+  return (e->flags & EALF_CACHED) ? adata_entry(d)->hash : adata_compute_hash(d);
+}
+
+/**
+ * adata_intern - get an interned copy of attribute payload
+ * @a: payload
+ *
+ * adata_intern() returns the interned &adata with the same contents as
+ * @a, creating it if it does not exist yet. Its use count is incremented,
+ * the caller must release it by adata_free() afterwards.
+ */
+static struct adata *
+adata_intern(struct adata *a)
+{
+  u32 h = adata_compute_hash(a);
+  struct adata_entry *e = HASH_FIND(adata_hash_table, ADH, h, a);
+
+  if (!e)
+    {
+      e = mb_alloc(rta_pool, sizeof(struct adata_entry) + a->length);
+      e->hash = h;
+      e->uc = 0;
+      memcpy(&e->ad, a, sizeof(struct adata) + a->length);
+      HASH_INSERT2(adata_hash_table, ADH, rta_pool, e);
+      adata_bytes += a->length;
+    }
+
+  e->uc++;
+  adata_refs++;
+  adata_ref_bytes += a->length;
+  return &e->ad;
+}
+
+static void
+adata_free(struct adata *a)
+{
+  struct adata_entry *e = adata_entry(a);
+
+  adata_refs--;
+  adata_ref_bytes -= a->length;
+  if (--e->uc)
+    return;
+
+  adata_bytes -= a->length;
+  HASH_REMOVE2(adata_hash_table, ADH, rta_pool, e);
+  mb_free(e);
+}
+
 /**
  * ea_same - compare two &ea_list's
  * @x: attribute list
@@ -684,6 +808,10 @@ ea_same(ea_list *x, ea_list *y)
   ASSERT(!x->next && !y->next);
   if (x->count != y->count)
     return 0;
+
+  /* Interned payloads are equal iff they are identical */
+  int interned = x->flags & y->flags & EALF_CACHED;
+
   for(c=0; c<x->count; c++)
     {
       eattr *a = &x->attrs[c];
@@ -691,9 +819,19 @@ ea_same(ea_list *x, ea_list *y)
 
       if (a->id != b->id ||
 	  a->flags != b->flags ||
-	  a->type != b->type ||
-	  ((a->type & EAF_EMBEDDED) ? a->u.data != b->u.data : !adata_same(a->u.ptr, b->u.ptr)))
+	  a->type != b->type)
 	return 0;
+
+      if (a->type & EAF_EMBEDDED)
+	{
+	  if (a->u.data != b->u.data)
+	    return 0;
+	}
+      else if (a->u.ptr != b->u.ptr)
+	{
+	  if (interned || !adata_same(a->u.ptr, b->u.ptr))
+	    return 0;
+	}
     }
   return 1;
 }
@@ -715,12 +853,7 @@ ea_list_copy(ea_list *o)
     {
       eattr *a = &n->attrs[i];
       if (!(a->type & EAF_EMBEDDED))
-	{
-	  unsigned size = sizeof(struct adata) + a->u.ptr->length;
-	  struct adata *d = mb_alloc(rta_pool, size);
-	  memcpy(d, a->u.ptr, size);
-	  a->u.ptr = d;
-	}
+	a->u.ptr = adata_intern(a->u.ptr);
     }
   return n;
 }
@@ -737,7 +870,7 @@ ea_free(ea_list *o)
 	{
 	  eattr *a = &o->attrs[i];
 	  if (!(a->type & EAF_EMBEDDED))
-	    mb_free(a->u.ptr);
+	    adata_free(a->u.ptr);
 	}
       mb_free(o);
     }
@@ -980,27 +1113,13 @@ ea_hash(ea_list *e)
       for(i=0; i<e->count; i++)
 	{
 	  struct eattr *a = &e->attrs[i];
-	  h ^= a->id;
+	  h = u32_rol(h, 5) ^ a->id;
 	  if (a->type & EAF_EMBEDDED)
-	    h ^= a->u.data;
+	    h = u32_rol(h, 5) ^ a->u.data;
 	  else
-	    {
-	      struct adata *d = a->u.ptr;
-	      int size = d->length;
-	      byte *z = d->data;
-	      while (size >= 4)
-		{
-		  h ^= *(u32 *)z;
-		  z += 4;
-		  size -= 4;
-		}
-	      while (size--)
-		h = (h >> 24) ^ (h << 8) ^ *z++;
-	    }
+	    h = u32_rol(h, 5) ^ adata_hash(e, a->u.ptr);
 	}
-      h ^= h >> 16;
-      h ^= h >> 6;
-      h &= 0xffff;
+      h = rta_mix_hash(h);
     }
   return h;
 }
@@ -1031,28 +1150,62 @@ ea_append(ea_list *to, ea_list *what)
  *	rta's
  */
 
-static uint rta_cache_count;
-static uint rta_cache_size = 32;
-static uint rta_cache_limit;
+/*
+ * The attribute cache is a chained hash table indexed by the low bits of a
+ * full 32-bit hash key. When the number of entries exceeds twice the number
+ * of buckets, a table of double size is allocated and entries are moved to
+ * it gradually, RTA_REHASH_STEP old buckets with each rta_lookup(), so that
+ * growing a large cache does not stall the main loop. While the move is in
+ * progress, buckets of the old table below @rta_old_pos are already empty
+ * and lookups have to check both tables.
+ */
+
+#define RTA_CACHE_INIT_ORDER	5
+#define RTA_CACHE_MAX_ORDER	28
+#define RTA_REHASH_STEP		16
+
+uint rta_cache_count;
+static uint rta_cache_order;
 static uint rta_cache_mask;
+static uint rta_cache_limit;
 static rta **rta_hash_table;
 
+static rta **rta_old_table;		/* Table being emptied by incremental rehash */
+static uint rta_old_mask;
+static uint rta_old_pos;		/* First old bucket not moved yet */
+
+static struct {
+  unsigned long lookups, hits, probes;	/* Probes = rta_same() calls in rta_lookup() */
+  uint rehashes;
+} rta_stats;
+
 static void
-rta_alloc_hash(void)
+rta_alloc_hash(uint order)
 {
-  rta_hash_table = mb_allocz(rta_pool, sizeof(rta *) * rta_cache_size);
-  if (rta_cache_size < 32768)
-    rta_cache_limit = rta_cache_size * 2;
-  else
-    rta_cache_limit = ~0;
-  rta_cache_mask = rta_cache_size - 1;
+  rta_cache_order = order;
+  rta_cache_mask = (1U << order) - 1;
+  rta_hash_table = mb_allocz(rta_pool, sizeof(rta *) << order);
+  rta_cache_limit = (order < RTA_CACHE_MAX_ORDER) ? (2U << order) : ~0U;
 }
 
-static inline uint
+static inline u32
+rta_ptr_hash(void *ptr)
+{
+  u64 p = (uintptr_t) ptr;
+  return (u32) p ^ (u32) (p >> 32);
+}
+
+static inline u32
 rta_hash(rta *a)
 {
-  return (((uint) (uintptr_t) a->src) ^ ipa_hash(a->gw) ^
-	  mpnh_hash(a->nexthops) ^ ea_hash(a->eattrs)) & 0xffff;
+  u32 h = rta_ptr_hash(a->src);
+
+  h = h * 31 + ipa_hash32(a->gw);
+  h = h * 31 + rta_ptr_hash(a->iface);
+  h = h * 31 + ((a->source << 24) | (a->dest << 16) | (a->scope << 8) | a->cast);
+  h = h * 31 + mpnh_hash(a->nexthops);
+  h = h * 31 + ea_hash(a->eattrs);
+  return rta_mix_hash(h);
 }
 
 static inline int
@@ -1097,23 +1250,55 @@ rta_insert(rta *r)
 }
 
 static void
-rta_rehash(void)
+rta_rehash_step(uint steps)
 {
-  uint ohs = rta_cache_size;
-  uint h;
   rta *r, *n;
-  rta **oht = rta_hash_table;
 
-  rta_cache_size = 2*rta_cache_size;
-  DBG("Rehashing rta cache from %d to %d entries.\n", ohs, rta_cache_size);
-  rta_alloc_hash();
-  for(h=0; h<ohs; h++)
-    for(r=oht[h]; r; r=n)
+  for (; steps && (rta_old_pos <= rta_old_mask); steps--, rta_old_pos++)
+    for (r = rta_old_table[rta_old_pos]; r; r = n)
       {
 	n = r->next;
 	rta_insert(r);
       }
-  mb_free(oht);
+
+  if (rta_old_pos > rta_old_mask)
+    {
+      DBG("Rehashing of rta cache to %u buckets finished.\n", rta_cache_mask + 1);
+      mb_free(rta_old_table);
+      rta_old_table = NULL;
+    }
+}
+
+static void
+rta_rehash(void)
+{
+  /* Finish the previous round first, should be rare */
+  if (rta_old_table)
+    rta_rehash_step(~0U);
+
+  DBG("Rehashing rta cache from %u to %u buckets.\n", rta_cache_mask + 1, 2 * (rta_cache_mask + 1));
+  rta_old_table = rta_hash_table;
+  rta_old_mask = rta_cache_mask;
+  rta_old_pos = 0;
+  rta_alloc_hash(rta_cache_order + 1);
+  rta_stats.rehashes++;
+}
+
+static inline rta *
+rta_find(rta *o, u32 h)
+{
+  rta *r;
+
+  for (r = rta_hash_table[h & rta_cache_mask]; r; r = r->next)
+    if (r->hash_key == h && (rta_stats.probes++, rta_same(r, o)))
+      return r;
+
+  if (rta_old_table && ((h & rta_old_mask) >= rta_old_pos))
+    for (r = rta_old_table[h & rta_old_mask]; r; r = r->next)
+      if (r->hash_key == h && (rta_stats.probes++, rta_same(r, o)))
+	return r;
+
+  return NULL;
 }
 
 /**
@@ -1133,7 +1318,7 @@ rta *
 rta_lookup(rta *o)
 {
   rta *r;
-  uint h;
+  u32 h;
 
   ASSERT(!(o->aflags & RTAF_CACHED));
   if (o->eattrs)
@@ -1147,10 +1332,16 @@ rta_lookup(rta *o)
       ea_sort(o->eattrs);
     }
 
+  if (rta_old_table)
+    rta_rehash_step(RTA_REHASH_STEP);
+
+  rta_stats.lookups++;
   h = rta_hash(o);
-  for(r=rta_hash_table[h & rta_cache_mask]; r; r=r->next)
-    if (r->hash_key == h && rta_same(r, o))
+  if (r = rta_find(o, h))
+    {
+      rta_stats.hits++;
       return rta_clone(r);
+    }
 
   r = rta_copy(o);
   r->hash_key = h;
@@ -1207,7 +1398,7 @@ rta_dump(rta *a)
   static char *rtc[] = { "", " BC", " MC", " AC" };
   static char *rtd[] = { "", " DEV", " HOLE", " UNREACH", " PROHIBIT" };
 
-  debug("p=%s uc=%d %s %s%s%s h=%04x",
+  debug("p=%s uc=%d %s %s%s%s h=%08x",
 	a->src->proto->name, a->uc, rts[a->source], ip_scope_text(a->scope), rtc[a->cast],
 	rtd[a->dest], a->hash_key);
   if (!(a->aflags & RTAF_CACHED))
@@ -1237,16 +1428,81 @@ rta_dump_all(void)
   uint h;
 
   debug("Route attribute cache (%d entries, rehash at %d):\n", rta_cache_count, rta_cache_limit);
-  for(h=0; h<rta_cache_size; h++)
+  for(h=0; h<=rta_cache_mask; h++)
     for(a=rta_hash_table[h]; a; a=a->next)
       {
 	debug("%p ", a);
 	rta_dump(a);
 	debug("\n");
       }
+  if (rta_old_table)
+    for(h=rta_old_pos; h<=rta_old_mask; h++)
+      for(a=rta_old_table[h]; a; a=a->next)
+	{
+	  debug("%p ", a);
+	  rta_dump(a);
+	  debug("\n");
+	}
   debug("\n");
 }
 
+static void
+rta_chain_stats(rta **tab, uint from, uint to, uint *used, uint *longest)
+{
+  uint h, len;
+  rta *a;
+
+  for (h = from; h <= to; h++)
+    {
+      for (len = 0, a = tab[h]; a; a = a->next)
+	len++;
+      if (len)
+	(*used)++;
+      if (len > *longest)
+	*longest = len;
+    }
+}
+
+/**
+ * rta_show_stats - show attribute cache statistics
+ *
+ * This function prints size and chain length statistics of the route
+ * attribute cache as a reply to the 'show attributes' CLI command.
+ */
+void
+rta_show_stats(void)
+{
+  uint buckets = rta_cache_mask + 1;
+  uint used = 0, longest = 0;
+
+  rta_chain_stats(rta_hash_table, 0, rta_cache_mask, &used, &longest);
+  if (rta_old_table)
+    {
+      buckets += rta_old_mask + 1 - rta_old_pos;
+      rta_chain_stats(rta_old_table, rta_old_pos, rta_old_mask, &used, &longest);
+    }
+
+  cli_msg(-1026, "Route attribute cache:");
+  cli_msg(-1026, "  Entries:          %u", rta_cache_count);
+  cli_msg(-1026, "  Buckets:          %u (%u used), grows at %u entries",
+	  rta_cache_mask + 1, used, rta_cache_limit);
+  if (rta_old_table)
+    cli_msg(-1026, "  Rehash:           in progress, %u of %u old buckets moved",
+	    rta_old_pos, rta_old_mask + 1);
+  cli_msg(-1026, "  Load factor:      %u.%02u", rta_cache_count / buckets,
+	  (uint) ((100ULL * rta_cache_count / buckets) % 100));
+  cli_msg(-1026, "  Chain length:     %u.%02u average, %u longest",
+	  used ? rta_cache_count / used : 0,
+	  used ? (uint) ((100ULL * rta_cache_count / used) % 100) : 0, longest);
+  cli_msg(-1026, "  Lookups:          %lu (%lu hits), %lu compares, %u rehashes",
+	  rta_stats.lookups, rta_stats.hits, rta_stats.probes, rta_stats.rehashes);
+  cli_msg(-1026, "Interned attribute payloads:");
+  cli_msg(-1026, "  Entries:          %u, %lu references", adata_hash_table.count, (unsigned long) adata_refs);
+  cli_msg(-1026, "  Size:             %lu kB stored, %lu kB referenced",
+	  (unsigned long) (adata_bytes >> 10), (unsigned long) (adata_ref_bytes >> 10));
+  cli_msg(0, "");
+}
+
 void
 rta_show(struct cli *c, rta *a, ea_list *eal)
 {
@@ -1275,7 +1531,8 @@ rta_init(void)
   rta_pool = rp_new(&root_pool, "Attributes");
   rta_slab = sl_new(rta_pool, sizeof(rta));
   mpnh_slab = sl_new(rta_pool, sizeof(struct mpnh));
-  rta_alloc_hash();
+  rta_alloc_hash(RTA_CACHE_INIT_ORDER);
+  HASH_INIT(adata_hash_table, rta_pool, ADH_INIT_ORDER);
   rte_src_init();
 }
 
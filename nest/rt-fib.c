@@ -46,6 +46,18 @@
  * again. You can use FIB_ITERATE_UNLINK() to unlink the iterator (while
  * iteration is suspended) in cases like premature end of FIB iteration.
  *
+ * Longest prefix match lookups (fib_route()) probe the hash table for each
+ * prefix length by default. FIBs used for frequent routing lookups can enable
+ * an additional index by fib_lpm_init(). It is a path-compressed binary trie
+ * of all prefixes in the FIB, kept in sync by fib_get() and fib_delete(), so
+ * a lookup visits just the trie nodes on the path to the longest match.
+ *
+ * Ordered FIBs (see fib_init_ordered()) have no hash table at all. All their
+ * nodes are kept in the trie and linked in one chain in the prefix order, which
+ * is presented as a hash table with just one bucket. Therefore, the walking and
+ * iteration code is shared, iteration follows the prefix order and there is no
+ * rehashing. Searching costs a trie walk instead of a hash table probe.
+ *
  * Note that the iterator must not be destroyed when the iteration is suspended,
  * the FIB would then contain a pointer to invalid memory. Therefore, after each
  * FIB_ITERATE_INIT() or FIB_ITERATE_PUT() there must be either
@@ -126,6 +138,39 @@ fib_init(struct fib *f, pool *p, unsigned node_size, unsigned hash_order, fib_in
   f->entries = 0;
   f->entries_min = 0;
   f->init = init ? : fib_dummy_init;
+  f->trie = NULL;
+  f->trie_slab = NULL;
+  f->ordered = 0;
+}
+
+/**
+ * fib_init_ordered - initialize a new ordered FIB
+ * @f: the FIB to be initialized (the structure itself being allocated by the caller)
+ * @p: pool to allocate the nodes in
+ * @node_size: node size to be used (each node consists of a standard header &fib_node
+ * followed by user data)
+ * @init: pointer a function to be called to initialize a newly created node
+ *
+ * This function is a variant of fib_init() for FIBs that keep nodes in a trie
+ * instead of a hash table. Such FIB is walked in the order of prefixes, it is
+ * never rehashed and it has the LPM index implicitly.
+ */
+void
+fib_init_ordered(struct fib *f, pool *p, unsigned node_size, fib_init_func init)
+{
+  f->fib_pool = p;
+  f->fib_slab = sl_new(p, node_size);
+  f->hash_order = 0;
+  f->hash_size = 1;
+  f->hash_shift = 16;
+  f->hash_table = mb_allocz(p, sizeof(struct fib_node *));
+  f->entries = 0;
+  f->entries_min = 0;
+  f->entries_max = ~0;
+  f->init = init ? : fib_dummy_init;
+  f->trie = NULL;
+  f->trie_slab = sl_new(p, sizeof(struct fib_trie_node));
+  f->ordered = 1;
 }
 
 static void
@@ -171,6 +216,182 @@ fib_rehash(struct fib *f, int step)
   fib_ht_free(m);
 }
 
+/*
+ *	LPM index
+ */
+
+static inline uint
+fib_trie_bit(ip_addr a, uint pos)
+{
+  return !!ipa_getbit(a, pos);
+}
+
+static struct fib_trie_node *
+fib_trie_new(struct fib *f, ip_addr a, int len, struct fib_node *e, struct fib_trie_node *parent)
+{
+  struct fib_trie_node *t = sl_alloc(f->trie_slab);
+
+  t->parent = parent;
+  t->child[0] = t->child[1] = NULL;
+  t->node = e;
+  t->prefix = a;
+  t->pxlen = len;
+  return t;
+}
+
+static inline void
+fib_trie_link(struct fib_trie_node *t, struct fib_trie_node *c)
+{
+  t->child[fib_trie_bit(c->prefix, t->pxlen)] = c;
+  c->parent = t;
+}
+
+static struct fib_trie_node *
+fib_trie_insert(struct fib *f, struct fib_node *e)
+{
+  struct fib_trie_node **tp = &f->trie, *parent = NULL, *t, *n;
+  ip_addr a = e->prefix;
+  int len = e->pxlen;
+
+  while (t = *tp)
+    {
+      int l = MIN(t->pxlen, len);
+
+      if (!ipa_in_net(a, t->prefix, l))
+	{
+	  /* Paths diverge, add a branching node */
+	  l = ipa_pxlen(a, t->prefix);
+	  n = fib_trie_new(f, ipa_and(a, ipa_mkmask(l)), l, NULL, parent);
+	  fib_trie_link(n, t);
+	  *tp = n;
+	  t = fib_trie_new(f, a, len, e, n);
+	  fib_trie_link(n, t);
+	  return t;
+	}
+
+      if (t->pxlen == len)
+	{
+	  /* Existing branching node */
+	  t->node = e;
+	  return t;
+	}
+
+      if (len < t->pxlen)
+	{
+	  /* New node is above the current one */
+	  n = fib_trie_new(f, a, len, e, parent);
+	  fib_trie_link(n, t);
+	  *tp = n;
+	  return n;
+	}
+
+      parent = t;
+      tp = &t->child[fib_trie_bit(a, t->pxlen)];
+    }
+
+  return *tp = fib_trie_new(f, a, len, e, parent);
+}
+
+/* Find the previous FIB node in the prefix order (preorder of the trie) */
+static struct fib_node *
+fib_trie_pred(struct fib_trie_node *t)
+{
+  struct fib_trie_node *p;
+
+  for (; p = t->parent; t = p)
+    {
+      if ((t == p->child[1]) && p->child[0])
+	{
+	  /* The last node of the left sibling subtree, leaves always have FIB nodes */
+	  for (t = p->child[0]; t->child[0] || t->child[1]; )
+	    t = t->child[1] ? : t->child[0];
+	  return t->node;
+	}
+
+      if (p->node)
+	return p->node;
+    }
+
+  return NULL;
+}
+
+static struct fib_trie_node *
+fib_trie_find(struct fib *f, ip_addr a, int len)
+{
+  struct fib_trie_node *t = f->trie;
+
+  while (t && (t->pxlen < len) && ipa_in_net(a, t->prefix, t->pxlen))
+    t = t->child[fib_trie_bit(a, t->pxlen)];
+
+  return (t && (t->pxlen == len) && ipa_equal(t->prefix, a)) ? t : NULL;
+}
+
+static void
+fib_trie_remove(struct fib *f, struct fib_node *e)
+{
+  struct fib_trie_node *t = fib_trie_find(f, e->prefix, e->pxlen);
+  struct fib_trie_node *c, *p, **tp;
+
+  ASSERT(t && (t->node == e));
+  t->node = NULL;
+
+  /* Remove nodes that are no longer needed, at most the node and its parent */
+  while (t && !t->node && !(t->child[0] && t->child[1]))
+    {
+      c = t->child[0] ? : t->child[1];
+      p = t->parent;
+      tp = p ? &p->child[fib_trie_bit(t->prefix, p->pxlen)] : &f->trie;
+
+      *tp = c;
+      if (c)
+	c->parent = p;
+
+      sl_free(f->trie_slab, t);
+      t = c ? NULL : p;
+    }
+}
+
+/**
+ * fib_lpm_init - enable LPM index
+ * @f: FIB
+ *
+ * This function adds the LPM index to the FIB, speeding up fib_route()
+ * lookups at the cost of two trie nodes per FIB node at most. It may be
+ * called on a FIB with existing entries.
+ */
+void
+fib_lpm_init(struct fib *f)
+{
+  if (f->trie_slab)
+    return;
+
+  f->trie_slab = sl_new(f->fib_pool, sizeof(struct fib_trie_node));
+
+  FIB_WALK(f, e)
+    fib_trie_insert(f, e);
+  FIB_WALK_END;
+}
+
+static void *
+fib_trie_route(struct fib *f, ip_addr a, int len)
+{
+  struct fib_trie_node *t = f->trie;
+  struct fib_node *best = NULL;
+
+  while (t && (t->pxlen <= len) && ipa_in_net(a, t->prefix, t->pxlen))
+    {
+      if (t->node)
+	best = t->node;
+
+      if (t->pxlen == len)
+	break;
+
+      t = t->child[fib_trie_bit(a, t->pxlen)];
+    }
+
+  return best;
+}
+
 /**
  * fib_find - search for FIB node by prefix
  * @f: FIB to search in
@@ -183,6 +404,12 @@ fib_rehash(struct fib *f, int step)
 void *
 fib_find(struct fib *f, ip_addr *a, int len)
 {
+  if (f->ordered)
+    {
+      struct fib_trie_node *t = fib_trie_find(f, *a, len);
+      return t ? t->node : NULL;
+    }
+
   struct fib_node *e = f->hash_table[fib_hash(f, a)];
 
   while (e && (e->pxlen != len || !ipa_equal(*a, e->prefix)))
@@ -221,9 +448,50 @@ fib_histogram(struct fib *f)
  * Search for a FIB node corresponding to the given prefix and
  * return a pointer to it. If no such node exists, create it.
  */
+static void *
+fib_get_ordered(struct fib *f, ip_addr *a, int len)
+{
+  struct fib_trie_node *t = fib_trie_find(f, *a, len);
+  struct fib_node *e, *pred;
+
+  if (t && t->node)
+    return t->node;
+#ifdef DEBUGGING
+  if (len < 0 || len > BITS_PER_IP_ADDRESS || !ip_is_prefix(*a,len))
+    bug("fib_get() called for invalid address");
+#endif
+
+  e = sl_alloc(f->fib_slab);
+  e->prefix = *a;
+  e->pxlen = len;
+  e->uid = 0;
+  e->readers = NULL;
+
+  /* Link the node to the chain after its predecessor in the trie */
+  pred = fib_trie_pred(fib_trie_insert(f, e));
+  if (pred)
+    {
+      e->next = pred->next;
+      pred->next = e;
+    }
+  else
+    {
+      e->next = f->hash_table[0];
+      f->hash_table[0] = e;
+    }
+
+  f->init(e);
+  f->entries++;
+
+  return e;
+}
+
 void *
 fib_get(struct fib *f, ip_addr *a, int len)
 {
+  if (f->ordered)
+    return fib_get_ordered(f, a, len);
+
   uint h = ipa_hash(*a);
   struct fib_node **ee = f->hash_table + (h >> f->hash_shift);
   struct fib_node *g, *e = *ee;
@@ -259,6 +527,8 @@ fib_get(struct fib *f, ip_addr *a, int len)
   *ee = e;
   e->readers = NULL;
   f->init(e);
+  if (f->trie_slab)
+    fib_trie_insert(f, e);
   if (f->entries++ > f->entries_max)
     fib_rehash(f, HASH_HI_STEP);
 
@@ -281,6 +551,9 @@ fib_route(struct fib *f, ip_addr a, int len)
   ip_addr a0;
   void *t;
 
+  if (f->trie_slab)
+    return fib_trie_route(f, a, len);
+
   while (len >= 0)
     {
       a0 = ipa_and(a, ipa_mkmask(len));
@@ -292,6 +565,101 @@ fib_route(struct fib *f, ip_addr a, int len)
   return NULL;
 }
 
+/**
+ * fib_route_all - find all FIB nodes covering a network
+ * @f: FIB to search in
+ * @a: IP address of the prefix
+ * @len: prefix length
+ * @nodes: array for found nodes, at least %BITS_PER_IP_ADDRESS+1 entries
+ *
+ * Search for all FIB nodes with prefixes covering the given network, store
+ * them to @nodes ordered from the shortest prefix and return their number.
+ * With the LPM index, just the trie nodes on the path are visited.
+ */
+int
+fib_route_all(struct fib *f, ip_addr a, int len, void **nodes)
+{
+  struct fib_trie_node *t = f->trie;
+  ip_addr a0;
+  int i, n = 0;
+
+  if (!f->trie_slab)
+    {
+      for (i = 0; i <= len; i++)
+	{
+	  a0 = ipa_and(a, ipa_mkmask(i));
+	  if (nodes[n] = fib_find(f, &a0, i))
+	    n++;
+	}
+      return n;
+    }
+
+  while (t && (t->pxlen <= len) && ipa_in_net(a, t->prefix, t->pxlen))
+    {
+      if (t->node)
+	nodes[n++] = t->node;
+
+      if (t->pxlen == len)
+	break;
+
+      t = t->child[fib_trie_bit(a, t->pxlen)];
+    }
+
+  return n;
+}
+
+static void
+fib_trie_walk(struct fib_trie_node *t, void (*hook)(struct fib_node *, void *), void *data)
+{
+  for (; t; t = t->child[1])
+    {
+      if (t->node)
+	hook(t->node, data);
+
+      fib_trie_walk(t->child[0], hook, data);
+    }
+}
+
+/**
+ * fib_walk_in - walk FIB nodes within a network
+ * @f: FIB to walk
+ * @a: IP address of the prefix
+ * @len: prefix length
+ * @hook: function called for each node
+ * @data: argument for @hook
+ *
+ * Call @hook for all FIB nodes with prefixes covered by the given network
+ * (including the network itself). With the LPM index, just the subtree of
+ * the network is walked, otherwise the whole FIB. The hook must not modify
+ * the FIB.
+ */
+void
+fib_walk_in(struct fib *f, ip_addr a, int len, void (*hook)(struct fib_node *, void *), void *data)
+{
+  struct fib_trie_node *t = f->trie;
+
+  if (!f->trie_slab)
+    {
+      FIB_WALK(f, e)
+	if (net_in_net(e->prefix, e->pxlen, a, len))
+	  hook(e, data);
+      FIB_WALK_END;
+      return;
+    }
+
+  while (t && (t->pxlen < len) && ipa_in_net(a, t->prefix, t->pxlen))
+    t = t->child[fib_trie_bit(a, t->pxlen)];
+
+  if (t && (t->pxlen >= len) && ipa_in_net(t->prefix, a, len))
+    {
+      if (t->node)
+	hook(t->node, data);
+
+      fib_trie_walk(t->child[0], hook, data);
+      fib_trie_walk(t->child[1], hook, data);
+    }
+}
+
 static inline void
 fib_merge_readers(struct fib_iterator *i, struct fib_node *to)
 {
@@ -343,11 +711,21 @@ fib_delete(struct fib *f, void *E)
   struct fib_node **ee = f->hash_table + h;
   struct fib_iterator *it;
 
+  /* In ordered FIB, we find the predecessor in the trie instead of the chain walk */
+  if (f->ordered)
+    {
+      struct fib_node *pred = fib_trie_pred(fib_trie_find(f, e->prefix, e->pxlen));
+      if (pred)
+	ee = &pred->next;
+    }
+
   while (*ee)
     {
       if (*ee == e)
 	{
 	  *ee = e->next;
+	  if (f->trie_slab)
+	    fib_trie_remove(f, e);
 	  if (it = e->readers)
 	    {
 	      struct fib_node *l = e->next;
@@ -383,6 +761,8 @@ fib_free(struct fib *f)
 {
   fib_ht_free(f->hash_table);
   rfree(f->fib_slab);
+  if (f->trie_slab)
+    rfree(f->trie_slab);
 }
 
 void
@@ -469,6 +849,22 @@ found:
 
 #ifdef DEBUGGING
 
+static uint
+fib_trie_check(struct fib_trie_node *t, struct fib_trie_node *parent)
+{
+  if (!t)
+    return 0;
+
+  if (t->parent != parent)
+    bug("fib_check: trie parent mismatch");
+  if (parent && ((t->pxlen <= parent->pxlen) || !ipa_in_net(t->prefix, parent->prefix, parent->pxlen)))
+    bug("fib_check: trie node %I/%d misplaced", t->prefix, t->pxlen);
+  if (!t->node && !(t->child[0] && t->child[1]))
+    bug("fib_check: redundant trie node %I/%d", t->prefix, t->pxlen);
+
+  return !!t->node + fib_trie_check(t->child[0], t) + fib_trie_check(t->child[1], t);
+}
+
 /**
  * fib_check - audit a FIB
  * @f: FIB to be checked
@@ -480,6 +876,7 @@ void
 fib_check(struct fib *f)
 {
   uint i, ec, lo, nulls;
+  struct fib_node *pn = NULL;
 
   ec = 0;
   for(i=0; i<f->hash_size; i++)
@@ -490,11 +887,20 @@ fib_check(struct fib *f)
 	{
 	  struct fib_iterator *j, *j0;
 	  uint h0 = ipa_hash(n->prefix);
-	  if (h0 < lo)
-	    bug("fib_check: discord in hash chains");
-	  lo = h0;
-	  if ((h0 >> f->hash_shift) != i)
-	    bug("fib_check: mishashed %x->%x (order %d)", h0, i, f->hash_order);
+	  if (f->ordered)
+	    {
+	      struct fib_trie_node *t = fib_trie_find(f, n->prefix, n->pxlen);
+	      if (!t || (t->node != n) || (fib_trie_pred(t) != pn))
+		bug("fib_check: discord in ordered chain");
+	    }
+	  else
+	    {
+	      if (h0 < lo)
+		bug("fib_check: discord in hash chains");
+	      lo = h0;
+	      if ((h0 >> f->hash_shift) != i)
+		bug("fib_check: mishashed %x->%x (order %d)", h0, i, f->hash_order);
+	    }
 	  j0 = (struct fib_iterator *) n;
 	  nulls = 0;
 	  for(j=n->readers; j; j=j->next)
@@ -509,17 +915,30 @@ fib_check(struct fib *f)
 	      else if (j->node != n)
 		bug("fib_check: iterator->node mismatch");
 	    }
+	  pn = n;
 	  ec++;
 	}
     }
   if (ec != f->entries)
     bug("fib_check: invalid entry count (%d != %d)", ec, f->entries);
+
+  if (f->trie_slab)
+    {
+      FIB_WALK(f, n)
+	if (!fib_trie_find(f, n->prefix, n->pxlen))
+	  bug("fib_check: %I/%d missing in LPM index", n->prefix, n->pxlen);
+      FIB_WALK_END;
+
+      if (fib_trie_check(f->trie, NULL) != f->entries)
+	bug("fib_check: invalid LPM index entry count");
+    }
 }
 
 #endif
 
 #ifdef TEST
 
+#include <time.h>
 #include "lib/resource.h"
 
 struct fib f;
@@ -549,6 +968,78 @@ void init(struct fib_node *n)
 {
 }
 
+/*
+ * Micro-benchmark of fib_route(), compares lookups by probing the hash table
+ * for each prefix length with lookups in the LPM index. It fills a FIB with
+ * random prefixes with roughly realistic length distribution and then looks up
+ * random host addresses.
+ */
+
+#define BENCH_PREFIXES	500000
+#define BENCH_LOOKUPS	2000000
+
+static u32
+bench_random(void)
+{
+  static u32 x = 2463534242;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+static double
+bench_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_route(int lpm)
+{
+  struct fib b;
+  ip_addr a;
+  int i, len, found = 0;
+  double t0, t1;
+
+  fib_init(&b, &root_pool, sizeof(struct fib_node), 0, init);
+  if (lpm)
+    fib_lpm_init(&b);
+
+  for (i = 0; i < BENCH_PREFIXES; i++)
+    {
+      len = (i % 3) ? 24 : (16 + bench_random() % 8);
+      a = ipa_and(ipa_from_u32(bench_random()), ipa_mkmask(len));
+      fib_get(&b, &a, len);
+    }
+
+  /* Both lookup methods must give the same results */
+  if (lpm)
+    for (i = 0; i < BENCH_LOOKUPS / 16; i++)
+      {
+	slab *s = b.trie_slab;
+	a = ipa_from_u32(bench_random());
+	void *x = fib_route(&b, a, BITS_PER_IP_ADDRESS);
+	b.trie_slab = NULL;
+	void *y = fib_route(&b, a, BITS_PER_IP_ADDRESS);
+	b.trie_slab = s;
+	if (x != y)
+	  bug("bench_route: LPM index mismatch for %I", a);
+      }
+
+  t0 = bench_time();
+  for (i = 0; i < BENCH_LOOKUPS; i++)
+    found += !!fib_route(&b, ipa_from_u32(bench_random()), BITS_PER_IP_ADDRESS);
+  t1 = bench_time();
+
+  debug("fib_route %s: %d lookups, %d found, %d ns per lookup\n",
+	lpm ? "with LPM index" : "by hash probing", BENCH_LOOKUPS, found,
+	(int) ((t1 - t0) * 1e9 / BENCH_LOOKUPS));
+
+  fib_free(&b);
+}
+
 int main(void)
 {
   struct fib_node *n;
@@ -556,9 +1047,10 @@ int main(void)
   ip_addr a;
   int c;
 
-  log_init_debug(NULL);
+  log_init_debug("");
   resource_init();
   fib_init(&f, &root_pool, sizeof(struct fib_node), 4, init);
+  fib_lpm_init(&f);
   dump("init");
 
   a = ipa_from_u32(0x01020304); n = fib_get(&f, &a, 32);
@@ -608,6 +1100,9 @@ next:
   fib_delete(&f, n);
   dump("iter step 3");
 
+  bench_route(0);
+  bench_route(1);
+
   return 0;
 }
 
@@ -7,9 +7,13 @@
 
 #undef LOCAL_DEBUG
 
+#include <stdlib.h>
+
 #include "nest/bird.h"
 #include "nest/route.h"
+#include "nest/protocol.h"
 #include "nest/cli.h"
+#include "lib/buffer.h"
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/event.h"
@@ -18,14 +22,163 @@
 
 
 pool *roa_pool;
-static slab *roa_slab;			/* Slab of struct roa_item */
 static list roa_table_list;		/* List of struct roa_table */
 struct roa_table *roa_table_default;	/* The first ROA table in the config */
 
+struct announce_hook *roa_filter_ahook;	/* Hook of the running filter, see roa_add_dep() */
+byte roa_filter_dir;			/* Direction of the running filter (ROA_DEP_*) */
+byte roa_filter_prev;			/* Filter checks ROA state before pending changes */
+
+#define ROA_MAX_CHANGES	4096		/* Then all dependent routes are re-evaluated */
+
 static inline int
 src_match(struct roa_item *it, byte src)
 { return !src || it->src == src; }
 
+/* Items of a ROA node are sorted by ASN, then by decreasing maxlen and by source */
+static inline int
+roa_item_cmp(u32 asn, byte maxlen, byte src, struct roa_item *it)
+{
+  if (asn != it->asn)
+    return (asn < it->asn) ? -1 : 1;
+  if (maxlen != it->maxlen)
+    return (maxlen > it->maxlen) ? -1 : 1;
+  if (src != it->src)
+    return (src < it->src) ? -1 : 1;
+  return 0;
+}
+
+/* Position of the first item in @items not less than the given key */
+static uint
+roa_items_lookup(struct roa_item *items, uint num, u32 asn, byte maxlen, byte src)
+{
+  uint lo = 0, hi = num;
+
+  while (lo < hi)
+    {
+      uint mid = (lo + hi) / 2;
+      if (roa_item_cmp(asn, maxlen, src, &items[mid]) > 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return lo;
+}
+
+static inline uint
+roa_node_lookup(struct roa_node *n, u32 asn, byte maxlen, byte src)
+{ return roa_items_lookup(n->items, n->num_items, asn, maxlen, src); }
+
+/* Find a ROA item with given fields, any source matching @src */
+static int
+roa_node_find(struct roa_node *n, u32 asn, byte maxlen, byte src)
+{
+  uint i;
+
+  for (i = roa_node_lookup(n, asn, maxlen, ROA_SRC_ANY); i < n->num_items; i++)
+    {
+      struct roa_item *it = &n->items[i];
+
+      if ((it->asn != asn) || (it->maxlen != maxlen))
+	break;
+
+      if (src_match(it, src))
+	return i;
+    }
+
+  return -1;
+}
+
+/* Empty nodes with pending changes are kept until roa_release_saved() */
+static inline void
+roa_node_free(struct roa_table *t, struct roa_node *n)
+{
+  mb_free(n->items);
+  n->items = NULL;
+
+  if (!n->saved)
+    fib_delete(&t->fib, n);
+}
+
+/*
+ * Export filters of routes re-evaluated after changes of a ROA table have to
+ * know whether the routes were exported before, so changed nodes keep their
+ * previous items until roa_update_deps(). These are used by roa_check() for
+ * old routes (see roa_filter_prev). It is not needed when everything is
+ * refed anyway.
+ */
+static void
+roa_save_node(struct roa_table *t, struct roa_node *n)
+{
+  if (n->saved || EMPTY_LIST(t->deps) || t->changes_all)
+    return;
+
+  uint size = n->num_items * sizeof(struct roa_item);
+  n->prev_items = size ? mb_alloc(roa_pool, size) : NULL;
+  memcpy(n->prev_items, n->items, size);
+  n->prev_num = n->num_items;
+  n->saved = 1;
+  n->next_saved = t->saved;
+  t->saved = n;
+}
+
+static void
+roa_release_saved(struct roa_table *t)
+{
+  struct roa_node *n, *nx;
+
+  for (n = t->saved; n; n = nx)
+    {
+      nx = n->next_saved;
+      mb_free(n->prev_items);
+      n->prev_items = NULL;
+      n->prev_num = 0;
+      n->next_saved = NULL;
+      n->saved = 0;
+
+      if (!n->num_items)
+	roa_node_free(t, n);
+    }
+
+  t->saved = NULL;
+}
+
+/*
+ * Any change of a ROA node invalidates cached results and it is recorded
+ * for re-evaluation of dependent routes, see roa_update_deps().
+ */
+static void
+roa_changed(struct roa_table *t, ip_addr prefix, byte pxlen)
+{
+  if (!++t->gen)
+    {
+      /* Generation wrapped around, cache entries with gen 0 are unused */
+      t->gen = 1;
+      if (t->cache)
+	bzero(t->cache, sizeof(struct roa_cache_entry) << t->cache_order);
+    }
+
+  if (EMPTY_LIST(t->deps) || t->changes_all)
+    return;
+
+  if (t->num_changes == t->max_changes)
+    {
+      if (t->max_changes >= ROA_MAX_CHANGES)
+	{
+	  t->changes_all = 1;
+	  return;
+	}
+
+      t->max_changes = t->max_changes ? 2 * t->max_changes : 16;
+      uint size = t->max_changes * sizeof(struct prefix);
+      t->changes = t->changes ? mb_realloc(t->changes, size) : mb_alloc(roa_pool, size);
+    }
+
+  t->changes[t->num_changes++] = (struct prefix) { prefix, pxlen };
+  ev_schedule(t->deps_event);
+}
+
 /**
  * roa_add_item - add a ROA entry
  * @t: ROA table
@@ -44,20 +197,20 @@ roa_add_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u32 a
 {
   struct roa_node *n = fib_get(&t->fib, &prefix, pxlen);
 
-  // if ((n->items == NULL) && (n->n.x0 != ROA_INVALID))
-  // t->cached_items--;
+  if (roa_node_find(n, asn, maxlen, src) >= 0)
+    return;
+
+  roa_save_node(t, n);
 
-  struct roa_item *it;
-  for (it = n->items; it; it = it->next)
-    if ((it->maxlen == maxlen) && (it->asn == asn) && src_match(it, src))
-      return;
+  uint pos = roa_node_lookup(n, asn, maxlen, src);
+  uint size = (n->num_items + 1) * sizeof(struct roa_item);
 
-  it = sl_alloc(roa_slab);
-  it->asn = asn;
-  it->maxlen = maxlen;
-  it->src = src;
-  it->next = n->items;
-  n->items = it;
+  n->items = n->items ? mb_realloc(n->items, size) : mb_alloc(roa_pool, size);
+  memmove(n->items + pos + 1, n->items + pos, (n->num_items - pos) * sizeof(struct roa_item));
+  n->items[pos] = (struct roa_item) { .asn = asn, .maxlen = maxlen, .src = src };
+  n->num_items++;
+
+  roa_changed(t, prefix, pxlen);
 }
 
 /**
@@ -81,21 +234,97 @@ roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u3
   if (!n)
     return;
 
-  struct roa_item *it, **itp;
-  for (itp = &n->items; it = *itp; itp = &it->next)
-    if ((it->maxlen == maxlen) && (it->asn == asn) && src_match(it, src))
-      break;
+  int pos = roa_node_find(n, asn, maxlen, src);
+
+  if (pos < 0)
+    return;
+
+  roa_save_node(t, n);
+
+  n->num_items--;
+  memmove(n->items + pos, n->items + pos + 1, (n->num_items - pos) * sizeof(struct roa_item));
+
+  if (!n->num_items)
+    roa_node_free(t, n);
+
+  roa_changed(t, prefix, pxlen);
+}
+
+
+/* Position of ROA config entries for the given prefix in sorted @v, or -1 */
+static int
+roa_config_find(struct roa_item_config **v, uint num, ip_addr prefix, byte pxlen)
+{
+  uint lo = 0, hi = num;
 
-  if (!it)
+  while (lo < hi)
+    {
+      uint mid = (lo + hi) / 2;
+      int x = ipa_compare(v[mid]->prefix, prefix);
+
+      if (!x)
+	x = (v[mid]->pxlen > pxlen) - (v[mid]->pxlen < pxlen);
+      if (!x)
+	return mid;
+
+      if (x < 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return -1;
+}
+
+/* Remove entries of @src from a ROA node */
+static void
+roa_node_flush(struct roa_table *t, struct roa_node *n, byte src)
+{
+  uint i, j;
+
+  for (i = 0; (i < n->num_items) && !src_match(&n->items[i], src); i++)
+    ;
+
+  if (i == n->num_items)
     return;
 
-  *itp = it->next;
-  sl_free(roa_slab, it);
+  roa_save_node(t, n);
 
-  // if ((n->items == NULL) && (n->n.x0 != ROA_INVALID))
-  // t->cached_items++;
+  for (j = i; i < n->num_items; i++)
+    if (!src_match(&n->items[i], src))
+      n->items[j++] = n->items[i];
+
+  n->num_items = j;
+  roa_changed(t, n->n.prefix, n->n.pxlen);
 }
 
+/* Remove entries of @src from all nodes except the ones with prefixes in sorted @v */
+static void
+roa_flush_except(struct roa_table *t, byte src, struct roa_item_config **v, uint num)
+{
+  struct fib_iterator fit;
+  struct roa_node *n;
+
+  FIB_ITERATE_INIT(&fit, &t->fib);
+again:
+  FIB_ITERATE_START(&t->fib, &fit, fn)
+    {
+      n = (struct roa_node *) fn;
+
+      /* Kept nodes are handled by roa_replace_items() */
+      if (!num || (roa_config_find(v, num, n->n.prefix, n->n.pxlen) < 0))
+	roa_node_flush(t, n, src);
+
+      if (!n->num_items && !n->saved)
+	{
+	  /* Remove empty nodes */
+	  FIB_ITERATE_PUT(&fit, fn);
+	  roa_node_free(t, n);
+	  goto again;
+	}
+    }
+  FIB_ITERATE_END(fn);
+}
 
 /**
  * roa_flush - flush a ROA table
@@ -109,63 +338,111 @@ roa_delete_item(struct roa_table *t, ip_addr prefix, byte pxlen, byte maxlen, u3
 void
 roa_flush(struct roa_table *t, byte src)
 {
-  struct roa_item *it, **itp;
-  struct roa_node *n;
-
-  FIB_WALK(&t->fib, fn)
-    {
-      n = (struct roa_node *) fn;
-
-      itp = &n->items;
-      while (it = *itp)
-	if (src_match(it, src))
-	  {
-	    *itp = it->next;
-	    sl_free(roa_slab, it);
-	  }
-	else
-	  itp = &it->next;
-    }
-  FIB_WALK_END;
+  roa_flush_except(t, src, NULL, 0);
+}
 
-  // TODO add cleanup of roa_nodes
+static int
+roa_item_config_cmp(const void *A, const void *B)
+{
+  const struct roa_item_config *a = *(const struct roa_item_config **) A;
+  const struct roa_item_config *b = *(const struct roa_item_config **) B;
+
+  int x = ipa_compare(a->prefix, b->prefix);
+  if (x)
+    return x;
+  if (a->pxlen != b->pxlen)
+    return (a->pxlen < b->pxlen) ? -1 : 1;
+  if (a->asn != b->asn)
+    return (a->asn < b->asn) ? -1 : 1;
+  if (a->maxlen != b->maxlen)
+    return (a->maxlen > b->maxlen) ? -1 : 1;
+  return 0;
 }
 
+static inline int
+roa_items_same(struct roa_item *a, struct roa_item *b, uint num)
+{
+  uint i;
 
+  for (i = 0; i < num; i++)
+    if (roa_item_cmp(a[i].asn, a[i].maxlen, a[i].src, &b[i]))
+      return 0;
+
+  return 1;
+}
 
 /*
-byte
-roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
+ * Bulk replace of ROA entries of @src. Entries in sorted @v are grouped by
+ * ROA nodes, so each node is found just once and its item array is built by
+ * one merge of the old items (without the ones of @src) and the new items.
+ * Nodes are recorded as changed only if their items really differ, so
+ * reconfiguration with the same static ROAs does not trigger anything.
+ */
+static void
+roa_replace_items(struct roa_table *t, struct roa_item_config **v, uint num, byte src)
 {
-  struct roa_node *n = fib_find(&t->fib, &prefix, pxlen);
+  uint i, j, k;
 
-  if (n && n->n.x0 == ROA_UNKNOWN)
-    return ROA_UNKNOWN;
+  roa_flush_except(t, src, v, num);
 
-  if (n && n->n.x0 == ROA_VALID && asn == n->cached_asn)
-    return ROA_VALID;
+  for (i = 0; i < num; i = j)
+    {
+      for (j = i + 1; j < num; j++)
+	if ((v[j]->pxlen != v[i]->pxlen) || !ipa_equal(v[j]->prefix, v[i]->prefix))
+	  break;
 
-  byte rv = roa_match(t, n, prefix, pxlen, asn);
+      struct roa_node *n = fib_get(&t->fib, &v[i]->prefix, v[i]->pxlen);
+      struct roa_item *old = n->items;
+      struct roa_item *items = mb_alloc(roa_pool, (n->num_items + j - i) * sizeof(struct roa_item));
+      uint m = 0;
 
-  if (rv != ROA_INVALID)
-    {
-      if (!n)
+      for (k = 0; (i < j) || (k < n->num_items); )
 	{
-	  if (t->cached_items >= t->cached_items_max)
-	  n = fib_get(&t->fib, &prefix, pxlen);
-	  t->cached_items++;
+	  struct roa_item it = { .src = src };
+	  int x = 1;
+
+	  /* Old entries of @src are replaced */
+	  if ((k < n->num_items) && (old[k].src == src))
+	    {
+	      k++;
+	      continue;
+	    }
+
+	  if (i < j)
+	    {
+	      it.asn = v[i]->asn;
+	      it.maxlen = v[i]->maxlen;
+	      x = (k < n->num_items) ? roa_item_cmp(it.asn, it.maxlen, src, &old[k]) : -1;
+	    }
+
+	  if (x < 0)
+	    {
+	      /* Skip duplicates */
+	      if (!m || roa_item_cmp(it.asn, it.maxlen, src, &items[m-1]))
+		items[m++] = it;
+	      i++;
+	    }
+	  else
+	    items[m++] = old[k++];
 	}
 
-      n->cached_asn = asn;
-      n->n.x0 = rv;
-    }
+      if ((m == n->num_items) && roa_items_same(items, old, m))
+	{
+	  mb_free(items);
+	  continue;
+	}
 
-  return rv;
+      roa_save_node(t, n);
+      roa_changed(t, n->n.prefix, n->n.pxlen);
+
+      mb_free(old);
+      n->items = items;
+      n->num_items = m;
+    }
 }
-*/
 
 /**
- * roa_check - check validity of route origination in a ROA table 
+ * roa_check - check validity of route origination in a ROA table
  * @t: ROA table
  * @prefix: network prefix to check
  * @pxlen: length of network prefix
@@ -179,33 +456,244 @@ roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
  * length, return ROA_VALID. Otherwise return ROA_INVALID. If caller
  * cannot determine origin AS, 0 could be used (in that case ROA_VALID
  * cannot happen).
+ *
+ * Candidate ROA nodes are found by one walk of the LPM index of the ROA
+ * table, their items are searched by binary search on ASN. If the table
+ * has a result cache, the results are cached until the next change of
+ * the table. When @roa_filter_prev is set, nodes with pending changes are
+ * checked in their state before the changes.
  */
 byte
 roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
 {
-  struct roa_node *n;
-  ip_addr px;
-  byte anything = 0;
+  struct roa_node *nodes[BITS_PER_IP_ADDRESS + 1];
+  struct roa_cache_entry *ce = NULL;
+  byte rv = ROA_UNKNOWN;
+  int i, num;
+
+  /* Previous state of nodes with pending changes, see roa_save_node() */
+  int prev = roa_filter_prev && t->saved;
+
+  if (t->cache && !prev)
+    {
+      u32 h = u32_hash(ipa_hash32(prefix) ^ u32_hash(asn) ^ pxlen);
+      ce = &t->cache[h >> (32 - t->cache_order)];
+
+      if ((ce->gen == t->gen) && (ce->asn == asn) && (ce->pxlen == pxlen) &&
+	  ipa_equal(ce->prefix, prefix))
+	return ce->result;
+    }
+
+  num = fib_route_all(&t->fib, prefix, pxlen, (void **) nodes);
+
+  for (i = 0; i < num; i++)
+    {
+      struct roa_node *n = nodes[i];
+      struct roa_item *items = n->items;
+      uint cnt = n->num_items;
+      uint pos;
+
+      if (prev && n->saved)
+	{
+	  items = n->prev_items;
+	  cnt = n->prev_num;
+	}
+
+      if (!cnt)
+	continue;
+
+      rv = ROA_INVALID;
+
+      /* The first item with matching ASN has the highest maxlen */
+      pos = roa_items_lookup(items, cnt, asn, 255, ROA_SRC_ANY);
+      if (asn && (pos < cnt) && (items[pos].asn == asn) && (items[pos].maxlen >= pxlen))
+	{
+	  rv = ROA_VALID;
+	  break;
+	}
+    }
+
+  if (ce)
+    *ce = (struct roa_cache_entry) {
+      .prefix = prefix, .asn = asn, .gen = t->gen, .pxlen = pxlen, .result = rv
+    };
+
+  return rv;
+}
+
+/**
+ * roa_add_dep - record dependency of a filter on a ROA table
+ * @t: ROA table
+ * @other_net: the filter checked a prefix other than the one of the route
+ *
+ * This function is called from roa_check() in filters. When the filter is
+ * running as an import or export filter of some announce hook (see
+ * @roa_filter_ahook), the dependency of the hook on the ROA table is
+ * recorded, so routes passing through the hook are re-evaluated after
+ * changes of the ROA table. See roa_update_deps().
+ */
+void
+roa_add_dep(struct roa_table *t, int other_net)
+{
+  struct announce_hook *ah = roa_filter_ahook;
+  struct roa_dep *d;
+
+  if (!ah)
+    return;
+
+  for (d = ah->roa_deps; d; d = d->next)
+    if ((d->table == t) && (d->dir == roa_filter_dir))
+      {
+	d->other_nets |= other_net;
+	return;
+      }
+
+  d = mb_allocz(roa_pool, sizeof(struct roa_dep));
+  d->table = t;
+  d->ah = ah;
+  d->dir = roa_filter_dir;
+  d->other_nets = other_net;
+  d->next = ah->roa_deps;
+  ah->roa_deps = d;
+  add_tail(&t->deps, &d->n);
+}
+
+/**
+ * roa_unlink_ahook - remove ROA dependencies of an announce hook
+ * @ah: announce hook going to be freed
+ */
+void
+roa_unlink_ahook(struct announce_hook *ah)
+{
+  struct roa_dep *d, *dn;
+
+  for (d = ah->roa_deps; d; d = dn)
+    {
+      dn = d->next;
+      rem_node(&d->n);
+      mb_free(d);
+    }
+
+  ah->roa_deps = NULL;
+}
+
+static int
+roa_prefix_cmp(const void *A, const void *B)
+{
+  const struct prefix *a = A;
+  const struct prefix *b = B;
+
+  int x = ipa_compare(a->addr, b->addr);
+  if (x)
+    return x;
+  return (a->len < b->len) ? -1 : (a->len > b->len);
+}
+
+typedef BUFFER(net *) roa_net_buffer;
+
+static void
+roa_collect_net(struct fib_node *fn, void *data)
+{
+  roa_net_buffer *nets = data;
+  BUFFER_PUSH(*nets) = (net *) fn;
+}
 
-  int len;
-  for (len = pxlen; len >= 0; len--)
+/*
+ * Changed prefixes are sorted, so a prefix is followed by all prefixes it
+ * covers. These are dropped, as nets within them are refreshed anyway.
+ */
+static uint
+roa_reduce_changes(struct roa_table *t)
+{
+  struct prefix *c = t->changes;
+  uint i, j;
+
+  qsort(c, t->num_changes, sizeof(struct prefix), roa_prefix_cmp);
+
+  for (i = j = 0; i < t->num_changes; i++)
+    if (!j || !net_in_net(c[i].addr, c[i].len, c[j-1].addr, c[j-1].len))
+      c[j++] = c[i];
+
+  return j;
+}
+
+static void
+roa_update_nets(struct roa_dep *d, struct prefix *c, uint num)
+{
+  struct announce_hook *ah = d->ah;
+  roa_net_buffer nets;
+  uint i, j;
+
+  BUFFER_INIT(nets, roa_pool, 64);
+
+  /* Walks within changed prefixes need the LPM index of the table */
+  fib_lpm_init(&ah->table->fib);
+
+  for (i = 0; i < num; i++)
+    {
+      /* Collect nets first, updates may modify the table through pipes */
+      BUFFER_FLUSH(nets);
+      fib_walk_in(&ah->table->fib, c[i].addr, c[i].len, roa_collect_net, &nets);
+
+      for (j = 0; j < nets.used; j++)
+	if (d->dir == ROA_DEP_IMPORT)
+	  rt_reimport_net(ah, nets.data[j]);
+	else
+	  rt_refeed_net(ah, nets.data[j]);
+    }
+
+  mb_free(nets.data);
+}
+
+/*
+ * Re-evaluation of routes depending on a changed ROA table. Filters are re-run
+ * just for nets within changed ROA prefixes, unless the filter checked other
+ * prefixes than the net's one or there were too many changes. Then an import
+ * filter is re-run for all nets of the table and the whole table is refed to
+ * a protocol with an export filter. The whole table is also refed to protocols
+ * receiving accepted or merged routes, as their exports depend on other routes
+ * of the net. Imports are re-evaluated from routes kept before filtering (see
+ * rt_reimport_net()), so the protocol is not involved and the cost depends on
+ * the number of affected nets.
+ */
+static void
+roa_update_deps(void *data)
+{
+  struct roa_table *t = data;
+  struct roa_dep *d;
+  struct prefix all = { IPA_NONE, 0 };
+  uint num = 0;
+
+  if (!t->changes_all)
+    num = roa_reduce_changes(t);
+
+  WALK_LIST(d, t->deps)
     {
-      px = ipa_and(prefix, ipa_mkmask(len));
-      n = fib_find(&t->fib, &px, len);
+      struct proto *p = d->ah->proto;
 
-      if (!n)
+      if (p->proto_state != PS_UP)
 	continue;
 
-      struct roa_item *it;
-      for (it = n->items; it; it = it->next)
+      if (d->dir == ROA_DEP_IMPORT)
 	{
-	  anything = 1;
-	  if ((it->maxlen >= pxlen) && (it->asn == asn) && asn)
-	    return ROA_VALID;
+	  if (!d->ah->in_keep_original)
+	    continue;
+
+	  if (t->changes_all || d->other_nets)
+	    roa_update_nets(d, &all, 1);
+	  else
+	    roa_update_nets(d, t->changes, num);
 	}
+      else if (t->changes_all || d->other_nets ||
+	       ((p->accept_ra_types != RA_OPTIMAL) && (p->accept_ra_types != RA_ANY)))
+	proto_request_feeding(p);
+      else
+	roa_update_nets(d, t->changes, num);
     }
 
-  return anything ? ROA_INVALID : ROA_UNKNOWN;
+  roa_release_saved(t);
+  t->num_changes = 0;
+  t->changes_all = 0;
 }
 
 static void
@@ -213,14 +701,71 @@ roa_node_init(struct fib_node *fn)
 {
   struct roa_node *n = (struct roa_node *) fn;
   n->items = NULL;
+  n->num_items = 0;
+}
+
+static void
+roa_set_cache(struct roa_table *t, uint size)
+{
+  mb_free(t->cache);
+  t->cache = NULL;
+  t->cache_order = 0;
+
+  if (!size)
+    return;
+
+  uint order = 1;
+  while ((1U << order) < size)
+    order++;
+
+  t->cache = mb_allocz(roa_pool, sizeof(struct roa_cache_entry) << order);
+  t->cache_order = order;
+}
+
+static void
+roa_free_deps(struct roa_table *t)
+{
+  struct roa_dep *d, *dx, **dp;
+
+  WALK_LIST_DELSAFE(d, dx, t->deps)
+    {
+      for (dp = &d->ah->roa_deps; *dp != d; dp = &(*dp)->next)
+	;
+
+      *dp = d->next;
+      rem_node(&d->n);
+      mb_free(d);
+    }
+
+  roa_release_saved(t);
+  rfree(t->deps_event);
+  mb_free(t->changes);
 }
 
 static inline void
 roa_populate(struct roa_table *t)
 {
   struct roa_item_config *ric;
+  uint num = 0;
+
   for (ric = t->cf->roa_items; ric; ric = ric->next)
-    roa_add_item(t, ric->prefix, ric->pxlen, ric->maxlen, ric->asn, ROA_SRC_CONFIG);
+    num++;
+
+  if (!num)
+    {
+      roa_flush(t, ROA_SRC_CONFIG);
+      return;
+    }
+
+  struct roa_item_config **v = mb_alloc(roa_pool, num * sizeof(struct roa_item_config *));
+
+  num = 0;
+  for (ric = t->cf->roa_items; ric; ric = ric->next)
+    v[num++] = ric;
+
+  qsort(v, num, sizeof(struct roa_item_config *), roa_item_config_cmp);
+  roa_replace_items(t, v, num, ROA_SRC_CONFIG);
+  mb_free(v);
 }
 
 static void
@@ -230,8 +775,15 @@ roa_new_table(struct roa_table_config *cf)
 
   t = mb_allocz(roa_pool, sizeof(struct roa_table));
   fib_init(&t->fib, roa_pool, sizeof(struct roa_node), 0, roa_node_init);
+  fib_lpm_init(&t->fib);
   t->name = cf->name;
   t->cf = cf;
+  t->gen = 1;
+  roa_set_cache(t, cf->cache_size);
+  init_list(&t->deps);
+  t->deps_event = ev_new(roa_pool);
+  t->deps_event->hook = roa_update_deps;
+  t->deps_event->data = t;
 
   cf->table = t;
   add_tail(&roa_table_list, &t->n);
@@ -279,7 +831,6 @@ void
 roa_init(void)
 {
   roa_pool = rp_new(&root_pool, "ROA tables");
-  roa_slab = sl_new(roa_pool, sizeof(struct roa_item));
   init_list(&roa_table_list);
 }
 
@@ -316,12 +867,14 @@ roa_commit(struct config *new, struct config *old)
 	  {
 	    /* Found old table in new config */
 	    cf = sym->def;
+	    if (cf->cache_size != t->cf->cache_size)
+	      roa_set_cache(t, cf->cache_size);
+
 	    cf->table = t;
 	    t->name = cf->name;
 	    t->cf = cf;
 
-	    /* Reconfigure it */
-	    roa_flush(t, ROA_SRC_CONFIG);
+	    /* Reconfigure it, changes of static entries are found by roa_replace_items() */
 	    roa_populate(t);
 	  }
 	else
@@ -330,6 +883,8 @@ roa_commit(struct config *new, struct config *old)
 
 	    /* Free it now */
 	    roa_flush(t, ROA_SRC_ANY);
+	    roa_free_deps(t);
+	    mb_free(t->cache);
 	    rem_node(&t->n);
 	    fib_free(&t->fib);
 	    mb_free(t);
@@ -352,7 +907,7 @@ roa_show_node(struct cli *c, struct roa_node *rn, int len, u32 asn)
 {
   struct roa_item *ri;
 
-  for (ri = rn->items; ri; ri = ri->next)
+  for (ri = rn->items; ri < rn->items + rn->num_items; ri++)
     if ((ri->maxlen >= len) && (!asn || (ri->asn == asn)))
       cli_printf(c, -1019, "%I/%d max %d as %u", rn->n.prefix, rn->n.pxlen, ri->maxlen, ri->asn);
 }
@@ -398,9 +953,8 @@ roa_show_cleanup(struct cli *c)
 void
 roa_show(struct roa_show_data *d)
 {
-  struct roa_node *rn;
-  ip_addr px;
-  int len;
+  struct roa_node *rn, *nodes[BITS_PER_IP_ADDRESS + 1];
+  int num;
 
   switch (d->mode)
     {
@@ -414,7 +968,7 @@ roa_show(struct roa_show_data *d)
 
     case ROA_SHOW_PX:
       rn = fib_find(&d->table->fib, &d->prefix, d->pxlen);
-      if (rn)
+      if (rn && rn->num_items)
 	{
 	  roa_show_node(this_cli, rn, 0, d->asn);
 	  cli_msg(0, "");
@@ -424,16 +978,9 @@ roa_show(struct roa_show_data *d)
       break;
 
     case ROA_SHOW_FOR:
-      for (len = d->pxlen; len >= 0; len--)
-	{
-	  px = ipa_and(d->prefix, ipa_mkmask(len));
-	  rn = fib_find(&d->table->fib, &px, len);
-
-	  if (!rn)
-	    continue;
-
-	  roa_show_node(this_cli, rn, 0, d->asn);
-	}
+      num = fib_route_all(&d->table->fib, d->prefix, d->pxlen, (void **) nodes);
+      while (num--)
+	roa_show_node(this_cli, nodes[num], 0, d->asn);
       cli_msg(0, "");
       break;
     }
@@ -64,18 +64,12 @@ static inline void rt_schedule_prune(rtable *tab);
 static net *
 net_route(rtable *tab, ip_addr a, int len)
 {
-  ip_addr a0;
-  net *n;
+  net *n = fib_route(&tab->fib, a, len);
 
-  while (len >= 0)
-    {
-      a0 = ipa_and(a, ipa_mkmask(len));
-      n = fib_find(&tab->fib, &a0, len);
-      if (n && rte_is_valid(n->routes))
-	return n;
-      len--;
-    }
-  return NULL;
+  while (n && !rte_is_valid(n->routes))
+    n = n->n.pxlen ? fib_route(&tab->fib, a, n->n.pxlen - 1) : NULL;
+
+  return n;
 }
 
 static void
@@ -85,6 +79,7 @@ rte_init(struct fib_node *N)
 
   N->flags = 0;
   n->routes = NULL;
+  n->in_routes = NULL;
 }
 
 /**
@@ -272,9 +267,12 @@ export_filter_(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa
       goto accept;
     }
 
+  roa_filter_ahook = ah;
+  roa_filter_dir = ROA_DEP_EXPORT;
   v = filter && ((filter == FILTER_REJECT) ||
-		 (f_run(filter, &rt, tmpa, pool,
+		 (f_run_cached(filter, &rt, tmpa, pool,
 			FF_FORCE_TMPATTR | (silent ? FF_SILENT : 0)) > F_ACCEPT));
+  roa_filter_ahook = NULL;
   if (v)
     {
       if (silent)
@@ -874,6 +872,29 @@ rte_same(rte *x, rte *y)
     rte_is_filtered(x) == rte_is_filtered(y);
 }
 
+/*
+ * Routes with recursive next hops in their home table (the dependent table of
+ * their hostentry) are kept in the hostentry dependency list, so that Next Hop
+ * Update could find them without walking the whole table.
+ */
+static inline void
+rte_link_hostentry(rtable *tab, rte *e)
+{
+  struct hostentry *he = e->attrs->hostentry;
+
+  if (he && (he->tab == tab))
+    add_tail(&he->deps, &e->hn);
+}
+
+static inline void
+rte_unlink_hostentry(rtable *tab, rte *e)
+{
+  struct hostentry *he = e->attrs->hostentry;
+
+  if (he && (he->tab == tab))
+    rem_node(&e->hn);
+}
+
 static inline int rte_is_ok(rte *e) { return e && !rte_is_filtered(e); }
 
 static void
@@ -1094,8 +1115,14 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
       /* The fourth (empty) case - suboptimal route was removed, nothing to do */
     }
 
+  if (old)
+    rte_unlink_hostentry(table, old);
+
   if (new)
-    new->lastmod = now;
+    {
+      rte_link_hostentry(table, new);
+      new->lastmod = now;
+    }
 
   /* Log the route change */
   if (p->debug & D_ROUTES)
@@ -1212,8 +1239,12 @@ rte_unhide_dummy_routes(net *net, rte **dummy)
  * finishes.
  */
 
-void
-rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
+/*
+ * Import filtering and table update part of rte_update2(), also used to
+ * re-import routes from their kept originals, see rt_reimport_net().
+ */
+static void
+rte_import(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
 {
   struct proto *p = ah->proto;
   struct proto_stats *stats = ah->stats;
@@ -1221,19 +1252,8 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
   ea_list *tmpa = NULL;
   rte *dummy = NULL;
 
-  rte_update_lock();
   if (new)
     {
-      new->sender = ah;
-
-      stats->imp_updates_received++;
-      if (!rte_validate(new))
-	{
-	  rte_trace_in(D_FILTERS, p, new, "invalid");
-	  stats->imp_updates_invalid++;
-	  goto drop;
-	}
-
       if (filter == FILTER_REJECT)
 	{
 	  stats->imp_updates_filtered++;
@@ -1251,7 +1271,10 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
 	  if (filter && (filter != FILTER_REJECT))
 	    {
 	      ea_list *old_tmpa = tmpa;
+	      roa_filter_ahook = ah;
+	      roa_filter_dir = ROA_DEP_IMPORT;
 	      int fr = f_run(filter, &new, &tmpa, rte_update_pool, 0);
+	      roa_filter_ahook = NULL;
 	      if (fr > F_ACCEPT)
 		{
 		  stats->imp_updates_filtered++;
@@ -1270,6 +1293,71 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
 	new->attrs = rta_lookup(new->attrs);
       new->flags |= REF_COW;
     }
+
+ recalc:
+  rte_hide_dummy_routes(net, &dummy);
+  rte_recalculate(ah, net, new, src);
+  rte_unhide_dummy_routes(net, &dummy);
+  return;
+
+ drop:
+  rte_free(new);
+  new = NULL;
+  goto recalc;
+}
+
+/*
+ * Keeps a copy of the route @new before import filtering in @net->in_routes,
+ * replacing the previous copy from the same hook and source. The copy is
+ * removed if @new is %NULL.
+ */
+static void
+rte_keep_original(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
+{
+  rte *e, **ep;
+
+  for (ep = &net->in_routes; e = *ep; ep = &e->next)
+    if ((e->sender == ah) && (e->attrs->src == src))
+      {
+	*ep = e->next;
+	rte_free_quick(e);
+	break;
+      }
+
+  if (!new)
+    return;
+
+  e = sl_alloc(rte_slab);
+  memcpy(e, new, sizeof(rte));
+
+  /* rta_lookup() may modify the rta, so it gets a shallow copy */
+  e->attrs = rta_is_cached(new->attrs) ?
+    rta_clone(new->attrs) : rta_lookup(rta_do_cow(new->attrs, rte_update_pool));
+  e->flags = 0;
+  e->next = net->in_routes;
+  net->in_routes = e;
+}
+
+void
+rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
+{
+  struct proto *p = ah->proto;
+  struct proto_stats *stats = ah->stats;
+
+  rte_update_lock();
+  if (new)
+    {
+      new->sender = ah;
+
+      stats->imp_updates_received++;
+      if (!rte_validate(new))
+	{
+	  rte_trace_in(D_FILTERS, p, new, "invalid");
+	  stats->imp_updates_invalid++;
+	  rte_free(new);
+	  new = NULL;
+	}
+    }
   else
     {
       stats->imp_withdraws_received++;
@@ -1282,17 +1370,11 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
 	}
     }
 
- recalc:
-  rte_hide_dummy_routes(net, &dummy);
-  rte_recalculate(ah, net, new, src);
-  rte_unhide_dummy_routes(net, &dummy);
-  rte_update_unlock();
-  return;
+  if (ah->in_keep_original)
+    rte_keep_original(ah, net, new, src);
 
- drop:
-  rte_free(new);
-  new = NULL;
-  goto recalc;
+  rte_import(ah, net, new, src);
+  rte_update_unlock();
 }
 
 /* Independent call to rte_announce(), used from next hop
@@ -1391,6 +1473,10 @@ rt_refresh_begin(rtable *t, struct announce_hook *ah)
       for (e = n->routes; e; e = e->next)
 	if (e->sender == ah)
 	  e->flags |= REF_STALE;
+
+      for (e = n->in_routes; e; e = e->next)
+	if (e->sender == ah)
+	  e->flags |= REF_STALE;
     }
   FIB_WALK_END;
 }
@@ -1408,7 +1494,7 @@ rt_refresh_end(rtable *t, struct announce_hook *ah)
 {
   int prune = 0;
   net *n;
-  rte *e;
+  rte *e, **ep;
 
   FIB_WALK(&t->fib, fn)
     {
@@ -1419,6 +1505,17 @@ rt_refresh_end(rtable *t, struct announce_hook *ah)
 	    e->flags |= REF_DISCARD;
 	    prune = 1;
 	  }
+
+      /* Kept originals are not announced, they can be removed right away */
+      for (ep = &n->in_routes; e = *ep; )
+	if ((e->sender == ah) && (e->flags & REF_STALE))
+	  {
+	    *ep = e->next;
+	    rte_free_quick(e);
+	    prune = 1;
+	  }
+	else
+	  ep = &e->next;
     }
   FIB_WALK_END;
 
@@ -1539,15 +1636,32 @@ rt_schedule_hcu(rtable *tab)
 }
 
 static inline void
-rt_schedule_nhu(rtable *tab)
+rt_schedule_nhu(struct hostentry *he)
 {
-  if (tab->nhu_state == 0)
+  rtable *tab = he->tab;
+
+  /* All dependent routes are outdated now, including already updated ones */
+  if (!EMPTY_LIST(he->deps))
+    {
+      add_tail_list(&he->outdated, &he->deps);
+      init_list(&he->deps);
+    }
+
+  if (he->nhu_node.next)
+    return;
+
+  if (EMPTY_LIST(tab->nhu_queue))
     ev_schedule(tab->rt_event);
 
-  /* state change 0->1, 2->3 */
-  tab->nhu_state |= 1;
+  add_tail(&tab->nhu_queue, &he->nhu_node);
 }
 
+static inline void
+rt_unschedule_nhu(struct hostentry *he)
+{
+  if (he->nhu_node.next)
+    rem_node(&he->nhu_node);
+}
 
 static void
 rt_prune_nets(rtable *tab)
@@ -1589,7 +1703,7 @@ rt_event(void *ptr)
   if (tab->hcu_scheduled)
     rt_update_hostcache(tab);
 
-  if (tab->nhu_state)
+  if (!EMPTY_LIST(tab->nhu_queue))
     rt_next_hop_update(tab);
 
   if (tab->prune_state)
@@ -1611,10 +1725,14 @@ void
 rt_setup(pool *p, rtable *t, char *name, struct rtable_config *cf)
 {
   bzero(t, sizeof(*t));
-  fib_init(&t->fib, p, sizeof(net), 0, rte_init);
+  if (cf && cf->ordered)
+    fib_init_ordered(&t->fib, p, sizeof(net), rte_init);
+  else
+    fib_init(&t->fib, p, sizeof(net), 0, rte_init);
   t->name = name;
   t->config = cf;
   init_list(&t->hooks);
+  init_list(&t->nhu_queue);
   if (cf)
     {
       t->rt_event = ev_new(p);
@@ -1664,7 +1782,7 @@ again:
   FIB_ITERATE_START(&tab->fib, fit, fn)
     {
       net *n = (net *) fn;
-      rte *e;
+      rte *e, **ep;
 
     rescan:
       for (e=n->routes; e; e=e->next)
@@ -1698,7 +1816,16 @@ again:
 	  }
       }
 
-      if (!n->routes)		/* Orphaned FIB entry */
+      for (ep = &n->in_routes; e = *ep; )
+	if (e->sender->proto->flushing)
+	  {
+	    *ep = e->next;
+	    rte_free_quick(e);
+	  }
+	else
+	  ep = &e->next;
+
+      if (!n->routes && !n->in_routes)	/* Orphaned FIB entry */
 	{
 	  FIB_ITERATE_PUT(fit, fn);
 	  fib_delete(&tab->fib, fn);
@@ -1830,6 +1957,9 @@ rt_next_hop_update_net(rtable *tab, net *n)
 	new = rt_next_hop_update_rte(tab, e);
 	*k = new;
 
+	rte_unlink_hostentry(tab, e);
+	rte_link_hostentry(tab, new);
+
 	rte_announce_i(tab, RA_ANY, n, new, e, NULL, NULL);
 	rte_trace_in(D_ROUTES, new->sender->proto, new, "updated");
 
@@ -1886,35 +2016,36 @@ rt_next_hop_update_net(rtable *tab, net *n)
 static void
 rt_next_hop_update(rtable *tab)
 {
-  struct fib_iterator *fit = &tab->nhu_fit;
   int max_feed = 32;
 
-  if (tab->nhu_state == 0)
-    return;
-
-  if (tab->nhu_state == 1)
+  /* Update only nets with routes depending on changed hostentries */
+  while (!EMPTY_LIST(tab->nhu_queue))
     {
-      FIB_ITERATE_INIT(fit, &tab->fib);
-      tab->nhu_state = 2;
-    }
+      struct hostentry *he = SKIP_BACK(struct hostentry, nhu_node, HEAD(tab->nhu_queue));
 
-  FIB_ITERATE_START(&tab->fib, fit, fn)
-    {
-      if (max_feed <= 0)
+      while (!EMPTY_LIST(he->outdated))
 	{
-	  FIB_ITERATE_PUT(fit, fn);
-	  ev_schedule(tab->rt_event);
-	  return;
-	}
-      max_feed -= rt_next_hop_update_net(tab, (net *) fn);
-    }
-  FIB_ITERATE_END(fn);
+	  if (max_feed <= 0)
+	    {
+	      ev_schedule(tab->rt_event);
+	      return;
+	    }
 
-  /* state change 2->0, 3->1 */
-  tab->nhu_state &= 1;
+	  /* Updated routes are relinked to he->deps, others have to be moved */
+	  rte *e = SKIP_BACK(rte, hn, HEAD(he->outdated));
+	  int count = rt_next_hop_update_net(tab, e->net);
 
-  if (tab->nhu_state > 0)
-    ev_schedule(tab->rt_event);
+	  if (!count)
+	    {
+	      rem_node(&e->hn);
+	      add_tail(&he->deps, &e->hn);
+	    }
+
+	  max_feed -= count;
+	}
+
+      rem_node(&he->nhu_node);
+    }
 }
 
 
@@ -1967,6 +2098,12 @@ rt_unlock_table(rtable *r)
       r->config->table = NULL;
       if (r->hostcache)
 	rt_free_hostcache(r);
+
+      /* Hostentries may outlive their dependent table */
+      node *n, *x;
+      WALK_LIST_DELSAFE(n, x, r->nhu_queue)
+	rem_node(n);
+
       rem_node(&r->n);
       fib_free(&r->fib);
       rfree(r->rt_event);
@@ -2010,6 +2147,8 @@ rt_commit(struct config *new, struct config *old)
 		  ot->config = r;
 		  if (o->sorted != r->sorted)
 		    log(L_WARN "Reconfiguration of rtable sorted flag not implemented");
+		  if (o->ordered != r->ordered)
+		    log(L_WARN "Reconfiguration of rtable ordered flag not implemented");
 		}
 	      else
 		{
@@ -2048,6 +2187,167 @@ do_feed_baby(struct proto *p, int type, struct announce_hook *h, net *n, rte *e)
   rte_update_unlock();
 }
 
+/* Compare chains of temporary attributes, made from the same route by the same filter */
+static int
+rt_tmpa_same(ea_list *x, ea_list *y)
+{
+  uint i;
+
+  for (; x && y; x = x->next, y = y->next)
+    {
+      if (x->count != y->count)
+	return 0;
+
+      for (i = 0; i < x->count; i++)
+	{
+	  eattr *a = &x->attrs[i];
+	  eattr *b = &y->attrs[i];
+
+	  if ((a->id != b->id) || (a->flags != b->flags) || (a->type != b->type))
+	    return 0;
+
+	  if (a->type & EAF_EMBEDDED)
+	    {
+	      if (a->u.data != b->u.data)
+		return 0;
+	    }
+	  else if (!adata_same(a->u.ptr, b->u.ptr))
+	    return 0;
+	}
+    }
+
+  return x == y;
+}
+
+/*
+ * Re-evaluate export of one route. The old verdict is found with the ROA state
+ * before pending changes. If both runs accept the route unchanged, there is
+ * nothing to announce.
+ */
+static void
+rt_reeval_route(struct announce_hook *ah, net *n, rte *e)
+{
+  rte *new_free = NULL;
+  rte *old_free = NULL;
+  ea_list *tmpa = NULL;
+  ea_list *old_tmpa = NULL;
+
+  ah->stats->exp_updates_received++;
+
+  rte *new = export_filter(ah, e, &new_free, &tmpa, 0);
+
+  roa_filter_prev = 1;
+  rte *old = export_filter(ah, e, &old_free, &old_tmpa, 1);
+  roa_filter_prev = 0;
+
+  if ((new != old) || (new && (new != e || !rt_tmpa_same(tmpa, old_tmpa))))
+    do_rt_notify(ah, n, new, old, tmpa, 0);
+
+  if (new_free)
+    rte_free(new_free);
+  if (old_free)
+    rte_free(old_free);
+}
+
+/**
+ * rt_refeed_net - re-export one network to a protocol
+ * @h: announce hook of the protocol
+ * @n: network in the table of @h
+ *
+ * This function re-evaluates export of routes of network @n to the protocol
+ * after a change of ROA tables the export filter depends on. Whether a route
+ * was exported before is found by the filter with the ROA state before the
+ * change (see roa_filter_prev), so the route is announced, replaced or
+ * withdrawn like by a regular update, and export counters and limits are
+ * handled accordingly. Only protocols receiving optimal or all routes are
+ * supported.
+ */
+void
+rt_refeed_net(struct announce_hook *h, net *n)
+{
+  struct proto *p = h->proto;
+  rte *e;
+
+  if (p->export_state == ES_DOWN)
+    return;
+
+  rte_update_lock();
+  if (p->accept_ra_types == RA_OPTIMAL)
+    {
+      if (rte_is_valid(n->routes))
+	rt_reeval_route(h, n, n->routes);
+    }
+  else if (p->accept_ra_types == RA_ANY)
+    {
+      for (e = n->routes; e; e = e->next)
+	if (rte_is_valid(e))
+	  rt_reeval_route(h, n, e);
+    }
+  rte_update_unlock();
+}
+
+/**
+ * rt_reimport_net - re-import one network from a protocol
+ * @h: announce hook of the protocol
+ * @n: network in the table of @h
+ *
+ * This function runs the import filter of @h again for routes of network @n
+ * received through @h, starting from their copies kept before filtering
+ * (see &announce_hook->in_keep_original). It is used after a change of ROA
+ * tables the import filter depends on. Routes in the middle of a refresh
+ * cycle (see rt_refresh_begin()) are skipped, their fate is decided by the
+ * refresh.
+ */
+void
+rt_reimport_net(struct announce_hook *h, net *n)
+{
+  rte *e, *next;
+
+  rte_update_lock();
+  for (e = n->in_routes; e; e = next)
+    {
+      next = e->next;
+      if ((e->sender == h) && !(e->flags & REF_STALE))
+	rte_import(h, n, rte_do_cow(e), e->attrs->src);
+    }
+  rte_update_unlock();
+}
+
+/**
+ * rt_flush_originals - drop routes kept before import filtering
+ * @t: routing table
+ * @h: announce hook in @t
+ *
+ * This function removes copies of routes kept for re-import through @h
+ * when they are no longer needed, i.e. the new import filter of @h does
+ * not use ROA tables.
+ */
+void
+rt_flush_originals(rtable *t, struct announce_hook *h)
+{
+  int prune = 0;
+  net *n;
+  rte *e, **ep;
+
+  FIB_WALK(&t->fib, fn)
+    {
+      n = (net *) fn;
+      for (ep = &n->in_routes; e = *ep; )
+	if (e->sender == h)
+	  {
+	    *ep = e->next;
+	    rte_free_quick(e);
+	    prune = 1;
+	  }
+	else
+	  ep = &e->next;
+    }
+  FIB_WALK_END;
+
+  if (prune)
+    rt_schedule_prune(t);
+}
+
 /**
  * rt_feed_baby - advertise routes to a new protocol
  * @p: protocol to be fed
@@ -2056,13 +2356,20 @@ do_feed_baby(struct proto *p, int type, struct announce_hook *h, net *n, rte *e)
  * initialized protocol. It's called by the protocol code as long as it
  * has something to do. (We avoid transferring all the routes in single
  * pass in order not to monopolize CPU time.)
+ *
+ * The length of the pass is limited by the time budget of the protocol
+ * (&proto_config->feed_time), the monotonic clock is checked after each
+ * chunk of &proto_config->feed_chunk routes. The pass also ends early when
+ * the protocol reports through its feed_busy() hook that it cannot accept
+ * more routes for now. Returns 1 when feeding is finished, 0 otherwise.
  */
 int
 rt_feed_baby(struct proto *p)
 {
   struct announce_hook *h;
   struct fib_iterator *fit;
-  int max_feed = 256;
+  btime deadline = tm_monotonic_time() + p->cf->feed_time;
+  int max_feed = p->cf->feed_chunk;
 
   if (!p->feed_ahook)			/* Need to initialize first */
     {
@@ -2083,8 +2390,14 @@ again:
       rte *e = n->routes;
       if (max_feed <= 0)
 	{
-	  FIB_ITERATE_PUT(fit, fn);
-	  return 0;
+	  if ((tm_monotonic_time() >= deadline) ||
+	      (p->feed_busy && p->feed_busy(p)))
+	    {
+	      FIB_ITERATE_PUT(fit, fn);
+	      return 0;
+	    }
+
+	  max_feed = p->cf->feed_chunk;
 	}
 
       /* XXXX perhaps we should change feed for RA_ACCEPTED to not use 'new' */
@@ -2229,6 +2542,10 @@ hc_new_hostentry(struct hostcache *hc, ip_addr a, ip_addr ll, rtable *dep, unsig
   he->hash_key = k;
   he->uc = 0;
   he->src = NULL;
+  he->pxlen = 0;
+  he->nhu_node.next = NULL;
+  init_list(&he->deps);
+  init_list(&he->outdated);
 
   add_tail(&hc->hostentries, &he->ln);
   hc_insert(hc, he);
@@ -2244,6 +2561,7 @@ static void
 hc_delete_hostentry(struct hostcache *hc, struct hostentry *he)
 {
   rta_free(he->src);
+  rt_unschedule_nhu(he);
 
   rem_node(&he->ln);
   hc_remove(hc, he);
@@ -2267,6 +2585,9 @@ rt_init_hostcache(rtable *tab)
   hc->lp = lp_new(rt_table_pool, 1008);
   hc->trie = f_new_trie(hc->lp, sizeof(struct f_trie_node));
 
+  /* Hostentry updates resolve next hops by net_route() */
+  fib_lpm_init(&tab->fib);
+
   tab->hostcache = hc;
 }
 
@@ -2280,6 +2601,7 @@ rt_free_hostcache(rtable *tab)
     {
       struct hostentry *he = SKIP_BACK(struct hostentry, ln, n);
       rta_free(he->src);
+      rt_unschedule_nhu(he);
 
       if (he->uc)
 	log(L_ERR "Hostcache is not empty in table %s", tab->name);
@@ -2296,11 +2618,34 @@ rt_notify_hostcache(rtable *tab, net *net)
 {
   struct hostcache *hc = tab->hostcache;
 
-  if (tab->hcu_scheduled)
+  if (hc->update_all)
+    return;
+
+  if (!trie_match_prefix(hc->trie, net->n.prefix, net->n.pxlen))
     return;
 
-  if (trie_match_prefix(hc->trie, net->n.prefix, net->n.pxlen))
-    rt_schedule_hcu(tab);
+  /* Remember the changed prefix, so only hostentries covered by it are updated */
+  if (hc->num_changes < HC_MAX_CHANGES)
+    hc->changes[hc->num_changes++] = (struct prefix) { net->n.prefix, net->n.pxlen };
+  else
+    hc->update_all = 1;
+
+  rt_schedule_hcu(tab);
+}
+
+static int
+hc_changed_hostentry(struct hostcache *hc, struct hostentry *he)
+{
+  if (hc->update_all)
+    return 1;
+
+  /* Hostentry is affected by changes of its resolving route and more specific ones */
+  for (uint i = 0; i < hc->num_changes; i++)
+    if ((hc->changes[i].len >= he->pxlen) &&
+	ipa_in_net(he->addr, hc->changes[i].addr, hc->changes[i].len))
+      return 1;
+
+  return 0;
 }
 
 static int
@@ -2398,6 +2743,7 @@ rt_update_hostentry(rtable *tab, struct hostentry *he)
 
  done:
   /* Add a prefix range to the trie */
+  he->pxlen = pxlen;
   trie_add_prefix(tab->hostcache->trie, he->addr, MAX_PREFIX_LENGTH, pxlen, MAX_PREFIX_LENGTH);
 
   rta_free(old_src);
@@ -2424,10 +2770,19 @@ rt_update_hostcache(rtable *tab)
 	  continue;
 	}
 
+      if (!hc_changed_hostentry(hc, he))
+	{
+	  /* Just keep its prefix range in the trie */
+	  trie_add_prefix(hc->trie, he->addr, MAX_PREFIX_LENGTH, he->pxlen, MAX_PREFIX_LENGTH);
+	  continue;
+	}
+
       if (rt_update_hostentry(tab, he))
-	rt_schedule_nhu(he->tab);
+	rt_schedule_nhu(he);
     }
 
+  hc->update_all = 0;
+  hc->num_changes = 0;
   tab->hcu_scheduled = 0;
 }
 
@@ -740,16 +740,90 @@ bgp_rehash_buckets(struct bgp_proto *p)
   mb_free(old);
 }
 
-static struct bgp_bucket *
-bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
+/*
+ *	Attribute groups
+ *
+ * Sessions which encode outgoing attributes in the same way (i.e. with the
+ * same AS_PATH encoding) form an attribute group. Normalized attribute lists
+ * of buckets are kept in a hash table shared by the group (&bgp_attr_set),
+ * together with their encoded form, so each distinct attribute list is stored
+ * and encoded just once for the whole group. Attribute normalization depends
+ * on the session, but it is done before the lookup, so sessions differing in
+ * it just share fewer attribute sets.
+ *
+ * Note that these are not update groups: buckets, prefix queues and NLRI
+ * encoding stay per session and UPDATE messages are built for each session
+ * by bgp_create_update().
+ */
+
+static list bgp_attr_groups;
+static uint bgp_attr_group_id;
+
+#define BSH_KEY(n)		n->hash, n->eattrs
+#define BSH_NEXT(n)		n->next
+#define BSH_EQ(h1,e1,h2,e2)	h1 == h2 && ea_same(e1, e2)
+#define BSH_FN(h,e)		u32_hash(h)
+
+#define BSH_REHASH		bgp_bsh_rehash
+#define BSH_PARAMS		/8, *2, 2, 2, 8, 20
+
+
+HASH_DEFINE_REHASH_FN(BSH, struct bgp_attr_set)
+
+static struct bgp_attr_group *
+bgp_get_attr_group(struct bgp_proto *p)
 {
-  struct bgp_bucket *b;
+  struct bgp_attr_group *g;
+
+  if (!bgp_attr_groups.head)
+    init_list(&bgp_attr_groups);
+
+  WALK_LIST(g, bgp_attr_groups)
+    if (g->as4_session == p->as4_session)
+    {
+      g->uc++;
+      return g;
+    }
+
+  pool *pool = rp_new(&root_pool, "BGP attribute group");
+  g = mb_allocz(pool, sizeof(struct bgp_attr_group));
+  g->pool = pool;
+  g->id = ++bgp_attr_group_id;
+  g->uc = 1;
+  g->as4_session = p->as4_session;
+  HASH_INIT(g->set_hash, pool, 8);
+  add_tail(&bgp_attr_groups, &g->n);
+
+  return g;
+}
+
+static void
+bgp_put_attr_group(struct bgp_attr_group *g)
+{
+  if (--g->uc)
+    return;
+
+  /* All attribute sets were released with their buckets */
+  rem_node(&g->n);
+  rfree(g->pool);
+}
+
+static struct bgp_attr_set *
+bgp_get_attr_set(struct bgp_attr_group *g, ea_list *new, unsigned hash)
+{
+  struct bgp_attr_set *s;
   unsigned ea_size = sizeof(ea_list) + new->count * sizeof(eattr);
   unsigned ea_size_aligned = BIRD_ALIGN(ea_size, CPU_STRUCT_ALIGN);
-  unsigned size = sizeof(struct bgp_bucket) + ea_size_aligned;
+  unsigned size = sizeof(struct bgp_attr_set) + ea_size_aligned;
   unsigned i;
   byte *dest;
-  unsigned index = hash & (p->hash_size - 1);
+
+  s = HASH_FIND(g->set_hash, BSH, hash, new);
+  if (s)
+  {
+    s->uc++;
+    return s;
+  }
 
   /* Gather total size of non-inline attributes */
   for (i=0; i<new->count; i++)
@@ -759,23 +833,18 @@ bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
 	size += BIRD_ALIGN(sizeof(struct adata) + a->u.ptr->length, CPU_STRUCT_ALIGN);
     }
 
-  /* Create the bucket and hash it */
-  b = mb_alloc(p->p.pool, size);
-  b->hash_next = p->bucket_hash[index];
-  if (b->hash_next)
-    b->hash_next->hash_prev = b;
-  p->bucket_hash[index] = b;
-  b->hash_prev = NULL;
-  b->hash = hash;
-  add_tail(&p->bucket_queue, &b->send_node);
-  init_list(&b->prefixes);
-  memcpy(b->eattrs, new, ea_size);
-  dest = ((byte *)b->eattrs) + ea_size_aligned;
+  s = mb_alloc(g->pool, size);
+  s->hash = hash;
+  s->uc = 1;
+  s->enc = NULL;
+  s->enc_len = -1;
+  memcpy(s->eattrs, new, ea_size);
+  dest = ((byte *)s->eattrs) + ea_size_aligned;
 
   /* Copy values of non-inline attributes */
   for (i=0; i<new->count; i++)
     {
-      eattr *a = &b->eattrs->attrs[i];
+      eattr *a = &s->eattrs->attrs[i];
       if (!(a->type & EAF_EMBEDDED))
 	{
 	  struct adata *oa = a->u.ptr;
@@ -786,6 +855,83 @@ bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
 	}
     }
 
+  HASH_INSERT2(g->set_hash, BSH, g->pool, s);
+  g->set_count++;
+
+  return s;
+}
+
+static void
+bgp_put_attr_set(struct bgp_attr_group *g, struct bgp_attr_set *s)
+{
+  if (--s->uc)
+    return;
+
+  HASH_REMOVE2(g->set_hash, BSH, g->pool, s);
+  g->set_count--;
+  mb_free(s->enc);
+  mb_free(s);
+}
+
+/**
+ * bgp_encode_bucket_attrs - encode BGP attributes of a bucket
+ * @p: BGP instance
+ * @w: buffer
+ * @buck: bucket to be sent
+ * @remains: remaining space in the buffer
+ *
+ * The bgp_encode_bucket_attrs() function is a variant of bgp_encode_attrs()
+ * for bucket attributes. As all sessions in the attribute group encode the
+ * attribute list in the same way, the encoded form is kept in the shared
+ * attribute set and just copied by other sessions.
+ *
+ * Result: Length of the attribute block generated or -1 if not enough space.
+ */
+int
+bgp_encode_bucket_attrs(struct bgp_proto *p, byte *w, struct bgp_bucket *buck, int remains)
+{
+  struct bgp_attr_set *s = buck->set;
+  int len;
+
+  if (s->enc_len >= 0)
+  {
+    if (s->enc_len > remains)
+      return -1;
+
+    memcpy(w, s->enc, s->enc_len);
+    return s->enc_len;
+  }
+
+  len = bgp_encode_attrs(p, w, s->eattrs, remains);
+  if (len < 0)
+    return -1;
+
+  s->enc = len ? mb_alloc(p->attr_group->pool, len) : NULL;
+  s->enc_len = len;
+  memcpy(s->enc, w, len);
+
+  return len;
+}
+
+static struct bgp_bucket *
+bgp_new_bucket(struct bgp_proto *p, struct bgp_attr_set *set)
+{
+  struct bgp_bucket *b;
+  unsigned index = set->hash & (p->hash_size - 1);
+
+  /* Create the bucket and hash it */
+  b = mb_alloc(p->p.pool, sizeof(struct bgp_bucket));
+  b->hash_next = p->bucket_hash[index];
+  if (b->hash_next)
+    b->hash_next->hash_prev = b;
+  p->bucket_hash[index] = b;
+  b->hash_prev = NULL;
+  b->hash = set->hash;
+  b->set = set;
+  b->eattrs = set->eattrs;
+  add_tail(&p->bucket_queue, &b->send_node);
+  init_list(&b->prefixes);
+
   /* If needed, rehash */
   p->hash_count++;
   if (p->hash_count > p->hash_limit)
@@ -802,6 +948,7 @@ bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
   eattr *a, *d;
   u32 seen = 0;
   struct bgp_bucket *b;
+  struct bgp_attr_set *set;
 
   /* Merge the attribute list */
   new = alloca(ea_scan(attrs));
@@ -875,12 +1022,14 @@ bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
 
   /* Hash */
   hash = ea_hash(new);
-  for(b=p->bucket_hash[hash & (p->hash_size - 1)]; b; b=b->hash_next)
-    if (b->hash == hash && ea_same(b->eattrs, new))
-      {
-	DBG("Found bucket.\n");
-	return b;
-      }
+  set = HASH_FIND(p->attr_group->set_hash, BSH, hash, new);
+  if (set)
+    for(b=p->bucket_hash[hash & (p->hash_size - 1)]; b; b=b->hash_next)
+      if (b->set == set)
+	{
+	  DBG("Found bucket.\n");
+	  return b;
+	}
 
   /* Ensure that there are all mandatory attributes */
   for(i=0; i<ARRAY_SIZE(bgp_mandatory_attrs); i++)
@@ -900,7 +1049,8 @@ bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
 
   /* Create new bucket */
   DBG("Creating bucket.\n");
-  return bgp_new_bucket(p, new, hash);
+  set = bgp_get_attr_set(p->attr_group, new, hash);
+  return bgp_new_bucket(p, set);
 }
 
 void
@@ -912,6 +1062,7 @@ bgp_free_bucket(struct bgp_proto *p, struct bgp_bucket *buck)
     buck->hash_prev->hash_next = buck->hash_next;
   else
     p->bucket_hash[buck->hash & (p->hash_size-1)] = buck->hash_next;
+  bgp_put_attr_set(p->attr_group, buck->set);
   mb_free(buck);
 }
 
@@ -2002,6 +2153,7 @@ bgp_init_bucket_table(struct bgp_proto *p)
   p->bucket_hash = mb_allocz(p->p.pool, p->hash_size * sizeof(struct bgp_bucket *));
   init_list(&p->bucket_queue);
   p->withdraw_bucket = NULL;
+  p->attr_group = bgp_get_attr_group(p);
   // fib_init(&p->prefix_fib, p->p.pool, sizeof(struct bgp_prefix), 0, bgp_init_prefix);
 }
 
@@ -2015,11 +2167,15 @@ bgp_free_bucket_table(struct bgp_proto *p)
   WALK_LIST_FIRST(b, p->bucket_queue)
   {
     rem_node(&b->send_node);
+    bgp_put_attr_set(p->attr_group, b->set);
     mb_free(b);
   }
 
   mb_free(p->withdraw_bucket);
   p->withdraw_bucket = NULL;
+
+  bgp_put_attr_group(p->attr_group);
+  p->attr_group = NULL;
 }
 
 void
@@ -38,7 +38,10 @@
  * the same destination queued for sending, so that we can replace it with the new one
  * immediately instead of sending both updates). There also exists a special bucket holding
  * all the route withdrawals which cannot be queued anywhere else as they don't have any
- * attributes. If we have any packet to send (due to either new routes or the connection
+ * attributes. Attribute lists of buckets are shared by all sessions of the same attribute
+ * group (&bgp_attr_group), so identical attributes exported to many neighbors are
+ * stored and encoded only once, but buckets and UPDATE messages are still per session.
+ * If we have any packet to send (due to either new routes or the connection
  * tracking code wanting to send a Open, Keepalive or Notification message), we call
  * bgp_schedule_packet() which sets the corresponding bit in a @packet_to_send
  * bit field in &bgp_conn and as soon as the transmit socket buffer becomes empty,
@@ -210,8 +213,8 @@ bgp_close(struct bgp_proto *p, int apply_md5)
  * @t: timer
  * @value: time to fire (0 to disable the timer)
  *
- * This functions calls tm_start() on @t with time @value and the
- * amount of randomization suggested by the BGP standard. Please use
+ * This functions calls tm_start_btime() on @t with time @value (in seconds)
+ * and the amount of randomization suggested by the BGP standard. Please use
  * it for all BGP timers.
  */
 void
@@ -219,9 +222,9 @@ bgp_start_timer(timer *t, int value)
 {
   if (value)
     {
-      /* The randomization procedure is specified in RFC 1771: 9.2.3.3 */
-      t->randomize = value / 4;
-      tm_start(t, value - t->randomize);
+      /* The randomization procedure is specified in RFC 4271 10, we jitter by up to 25% in ms */
+      btime jitter = (random_u32() % (value * 250 + 1)) MS;
+      tm_start_btime(t, (btime) value S - jitter);
     }
   else
     tm_stop(t);
@@ -620,6 +623,8 @@ bgp_send_open(struct bgp_conn *conn)
   conn->peer_llgr_aflags = 0;
   conn->peer_ext_messages_support = 0;
 
+  conn->rx_start = conn->rx_end = 0;
+
   DBG("BGP: Sending open\n");
   conn->sk->rx_hook = bgp_rx;
   conn->sk->tx_hook = bgp_tx;
@@ -796,7 +801,7 @@ bgp_connect(struct bgp_proto *p)	/* Enter Connect state and start establishing c
   s->vrf = p->p.vrf;
   s->ttl = p->cf->ttl_security ? 255 : hops;
   s->rbsize = p->cf->enable_extended_messages ? BGP_RX_BUFFER_EXT_SIZE : BGP_RX_BUFFER_SIZE;
-  s->tbsize = p->cf->enable_extended_messages ? BGP_TX_BUFFER_EXT_SIZE : BGP_TX_BUFFER_SIZE;
+  s->tbsize = p->cf->tx_buffer;
   s->tos = IP_PREC_INTERNET_CONTROL;
   s->password = p->cf->password;
   s->tx_hook = bgp_connected;
@@ -916,9 +921,11 @@ bgp_incoming_connection(sock *sk, uint dummy UNUSED)
       goto err;
 
   if (p->cf->enable_extended_messages)
+    sk->rbsize = BGP_RX_BUFFER_EXT_SIZE;
+
+  if (p->cf->enable_extended_messages || (sk->tbsize != p->cf->tx_buffer))
     {
-      sk->rbsize = BGP_RX_BUFFER_EXT_SIZE;
-      sk->tbsize = BGP_TX_BUFFER_EXT_SIZE;
+      sk->tbsize = p->cf->tx_buffer;
       sk_reallocate(sk);
     }
 
@@ -1154,6 +1161,20 @@ bgp_feed_end(struct proto *P)
   bgp_schedule_packet(p->conn, PKT_UPDATE);
 }
 
+/*
+ * Routes passed to bgp_rt_notify() are queued in the prefix hash until they
+ * are sent in UPDATE messages. When the queue grows too much or the socket
+ * is not able to take more data, we ask the core to pause feeding, it is
+ * resumed from bgp_fire_tx() when the queue drains.
+ */
+static int
+bgp_feed_busy(struct proto *P)
+{
+  struct bgp_proto *p = (struct bgp_proto *) P;
+
+  return bgp_tx_congested(p, BGP_FEED_HIGH_WATERMARK);
+}
+
 
 static void
 bgp_start_locked(struct object_lock *lock)
@@ -1211,6 +1232,10 @@ bgp_start(struct proto *P)
   p->bfd_req = NULL;
   p->gr_ready = 0;
   p->gr_active = 0;
+  p->tx_messages = p->tx_bytes = p->tx_writes = 0;
+  p->rx_messages = p->rx_bytes = p->rx_reads = 0;
+  memset(p->rx_read_hist, 0, sizeof(p->rx_read_hist));
+  memset(p->rx_msgs_hist, 0, sizeof(p->rx_msgs_hist));
 
   rt_lock_table(p->igp_table);
 
@@ -1359,6 +1384,7 @@ bgp_init(struct proto_config *C)
   P->reload_routes = bgp_reload_routes;
   P->feed_begin = bgp_feed_begin;
   P->feed_end = bgp_feed_end;
+  P->feed_busy = bgp_feed_busy;
   P->rte_better = bgp_rte_better;
   P->rte_mergable = bgp_rte_mergable;
   P->rte_recalculate = c->deterministic_med ? bgp_rte_recalculate : NULL;
@@ -1455,6 +1481,18 @@ bgp_check_config(struct bgp_config *c)
 
   if (!c->gr_mode && c->llgr_mode)
     cf_error("Long-lived graceful restart requires basic graceful restart");
+
+  if (!c->tx_buffer)
+    c->tx_buffer = c->enable_extended_messages ? BGP_TX_BUFFER_EXT_DEFAULT : BGP_TX_BUFFER_DEFAULT;
+
+  if (c->enable_extended_messages && (c->tx_buffer < BGP_TX_BUFFER_EXT_SIZE))
+    cf_error("TX buffer must hold a message of extended length");
+
+  if (!c->rx_buffer)
+    c->rx_buffer = c->enable_extended_messages ? BGP_RX_BUFFER_EXT_DEFAULT : BGP_RX_BUFFER_DEFAULT;
+
+  if (c->enable_extended_messages && (c->rx_buffer < BGP_RX_BUFFER_EXT_SIZE))
+    cf_error("RX buffer must hold a message of extended length");
 }
 
 static int
@@ -1608,6 +1646,21 @@ bgp_get_status(struct proto *P, byte *buf)
     bsprintf(buf, "%-14s%s%s", bgp_state_dsc(p), err1, err2);
 }
 
+static void
+bgp_show_histogram(const char *name, uint *hist)
+{
+  static const char *labels[BGP_RX_HIST] =
+    { "0", "1+", "4+", "16+", "64+", "256+", "1k+", "4k+", "16k+", "64k+", "256k+" };
+  byte buf[256], *pos = buf;
+  uint i;
+
+  for (i = 0; i < BGP_RX_HIST; i++)
+    if (hist[i])
+      pos += bsprintf(pos, " %s:%u", labels[i], hist[i]);
+
+  cli_msg(-1006, "    %-17s%s", name, (pos != buf) ? (char *) buf : " none");
+}
+
 static void
 bgp_show_proto_info(struct proto *P)
 {
@@ -1664,6 +1717,9 @@ bgp_show_proto_info(struct proto *P)
 	      p->add_path_tx ? " add-path-tx" : "",
 	      p->ext_messages ? " ext-messages" : "");
       cli_msg(-1006, "    Source address:   %I", p->source_addr);
+      if (p->attr_group)
+	cli_msg(-1006, "    Attribute group:  %u (%u sessions, %u attribute sets)",
+		p->attr_group->id, p->attr_group->uc, p->attr_group->set_count);
       if (P->cf->in_limit)
 	cli_msg(-1006, "    Route limit:      %d/%d",
 		p->p.stats.imp_routes + p->p.stats.filt_routes, P->cf->in_limit->limit);
@@ -1671,6 +1727,14 @@ bgp_show_proto_info(struct proto *P)
 	      tm_remains(c->hold_timer), c->hold_time);
       cli_msg(-1006, "    Keepalive timer:  %d/%d",
 	      tm_remains(c->keepalive_timer), c->keepalive_time);
+      cli_msg(-1006, "    TX messages:      %lu (%lu bytes in %lu writes)",
+	      p->tx_messages, p->tx_bytes, p->tx_writes);
+      cli_msg(-1006, "    RX messages:      %lu (%lu bytes in %lu reads)",
+	      p->rx_messages, p->rx_bytes, p->rx_reads);
+      if (c->sk)
+	cli_msg(-1006, "    RX buffer:        %u/%u", c->sk->rbsize, p->cf->rx_buffer);
+      bgp_show_histogram("RX read sizes:", p->rx_read_hist);
+      bgp_show_histogram("RX msgs per read:", p->rx_msgs_hist);
     }
 
   if ((p->last_error_class != BE_NONE) &&
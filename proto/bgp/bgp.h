@@ -41,6 +41,8 @@ struct bgp_config {
   int enable_refresh;			/* Enable local support for route refresh [RFC2918] */
   int enable_as4;			/* Enable local support for 4B AS numbers [RFC4893] */
   int enable_extended_messages;		/* Enable local support for extended messages [draft] */
+  uint tx_buffer;			/* Size of TX buffer for batches of messages, 0 for default */
+  uint rx_buffer;			/* Maximal size the RX buffer may grow to, 0 for default */
   u32 rr_cluster_id;			/* Route reflector cluster ID, if different from local ID */
   int rr_client;			/* Whether neighbor is RR client of me */
   int rs_client;			/* Whether neighbor is RS client of me */
@@ -133,8 +135,11 @@ struct bgp_conn {
   u8 peer_llgr_aflags;
   u8 peer_ext_messages_support;		/* Peer supports extended message length [draft] */
   unsigned hold_time, keepalive_time;	/* Times calculated from my and neighbor's requirements */
+  uint rx_start, rx_end;		/* Unparsed data in the RX buffer, as offsets */
 };
 
+#define BGP_RX_HIST 11		/* Number of buckets of RX histograms */
+
 struct bgp_proto {
   struct proto p;
   struct bgp_config *cf;		/* Shortcut to BGP configuration */
@@ -166,6 +171,7 @@ struct bgp_proto {
   struct event *event;			/* Event for respawning and shutting process */
   struct timer *startup_timer;		/* Timer used to delay protocol startup due to previous errors (startup_delay) */
   struct timer *gr_timer;		/* Timer waiting for reestablishment after graceful restart */
+  struct bgp_attr_group *attr_group;	/* Group sharing attribute sets */
   struct bgp_bucket **bucket_hash;	/* Hash table of attribute buckets */
   uint hash_size, hash_count, hash_limit;
   HASH(struct bgp_prefix) prefix_hash;	/* Prefixes to be sent */
@@ -177,6 +183,14 @@ struct bgp_proto {
   u8 last_error_class; 			/* Error class of last error */
   u32 last_error_code;			/* Error code of last error. BGP protocol errors
 					   are encoded as (bgp_err_code << 16 | bgp_err_subcode) */
+  unsigned long tx_messages;		/* Messages sent since protocol start */
+  unsigned long tx_bytes;		/* Bytes of these messages */
+  unsigned long tx_writes;		/* Batches of these messages passed to the socket */
+  unsigned long rx_messages;		/* Messages received since protocol start */
+  unsigned long rx_bytes;		/* Bytes read from the socket */
+  unsigned long rx_reads;		/* Number of these reads */
+  uint rx_read_hist[BGP_RX_HIST];	/* Histogram of read sizes, see bgp_hist_bucket() */
+  uint rx_msgs_hist[BGP_RX_HIST];	/* Histogram of complete messages per read */
 #ifdef IPV6
   byte *mp_reach_start, *mp_unreach_start; /* Multiprotocol BGP attribute notes */
   unsigned mp_reach_len, mp_unreach_len;
@@ -199,7 +213,27 @@ struct bgp_bucket {
   struct bgp_bucket *hash_next, *hash_prev;	/* Node in bucket hash table */
   unsigned hash;			/* Hash over extended attributes */
   list prefixes;			/* Prefixes in this buckets */
-  ea_list eattrs[0];			/* Per-bucket extended attributes */
+  struct bgp_attr_set *set;		/* Shared attribute set */
+  ea_list *eattrs;			/* Per-bucket extended attributes (from the set) */
+};
+
+struct bgp_attr_set {
+  struct bgp_attr_set *next;		/* Node in attribute group hash table */
+  unsigned hash;			/* Hash over extended attributes */
+  uint uc;				/* Number of buckets using the set */
+  int enc_len;				/* Length of encoded attributes, -1 if not yet */
+  byte *enc;				/* Encoded attributes (in group pool) */
+  ea_list eattrs[0];			/* Normalized extended attributes */
+};
+
+struct bgp_attr_group {
+  node n;				/* Node in list of attribute groups */
+  pool *pool;				/* Pool for attribute sets */
+  uint id;				/* Group number (for show protocols) */
+  uint uc;				/* Number of sessions in the group */
+  uint set_count;			/* Number of attribute sets */
+  u8 as4_session;			/* AS_PATH encoding of the group */
+  HASH(struct bgp_attr_set) set_hash;	/* Attribute sets of the group */
 };
 
 #define BGP_PORT		179
@@ -211,10 +245,25 @@ struct bgp_bucket {
 #define BGP_TX_BUFFER_SIZE	4096
 #define BGP_RX_BUFFER_EXT_SIZE	65535
 #define BGP_TX_BUFFER_EXT_SIZE	65535
+#define BGP_TX_BUFFER_DEFAULT	(16 * BGP_TX_BUFFER_SIZE)
+#define BGP_TX_BUFFER_EXT_DEFAULT (4 * BGP_TX_BUFFER_EXT_SIZE)
+#define BGP_TX_BUFFER_MAX_SIZE	(16 << 20)
+#define BGP_TX_ROUND_SIZE	(1024 * BGP_TX_BUFFER_SIZE)
+#define BGP_RX_BUFFER_DEFAULT	(64 * BGP_RX_BUFFER_SIZE)
+#define BGP_RX_BUFFER_EXT_DEFAULT (4 * BGP_RX_BUFFER_EXT_SIZE)
+#define BGP_RX_BUFFER_MAX_SIZE	(16 << 20)
 
 static inline uint bgp_max_packet_length(struct bgp_proto *p)
 { return p->ext_messages ? BGP_MAX_EXT_MSG_LENGTH : BGP_MAX_MESSAGE_LENGTH; }
 
+/* Histogram buckets by powers of four: 0, 1-3, 4-15, 16-63, ... */
+static inline uint bgp_hist_bucket(uint val)
+{ return val ? MIN_(1 + u32_log2(val) / 2, BGP_RX_HIST - 1) : 0; }
+
+/* Feeding is paused above the high watermark of queued prefixes and resumed below the low one */
+#define BGP_FEED_HIGH_WATERMARK	8192
+#define BGP_FEED_LOW_WATERMARK	2048
+
 extern struct linpool *bgp_linpool;
 
 
@@ -281,6 +330,7 @@ void bgp_init_prefix_table(struct bgp_proto *p, u32 order);
 void bgp_free_prefix_table(struct bgp_proto *p);
 void bgp_free_prefix(struct bgp_proto *p, struct bgp_prefix *bp);
 uint bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains);
+int bgp_encode_bucket_attrs(struct bgp_proto *p, byte *w, struct bgp_bucket *buck, int remains);
 void bgp_get_route_info(struct rte *, byte *buf, struct ea_list *attrs);
 
 inline static void bgp_attach_attr_ip(struct ea_list **to, struct linpool *pool, unsigned attr, ip_addr a)
@@ -291,6 +341,7 @@ inline static void bgp_attach_attr_ip(struct ea_list **to, struct linpool *pool,
 void bgp_dump_state_change(struct bgp_conn *conn, uint old, uint new);
 void bgp_schedule_packet(struct bgp_conn *conn, int type);
 void bgp_kick_tx(void *vconn);
+int bgp_tx_congested(struct bgp_proto *p, uint limit);
 void bgp_tx(struct birdsock *sk);
 int bgp_rx(struct birdsock *sk, uint size);
 const char * bgp_error_dsc(unsigned code, unsigned subcode);
@@ -377,7 +377,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	    }
 
 	  DBG("Processing bucket %p\n", buck);
-	  a_size = bgp_encode_attrs(p, w+2, buck->eattrs, remains - 1024);
+	  a_size = bgp_encode_bucket_attrs(p, w+2, buck, remains - 1024);
 
 	  if (a_size < 0)
 	    {
@@ -472,7 +472,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	  rem_stored = remains;
 	  w_stored = w;
 
-	  size = bgp_encode_attrs(p, w, buck->eattrs, remains - 1024);
+	  size = bgp_encode_bucket_attrs(p, w, buck, remains - 1024);
 	  if (size < 0)
 	    {
 	      log(L_ERR "%s: Attribute list too long, skipping corresponding routes", p->p.name);
@@ -661,38 +661,26 @@ bgp_create_header(byte *buf, uint len, uint type)
 }
 
 /**
- * bgp_fire_tx - transmit packets
+ * bgp_create_packet - assemble one queued packet
  * @conn: connection
+ * @buf: buffer for the packet
  *
- * Whenever the transmit buffers of the underlying TCP connection
- * are free and we have any packets queued for sending, the socket functions
- * call bgp_fire_tx() which takes care of selecting the highest priority packet
- * queued (Notification > Keepalive > Open > Update), assembling its header
- * and body and sending it to the connection.
+ * Selects the highest priority packet queued for @conn (Notification >
+ * Keepalive > Open > Update), assembles its header and body to @buf and
+ * returns a pointer just after its end, or NULL if there is nothing to send.
+ * The buffer must have room for a packet of maximal length.
  */
-static int
-bgp_fire_tx(struct bgp_conn *conn)
+static byte *
+bgp_create_packet(struct bgp_conn *conn, byte *buf)
 {
   struct bgp_proto *p = conn->bgp;
   uint s = conn->packets_to_send;
-  sock *sk = conn->sk;
-  byte *buf, *pkt, *end;
+  byte *pkt = buf + BGP_HEADER_LENGTH;
+  byte *end;
   int type;
 
-  if (!sk)
-    {
-      conn->packets_to_send = 0;
-      return 0;
-    }
-  buf = sk->tbuf;
-  pkt = buf + BGP_HEADER_LENGTH;
-
   if (s & (1 << PKT_SCHEDULE_CLOSE))
-    {
-      /* We can finally close connection and enter idle state */
-      bgp_conn_enter_idle_state(conn);
-      return 0;
-    }
+    return NULL;
   if (s & (1 << PKT_NOTIFICATION))
     {
       s = 1 << PKT_SCHEDULE_CLOSE;
@@ -749,16 +737,102 @@ bgp_fire_tx(struct bgp_conn *conn)
 	  }
 
 	  else /* Really nothing to send */
-	    return 0;
+	    return NULL;
 
 	  p->feed_state = BFS_NONE;
 	}
     }
   else
-    return 0;
+    return NULL;
 
   conn->packets_to_send = s;
   bgp_create_header(buf, end - buf, type);
+  return end;
+}
+
+/* Whether bgp_create_packet() would assemble another packet */
+static inline int
+bgp_tx_pending(struct bgp_conn *conn)
+{
+  struct bgp_proto *p = conn->bgp;
+  uint s = conn->packets_to_send;
+
+  if (s & (1 << PKT_SCHEDULE_CLOSE))
+    return 0;
+
+  if (s & ~(1 << PKT_UPDATE))
+    return 1;
+
+  return (s & (1 << PKT_UPDATE)) &&
+    (p->prefix_hash.count || (p->feed_state == BFS_LOADED) || (p->feed_state == BFS_REFRESHED));
+}
+
+/**
+ * bgp_fire_tx - transmit packets
+ * @conn: connection
+ *
+ * Whenever the transmit buffers of the underlying TCP connection
+ * are free and we have any packets queued for sending, the socket functions
+ * call bgp_fire_tx() which assembles queued packets by bgp_create_packet()
+ * one after another to the transmit buffer as long as another packet of
+ * maximal length fits in, and sends the whole batch to the connection
+ * by a single write. The size of the buffer is given by the &tx buffer
+ * option. When the batch is cut short by the buffer size and more packets
+ * wait, the socket is asked to keep a partial TCP segment for the next batch.
+ */
+static int
+bgp_fire_tx(struct bgp_conn *conn)
+{
+  struct bgp_proto *p = conn->bgp;
+  sock *sk = conn->sk;
+  byte *buf, *end, *pos;
+  uint max, n = 0;
+
+  if (!sk)
+    {
+      conn->packets_to_send = 0;
+      return 0;
+    }
+
+  /* Continue feeding paused by bgp_feed_busy() when the queue drained */
+  if (p->p.feed_paused && !bgp_tx_congested(p, BGP_FEED_LOW_WATERMARK))
+    proto_feed_resume(&p->p);
+
+  if (conn->packets_to_send & (1 << PKT_SCHEDULE_CLOSE))
+    {
+      /* We can finally close connection and enter idle state */
+      bgp_conn_enter_idle_state(conn);
+      return 0;
+    }
+
+  buf = end = sk->tbuf;
+  max = bgp_max_packet_length(p);
+
+  while ((uint) (sk->tbuf + sk->tbsize - end) >= max)
+    {
+      if (!(pos = bgp_create_packet(conn, end)))
+	break;
+
+      end = pos;
+      n++;
+
+      /* Nothing may follow a Notification */
+      if (conn->packets_to_send & (1 << PKT_SCHEDULE_CLOSE))
+	break;
+    }
+
+  if (!n)
+    return 0;
+
+  if (((uint) (sk->tbuf + sk->tbsize - end) < max) && bgp_tx_pending(conn))
+    sk->flags |= SKF_TX_MORE;
+  else
+    sk->flags &= ~SKF_TX_MORE;
+
+  p->tx_messages += n;
+  p->tx_bytes += end - buf;
+  p->tx_writes++;
+
   return sk_send(sk, end - buf);
 }
 
@@ -778,13 +852,37 @@ bgp_schedule_packet(struct bgp_conn *conn, int type)
     ev_schedule(conn->tx_ev);
 }
 
+/**
+ * bgp_tx_congested - check for pending outgoing data
+ * @p: BGP instance
+ * @limit: maximal number of queued prefixes
+ *
+ * Returns 1 if more than @limit prefixes wait in the prefix hash to be
+ * sent or the socket of the established connection holds unsent data.
+ */
+int
+bgp_tx_congested(struct bgp_proto *p, uint limit)
+{
+  sock *sk = p->conn ? p->conn->sk : NULL;
+
+  return (p->prefix_hash.count > limit) || (sk && (sk->tpos != sk->tbuf));
+}
+
+/* Number of batches sent in one go, limited to about 1024 basic-sized packets */
+static inline uint
+bgp_tx_rounds(struct bgp_conn *conn)
+{
+  uint size = conn->sk ? conn->sk->tbsize : BGP_TX_BUFFER_SIZE;
+  return MAX(BGP_TX_ROUND_SIZE / size, 2);
+}
+
 void
 bgp_kick_tx(void *vconn)
 {
   struct bgp_conn *conn = vconn;
 
   DBG("BGP: kicking TX\n");
-  uint max = 1024;
+  uint max = bgp_tx_rounds(conn);
   while (--max && (bgp_fire_tx(conn) > 0))
     ;
 
@@ -798,7 +896,7 @@ bgp_tx(sock *sk)
   struct bgp_conn *conn = sk->data;
 
   DBG("BGP: TX hook\n");
-  uint max = 1024;
+  uint max = bgp_tx_rounds(conn);
   while (--max && (bgp_fire_tx(conn) > 0))
     ;
 
@@ -1749,6 +1847,16 @@ bgp_rx_packet(struct bgp_conn *conn, byte *pkt, unsigned len)
     }
 }
 
+static void
+bgp_rx_account(struct bgp_proto *p, uint bytes, uint msgs)
+{
+  p->rx_reads++;
+  p->rx_bytes += bytes;
+  p->rx_messages += msgs;
+  p->rx_read_hist[bgp_hist_bucket(bytes)]++;
+  p->rx_msgs_hist[bgp_hist_bucket(msgs)]++;
+}
+
 /**
  * bgp_rx - handle received data
  * @sk: socket
@@ -1757,22 +1865,34 @@ bgp_rx_packet(struct bgp_conn *conn, byte *pkt, unsigned len)
  * bgp_rx() is called by the socket layer whenever new data arrive from
  * the underlying TCP connection. It assembles the data fragments to packets,
  * checks their headers and framing and passes complete packets to
- * bgp_rx_packet().
+ * bgp_rx_packet(). Packets are parsed in place in the RX buffer.
+ *
+ * Consumed data are not removed from the buffer as long as there is room
+ * for another packet of maximal length after the unparsed rest, so
+ * a partial packet is moved to the front only once the buffer fills up.
+ * If a read fills the whole buffer, the buffer is doubled up to the size
+ * given by the &rx buffer option, so that a peer sending a full table is
+ * drained by few large reads.
  */
 int
 bgp_rx(sock *sk, uint size)
 {
   struct bgp_conn *conn = sk->data;
   struct bgp_proto *p = conn->bgp;
-  byte *pkt_start = sk->rbuf;
-  byte *end = pkt_start + size;
+  byte *pkt_start = sk->rbuf + conn->rx_start;
+  byte *end = sk->rbuf + size;
+  uint bytes = size - conn->rx_end;
+  uint msgs = 0;
   unsigned i, len;
 
-  DBG("BGP: RX hook: Got %d bytes\n", size);
+  DBG("BGP: RX hook: Got %d bytes\n", bytes);
   while (end >= pkt_start + BGP_HEADER_LENGTH)
     {
       if ((conn->state == BS_CLOSE) || (conn->sk != sk))
-	return 0;
+	{
+	  bgp_rx_account(p, bytes, msgs);
+	  return 0;
+	}
       for(i=0; i<16; i++)
 	if (pkt_start[i] != 0xff)
 	  {
@@ -1789,11 +1909,25 @@ bgp_rx(sock *sk, uint size)
 	break;
       bgp_rx_packet(conn, pkt_start, len);
       pkt_start += len;
+      msgs++;
     }
-  if (pkt_start != sk->rbuf)
+  bgp_rx_account(p, bytes, msgs);
+
+  if (pkt_start == end)
+    pkt_start = end = sk->rbuf;
+  else if ((uint) (sk->rbuf + sk->rbsize - end) < bgp_max_packet_length(p))
     {
       memmove(sk->rbuf, pkt_start, end - pkt_start);
-      sk->rpos = sk->rbuf + (end - pkt_start);
+      end = sk->rbuf + (end - pkt_start);
+      pkt_start = sk->rbuf;
     }
+
+  conn->rx_start = pkt_start - sk->rbuf;
+  conn->rx_end = end - sk->rbuf;
+  sk->rpos = end;
+
+  if ((size == sk->rbsize) && (sk->rbsize < p->cf->rx_buffer))
+    sk_grow_rbsize(sk, MIN(2 * sk->rbsize, p->cf->rx_buffer));
+
   return 0;
 }
@@ -39,7 +39,9 @@
  * - RFC 8050 - ADD_PATH extension
  */
 
+#include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <errno.h>
 
@@ -48,8 +50,13 @@
 #include "nest/cli.h"
 #include "filter/filter.h"
 #include "proto/bgp/bgp.h"
+#include "lib/socket.h"
 #include "sysdep/unix/unix.h"
 
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
 
 #ifdef PATH_MAX
 #define BIRD_PATH_MAX PATH_MAX
@@ -66,6 +73,397 @@
   })
 
 
+/*
+ *	MRT output
+ *
+ * Finished MRT messages are not written to files directly. They are collected
+ * in large chunks (struct mrt_chunk) per output file, and full chunks are
+ * passed to a queue served by a writer thread, so the main loop never waits
+ * for the disk. The writer thread also closes the files, therefore the file
+ * descriptor is owned by the output and passed along with the last chunk.
+ *
+ * Table dumps are throttled: when the queue grows above %MRT_QUEUE_HIGH, the
+ * dump is paused until the writer drains it below %MRT_QUEUE_LOW and kicks the
+ * main loop through a pipe. BGP4MP messages cannot wait, so their chunks are
+ * dropped when the queue exceeds %MRT_QUEUE_MAX. Without thread support, the
+ * chunks are written synchronously.
+ */
+
+struct mrt_chunk {
+  struct mrt_chunk *next;
+  int fd;				/* Target file */
+  int close;				/* Close the file after the data are written */
+  uint len, size;			/* Used and allocated data length */
+  byte data[0];
+};
+
+#define MRT_CHUNK_SIZE		(256 * 1024)
+#define MRT_QUEUE_LOW		(8 * MRT_CHUNK_SIZE)
+#define MRT_QUEUE_HIGH		(32 * MRT_CHUNK_SIZE)
+#define MRT_QUEUE_MAX		(128 * MRT_CHUNK_SIZE)
+
+struct mrt_writer_stats {
+  uint queued, peak;			/* Current and maximal queue length in bytes */
+  unsigned long written;		/* Bytes written */
+  unsigned long dropped;		/* Bytes dropped due to full queue */
+  unsigned long failed;			/* Bytes not written due to errors */
+};
+
+static struct mrt_writer {
+#ifdef USE_PTHREADS
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t more;			/* Signalled when a chunk is queued */
+  pthread_cond_t done;			/* Signalled when a chunk is written */
+  int running, stop;
+  int waiting;				/* Main loop wants a kick below low watermark */
+  int notify_fds[2];			/* Pipe for the kick */
+#endif
+  struct mrt_chunk *first, **last;	/* Queue of chunks to write */
+  struct mrt_writer_stats stats;
+} mrt_writer;
+
+static list mrt_wait_list;		/* MRT protocols with paused table dumps */
+
+static void mrt_bgp_flush(void *data);
+
+static struct mrt_chunk *
+mrt_chunk_new(int fd, uint size)
+{
+  struct mrt_chunk *c = xmalloc(sizeof(struct mrt_chunk) + size);
+
+  c->next = NULL;
+  c->fd = fd;
+  c->close = 0;
+  c->len = 0;
+  c->size = size;
+
+  return c;
+}
+
+/* Write and release a chunk, returns number of bytes not written */
+static uint
+mrt_chunk_write(struct mrt_chunk *c)
+{
+  byte *pos = c->data;
+  byte *end = c->data + c->len;
+
+  while (pos < end)
+  {
+    int rv = write(c->fd, pos, end - pos);
+
+    if (rv < 0)
+    {
+      if (errno == EINTR)
+	continue;
+
+      log(L_ERR "Write to MRT file failed: %m");
+      break;
+    }
+
+    pos += rv;
+  }
+
+  if (c->close)
+    close(c->fd);
+
+  return end - pos;
+}
+
+#ifdef USE_PTHREADS
+
+static void *
+mrt_writer_main(void *arg UNUSED)
+{
+  struct mrt_writer *w = &mrt_writer;
+
+  pthread_mutex_lock(&w->mutex);
+  while (1)
+  {
+    while (!w->first && !w->stop)
+      pthread_cond_wait(&w->more, &w->mutex);
+
+    struct mrt_chunk *c = w->first;
+    if (!c)
+      break;
+
+    /* The chunk stays queued while being written */
+    pthread_mutex_unlock(&w->mutex);
+    uint failed = mrt_chunk_write(c);
+    pthread_mutex_lock(&w->mutex);
+
+    w->first = c->next;
+    if (!w->first)
+      w->last = &w->first;
+
+    w->stats.queued -= c->len;
+    w->stats.written += c->len - failed;
+    w->stats.failed += failed;
+    xfree(c);
+
+    pthread_cond_broadcast(&w->done);
+
+    if (w->waiting && (w->stats.queued <= MRT_QUEUE_LOW))
+    {
+      u64 v = 1;
+      w->waiting = 0;
+      if (write(w->notify_fds[1], &v, sizeof(v)) < 0)
+	log(L_ERR "MRT: Writer wakeup failed: %m");
+    }
+  }
+  pthread_mutex_unlock(&w->mutex);
+
+  return NULL;
+}
+
+static int
+mrt_writer_notify_hook(sock *sk, uint len UNUSED)
+{
+  struct mrt_proto *p;
+  node *n;
+  char buf[64];
+
+  while (read(sk->fd, buf, sizeof(buf)) > 0)
+    ;
+
+  WALK_LIST_FIRST(n, mrt_wait_list)
+  {
+    p = SKIP_BACK(struct mrt_proto, wait_node, n);
+    rem_node(n);
+    ev_schedule(p->event);
+  }
+
+  return 0;
+}
+
+static void
+mrt_writer_notify_err(sock *sk UNUSED, int err)
+{
+  log(L_ERR "MRT: Writer notify socket error: %M", err);
+}
+
+static void
+mrt_writer_stop(void)
+{
+  struct mrt_writer *w = &mrt_writer;
+
+  mrt_bgp_flush(NULL);
+
+  pthread_mutex_lock(&w->mutex);
+  w->stop = 1;
+  pthread_cond_signal(&w->more);
+  pthread_mutex_unlock(&w->mutex);
+
+  pthread_join(w->thread, NULL);
+}
+
+static void
+mrt_writer_start(void)
+{
+  struct mrt_writer *w = &mrt_writer;
+
+  if (pipe(w->notify_fds) < 0)
+    die("pipe: %m");
+
+  if ((fcntl(w->notify_fds[0], F_SETFL, O_NONBLOCK) < 0) ||
+      (fcntl(w->notify_fds[1], F_SETFL, O_NONBLOCK) < 0))
+    die("fcntl(O_NONBLOCK): %m");
+
+  sock *sk = sk_new(&root_pool);
+  sk->type = SK_MAGIC;
+  sk->rx_hook = mrt_writer_notify_hook;
+  sk->err_hook = mrt_writer_notify_err;
+  sk->fd = w->notify_fds[0];
+  if (sk_open(sk) < 0)
+    die("MRT: sk_open failed");
+
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->more, NULL);
+  pthread_cond_init(&w->done, NULL);
+
+  int rv = pthread_create(&w->thread, NULL, mrt_writer_main, NULL);
+  if (rv)
+    die("pthread_create(): %M", rv);
+
+  w->running = 1;
+  atexit(mrt_writer_stop);
+}
+
+static void
+mrt_writer_push(struct mrt_chunk *c)
+{
+  struct mrt_writer *w = &mrt_writer;
+
+  if (!w->running)
+    mrt_writer_start();
+
+  pthread_mutex_lock(&w->mutex);
+  *w->last = c;
+  w->last = &c->next;
+  w->stats.queued += c->len;
+  w->stats.peak = MAX(w->stats.peak, w->stats.queued);
+  pthread_cond_signal(&w->more);
+  pthread_mutex_unlock(&w->mutex);
+}
+
+static inline uint
+mrt_writer_queued(void)
+{
+  struct mrt_writer *w = &mrt_writer;
+
+  if (!w->running)
+    return 0;
+
+  pthread_mutex_lock(&w->mutex);
+  uint queued = w->stats.queued;
+  pthread_mutex_unlock(&w->mutex);
+
+  return queued;
+}
+
+static void
+mrt_writer_get_stats(struct mrt_writer_stats *st)
+{
+  struct mrt_writer *w = &mrt_writer;
+
+  if (!w->running)
+  {
+    *st = w->stats;
+    return;
+  }
+
+  pthread_mutex_lock(&w->mutex);
+  *st = w->stats;
+  pthread_mutex_unlock(&w->mutex);
+}
+
+/* Returns 1 if the queue is above high watermark, then the main loop is kicked below low one */
+static int
+mrt_writer_congested(void)
+{
+  struct mrt_writer *w = &mrt_writer;
+
+  if (!w->running)
+    return 0;
+
+  pthread_mutex_lock(&w->mutex);
+  int congested = (w->stats.queued > MRT_QUEUE_HIGH);
+  if (congested)
+    w->waiting = 1;
+  pthread_mutex_unlock(&w->mutex);
+
+  return congested;
+}
+
+/* Block until the queue is below high watermark */
+static void
+mrt_writer_wait(void)
+{
+  struct mrt_writer *w = &mrt_writer;
+
+  if (!w->running)
+    return;
+
+  pthread_mutex_lock(&w->mutex);
+  while (w->stats.queued > MRT_QUEUE_HIGH)
+    pthread_cond_wait(&w->done, &w->mutex);
+  pthread_mutex_unlock(&w->mutex);
+}
+
+#else
+
+static void
+mrt_writer_push(struct mrt_chunk *c)
+{
+  struct mrt_writer *w = &mrt_writer;
+  uint failed = mrt_chunk_write(c);
+
+  w->stats.written += c->len - failed;
+  w->stats.failed += failed;
+  xfree(c);
+}
+
+static inline uint mrt_writer_queued(void) { return 0; }
+static inline void mrt_writer_get_stats(struct mrt_writer_stats *st) { *st = mrt_writer.stats; }
+static inline int mrt_writer_congested(void) { return 0; }
+static inline void mrt_writer_wait(void) { }
+
+#endif
+
+static void
+mrt_writer_init(void)
+{
+  if (mrt_writer.last)
+    return;
+
+  mrt_writer.last = &mrt_writer.first;
+  init_list(&mrt_wait_list);
+}
+
+static void
+mrt_output_init(struct mrt_output *o, int fd, int may_drop)
+{
+  mrt_writer_init();
+
+  o->fd = fd;
+  o->may_drop = may_drop;
+  o->chunk = NULL;
+}
+
+/* Pass the current chunk to the writer */
+static void
+mrt_output_flush(struct mrt_output *o)
+{
+  struct mrt_chunk *c = o->chunk;
+
+  if (!c)
+    return;
+
+  o->chunk = NULL;
+
+  if (o->may_drop && !c->close && (mrt_writer_queued() > MRT_QUEUE_MAX))
+  {
+    mrt_writer.stats.dropped += c->len;
+    xfree(c);
+    return;
+  }
+
+  mrt_writer_push(c);
+}
+
+static void
+mrt_output_close(struct mrt_output *o)
+{
+  if (o->fd < 0)
+    return;
+
+  if (!o->chunk)
+    o->chunk = mrt_chunk_new(o->fd, 0);
+
+  o->chunk->close = 1;
+  mrt_output_flush(o);
+  o->fd = -1;
+}
+
+static void
+mrt_output_write(struct mrt_output *o, const byte *data, uint len)
+{
+  struct mrt_chunk *c = o->chunk;
+
+  if (c && (c->len + len > c->size))
+  {
+    mrt_output_flush(o);
+    c = NULL;
+  }
+
+  if (!c)
+    c = o->chunk = mrt_chunk_new(o->fd, MAX(len, MRT_CHUNK_SIZE));
+
+  memcpy(c->data + c->len, data, len);
+  c->len += len;
+}
+
+
 /*
  *	MRT buffer code
  */
@@ -170,7 +568,7 @@ mrt_init_message(buffer *b, u16 type, u16 subtype)
 }
 
 static void
-mrt_dump_message(buffer *b, int fd)
+mrt_dump_message(buffer *b, struct mrt_output *o)
 {
   uint len = mrt_buffer_pos(b);
 
@@ -178,11 +576,10 @@ mrt_dump_message(buffer *b, int fd)
   ASSERT(len >= MRT_HDR_LENGTH);
   put_u32(b->start + 8, len - MRT_HDR_LENGTH);
 
-  if (fd < 0)
+  if (o->fd < 0)
     return;
 
-  if (write(fd, b->start, len) < 0)
-    log(L_ERR "Write to MRT file failed: %m"); /* TODO: name of file */
+  mrt_output_write(o, b->start, len);
 }
 
 static int
@@ -262,14 +659,14 @@ mrt_open_file(struct mrt_table_dump_state *s)
     return 0;
   }
 
-  s->file = rf_open(s->pool, name, "a");
-  if (!s->file)
+  int fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0666);
+  if (fd < 0)
   {
     mrt_log(s, "Unable to open MRT file '%s': %m", name);
     return 0;
   }
 
-  s->fd = rf_fileno(s->file);
+  mrt_output_init(&s->out, fd, 0);
   s->time_offset = now_real - now;
 
   return 1;
@@ -278,9 +675,7 @@ mrt_open_file(struct mrt_table_dump_state *s)
 static void
 mrt_close_file(struct mrt_table_dump_state *s)
 {
-  rfree(s->file);
-  s->file = NULL;
-  s->fd = -1;
+  mrt_output_close(&s->out);
 }
 
 
@@ -363,7 +758,7 @@ mrt_peer_table_dump(struct mrt_table_dump_state *s)
   /* Fix Peer Count */
   put_u16(s->buf.start + s->peer_count_offset, s->peer_count);
 
-  mrt_dump_message(&s->buf, s->fd);
+  mrt_dump_message(&s->buf, &s->out);
 }
 
 static void
@@ -511,7 +906,7 @@ mrt_rib_table_dump(struct mrt_table_dump_state *s, net *n, int add_path)
     return;
 
   s->seqnum++;
-  mrt_dump_message(&s->buf, s->fd);
+  mrt_dump_message(&s->buf, &s->out);
 }
 
 
@@ -534,7 +929,7 @@ mrt_table_dump_init(pool *pp)
   s->config = config;
   config_add_obstacle(s->config);
 
-  s->fd = -1;
+  mrt_output_init(&s->out, -1, 0);
 
   return s;
 }
@@ -551,6 +946,8 @@ mrt_table_dump_free(struct mrt_table_dump_state *s)
   if (s->table_ptr)
     rt_unlock_table(s->table_ptr);
 
+  mrt_output_close(&s->out);
+
   config_del_obstacle(s->config);
 
   rfree(s->pool);
@@ -641,6 +1038,13 @@ mrt_event(void *P)
   if (!p->table_dump)
     return;
 
+  /* Wait for a kick from the writer */
+  if (mrt_writer_congested())
+  {
+    add_tail(&mrt_wait_list, &p->wait_node);
+    return;
+  }
+
   if (!mrt_table_dump_step(p->table_dump))
   {
     ev_schedule(p->event);
@@ -664,6 +1068,9 @@ mrt_event(void *P)
 static void
 mrt_dump_cont(struct cli *c)
 {
+  /* CLI dumps cannot be paused, they wait for the writer as before */
+  mrt_writer_wait();
+
   if (!mrt_table_dump_step(c->rover))
     return;
 
@@ -712,6 +1119,46 @@ mrt_dump_cmd(struct mrt_dump_data *d)
  *	MRT BGP4MP dump
  */
 
+static struct mrt_output mrt_bgp_out = { .fd = -1 };
+static struct config *mrt_bgp_config;
+static event *mrt_bgp_event;
+
+static void
+mrt_bgp_flush(void *data UNUSED)
+{
+  mrt_output_close(&mrt_bgp_out);
+}
+
+/*
+ * BGP4MP messages collected during one pass of the main loop are written
+ * through a private duplicate of the MRTDump file descriptor, which the writer
+ * closes after them. So the configured file may be closed by reconfiguration
+ * regardless of the queue.
+ */
+static struct mrt_output *
+mrt_bgp_output(void)
+{
+  if (mrt_bgp_config != config)
+    mrt_bgp_flush(NULL);
+
+  if ((mrt_bgp_out.fd < 0) && (config->mrtdump_file >= 0))
+  {
+    int fd = dup(config->mrtdump_file);
+    if (fd < 0)
+      log(L_ERR "Unable to use MRTDump file: %m");
+
+    mrt_output_init(&mrt_bgp_out, fd, 1);
+    mrt_bgp_config = config;
+
+    if (!mrt_bgp_event)
+      mrt_bgp_event = ev_new_set(&root_pool, mrt_bgp_flush, NULL);
+
+    ev_schedule(mrt_bgp_event);
+  }
+
+  return &mrt_bgp_out;
+}
+
 static buffer *
 mrt_bgp_buffer(void)
 {
@@ -767,7 +1214,7 @@ mrt_dump_bgp_message(struct mrt_bgp_data *d)
   mrt_init_message(b, MRT_BGP4MP, subtypes[d->as4 + 4*d->add_path]);
   mrt_bgp_header(b, d);
   mrt_put_data(b, d->message, d->msg_len);
-  mrt_dump_message(b, config->mrtdump_file);
+  mrt_dump_message(b, mrt_bgp_output());
 }
 
 void
@@ -787,7 +1234,7 @@ mrt_dump_bgp_state_change(struct mrt_bgp_data *d)
   mrt_bgp_header(b, d);
   mrt_put_u16(b, states[d->old_state]);
   mrt_put_u16(b, states[d->new_state]);
-  mrt_dump_message(b, config->mrtdump_file);
+  mrt_dump_message(b, mrt_bgp_output());
 }
 
 
@@ -863,6 +1310,21 @@ mrt_reconfigure(struct proto *P, struct proto_config *CF)
   return 1;
 }
 
+static void
+mrt_show_proto_info(struct proto *P)
+{
+  struct mrt_proto *p = (void *) P;
+  struct mrt_writer_stats st;
+
+  mrt_writer_get_stats(&st);
+
+  cli_msg(-1006, "  Table dump:       %s",
+	  !p->table_dump ? "idle" : NODE_VALID(&p->wait_node) ? "waiting for writer" : "running");
+  cli_msg(-1006, "  Writer queue:     %u bytes (peak %u)", st.queued, st.peak);
+  cli_msg(-1006, "  Written:          %lu bytes", st.written);
+  cli_msg(-1006, "  Dropped:          %lu bytes (%lu failed)", st.dropped, st.failed);
+}
+
 static void
 mrt_copy_config(struct proto_config *dest, struct proto_config *src)
 {
@@ -880,4 +1342,5 @@ struct protocol proto_mrt = {
   .shutdown =		mrt_shutdown,
   .reconfigure =	mrt_reconfigure,
   .copy_config =	mrt_copy_config,
+  .show_proto_info =	mrt_show_proto_info,
 };
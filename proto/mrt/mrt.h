@@ -36,6 +36,13 @@ struct mrt_proto {
 
   struct mrt_target *file;
   struct mrt_table_dump_state *table_dump;
+  node wait_node;			/* Node in mrt_wait_list while the dump waits for the writer */
+};
+
+struct mrt_output {
+  int fd;				/* Output file (owned, closed by the writer), -1 if none */
+  int may_drop;				/* Drop data instead of overfilling the writer queue */
+  struct mrt_chunk *chunk;		/* Chunk being filled, NULL if none */
 };
 
 struct mrt_dump_data {
@@ -88,8 +95,7 @@ struct mrt_table_dump_state {
   u16 entry_count;			/* Number of RIB Entries */
   u32 entry_count_offset;		/* Buffer offset to store entry_count later */
 
-  struct rfile *file;			/* tracking for mrt table dump file */
-  int fd;
+  struct mrt_output out;			/* Output for mrt table dump file */
 };
 
 struct mrt_bgp_data {
@@ -157,6 +157,13 @@ ospf_area_add(struct ospf_proto *p, struct ospf_area_config *ac)
   fib_init(&oa->rtr, p->p.pool, sizeof(ort), 0, ospf_rt_initort);
   add_area_nets(oa, ac);
 
+  /* Separate pool, as area SPF may run in a worker thread */
+  oa->pool = rp_new(p->p.pool, "OSPF Area");
+  BUFFER_INIT(oa->cand, oa->pool, 32);
+  BUFFER_INIT(oa->spf_routes, oa->pool, 32);
+  oa->nhpool = lp_new(oa->pool, 12*sizeof(struct mpnh));
+  oa->spf_dirty = 1;
+
   if (oa->areaid == 0)
     p->backbone = oa;
 
@@ -191,6 +198,8 @@ ospf_area_remove(struct ospf_area *oa)
   fib_free(&oa->net_fib);
   fib_free(&oa->enet_fib);
 
+  rfree(oa->pool);
+
   if (oa->translator_timer)
     rfree(oa->translator_timer);
 
@@ -234,6 +243,9 @@ ospf_start(struct proto *P)
   p->merge_external = c->merge_external;
   p->asbr = c->asbr;
   p->ecmp = c->ecmp;
+  p->incremental_spf = c->incremental_spf;
+  p->spf_threads = c->spf_threads;
+  p->spf_full = 1;
   p->tick = c->tick;
   p->disp_timer = tm_new_set(P->pool, ospf_disp, p, 0, p->tick);
   tm_start(p->disp_timer, 1);
@@ -381,8 +393,8 @@ ospf_build_attrs(ea_list * next, struct linpool *pool, u32 m1, u32 m2,
 }
 
 
-void
-ospf_schedule_rtcalc(struct ospf_proto *p)
+static void
+ospf_request_rtcalc(struct ospf_proto *p)
 {
   if (p->calcrt)
     return;
@@ -391,6 +403,58 @@ ospf_schedule_rtcalc(struct ospf_proto *p)
   p->calcrt = 1;
 }
 
+void
+ospf_schedule_rtcalc(struct ospf_proto *p)
+{
+  /* We do not know what changed, all areas have to be recalculated */
+  p->spf_full = 1;
+  ospf_request_rtcalc(p);
+}
+
+/**
+ * ospf_schedule_rtcalc_lsa - schedule routing table calculation after LSA change
+ * @p: OSPF protocol instance
+ * @en: changed LSA
+ *
+ * Like ospf_schedule_rtcalc(), but when incremental SPF is enabled, only the
+ * area affected by the change is recalculated by SPF. Changes of summary and
+ * external LSAs do not need any area SPF.
+ */
+void
+ospf_schedule_rtcalc_lsa(struct ospf_proto *p, struct top_hash_entry *en)
+{
+  struct ospf_area *oa;
+  struct ospf_iface *ifa;
+
+  switch (en->lsa_type)
+  {
+  case LSA_T_RT:
+  case LSA_T_NET:
+  case LSA_T_PREFIX:
+    oa = ospf_find_area(p, en->domain);
+    if (oa)
+      oa->spf_dirty = 1;
+    break;
+
+  case LSA_T_LINK:
+    WALK_LIST(ifa, p->iface_list)
+      if (ifa->iface_id == en->domain)
+	ifa->oa->spf_dirty = 1;
+    break;
+
+  case LSA_T_SUM_NET:
+  case LSA_T_SUM_RT:
+  case LSA_T_EXT:
+  case LSA_T_NSSA:
+    break;
+
+  default:
+    p->spf_full = 1;
+  }
+
+  ospf_request_rtcalc(p);
+}
+
 static int
 ospf_reload_routes(struct proto *P)
 {
@@ -662,6 +726,8 @@ ospf_reconfigure(struct proto *P, struct proto_config *c)
   p->merge_external = new->merge_external;
   p->asbr = new->asbr;
   p->ecmp = new->ecmp;
+  p->incremental_spf = new->incremental_spf;
+  p->spf_threads = new->spf_threads;
   p->tick = new->tick;
   p->disp_timer->recurrent = p->tick;
   tm_start(p->disp_timer, 1);
@@ -759,6 +825,13 @@ ospf_sh(struct proto *P)
   cli_msg(-1014, "RFC1583 compatibility: %s", (p->rfc1583 ? "enabled" : "disabled"));
   cli_msg(-1014, "Stub router: %s", (p->stub_router ? "Yes" : "No"));
   cli_msg(-1014, "RT scheduler tick: %d", p->tick);
+  cli_msg(-1014, "Incremental SPF: %s", (p->incremental_spf ? "Yes" : "No"));
+  cli_msg(-1014, "SPF threads: %u", p->spf_threads);
+  cli_msg(-1014, "RT calculations:\t%u full, %u incremental",
+	  p->spf_runs_full, p->spf_runs_incr);
+  cli_msg(-1014, "Last RT calculation:\t%u us (%u areas by SPF)",
+	  (uint) p->spf_last_time, p->spf_last_areas);
+  cli_msg(-1014, "Longest RT calculation:\t%u us", (uint) p->spf_max_time);
   cli_msg(-1014, "Number of areas: %u", p->areano);
   cli_msg(-1014, "Number of LSAs in DB:\t%u", p->gr->hash_entries);
 
@@ -786,6 +859,7 @@ ospf_sh(struct proto *P)
     cli_msg(-1014, "\t\tStub:\t%s", oa_is_stub(oa) ? "Yes" : "No");
     cli_msg(-1014, "\t\tNSSA:\t%s", oa_is_nssa(oa) ? "Yes" : "No");
     cli_msg(-1014, "\t\tTransit:\t%s", oa->trcap ? "Yes" : "No");
+    cli_msg(-1014, "\t\tSPF calculations:\t%u (last %u us)", oa->spf_runs, (uint) oa->spf_time);
 
     if (oa_is_nssa(oa))
       cli_msg(-1014, "\t\tNSSA translation:\t%s%s", oa->translate ? "Yes" : "No",
@@ -17,6 +17,7 @@
 #include "lib/ip.h"
 #include "lib/lists.h"
 #include "lib/slists.h"
+#include "lib/buffer.h"
 #include "lib/socket.h"
 #include "lib/timer.h"
 #include "lib/resource.h"
@@ -96,7 +97,9 @@ struct ospf_config
   u8 rfc1583;
   u8 stub_router;
   u8 merge_external;
+  u8 incremental_spf;
   u8 instance_id;
+  uint spf_threads;
   u8 abr;
   u8 asbr;
   int ecmp;
@@ -226,11 +229,20 @@ struct ospf_proto
   byte merge_external;		/* Should i merge external routes? */
   byte asbr;			/* May i originate any ext/NSSA lsa? */
   byte ecmp;			/* Maximal number of nexthops in ECMP route, or 0 */
+  byte incremental_spf;		/* Recalculate SPF only in changed areas? */
+  byte spf_full;		/* Next calculation must recalculate all areas */
+  byte spf_defer;		/* Area SPF just keeps found routes (parallel SPF) */
+  uint spf_threads;		/* Number of threads for parallel area SPF */
   struct ospf_area *backbone;	/* If exists */
   event *flood_event;		/* Event for flooding LS updates */
   void *lsab;			/* LSA buffer used when originating router LSAs */
   int lsab_size, lsab_used;
   linpool *nhpool;		/* Linpool used for next hops computed in SPF */
+  uint spf_runs_full;		/* Number of full routing table calculations */
+  uint spf_runs_incr;		/* Number of incremental routing table calculations */
+  uint spf_last_areas;		/* Areas recalculated in the last calculation */
+  btime spf_last_time;		/* Duration of the last calculation (us) */
+  btime spf_max_time;		/* Maximal duration of a calculation (us) */
   sock *vlink_sk;		/* IP socket used for vlink TX */
   u32 router_id;
   u32 last_vlink_id;		/* Interface IDs for vlinks (starts at 0x80000000) */
@@ -245,12 +257,19 @@ struct ospf_area
   struct ospf_area_config *ac;	/* Related area config */
   struct top_hash_entry *rt;	/* My own router LSA */
   struct top_hash_entry *pxr_lsa; /* Originated prefix LSA */
-  list cand;			/* List of candidates for RT calc. */
+  pool *pool;			/* Pool for area SPF data */
+  BUFFER(struct top_hash_entry *) cand; /* Heap of candidates for RT calc., from 1 */
+  BUFFER(struct ospf_spf_route) spf_routes; /* Routes found by the last SPF */
+  linpool *nhpool;		/* Linpool for next hops computed in area SPF */
+  u32 cand_seq;			/* Sequence number of last added candidate */
+  uint spf_runs;		/* Number of SPF calculations of the area */
+  btime spf_time;		/* Duration of the last SPF calculation (us) */
   struct fib net_fib;		/* Networks to advertise or not */
   struct fib enet_fib;		/* External networks for NSSAs */
   u32 options;			/* Optional features */
   u8 update_rt_lsa;		/* Rt lsa origination scheduled? */
   u8 trcap;			/* Transit capability? */
+  u8 spf_dirty;			/* Area SPF has to be recalculated */
   u8 marked;			/* Used in OSPF reconfigure */
   u8 translate;			/* Translator state (TRANS_*), for NSSA ABR  */
   timer *translator_timer;	/* For NSSA translator switch */
@@ -821,15 +840,20 @@ struct lsadb_show_data {
 
 /* ospf.c */
 void ospf_schedule_rtcalc(struct ospf_proto *p);
+void ospf_schedule_rtcalc_lsa(struct ospf_proto *p, struct top_hash_entry *en);
 
+/*
+ * Notifications also mark the area for SPF recalculation, as they are caused
+ * by changes of interfaces or neighbors, which are used in next hop calculation.
+ */
 static inline void ospf_notify_rt_lsa(struct ospf_area *oa)
-{ oa->update_rt_lsa = 1; }
+{ oa->update_rt_lsa = 1; oa->spf_dirty = 1; }
 
 static inline void ospf_notify_net_lsa(struct ospf_iface *ifa)
-{ ifa->update_net_lsa = 1; }
+{ ifa->update_net_lsa = 1; ifa->oa->spf_dirty = 1; }
 
 static inline void ospf_notify_link_lsa(struct ospf_iface *ifa)
-{ ifa->update_link_lsa = 1; }
+{ ifa->update_link_lsa = 1; ifa->oa->spf_dirty = 1; }
 
 
 #define ospf_is_v2(X) OSPF_IS_V2
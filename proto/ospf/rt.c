@@ -9,10 +9,14 @@
  */
 
 #include "ospf.h"
+#include "lib/heap.h"
 
-static void add_cand(list * l, struct top_hash_entry *en,
-		     struct top_hash_entry *par, u32 dist,
-		     struct ospf_area *oa, int i);
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+static void add_cand(struct ospf_area *oa, struct top_hash_entry *en,
+		     struct top_hash_entry *par, u32 dist, int i);
 static void rt_sync(struct ospf_proto *p);
 
 
@@ -43,9 +47,9 @@ unresolved_vlink(ort *ort)
 }
 
 static inline struct mpnh *
-new_nexthop(struct ospf_proto *p, ip_addr gw, struct iface *iface, byte weight)
+new_nexthop(linpool *lp, ip_addr gw, struct iface *iface, byte weight)
 {
-  struct mpnh *nh = lp_alloc(p->nhpool, sizeof(struct mpnh));
+  struct mpnh *nh = lp_alloc(lp, sizeof(struct mpnh));
   nh->gw = gw;
   nh->iface = iface;
   nh->next = NULL;
@@ -74,7 +78,7 @@ fix_device_nexthops(struct ospf_proto *p, const struct mpnh *n, ip_addr gw)
   struct mpnh **nn2 = &root2;
 
   if (!p->ecmp)
-    return new_nexthop(p, gw, n->iface, n->weight);
+    return new_nexthop(p->nhpool, gw, n->iface, n->weight);
 
   /* This is a bit tricky. We cannot just copy the list and update n->gw,
      because the list should stay sorted, so we create two lists, one with new
@@ -82,7 +86,7 @@ fix_device_nexthops(struct ospf_proto *p, const struct mpnh *n, ip_addr gw)
 
   for (; n; n = n->next)
   {
-    struct mpnh *nn = new_nexthop(p, ipa_zero(n->gw) ? gw : n->gw, n->iface, n->weight);
+    struct mpnh *nn = new_nexthop(p->nhpool, ipa_zero(n->gw) ? gw : n->gw, n->iface, n->weight);
 
     if (ipa_zero(n->gw))
     {
@@ -402,6 +406,48 @@ px_pos_to_ifa(struct ospf_area *oa, int pos)
   return NULL;
 }
 
+/*
+ * With incremental SPF, routes found by area SPF are kept, so they can be
+ * installed again in later calculations without running SPF for the area.
+ * With parallel SPF, routes are just kept and installed later by the main
+ * thread, see ospf_rt_spfa_parallel().
+ */
+static inline void
+spf_install_route(struct ospf_area *oa, u8 type, ip_addr px, int pxlen, const orta *nf)
+{
+  struct ospf_proto *p = oa->po;
+
+  if (p->incremental_spf || p->spf_defer)
+  {
+    struct ospf_spf_route *r = &BUFFER_PUSH(oa->spf_routes);
+    r->px = px;
+    r->pxlen = pxlen;
+    r->type = type;
+    r->nf = *nf;
+  }
+
+  if (p->spf_defer)
+    return;
+
+  if (type == ORT_NET)
+    ri_install_net(p, px, pxlen, nf);
+  else
+    ri_install_rt(oa, nf->rid, nf);
+}
+
+static void
+spf_replay_routes(struct ospf_area *oa)
+{
+  struct ospf_spf_route *r = oa->spf_routes.data;
+  struct ospf_spf_route *end = r + oa->spf_routes.used;
+
+  for (; r < end; r++)
+    if (r->type == ORT_NET)
+      ri_install_net(oa->po, r->px, r->pxlen, &r->nf);
+    else
+      ri_install_rt(oa, r->nf.rid, &r->nf);
+}
+
 
 static void
 add_network(struct ospf_area *oa, ip_addr px, int pxlen, int metric, struct top_hash_entry *en, int pos)
@@ -437,10 +483,10 @@ add_network(struct ospf_area *oa, ip_addr px, int pxlen, int metric, struct top_
 
     struct ospf_iface *ifa;
     ifa = ospf_is_v2(p) ? rt_pos_to_ifa(oa, pos) : px_pos_to_ifa(oa, pos);
-    nf.nhs = ifa ? new_nexthop(p, IPA_NONE, ifa->iface, ifa->ecmp_weight) : NULL;
+    nf.nhs = ifa ? new_nexthop(oa->nhpool, IPA_NONE, ifa->iface, ifa->ecmp_weight) : NULL;
   }
 
-  ri_install_net(p, px, pxlen, &nf);
+  spf_install_route(oa, ORT_NET, px, pxlen, &nf);
 }
 
 
@@ -476,7 +522,7 @@ spfa_process_rt(struct ospf_proto *p, struct ospf_area *oa, struct top_hash_entr
       .oa = oa,
       .nhs = act->nhs
     };
-    ri_install_rt(oa, act->lsa.rt, &nf);
+    spf_install_route(oa, ORT_ROUTER, IPA_NONE, 0, &nf);
   }
 
   /* Errata 2078 to RFC 5340 4.8.1 - skip links from non-routing nodes */
@@ -517,7 +563,7 @@ spfa_process_rt(struct ospf_proto *p, struct ospf_area *oa, struct top_hash_entr
       break;
     }
 
-    add_cand(&oa->cand, tmp, act, act->dist + rtl.metric, oa, i);
+    add_cand(oa, tmp, act, act->dist + rtl.metric, i);
   }
 }
 
@@ -540,7 +586,7 @@ spfa_process_net(struct ospf_proto *p, struct ospf_area *oa, struct top_hash_ent
   for (i = 0; i < cnt; i++)
   {
     tmp = ospf_hash_find_rt(p->gr, oa->areaid, ln->routers[i]);
-    add_cand(&oa->cand, tmp, act, act->dist, oa, -1);
+    add_cand(oa, tmp, act, act->dist, -1);
   }
 }
 
@@ -602,13 +648,78 @@ spfa_process_prefixes(struct ospf_proto *p, struct ospf_area *oa)
   }
 }
 
+/*
+ * Candidates in Dijkstra's algorithm are kept in a binary heap (see
+ * lib/heap.h), indexed from 1. They are ordered by distance, networks are
+ * preferred to routers with the same distance. Ties are broken by sequence
+ * number, first added networks and last added routers are taken first. That
+ * is the same order as the original sorted list of candidates had, which
+ * matters for next hop calculation in some corner cases.
+ */
+static inline int
+cand_less(struct top_hash_entry *a, struct top_hash_entry *b)
+{
+  if (a->dist != b->dist)
+    return a->dist < b->dist;
+
+  if (a->lsa_type != b->lsa_type)
+    return a->lsa_type == LSA_T_NET;
+
+  if (a->lsa_type == LSA_T_NET)
+    return a->cand_seq < b->cand_seq;
+  else
+    return a->cand_seq > b->cand_seq;
+}
+
+#define CAND_LESS(a,b)		cand_less(a, b)
+#define CAND_SWAP(heap,a,b,t)	(t = heap[a], heap[a] = heap[b], heap[b] = t, \
+				   heap[a]->cand_pos = (a), heap[b]->cand_pos = (b))
+
+static inline uint cand_count(struct ospf_area *oa)
+{ return oa->cand.used - 1; }
+
+static void
+cand_insert(struct ospf_area *oa, struct top_hash_entry *en)
+{
+  uint num = oa->cand.used;
+
+  en->cand_seq = oa->cand_seq++;
+  en->cand_pos = num;
+  BUFFER_PUSH(oa->cand) = en;
+  HEAP_INSERT(oa->cand.data, num, struct top_hash_entry *, CAND_LESS, CAND_SWAP);
+}
+
+/* The distance of en was decreased */
+static void
+cand_decrease(struct ospf_area *oa, struct top_hash_entry *en)
+{
+  en->cand_seq = oa->cand_seq++;
+  HEAP_DECREASE(oa->cand.data, cand_count(oa), struct top_hash_entry *, CAND_LESS, CAND_SWAP, en->cand_pos);
+}
+
+static struct top_hash_entry *
+cand_delmin(struct ospf_area *oa)
+{
+  uint num = cand_count(oa);
+  struct top_hash_entry *en = oa->cand.data[1];
+
+  HEAP_DELMIN(oa->cand.data, num, struct top_hash_entry *, CAND_LESS, CAND_SWAP);
+  BUFFER_POP(oa->cand);
+
+  return en;
+}
+
 /* RFC 2328 16.1. calculating shortest paths for an area */
 static void
 ospf_rt_spfa(struct ospf_area *oa)
 {
   struct ospf_proto *p = oa->po;
   struct top_hash_entry *act;
-  node *n;
+
+  /* Drop results of the previous calculation */
+  oa->spf_dirty = 0;
+  BUFFER_FLUSH(oa->spf_routes);
+  lp_flush(oa->nhpool);
 
   if (oa->rt == NULL)
     return;
@@ -617,23 +728,24 @@ ospf_rt_spfa(struct ospf_area *oa)
 
   OSPF_TRACE(D_EVENTS, "Starting routing table calculation for area %R", oa->areaid);
 
+  btime start = tm_monotonic_time();
+
   /* 16.1. (1) */
-  init_list(&oa->cand);		/* Empty list of candidates */
+  BUFFER_SET(oa->cand, 1);	/* Empty heap of candidates */
+  oa->cand_seq = 0;
   oa->trcap = 0;
 
   DBG("LSA db prepared, adding me into candidate list.\n");
 
   oa->rt->dist = 0;
   oa->rt->color = CANDIDATE;
-  add_head(&oa->cand, &oa->rt->cn);
+  cand_insert(oa, oa->rt);
   DBG("RT LSA: rt: %R, id: %R, type: %u\n",
       oa->rt->lsa.rt, oa->rt->lsa.id, oa->rt->lsa_type);
 
-  while (!EMPTY_LIST(oa->cand))
+  while (cand_count(oa))
   {
-    n = HEAD(oa->cand);
-    act = SKIP_BACK(struct top_hash_entry, cn, n);
-    rem_node(n);
+    act = cand_delmin(oa);
 
     DBG("Working on LSA: rt: %R, id: %R, type: %u\n",
 	act->lsa.rt, act->lsa.id, act->lsa_type);
@@ -656,6 +768,9 @@ ospf_rt_spfa(struct ospf_area *oa)
 
   if (ospf_is_v3(p))
     spfa_process_prefixes(p, oa);
+
+  oa->spf_runs++;
+  oa->spf_time = tm_monotonic_time() - start;
 }
 
 static int
@@ -1546,6 +1661,143 @@ ospf_ext_spf(struct ospf_proto *p)
   }
 }
 
+
+/*
+ * Parallel area SPF
+ *
+ * With 'spf threads' option above one, SPF calculations (16.1) of different
+ * areas run in a pool of worker threads. The main thread takes part in them
+ * and waits until all are finished, so the LSA db, interfaces and neighbors
+ * do not change in the meantime and are just read. An area calculation writes
+ * only to its own data - router and network LSA entries of the area, the heap
+ * of candidates, next hops and kept routes, all allocated from the area pool.
+ * Found routes are not installed to shared routing tables by workers, they
+ * are kept in @spf_routes and installed by the main thread in the order of
+ * areas, the same order as in the sequential calculation. Therefore, the
+ * result is identical.
+ */
+
+#ifdef USE_PTHREADS
+
+static struct spf_workers {
+  pthread_mutex_t mutex;
+  pthread_cond_t more;			/* Signalled when jobs are added */
+  pthread_cond_t done;			/* Signalled when all jobs are finished */
+  uint threads;				/* Number of started worker threads */
+  struct ospf_area **jobs;		/* Areas to calculate */
+  uint num, next, finished;		/* Number of jobs, next and finished ones */
+} spf_workers = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .more = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Called and returns with locked mutex */
+static void
+spf_workers_run(struct spf_workers *w)
+{
+  while (w->next < w->num)
+  {
+    struct ospf_area *oa = w->jobs[w->next++];
+    pthread_mutex_unlock(&w->mutex);
+
+    ospf_rt_spfa(oa);
+
+    pthread_mutex_lock(&w->mutex);
+    if (++w->finished == w->num)
+      pthread_cond_signal(&w->done);
+  }
+}
+
+static void *
+spf_worker_main(void *arg UNUSED)
+{
+  struct spf_workers *w = &spf_workers;
+
+  pthread_mutex_lock(&w->mutex);
+  while (1)
+  {
+    spf_workers_run(w);
+    pthread_cond_wait(&w->more, &w->mutex);
+  }
+
+  return NULL;
+}
+
+static void
+spf_workers_start(uint threads)
+{
+  struct spf_workers *w = &spf_workers;
+
+  for (; w->threads < threads; w->threads++)
+  {
+    pthread_t thread;
+    int rv = pthread_create(&thread, NULL, spf_worker_main, NULL);
+    if (rv)
+    {
+      log(L_ERR "OSPF: Cannot create SPF thread: %M", rv);
+      break;
+    }
+
+    pthread_detach(thread);
+  }
+}
+
+static void
+ospf_rt_spfa_parallel(struct ospf_proto *p, uint num)
+{
+  struct spf_workers *w = &spf_workers;
+  struct ospf_area **jobs = alloca(num * sizeof(struct ospf_area *));
+  struct ospf_area *oa;
+  uint i = 0;
+
+  /* Worker threads are shared by all instances, the main thread is one of them */
+  spf_workers_start(p->spf_threads - 1);
+
+  WALK_LIST(oa, p->area_list)
+    if (oa->spf_dirty)
+      jobs[i++] = oa;
+
+  p->spf_defer = 1;
+
+  pthread_mutex_lock(&w->mutex);
+  w->jobs = jobs;
+  w->num = num;
+  w->next = w->finished = 0;
+  pthread_cond_broadcast(&w->more);
+
+  spf_workers_run(w);
+
+  while (w->finished < w->num)
+    pthread_cond_wait(&w->done, &w->mutex);
+
+  w->jobs = NULL;
+  w->num = w->next = w->finished = 0;
+  pthread_mutex_unlock(&w->mutex);
+
+  p->spf_defer = 0;
+
+  WALK_LIST(oa, p->area_list)
+    spf_replay_routes(oa);
+}
+
+#else
+
+static void
+ospf_rt_spfa_parallel(struct ospf_proto *p, uint num UNUSED)
+{
+  struct ospf_area *oa;
+
+  WALK_LIST(oa, p->area_list)
+    if (oa->spf_dirty)
+      ospf_rt_spfa(oa);
+    else
+      spf_replay_routes(oa);
+}
+
+#endif
+
+
 /* Cleanup of routing tables and data */
 void
 ospf_rt_reset(struct ospf_proto *p)
@@ -1565,14 +1817,19 @@ ospf_rt_reset(struct ospf_proto *p)
   }
   FIB_WALK_END;
 
-  /* Reset SPF data in LSA db */
+  /* Reset SPF data in LSA db, except for areas kept by incremental SPF */
   WALK_SLIST(en, p->lsal)
   {
+    if (((en->lsa_type == LSA_T_RT) || (en->lsa_type == LSA_T_NET)) &&
+	(oa = ospf_find_area(p, en->domain)) && !oa->spf_dirty)
+      goto keep;
+
     en->color = OUTSPF;
     en->dist = LSINFINITY;
     en->nhs = NULL;
     en->lb = IPA_NONE;
 
+  keep:
     if (en->mode == LSA_M_RTCALC)
       en->mode = LSA_M_STALE;
   }
@@ -1616,23 +1873,51 @@ ospf_rt_reset(struct ospf_proto *p)
  * Calculation of internal paths in an area is described in 16.1 of RFC 2328.
  * It's based on Dijkstra's shortest path tree algorithms.
  * This function is invoked from ospf_disp().
+ *
+ * With incremental SPF, the area calculation is done only for areas marked by
+ * @spf_dirty, i.e. areas with changed router, network or prefix LSAs, or with
+ * changed interfaces or neighbors. Routes from other areas are taken from
+ * their last calculation, only the remaining steps (16.2 - 16.5) are done
+ * for them.
+ *
+ * With more SPF threads, area calculations run in parallel, see
+ * ospf_rt_spfa_parallel().
  */
 void
 ospf_rt_spf(struct ospf_proto *p)
 {
   struct ospf_area *oa;
+  int full = !p->incremental_spf || p->spf_full;
+  uint areas = 0;
 
   if (p->areano == 0)
     return;
 
-  OSPF_TRACE(D_EVENTS, "Starting routing table calculation");
+  OSPF_TRACE(D_EVENTS, "Starting %s routing table calculation",
+	     full ? "full" : "incremental");
+
+  btime start = tm_monotonic_time();
+
+  if (full)
+    WALK_LIST(oa, p->area_list)
+      oa->spf_dirty = 1;
 
   /* 16. (1) */
   ospf_rt_reset(p);
 
   /* 16. (2) */
   WALK_LIST(oa, p->area_list)
-    ospf_rt_spfa(oa);
+    if (oa->spf_dirty)
+      areas++;
+
+  if ((p->spf_threads > 1) && (areas > 1))
+    ospf_rt_spfa_parallel(p, areas);
+  else
+    WALK_LIST(oa, p->area_list)
+      if (oa->spf_dirty)
+	ospf_rt_spfa(oa);
+      else
+	spf_replay_routes(oa);
 
   /* 16. (3) */
   ospf_rt_sum(ospf_main_area(p));
@@ -1654,7 +1939,24 @@ ospf_rt_spf(struct ospf_proto *p)
   rt_sync(p);
   lp_flush(p->nhpool);
 
+  if (!p->incremental_spf)
+    WALK_LIST(oa, p->area_list)
+    {
+      BUFFER_FLUSH(oa->spf_routes);
+      lp_flush(oa->nhpool);
+    }
+
   p->calcrt = 0;
+  p->spf_full = 0;
+
+  if (full)
+    p->spf_runs_full++;
+  else
+    p->spf_runs_incr++;
+
+  p->spf_last_areas = areas;
+  p->spf_last_time = tm_monotonic_time() - start;
+  p->spf_max_time = MAX(p->spf_max_time, p->spf_last_time);
 }
 
 
@@ -1696,7 +1998,7 @@ calc_next_hop(struct ospf_area *oa, struct top_hash_entry *en,
     if (!ifa)
       return NULL;
 
-    return new_nexthop(p, IPA_NONE, ifa->iface, ifa->ecmp_weight);
+    return new_nexthop(oa->nhpool, IPA_NONE, ifa->iface, ifa->ecmp_weight);
   }
 
   /* The second case - ptp or ptmp neighbor */
@@ -1707,13 +2009,13 @@ calc_next_hop(struct ospf_area *oa, struct top_hash_entry *en,
       return NULL;
 
     if (ifa->type == OSPF_IT_VLINK)
-      return new_nexthop(p, IPA_NONE, NULL, 0);
+      return new_nexthop(oa->nhpool, IPA_NONE, NULL, 0);
 
     struct ospf_neighbor *m = find_neigh(ifa, rid);
     if (!m || (m->state != NEIGHBOR_FULL))
       return NULL;
 
-    return new_nexthop(p, m->ip, ifa->iface, ifa->ecmp_weight);
+    return new_nexthop(oa->nhpool, m->ip, ifa->iface, ifa->ecmp_weight);
   }
 
   /* The third case - bcast or nbma neighbor */
@@ -1732,7 +2034,7 @@ calc_next_hop(struct ospf_area *oa, struct top_hash_entry *en,
       if (ipa_zero(en->lb))
 	goto bad;
 
-      return new_nexthop(p, en->lb, pn->iface, pn->weight);
+      return new_nexthop(oa->nhpool, en->lb, pn->iface, pn->weight);
     }
     else /* OSPFv3 */
     {
@@ -1751,7 +2053,7 @@ calc_next_hop(struct ospf_area *oa, struct top_hash_entry *en,
       if (ip6_zero(llsa->lladdr))
 	return NULL;
 
-      return new_nexthop(p, ipa_from_ip6(llsa->lladdr), pn->iface, pn->weight);
+      return new_nexthop(oa->nhpool, ipa_from_ip6(llsa->lladdr), pn->iface, pn->weight);
     }
   }
 
@@ -1762,15 +2064,12 @@ calc_next_hop(struct ospf_area *oa, struct top_hash_entry *en,
 }
 
 
-/* Add LSA into list of candidates in Dijkstra's algorithm */
+/* Add LSA into heap of candidates in Dijkstra's algorithm */
 static void
-add_cand(list * l, struct top_hash_entry *en, struct top_hash_entry *par,
-	 u32 dist, struct ospf_area *oa, int pos)
+add_cand(struct ospf_area *oa, struct top_hash_entry *en, struct top_hash_entry *par,
+	 u32 dist, int pos)
 {
   struct ospf_proto *p = oa->po;
-  node *prev, *n;
-  int added = 0;
-  struct top_hash_entry *act;
 
   /* 16.1. (2b) */
   if (en == NULL)
@@ -1836,7 +2135,7 @@ add_cand(list * l, struct top_hash_entry *en, struct top_hash_entry *par,
 
     /* Merge old and new */
     int new_reuse = (par->nhs != nhs);
-    en->nhs = mpnh_merge(en->nhs, nhs, en->nhs_reuse, new_reuse, p->ecmp, p->nhpool);
+    en->nhs = mpnh_merge(en->nhs, nhs, en->nhs_reuse, new_reuse, p->ecmp, oa->nhpool);
     en->nhs_reuse = 1;
     return;
   }
@@ -1844,44 +2143,17 @@ add_cand(list * l, struct top_hash_entry *en, struct top_hash_entry *par,
   DBG("     Adding candidate: rt: %R, id: %R, type: %u\n",
       en->lsa.rt, en->lsa.id, en->lsa_type);
 
-  if (en->color == CANDIDATE)
-  {				/* We found a shorter path */
-    rem_node(&en->cn);
-  }
+  int shorter = (en->color == CANDIDATE);
+
   en->nhs = nhs;
   en->dist = dist;
   en->color = CANDIDATE;
   en->nhs_reuse = (par->nhs != nhs);
 
-  prev = NULL;
-
-  if (EMPTY_LIST(*l))
-  {
-    add_head(l, &en->cn);
-  }
+  if (shorter)
+    cand_decrease(oa, en);	/* We found a shorter path */
   else
-  {
-    WALK_LIST(n, *l)
-    {
-      act = SKIP_BACK(struct top_hash_entry, cn, n);
-      if ((act->dist > dist) ||
-	  ((act->dist == dist) && (act->lsa_type == LSA_T_RT)))
-      {
-	if (prev == NULL)
-	  add_head(l, &en->cn);
-	else
-	  insert_node(&en->cn, prev);
-	added = 1;
-	break;
-      }
-      prev = n;
-    }
-
-    if (!added)
-    {
-      add_tail(l, &en->cn);
-    }
-  }
+    cand_insert(oa, en);
 }
 
 static inline int
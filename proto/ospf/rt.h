@@ -58,6 +58,15 @@ typedef struct orta
 }
 orta;
 
+/* Route found by area SPF, kept for repeated use by incremental SPF */
+struct ospf_spf_route
+{
+  ip_addr px;			/* Network prefix, unused for ORT_ROUTER */
+  u8 pxlen;
+  u8 type;			/* ORT_NET or ORT_ROUTER (with router ID in nf.rid) */
+  orta nf;
+};
+
 typedef struct ort
 {
   /*
@@ -99,7 +108,7 @@ static inline int rt_is_nssa(ort *nf)
  * - lsa.age < LSA_MAXAGE
  * - dist < LSINFINITY (or 2*LSINFINITY for ext-LSAs)
  * - nhs is non-NULL unless the node is oa->rt (calculating router itself)
- * - beware, nhs is not valid after SPF calculation
+ * - beware, nhs is not valid after SPF calculation (unless kept by incremental SPF)
  *
  * Invariants for structs orta nodes of fib tables po->rtf, oa->rtr:
  * - nodes may be invalid (n.type == 0), in that case other invariants don't hold
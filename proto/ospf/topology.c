@@ -83,7 +83,7 @@ ospf_install_lsa(struct ospf_proto *p, struct ospf_lsa_header *lsa, u32 type, u3
 	     en->lsa_type, en->lsa.id, en->lsa.rt, en->lsa.sn, en->lsa.age);
 
   if (change)
-    ospf_schedule_rtcalc(p);
+    ospf_schedule_rtcalc_lsa(p, en);
 
   return en;
 }
@@ -246,7 +246,7 @@ ospf_do_originate_lsa(struct ospf_proto *p, struct top_hash_entry *en, void *lsa
   ospf_flood_lsa(p, en, NULL);
 
   if (en->mode == LSA_M_BASIC)
-    ospf_schedule_rtcalc(p);
+    ospf_schedule_rtcalc_lsa(p, en);
 
   return 1;
 }
@@ -424,7 +424,7 @@ ospf_flush_lsa(struct ospf_proto *p, struct top_hash_entry *en)
   ospf_flood_lsa(p, en, NULL);
 
   if (en->mode == LSA_M_BASIC)
-    ospf_schedule_rtcalc(p);
+    ospf_schedule_rtcalc_lsa(p, en);
 
   en->mode = LSA_M_BASIC;
 }
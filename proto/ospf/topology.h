@@ -14,8 +14,6 @@
 struct top_hash_entry
 {				/* Index for fast mapping (type,rtrid,LSid)->vertex */
   snode n;
-  node cn;			/* For adding into list of candidates
-				   in intra-area routing table calculation */
   struct top_hash_entry *next;	/* Next in hash chain */
   struct ospf_lsa_header lsa;
   u16 lsa_type;			/* lsa.type processed and converted to common values (LSA_T_*) */
@@ -28,10 +26,13 @@ struct top_hash_entry
   u16 next_lsa_opts;		/* For postponed LSA origination */
   bird_clock_t inst_time;	/* Time of installation into DB */
   struct ort *nf;		/* Reference fibnode for sum and ext LSAs, NULL for otherwise */
-  struct mpnh *nhs;		/* Computed nexthops - valid only in ospf_rt_spf() */
+  struct mpnh *nhs;		/* Computed nexthops - valid only in ospf_rt_spf(),
+				   or until the next SPF of the area with incremental SPF */
   ip_addr lb;			/* In OSPFv2, link back address. In OSPFv3, any global address in the area useful for vlinks */
   u32 lb_id;			/* Interface ID of link back iface (for bcast or NBMA networks) */
   u32 dist;			/* Distance from the root */
+  u32 cand_pos;			/* Position in the heap of candidates in SPF */
+  u32 cand_seq;			/* Sequence number, breaks ties in the heap */
   int ret_count;		/* Number of retransmission lists referencing the entry */
   u8 color;
 #define OUTSPF 0
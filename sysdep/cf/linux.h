@@ -15,6 +15,7 @@
 #define CONFIG_UNIX_DONTROUTE
 
 #define CONFIG_RESTRICTED_PRIVILEGES
+#define CONFIG_EPOLL
 
 /*
 Link: sysdep/linux
@@ -33,11 +33,13 @@ static inline struct ifa * kif_get_primary_ip(struct iface *i UNUSED) { return N
 /* Kernel routes */
 
 #define KRT_ALLOW_MERGE_PATHS	1
+#define KRT_ALLOW_ASYNC_SCAN	1
 
 #define EA_KRT_PREFSRC		EA_CODE(EAP_KRT, 0x10)
 #define EA_KRT_REALM		EA_CODE(EAP_KRT, 0x11)
 #define EA_KRT_SCOPE		EA_CODE(EAP_KRT, 0x12)
 #define EA_KRT_TUNNEL		EA_CODE(EAP_KRT, 0x13)
+#define EA_KRT_TUNNEL_INDEX	EA_CODE(EAP_KRT, 0x14)	/* Resolved EA_KRT_TUNNEL, internal */
 
 
 #define KRT_METRICS_MAX		0x10	/* RTAX_QUICKACK+1 */
@@ -88,9 +90,13 @@ static inline struct ifa * kif_get_primary_ip(struct iface *i UNUSED) { return N
 #define EA_KRT_FEATURE_ALLFRAG	EA_KRT_FEATURES | EA_BIT(0x3)
 
 
+#define KRT_DEFAULT_BATCH_LIMIT	256
+
 struct krt_params {
   u32 table_id;				/* Kernel table ID we sync with */
   u32 metric;				/* Kernel metric used for all routes */
+  u8 batch;				/* Send route requests in batches */
+  u32 batch_limit;			/* Max number of requests in one batch */
 };
 
 struct krt_state {
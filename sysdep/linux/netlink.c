@@ -20,6 +20,7 @@
 #include "nest/protocol.h"
 #include "nest/iface.h"
 #include "lib/timer.h"
+#include "lib/event.h"
 #include "lib/unix.h"
 #include "lib/krt.h"
 #include "lib/socket.h"
@@ -50,6 +51,10 @@
 #define RTA_TABLE  15
 #endif
 
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK 10
+#endif
+
 
 #ifdef IPV6
 #define krt_ecmp6(X) 1
@@ -106,6 +111,7 @@ struct nl_sock
 {
   int fd;
   u32 seq;
+  u32 seq_first;			/* First sequence number of pending request(s) */
   byte *rx_buffer;			/* Receive buffer */
   struct nlmsghdr *last_hdr;		/* Recently received packet */
   uint last_size;
@@ -153,7 +159,7 @@ nl_send(struct nl_sock *nl, struct nlmsghdr *nh)
   memset(&sa, 0, sizeof(sa));
   sa.nl_family = AF_NETLINK;
   nh->nlmsg_pid = 0;
-  nh->nlmsg_seq = ++(nl->seq);
+  nh->nlmsg_seq = nl->seq_first = ++(nl->seq);
   if (sendto(nl->fd, nh, nh->nlmsg_len, 0, (struct sockaddr *)&sa, sizeof(sa)) < 0)
     die("rtnetlink sendto: %m");
   nl->last_hdr = NULL;
@@ -190,6 +196,8 @@ nl_get_reply(struct nl_sock *nl)
 	    .msg_iovlen = 1,
 	  };
 	  int x = recvmsg(nl->fd, &m, 0);
+	  if ((x < 0) && (errno == ENOBUFS) && (nl->seq_first != nl->seq))
+	    return NULL;	/* Lost replies for batched requests */
 	  if (x < 0)
 	    die("nl_get_reply: %m");
 	  if (sa.nl_pid)		/* It isn't from the kernel */
@@ -206,7 +214,7 @@ nl_get_reply(struct nl_sock *nl)
 	{
 	  struct nlmsghdr *h = nl->last_hdr;
 	  nl->last_hdr = NLMSG_NEXT(h, nl->last_size);
-	  if (h->nlmsg_seq != nl->seq)
+	  if ((h->nlmsg_seq - nl->seq_first) > (nl->seq - nl->seq_first))
 	    {
 	      log(L_WARN "nl_get_reply: Ignoring out of sequence netlink packet (%x != %x)",
 		  h->nlmsg_seq, nl->seq);
@@ -255,11 +263,16 @@ nl_get_scan(void)
   return h;
 }
 
+static void nl_batch_flush(void);
+
 static int
 nl_exchange(struct nlmsghdr *pkt, int ignore_esrch)
 {
   struct nlmsghdr *h;
 
+  /* Pending batched requests must be finished before we use the socket */
+  nl_batch_flush();
+
   nl_send(&nl_req, pkt);
   for(;;)
     {
@@ -271,6 +284,209 @@ nl_exchange(struct nlmsghdr *pkt, int ignore_esrch)
   return nl_error(h, ignore_esrch) ? -1 : 0;
 }
 
+/*
+ *	Batched route requests
+ *
+ * When batching is enabled, route requests are not exchanged one by one.
+ * They are appended to a common TX buffer without NLM_F_ACK and the buffer is
+ * sent in one datagram when it is full, when the batch limit is reached, or
+ * from an event after the current burst of route updates. The kernel
+ * processes all messages from the datagram and replies only for the failed
+ * ones. The last message of each batch is an acknowledged NLMSG_NOOP, which
+ * works as a barrier - once its ACK is received, all replies for the batch
+ * were received, too. Replies are matched to requests by sequence numbers,
+ * which are consecutive within the batch. One batch contains requests of one
+ * kernel protocol, so its batch limit applies.
+ */
+
+struct nl_batch_req
+{
+  struct krt_proto *proto;
+  ip_addr prefix;
+  byte pxlen;
+  int op;
+};
+
+struct nl_batch
+{
+  byte *tx_buffer;			/* Buffer for queued messages */
+  uint tx_pos;				/* Used part of the buffer */
+  struct nl_batch_req *reqs;		/* Queued requests, indexed by seq - seq_first */
+  uint count;				/* Number of queued requests */
+  uint max;				/* Current size of reqs array */
+  int last_failed;			/* The last request of the flushed batch failed */
+  event *flush_event;			/* Event for sending of the batch */
+};
+
+#define NL_TX_SIZE 65536
+#define NL_RX_BUFSIZE (4 << 20)
+
+static struct nl_batch nl_batch;
+
+static void
+nl_batch_reply(struct nlmsghdr *h)
+{
+  struct nl_batch_req *rq = &nl_batch.reqs[h->nlmsg_seq - nl_req.seq_first];
+  int delete = (rq->op == NL_OP_DELETE);
+
+  /* Ignore missing for DELETE, failed DELETE does not affect sync state */
+  if (!nl_error(h, delete) || delete)
+    return;
+
+  /* The barrier has the last sequence number */
+  if (h->nlmsg_seq == nl_req.seq - 1)
+    nl_batch.last_failed = 1;
+
+  net *n = net_find(rq->proto->p.table, rq->prefix, rq->pxlen);
+  if (n)
+    n->n.flags |= KRF_SYNC_ERROR;
+}
+
+static void
+nl_batch_overrun(void)
+{
+  /* We do not know which requests failed, so we expect the worst */
+  nl_batch.last_failed = 1;
+  for (uint i = 0; i < nl_batch.count; i++)
+    {
+      struct nl_batch_req *rq = &nl_batch.reqs[i];
+      net *n = (rq->op != NL_OP_DELETE) ? net_find(rq->proto->p.table, rq->prefix, rq->pxlen) : NULL;
+      if (n)
+	n->n.flags |= KRF_SYNC_ERROR;
+    }
+}
+
+static void
+nl_batch_flush(void)
+{
+  struct nlmsghdr *h;
+
+  if (!nl_batch.count)
+    return;
+
+  /* Append the barrier message */
+  h = (void *) (nl_batch.tx_buffer + nl_batch.tx_pos);
+  bzero(h, sizeof(struct nlmsghdr));
+  h->nlmsg_type = NLMSG_NOOP;
+  h->nlmsg_len = NLMSG_LENGTH(0);
+  h->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  h->nlmsg_seq = ++nl_req.seq;
+  nl_batch.tx_pos += NLMSG_ALIGN(h->nlmsg_len);
+
+  struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+  if (sendto(nl_req.fd, nl_batch.tx_buffer, nl_batch.tx_pos, 0, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+    die("rtnetlink sendto: %m");
+  nl_req.last_hdr = NULL;
+
+  DBG("nl_batch_flush: %u requests, %u bytes\n", nl_batch.count, nl_batch.tx_pos);
+
+  for (;;)
+    {
+      h = nl_get_reply(&nl_req);
+
+      if (!h)
+	{
+	  log(L_WARN "Netlink: Kernel dropped some replies, will resync on next scan");
+	  nl_batch_overrun();
+	  break;
+	}
+
+      if (h->nlmsg_type != NLMSG_ERROR)
+	log(L_WARN "nl_batch_flush: Unexpected reply received");
+      else if (h->nlmsg_seq == nl_req.seq)
+	break;
+      else
+	nl_batch_reply(h);
+    }
+
+  nl_batch.tx_pos = 0;
+  nl_batch.count = 0;
+  ev_postpone(nl_batch.flush_event);
+}
+
+static void
+nl_batch_flush_hook(void *data UNUSED)
+{
+  nl_batch_flush();
+}
+
+static int
+nl_batch_add(struct krt_proto *p, net *net, struct nlmsghdr *pkt, int op)
+{
+  uint len = NLMSG_ALIGN(pkt->nlmsg_len);
+  uint room = NL_TX_SIZE - NLMSG_ALIGN(NLMSG_LENGTH(0));
+
+  /* Too large messages are sent the old way */
+  if (len > room)
+    return nl_exchange(pkt, (op == NL_OP_DELETE));
+
+  if ((nl_batch.tx_pos + len > room) || (nl_batch.count >= KRT_CF->sys.batch_limit) ||
+      (nl_batch.count && (nl_batch.reqs[0].proto != p)))
+    nl_batch_flush();
+
+  if (!nl_batch.count)
+    {
+      nl_req.seq_first = nl_req.seq + 1;
+      ev_schedule(nl_batch.flush_event);
+    }
+
+  if (nl_batch.count == nl_batch.max)
+    {
+      nl_batch.max = nl_batch.max ? 2 * nl_batch.max : 64;
+      nl_batch.reqs = xrealloc(nl_batch.reqs, nl_batch.max * sizeof(struct nl_batch_req));
+    }
+
+  struct nl_batch_req *rq = &nl_batch.reqs[nl_batch.count++];
+  rq->proto = p;
+  rq->prefix = net->n.prefix;
+  rq->pxlen = net->n.pxlen;
+  rq->op = op;
+
+  pkt->nlmsg_pid = 0;
+  pkt->nlmsg_seq = ++nl_req.seq;
+  pkt->nlmsg_flags &= ~NLM_F_ACK;
+  memcpy(nl_batch.tx_buffer + nl_batch.tx_pos, pkt, pkt->nlmsg_len);
+  nl_batch.tx_pos += len;
+
+  return 0;
+}
+
+/*
+ * Send the batch immediately and report whether its last request failed.
+ * Used when following requests depend on the result of the last one.
+ */
+static int
+nl_batch_sync(void)
+{
+  nl_batch.last_failed = 0;
+  nl_batch_flush();
+
+  return nl_batch.last_failed ? -1 : 0;
+}
+
+static void
+nl_batch_init(void)
+{
+  int one = 1, rcvbuf = NL_RX_BUFSIZE;
+
+  if (nl_batch.tx_buffer)
+    return;
+
+  nl_batch.tx_buffer = xmalloc(NL_TX_SIZE);
+  nl_batch.flush_event = ev_new_set(&root_pool, nl_batch_flush_hook, NULL);
+
+  /*
+   * Failed requests are answered with errors that are received only when the
+   * whole batch is processed, so we need a large receive buffer. Also, we do
+   * not need copies of failed requests in these errors.
+   */
+  if ((setsockopt(nl_req.fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0) &&
+      (setsockopt(nl_req.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0))
+    log(L_WARN "Netlink: Cannot set receive buffer size: %m");
+
+  setsockopt(nl_req.fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+}
+
 /*
  *	Netlink attributes
  */
@@ -947,7 +1163,6 @@ nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int op, int d
     struct rtmsg r;
     char buf[0];
   } *r;
-  struct iface* i;
 
   uint rsize = sizeof(*r) + 128 + KRT_METRICS_MAX*8 + nh_bufsize(a->nexthops);
   r = alloca(rsize);
@@ -1026,15 +1241,14 @@ dest:
     {
     case RTD_ROUTER:
       r->r.rtm_type = RTN_UNICAST;
-      if ((ea = ea_find(eattrs, EA_KRT_TUNNEL)) &&
-          (nh = ea_find(eattrs, EA_CODE(EAP_BGP, BA_NEXT_HOP))) &&
-          (i = if_find_by_name(ea->u.ptr->data)))
+      if ((ea = ea_find(eattrs, EA_KRT_TUNNEL_INDEX)) &&
+          (nh = ea_find(eattrs, EA_CODE(EAP_BGP, BA_NEXT_HOP))))
       {
         /*
          * Tunnel attribute is set, so set the route up using the specified tunnel device
-         * to the originator of the route.
+         * to the originator of the route. The device was resolved by krt_resolve_tunnel().
          */
-        nl_add_attr_u32(&r->h, rsize, RTA_OIF, i->index);
+        nl_add_attr_u32(&r->h, rsize, RTA_OIF, ea->u.data);
         nl_add_attr_ipa(&r->h, rsize, RTA_GATEWAY, *(ip_addr *)(nh->u.ptr->data));
         r->r.rtm_flags |= RTNH_F_ONLINK;
       }
@@ -1067,6 +1281,13 @@ dest:
       bug("krt_capable inconsistent with nl_send_route");
     }
 
+  /*
+   * Repeated DELETE for IPv6 ECMP routes needs result of each request, so it
+   * is always done synchronously.
+   */
+  if (KRT_CF->sys.batch && !(krt_ecmp6(p) && (op == NL_OP_DELETE)))
+    return nl_batch_add(p, net, &r->h, op);
+
   /* Ignore missing for DELETE */
   return nl_exchange(&r->h, (op == NL_OP_DELETE));
 }
@@ -1082,6 +1303,11 @@ nl_add_rte(struct krt_proto *p, rte *e, struct ea_list *eattrs)
     struct mpnh *nh = a->nexthops;
 
     err = nl_send_route(p, e, eattrs, NL_OP_ADD, RTD_ROUTER, nh->gw, nh->iface);
+
+    /* APPENDs must not be sent when the ADD failed, so we need its result */
+    if (!err && KRT_CF->sys.batch)
+      err = nl_batch_sync();
+
     if (err < 0)
       return err;
 
@@ -1294,7 +1520,7 @@ nl_parse_route(struct nl_parse_state *s, struct nlmsghdr *h)
       return;
 
     case RTPROT_BIRD:
-      if (!s->scan)
+      if (!s->scan && !KRT_CF->async_scan)
 	SKIP("echo\n");
       src = KRT_SRC_BIRD;
       break;
@@ -1315,6 +1541,13 @@ nl_parse_route(struct nl_parse_state *s, struct nlmsghdr *h)
   ra->scope = SCOPE_UNIVERSE;
   ra->cast = RTC_UNICAST;
 
+  /* Removal of our route is just noted in the shadow table, skip the rest */
+  if (!new && (src == KRT_SRC_BIRD))
+    {
+      ra->dest = RTD_NONE;
+      goto done;
+    }
+
   switch (i->rtm_type)
     {
     case RTN_UNICAST:
@@ -1469,6 +1702,7 @@ nl_parse_route(struct nl_parse_state *s, struct nlmsghdr *h)
    * always the first case for them.
    */
 
+done:
   if (!s->net)
   {
     /* Store the new route */
@@ -1502,6 +1736,9 @@ krt_do_scan(struct krt_proto *p UNUSED)	/* CONFIG_ALL_TABLES_AT_ONCE => p is NUL
   struct nlmsghdr *h;
   struct nl_parse_state s;
 
+  /* Scan must see the results of all requests */
+  nl_batch_flush();
+
   nl_parse_begin(&s, 1, krt_ecmp6(p));
 
   nl_request_dump(BIRD_AF, RTM_GETROUTE);
@@ -1574,10 +1811,11 @@ nl_async_hook(sock *sk, uint size UNUSED)
 	{
 	  /*
 	   *  Netlink reports some packets have been thrown away.
-	   *  One day we might react to it by asking for route table
-	   *  scan in near future.
+	   *  Shadow tables are no longer reliable, so we ask for
+	   *  full route table scan.
 	   */
 	  log(L_WARN "Kernel dropped some netlink messages, will resync on next scan.");
+	  krt_async_overflow();
 	  return 1;	/* More data are likely to be ready */
 	}
       else if (errno != EWOULDBLOCK)
@@ -1645,6 +1883,12 @@ nl_open_async(void)
       return;
     }
 
+  /* Shadow tables need all route notifications, so use a large buffer */
+  int rcvbuf = NL_RX_BUFSIZE;
+  if ((setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0) &&
+      (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0))
+    log(L_WARN "Unable to enlarge asynchronous rtnetlink socket buffer: %m");
+
   nl_async_rx_buffer = xmalloc(NL_RX_SIZE);
 
   sk = nl_async_sk = sk_new(krt_pool);
@@ -1661,6 +1905,17 @@ nl_open_async(void)
  *	Interface to the UNIX krt module
  */
 
+void
+krt_sys_drain_async(void)
+{
+  /* Let the kernel process our pending requests and read all notifications */
+  nl_batch_flush();
+
+  if (nl_async_sk)
+    while (nl_async_hook(nl_async_sk, 0) > 0)
+      ;
+}
+
 void
 krt_sys_io_init(void)
 {
@@ -1685,18 +1940,27 @@ krt_sys_start(struct krt_proto *p)
   nl_open();
   nl_open_async();
 
+  if (KRT_CF->sys.batch)
+    nl_batch_init();
+
   return 1;
 }
 
 void
 krt_sys_shutdown(struct krt_proto *p)
 {
+  /* Queued requests may refer to the protocol */
+  nl_batch_flush();
+
   HASH_REMOVE2(nl_table_map, RTH, krt_pool, p);
 }
 
 int
 krt_sys_reconfigure(struct krt_proto *p UNUSED, struct krt_config *n, struct krt_config *o)
 {
+  if (n->sys.batch)
+    nl_batch_init();
+
   return (n->sys.table_id == o->sys.table_id) && (n->sys.metric == o->sys.metric);
 }
 
@@ -1705,6 +1969,8 @@ krt_sys_init_config(struct krt_config *cf)
 {
   cf->sys.table_id = RT_TABLE_MAIN;
   cf->sys.metric = 0;
+  cf->sys.batch = 0;
+  cf->sys.batch_limit = KRT_DEFAULT_BATCH_LIMIT;
 }
 
 void
@@ -1712,6 +1978,8 @@ krt_sys_copy_config(struct krt_config *d, struct krt_config *s)
 {
   d->sys.table_id = s->sys.table_id;
   d->sys.metric = s->sys.metric;
+  d->sys.batch = s->sys.batch;
+  d->sys.batch_limit = s->sys.batch_limit;
 }
 
 static const char *krt_metrics_names[KRT_METRICS_MAX] = {
@@ -44,6 +44,10 @@
 #include "lib/unix.h"
 #include "lib/sysio.h"
 
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+
 /* Maximum number of calls of tx handler for one socket in one
  * poll iteration. Should be small enough to not monopolize CPU by
  * one protocol instance.
@@ -133,16 +137,36 @@ rf_fileno(struct rfile *f)
  * Each timer is described by a &timer structure containing a pointer
  * to the handler function (@hook), data private to this function (@data),
  * time the function should be called at (@expires, 0 for inactive timers),
- * for the other fields see |timer.h|.
+ * for the other fields see |timer.h|. Internally, timers expire with
+ * microsecond precision (@when), tm_start_btime() may be used to start
+ * a timer with a timeout shorter than a second.
+ *
+ * Active timers are kept in a hierarchical timing wheel, so starting and
+ * stopping a timer takes constant time. The wheel moves in ticks of
+ * about one millisecond (%TW_TICK_BITS). Each of its %TW_LEVELS levels has
+ * %TW_SIZE slots, a slot on level @l covers %TW_SIZE^@l ticks. A timer is
+ * put on the lowest level where its expiration tick shares the covering
+ * slot of the next level with the current tick of the wheel. When the
+ * wheel reaches a slot of a higher level, the timers from the slot are
+ * cascaded to lower levels. Timers too far for the wheel are kept in
+ * an overflow list, which is cascaded when the top level wraps around.
  */
 
-#define NEAR_TIMER_LIMIT 4
+#define TW_TICK_BITS	10		/* One tick is 1024 us */
+#define TW_BITS		6
+#define TW_SIZE		(1 << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	5		/* Covers 2^40 us, almost 13 days */
+#define TW_INFINITY	((btime) 0x7fffffffffffffffLL)
 
-static list near_timers, far_timers;
-static bird_clock_t first_far_timer = TIME_INFINITY;
+static list tw_slots[TW_LEVELS][TW_SIZE];
+static u64 tw_used[TW_LEVELS];		/* Bitmaps of slots that may be non-empty */
+static list tw_overflow;		/* Timers beyond the wheel */
+static u64 tw_tick;			/* Current tick, processed up to tm_now */
 
 /* now must be different from 0, because 0 is a special value in timer->expires */
 bird_clock_t now = 1, now_real, boot_time;
+static btime tm_now = 1 S;		/* Current time in usec, corresponds to @now */
 
 static void
 update_times_plain(void)
@@ -156,6 +180,7 @@ update_times_plain(void)
    log(L_WARN "Time jump, delta %d s", delta);
 
   now_real = new_time;
+  tm_now = (btime) now S;
 }
 
 static void
@@ -175,6 +200,8 @@ update_times_gettime(void)
     now = ts.tv_sec;
     now_real = time(NULL);
   }
+
+  tm_now = ((s64) ts.tv_sec S) + (ts.tv_nsec / 1000);
 }
 
 static int clock_monotonic_available;
@@ -197,6 +224,29 @@ init_times(void)
    log(L_WARN "Monotonic timer is missing");
 }
 
+/**
+ * tm_monotonic_time - read the monotonic clock
+ *
+ * This function returns the current value of the monotonic clock in
+ * microseconds. Unlike @now, which is updated once per main loop
+ * iteration, the clock is read directly, so it may be used to measure
+ * time spent inside one event. When the monotonic clock is not available,
+ * it falls back to @now with one-second resolution.
+ */
+btime
+tm_monotonic_time(void)
+{
+  struct timespec ts;
+
+  if (!clock_monotonic_available)
+    return (btime) now S;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+    die("clock_gettime: %m");
+
+  return ((s64) ts.tv_sec S) + (ts.tv_nsec / 1000);
+}
+
 
 static void
 tm_free(resource *r)
@@ -217,7 +267,7 @@ tm_dump(resource *r)
   if (t->recurrent)
     debug("recur %d, ", t->recurrent);
   if (t->expires)
-    debug("expires in %d sec)\n", t->expires - now);
+    debug("expires in %d ms)\n", (int) ((t->when - tm_now) TO_MS));
   else
     debug("inactive)\n");
 }
@@ -246,14 +296,71 @@ tm_new(pool *p)
   return t;
 }
 
-static inline void
-tm_insert_near(timer *t)
+static void
+tw_insert(timer *t)
+{
+  u64 tick = MAX((u64) (t->when >> TW_TICK_BITS), tw_tick);
+  u64 diff = tick ^ tw_tick;
+  int level = diff ? ((63 - __builtin_clzll(diff)) / TW_BITS) : 0;
+
+  if (level >= TW_LEVELS)
+  {
+    add_tail(&tw_overflow, &t->n);
+    return;
+  }
+
+  uint slot = (tick >> (level * TW_BITS)) & TW_MASK;
+  add_tail(&tw_slots[level][slot], &t->n);
+  tw_used[level] |= 1ULL << slot;
+}
+
+/* Move timers of the current slot on @level (or the overflow list) to lower levels */
+static void
+tw_cascade(int level)
+{
+  list *l = &tw_overflow;
+  list tmp;
+  node *n, *nxt;
+
+  if (level < TW_LEVELS)
+  {
+    uint slot = (tw_tick >> (level * TW_BITS)) & TW_MASK;
+    l = &tw_slots[level][slot];
+    tw_used[level] &= ~(1ULL << slot);
+  }
+
+  if (EMPTY_LIST(*l))
+    return;
+
+  /* Timers from the overflow list may return there */
+  init_list(&tmp);
+  add_tail_list(&tmp, l);
+  init_list(l);
+
+  WALK_LIST_DELSAFE(n, nxt, tmp)
+  {
+    rem_node(n);
+    tw_insert(SKIP_BACK(timer, n, n));
+  }
+}
+
+/**
+ * tm_start_btime - start a timer with microsecond precision
+ * @t: timer
+ * @after: time in microseconds the timer should be run after
+ *
+ * This function works like tm_start(), but @after is given in microseconds
+ * and the @randomize field is not used.
+ */
+void
+tm_start_btime(timer *t, btime after)
 {
-  node *n = HEAD(near_timers);
+  if (t->expires)
+    rem_node(&t->n);
 
-  while (n->next && (SKIP_BACK(timer, n, n)->expires < t->expires))
-    n = n->next;
-  insert_node(&t->n, n->prev);
+  t->when = tm_now + MAX(after, 0);
+  t->expires = MAX((bird_clock_t) (t->when TO_S), 1);
+  tw_insert(t);
 }
 
 /**
@@ -266,8 +373,8 @@ tm_insert_near(timer *t)
  * started, it's @expire time is replaced by the new value.
  *
  * You can have set the @randomize field of @t, the timeout
- * will be increased by a random number of seconds chosen
- * uniformly from range 0 .. @randomize.
+ * will be increased by a random time chosen uniformly
+ * from range 0 .. @randomize seconds (with millisecond granularity).
  *
  * You can call tm_start() from the handler function of the timer
  * to request another run of the timer. Also, you can set the @recurrent
@@ -276,24 +383,12 @@ tm_insert_near(timer *t)
 void
 tm_start(timer *t, unsigned after)
 {
-  bird_clock_t when;
+  btime when = (btime) after S;
 
   if (t->randomize)
-    after += random() % (t->randomize + 1);
-  when = now + after;
-  if (t->expires == when)
-    return;
-  if (t->expires)
-    rem_node(&t->n);
-  t->expires = when;
-  if (after <= NEAR_TIMER_LIMIT)
-    tm_insert_near(t);
-  else
-    {
-      if (!first_far_timer || first_far_timer > when)
-	first_far_timer = when;
-      add_tail(&far_timers, &t->n);
-    }
+    when += (random() % (t->randomize * 1000 + 1)) MS;
+
+  tm_start_btime(t, when);
 }
 
 /**
@@ -319,6 +414,9 @@ tm_dump_them(char *name, list *l)
   node *n;
   timer *t;
 
+  if (EMPTY_LIST(*l))
+    return;
+
   debug("%s timers:\n", name);
   WALK_LIST(n, *l)
     {
@@ -332,22 +430,70 @@ tm_dump_them(char *name, list *l)
 void
 tm_dump_all(void)
 {
-  tm_dump_them("Near", &near_timers);
-  tm_dump_them("Far", &far_timers);
+  char name[16];
+  int i, j;
+
+  for (i = 0; i < TW_LEVELS; i++)
+    for (j = 0; j < TW_SIZE; j++)
+    {
+      bsprintf(name, "Level %d/%d", i, j);
+      tm_dump_them(name, &tw_slots[i][j]);
+    }
+
+  tm_dump_them("Overflow", &tw_overflow);
 }
 
-static inline time_t
+/* Returns the expiration time of the first timer, or an earlier time when
+   the wheel has to cascade timers from a higher level */
+static inline btime
 tm_first_shot(void)
 {
-  time_t x = first_far_timer;
+  int level;
 
-  if (!EMPTY_LIST(near_timers))
+  for (level = 0; level < TW_LEVELS; level++)
+  {
+    uint pos = (tw_tick >> (level * TW_BITS)) & TW_MASK;
+
+    /* Slots at the current position are already cascaded on higher levels */
+    u64 used = tw_used[level] & (~0ULL << pos);
+    if (level)
+      used &= ~(1ULL << pos);
+
+    while (used)
     {
-      timer *t = SKIP_BACK(timer, n, HEAD(near_timers));
-      if (t->expires < x)
-	x = t->expires;
+      uint slot = __builtin_ctzll(used);
+      list *l = &tw_slots[level][slot];
+
+      if (EMPTY_LIST(*l))
+      {
+	tw_used[level] &= ~(1ULL << slot);
+	used &= ~(1ULL << slot);
+	continue;
+      }
+
+      /* Replace the level index of the current tick with the slot */
+      uint shift = level * TW_BITS;
+      u64 tick = (tw_tick & ~((u64) TW_MASK << shift)) | ((u64) slot << shift);
+
+      if (level)
+	return (btime) ((tick >> shift) << shift) << TW_TICK_BITS;
+
+      /* Timers on the first level are few, find the exact time */
+      btime first = TW_INFINITY;
+      node *n;
+      WALK_LIST(n, *l)
+	first = MIN(first, SKIP_BACK(timer, n, n)->when);
+      return first;
     }
-  return x;
+  }
+
+  if (!EMPTY_LIST(tw_overflow))
+  {
+    uint shift = TW_LEVELS * TW_BITS;
+    return (btime) (((tw_tick >> shift) + 1) << shift) << TW_TICK_BITS;
+  }
+
+  return TW_INFINITY;
 }
 
 void io_log_event(void *hook, void *data);
@@ -355,48 +501,80 @@ void io_log_event(void *hook, void *data);
 static void
 tm_shot(void)
 {
+  u64 tick = tm_now >> TW_TICK_BITS;
+  list expired;
+  node *n, *nxt;
   timer *t;
-  node *n, *m;
+  int level;
+
+  init_list(&expired);
 
-  if (first_far_timer <= now)
+  for (;;)
     {
-      bird_clock_t limit = now + NEAR_TIMER_LIMIT;
-      first_far_timer = TIME_INFINITY;
-      n = HEAD(far_timers);
-      while (m = n->next)
+      uint slot = tw_tick & TW_MASK;
+
+      if (tw_used[0] & (1ULL << slot))
 	{
-	  t = SKIP_BACK(timer, n, n);
-	  if (t->expires <= limit)
-	    {
-	      rem_node(n);
-	      tm_insert_near(t);
-	    }
-	  else if (t->expires < first_far_timer)
-	    first_far_timer = t->expires;
-	  n = m;
+	  list *l = &tw_slots[0][slot];
+
+	  WALK_LIST_DELSAFE(n, nxt, *l)
+	    if (SKIP_BACK(timer, n, n)->when <= tm_now)
+	      {
+		rem_node(n);
+		add_tail(&expired, n);
+	      }
+
+	  if (EMPTY_LIST(*l))
+	    tw_used[0] &= ~(1ULL << slot);
 	}
+
+      if (tw_tick >= tick)
+	break;
+
+      /* Skip empty slots up to the end of the first level */
+      u64 used = tw_used[0] & (~0ULL << slot) & ~(1ULL << slot);
+      uint next = used ? __builtin_ctzll(used) : TW_SIZE;
+      tw_tick += MIN(next - slot, tick - tw_tick);
+
+      /* Cascade timers from higher levels whose slots we have entered */
+      for (level = TW_LEVELS; level > 0; level--)
+	if (!(tw_tick & ((1ULL << (level * TW_BITS)) - 1)))
+	  break;
+
+      for (; level > 0; level--)
+	tw_cascade(level);
     }
-  while ((n = HEAD(near_timers)) -> next)
+
+  while ((n = HEAD(expired))->next)
     {
-      int delay;
       t = SKIP_BACK(timer, n, n);
-      if (t->expires > now)
-	break;
       rem_node(n);
-      delay = t->expires - now;
       t->expires = 0;
       if (t->recurrent)
 	{
-	  int i = t->recurrent - delay;
-	  if (i < 0)
-	    i = 0;
-	  tm_start(t, i);
+	  /* Keep the period, we may run late */
+	  btime delay = tm_now - t->when;
+	  tm_start_btime(t, (btime) t->recurrent S - delay);
 	}
       io_log_event(t->hook, t->data);
       t->hook(t);
     }
 }
 
+/* Called when the time is known, before any timer is started */
+static void
+tm_init(void)
+{
+  int i, j;
+
+  for (i = 0; i < TW_LEVELS; i++)
+    for (j = 0; j < TW_SIZE; j++)
+      init_list(&tw_slots[i][j]);
+
+  init_list(&tw_overflow);
+  tw_tick = tm_now >> TW_TICK_BITS;
+}
+
 /**
  * tm_parse_datetime - parse a date and time
  * @x: datetime string
@@ -1074,6 +1252,83 @@ sk_next(sock *s)
     return SKIP_BACK(sock, n, s->n.next);
 }
 
+#ifdef CONFIG_EPOLL
+
+/*
+ * With epoll, sockets are registered persistently and the registration is
+ * changed only when the set of events we wait for changes. These events
+ * depend on rx_hook and tx_hook, which are assigned directly by protocols,
+ * so sockets which may start waiting for more events without our notice
+ * (no rx_hook, or unsent data but no tx_hook) are kept in the io_parked
+ * list and rechecked before each epoll_wait().
+ */
+
+static int io_epoll_fd = -1;
+static list io_parked;			/* Sockets with incomplete set of events */
+static list io_rx_queue;		/* Sockets waiting for slow RX */
+static struct epoll_event *io_ready;	/* Events returned by the last epoll_wait() */
+static int io_ready_num, io_ready_max;
+
+static void
+sk_update_events(sock *s)
+{
+  /* Sockets of other threads (e.g. BFD) are polled by their own loops */
+  if (s->flags & SKF_THREAD)
+    return;
+
+  /* Socket is not in sock_list (not opened yet or already freed) */
+  if (!s->n.next)
+    return;
+
+  int pending = (s->ttx != s->tpos);
+  uint events = (s->rx_hook ? EPOLLIN : 0) | ((s->tx_hook && pending) ? EPOLLOUT : 0);
+
+  if (events != s->io_events)
+  {
+    /* Without any events, the socket must be removed, as errors are reported anyway */
+    struct epoll_event ev = { .events = events, .data.ptr = s };
+    int op = !s->io_events ? EPOLL_CTL_ADD : events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+
+    if (epoll_ctl(io_epoll_fd, op, s->fd, &ev) < 0)
+      die("epoll_ctl: %m");
+
+    s->io_events = events;
+  }
+
+  int parked = !s->rx_hook || (!s->tx_hook && pending);
+  if (parked && !s->io_parked_node.next)
+    add_tail(&io_parked, &s->io_parked_node);
+  else if (!parked && s->io_parked_node.next)
+    rem_node(&s->io_parked_node);
+}
+
+static void
+sk_forget_events(sock *s)
+{
+  int i;
+
+  if (s->flags & SKF_THREAD)
+    return;
+
+  if (s->io_parked_node.next)
+    rem_node(&s->io_parked_node);
+
+  if (s->io_rx_node.next)
+    rem_node(&s->io_rx_node);
+
+  /* Epoll registration is removed by close(), but s may still wait in io_ready */
+  for (i = 0; i < io_ready_num; i++)
+    if (io_ready[i].data.ptr == s)
+      io_ready[i].data.ptr = NULL;
+}
+
+#else
+
+static inline void sk_update_events(sock *s UNUSED) { }
+static inline void sk_forget_events(sock *s UNUSED) { }
+
+#endif
+
 static void
 sk_alloc_bufs(sock *s)
 {
@@ -1118,6 +1373,7 @@ sk_free(resource *r)
       current_sock = sk_next(s);
     if (s == stored_sock)
       stored_sock = sk_next(s);
+    sk_forget_events(s);
     rem_node(&s->n);
   }
 }
@@ -1136,6 +1392,21 @@ sk_set_rbsize(sock *s, uint val)
   s->rpos = s->rbuf = s->rbuf_alloc;
 }
 
+void
+sk_grow_rbsize(sock *s, uint val)
+{
+  ASSERT(s->rbuf_alloc == s->rbuf);
+
+  if (s->rbsize >= val)
+    return;
+
+  byte *old_rbuf = s->rbuf;
+
+  s->rbsize = val;
+  s->rbuf = s->rbuf_alloc = xrealloc(s->rbuf_alloc, val);
+  s->rpos = s->rbuf + (s->rpos - old_rbuf);
+}
+
 void
 sk_set_tbsize(sock *s, uint val)
 {
@@ -1329,6 +1600,7 @@ static void
 sk_insert(sock *s)
 {
   add_tail(&sock_list, &s->n);
+  sk_update_events(s);
 }
 
 static void
@@ -1680,7 +1952,7 @@ sk_recvmsg(sock *s)
 static inline void reset_tx_buffer(sock *s) { s->ttx = s->tpos = s->tbuf; }
 
 static int
-sk_maybe_write(sock *s)
+sk_do_write(sock *s)
 {
   int e;
 
@@ -1691,6 +1963,11 @@ sk_maybe_write(sock *s)
   case SK_UNIX:
     while (s->ttx != s->tpos)
     {
+#ifdef MSG_MORE
+      if ((s->type == SK_TCP) && (s->flags & SKF_TX_MORE))
+	e = send(s->fd, s->ttx, s->tpos - s->ttx, MSG_MORE);
+      else
+#endif
       e = write(s->fd, s->ttx, s->tpos - s->ttx);
 
       if (e < 0)
@@ -1738,6 +2015,18 @@ sk_maybe_write(sock *s)
   }
 }
 
+static int
+sk_maybe_write(sock *s)
+{
+  int rv = sk_do_write(s);
+
+  /* After an error, the socket may have been freed by err_hook */
+  if (rv >= 0)
+    sk_update_events(s);
+
+  return rv;
+}
+
 int
 sk_rx_ready(sock *s)
 {
@@ -2100,33 +2389,337 @@ volatile int async_config_flag;		/* Asynchronous reconfiguration/dump scheduled
 volatile int async_dump_flag;
 volatile int async_shutdown_flag;
 
+static int short_loops = 0;
+#define SHORT_LOOP_MAX 10
+
+/*
+ * Socket event backends: io_wait_init() prepares the backend, io_prepare()
+ * is called before each wait to collect events we are interested in,
+ * io_wait() waits for them and io_dispatch() calls socket hooks for ready
+ * sockets. Both backends follow the same rules - fast RX and TX hooks are
+ * called for all ready sockets (at most MAX_STEPS times), other RX hooks
+ * only for MAX_RX_STEPS sockets and not in short loops.
+ */
+
+#ifdef CONFIG_EPOLL
+
+static void
+io_wait_init(void)
+{
+  init_list(&io_parked);
+  init_list(&io_rx_queue);
+
+  io_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (io_epoll_fd < 0)
+    die("epoll_create: %m");
+
+  io_ready_max = 256;
+  io_ready = xmalloc(io_ready_max * sizeof(struct epoll_event));
+}
+
+static void
+io_prepare(void)
+{
+  node *n, *nxt;
+
+  WALK_LIST_DELSAFE(n, nxt, io_parked)
+    sk_update_events(SKIP_BACK(sock, io_parked_node, n));
+}
+
+static int
+io_wait(int timeout)
+{
+  /* Keep room for more events, the rest is reported by the next call */
+  if (io_ready_num == io_ready_max)
+  {
+    io_ready_max *= 2;
+    io_ready = xrealloc(io_ready, io_ready_max * sizeof(struct epoll_event));
+  }
+
+  io_ready_num = 0;
+  int pout = epoll_wait(io_epoll_fd, io_ready, io_ready_max, timeout);
+
+  if (pout < 0)
+  {
+    if (errno == EINTR || errno == EAGAIN)
+      return 0;
+    die("epoll_wait: %m");
+  }
+
+  io_ready_num = pout;
+  return pout;
+}
+
+/* Note that epoll event flags have the same values as poll ones */
+static void
+io_dispatch(int events)
+{
+  int i, e, steps;
+
+  for (i = 0; i < io_ready_num; i++)
+  {
+    sock *s = current_sock = io_ready[i].data.ptr;
+    uint revents = io_ready[i].events;
+
+    if (!s)
+      continue;
+
+    steps = MAX_STEPS;
+    if (s->fast_rx && (revents & POLLIN) && s->rx_hook)
+      do
+      {
+	steps--;
+	io_log_event(s->rx_hook, s->data);
+	e = sk_read(s, revents);
+	if (s != current_sock)
+	  goto next;
+      }
+      while (e && s->rx_hook && steps);
+
+    steps = MAX_STEPS;
+    if (revents & POLLOUT)
+      do
+      {
+	steps--;
+	io_log_event(s->tx_hook, s->data);
+	e = sk_write(s);
+	if (s != current_sock)
+	  goto next;
+      }
+      while (e && steps);
+
+    sk_update_events(s);
+  next: ;
+  }
+
+  current_sock = NULL;
+
+  short_loops++;
+  if (events && (short_loops < SHORT_LOOP_MAX))
+    return;
+  short_loops = 0;
+
+  /* Ready sockets wait in FIFO order, sockets not served now are served first next time */
+  for (i = 0; i < io_ready_num; i++)
+  {
+    sock *s = io_ready[i].data.ptr;
+
+    if (s && !s->fast_rx && (io_ready[i].events & POLLIN) && s->rx_hook && !s->io_rx_node.next)
+      add_tail(&io_rx_queue, &s->io_rx_node);
+  }
+
+  int count = 0;
+  while (!EMPTY_LIST(io_rx_queue) && (count < MAX_RX_STEPS))
+  {
+    sock *s = current_sock = SKIP_BACK(sock, io_rx_node, HEAD(io_rx_queue));
+    rem_node(&s->io_rx_node);
+
+    if (!s->rx_hook)
+      continue;
+
+    count++;
+    io_log_event(s->rx_hook, s->data);
+    sk_read(s, POLLIN);
+    if (s == current_sock)
+      sk_update_events(s);
+  }
+
+  /* Errors of sockets still waiting for RX are handled after their data */
+  for (i = 0; i < io_ready_num; i++)
+  {
+    sock *s = current_sock = io_ready[i].data.ptr;
+    uint revents = io_ready[i].events;
+
+    if (s && (revents & (POLLHUP | POLLERR)) && !s->io_rx_node.next)
+    {
+      sk_err(s, revents);
+      if (s == current_sock)
+	sk_update_events(s);
+    }
+  }
+
+  current_sock = NULL;
+}
+
+#else
+
+static struct pollfd *io_pfd;		/* Poll buffer, see sock->index */
+static int io_pfd_num, io_pfd_max;
+
+static void
+io_wait_init(void)
+{
+  io_pfd_max = 256;
+  io_pfd = xmalloc(io_pfd_max * sizeof(struct pollfd));
+}
+
+static void
+io_prepare(void)
+{
+  struct pollfd *pfd;
+  sock *s;
+  node *n;
+
+  io_pfd_num = 0;
+  WALK_LIST(n, sock_list)
+    {
+      pfd = &io_pfd[io_pfd_num];
+      *pfd = (struct pollfd) { .fd = -1 }; /* everything other set to 0 by this */
+      s = SKIP_BACK(sock, n, n);
+      if (s->rx_hook)
+	{
+	  pfd->fd = s->fd;
+	  pfd->events |= POLLIN;
+	}
+      if (s->tx_hook && s->ttx != s->tpos)
+	{
+	  pfd->fd = s->fd;
+	  pfd->events |= POLLOUT;
+	}
+      if (pfd->fd != -1)
+	{
+	  s->index = io_pfd_num;
+	  io_pfd_num++;
+	}
+      else
+	s->index = -1;
+
+      if (io_pfd_num >= io_pfd_max)
+	{
+	  io_pfd_max *= 2;
+	  io_pfd = xrealloc(io_pfd, io_pfd_max * sizeof(struct pollfd));
+	}
+    }
+}
+
+static int
+io_wait(int timeout)
+{
+  int pout = poll(io_pfd, io_pfd_num, timeout);
+
+  if (pout < 0)
+  {
+    if (errno == EINTR || errno == EAGAIN)
+      return 0;
+    die("poll: %m");
+  }
+
+  return pout;
+}
+
+static void
+io_dispatch(int events)
+{
+  struct pollfd *pfd = io_pfd;
+
+  /* guaranteed to be non-empty */
+  current_sock = SKIP_BACK(sock, n, HEAD(sock_list));
+
+  while (current_sock)
+    {
+      sock *s = current_sock;
+      if (s->index == -1)
+	{
+	  current_sock = sk_next(s);
+	  goto next;
+	}
+
+      int e;
+      int steps;
+
+      steps = MAX_STEPS;
+      if (s->fast_rx && (pfd[s->index].revents & POLLIN) && s->rx_hook)
+	do
+	  {
+	    steps--;
+	    io_log_event(s->rx_hook, s->data);
+	    e = sk_read(s, pfd[s->index].revents);
+	    if (s != current_sock)
+	      goto next;
+	  }
+	while (e && s->rx_hook && steps);
+
+      steps = MAX_STEPS;
+      if (pfd[s->index].revents & POLLOUT)
+	do
+	  {
+	    steps--;
+	    io_log_event(s->tx_hook, s->data);
+	    e = sk_write(s);
+	    if (s != current_sock)
+	      goto next;
+	  }
+	while (e && steps);
+
+      current_sock = sk_next(s);
+    next: ;
+    }
+
+  short_loops++;
+  if (events && (short_loops < SHORT_LOOP_MAX))
+    return;
+  short_loops = 0;
+
+  int count = 0;
+  current_sock = stored_sock;
+  if (current_sock == NULL)
+    current_sock = SKIP_BACK(sock, n, HEAD(sock_list));
+
+  while (current_sock && count < MAX_RX_STEPS)
+    {
+      sock *s = current_sock;
+      if (s->index == -1)
+	{
+	  current_sock = sk_next(s);
+	  goto next2;
+	}
+
+      if (!s->fast_rx && (pfd[s->index].revents & POLLIN) && s->rx_hook)
+	{
+	  count++;
+	  io_log_event(s->rx_hook, s->data);
+	  sk_read(s, pfd[s->index].revents);
+	  if (s != current_sock)
+	    goto next2;
+	}
+
+      if (pfd[s->index].revents & (POLLHUP | POLLERR))
+	{
+	  sk_err(s, pfd[s->index].revents);
+	  if (s != current_sock)
+	    goto next2;
+	}
+
+      current_sock = sk_next(s);
+    next2: ;
+    }
+
+
+  stored_sock = current_sock;
+}
+
+#endif
+
 void
 io_init(void)
 {
-  init_list(&near_timers);
-  init_list(&far_timers);
   init_list(&sock_list);
   init_list(&global_event_list);
+  io_wait_init();
   krt_io_init();
   init_times();
   update_times();
+  tm_init();
   boot_time = now;
   srandom((int) now_real);
 }
 
-static int short_loops = 0;
-#define SHORT_LOOP_MAX 10
-
 void
 io_loop(void)
 {
   int poll_tout;
-  time_t tout;
-  int nfds, events, pout;
-  sock *s;
-  node *n;
-  int fdmax = 256;
-  struct pollfd *pfd = xmalloc(fdmax * sizeof(struct pollfd));
+  btime tout;
+  int events;
 
   watchdog_start1();
   for(;;)
@@ -2135,44 +2728,16 @@ io_loop(void)
     timers:
       update_times();
       tout = tm_first_shot();
-      if (tout <= now)
+      if (tout <= tm_now)
 	{
 	  tm_shot();
 	  goto timers;
 	}
-      poll_tout = (events ? 0 : MIN(tout - now, 3)) * 1000; /* Time in milliseconds */
+      poll_tout = events ? 0 : (MIN(tout - tm_now, 3 S) + 999) TO_MS; /* Time in milliseconds */
 
       io_close_event();
 
-      nfds = 0;
-      WALK_LIST(n, sock_list)
-	{
-	  pfd[nfds] = (struct pollfd) { .fd = -1 }; /* everything other set to 0 by this */
-	  s = SKIP_BACK(sock, n, n);
-	  if (s->rx_hook)
-	    {
-	      pfd[nfds].fd = s->fd;
-	      pfd[nfds].events |= POLLIN;
-	    }
-	  if (s->tx_hook && s->ttx != s->tpos)
-	    {
-	      pfd[nfds].fd = s->fd;
-	      pfd[nfds].events |= POLLOUT;
-	    }
-	  if (pfd[nfds].fd != -1)
-	    {
-	      s->index = nfds;
-	      nfds++;
-	    }
-	  else
-	    s->index = -1;
-
-	  if (nfds >= fdmax)
-	    {
-	      fdmax *= 2;
-	      pfd = xrealloc(pfd, fdmax * sizeof(struct pollfd));
-	    }
-	}
+      io_prepare();
 
       /*
        * Yes, this is racy. But even if the signal comes before this test
@@ -2201,102 +2766,11 @@ io_loop(void)
 
       /* And finally enter poll() to find active sockets */
       watchdog_stop();
-      pout = poll(pfd, nfds, poll_tout);
+      int pout = io_wait(poll_tout);
       watchdog_start();
 
-      if (pout < 0)
-	{
-	  if (errno == EINTR || errno == EAGAIN)
-	    continue;
-	  die("poll: %m");
-	}
       if (pout)
-	{
-	  /* guaranteed to be non-empty */
-	  current_sock = SKIP_BACK(sock, n, HEAD(sock_list));
-
-	  while (current_sock)
-	    {
-	      sock *s = current_sock;
-	      if (s->index == -1)
-		{
-		  current_sock = sk_next(s);
-		  goto next;
-		}
-
-	      int e;
-	      int steps;
-
-	      steps = MAX_STEPS;
-	      if (s->fast_rx && (pfd[s->index].revents & POLLIN) && s->rx_hook)
-		do
-		  {
-		    steps--;
-		    io_log_event(s->rx_hook, s->data);
-		    e = sk_read(s, pfd[s->index].revents);
-		    if (s != current_sock)
-		      goto next;
-		  }
-		while (e && s->rx_hook && steps);
-
-	      steps = MAX_STEPS;
-	      if (pfd[s->index].revents & POLLOUT)
-		do
-		  {
-		    steps--;
-		    io_log_event(s->tx_hook, s->data);
-		    e = sk_write(s);
-		    if (s != current_sock)
-		      goto next;
-		  }
-		while (e && steps);
-
-	      current_sock = sk_next(s);
-	    next: ;
-	    }
-
-	  short_loops++;
-	  if (events && (short_loops < SHORT_LOOP_MAX))
-	    continue;
-	  short_loops = 0;
-
-	  int count = 0;
-	  current_sock = stored_sock;
-	  if (current_sock == NULL)
-	    current_sock = SKIP_BACK(sock, n, HEAD(sock_list));
-
-	  while (current_sock && count < MAX_RX_STEPS)
-	    {
-	      sock *s = current_sock;
-	      if (s->index == -1)
-		{
-		  current_sock = sk_next(s);
-		  goto next2;
-		}
-
-	      if (!s->fast_rx && (pfd[s->index].revents & POLLIN) && s->rx_hook)
-		{
-		  count++;
-		  io_log_event(s->rx_hook, s->data);
-		  sk_read(s, pfd[s->index].revents);
-		  if (s != current_sock)
-		    goto next2;
-		}
-
-	      if (pfd[s->index].revents & (POLLHUP | POLLERR))
-		{
-		  sk_err(s, pfd[s->index].revents);
-		  if (s != current_sock)
-		    goto next2;
-		}
-
-	      current_sock = sk_next(s);
-	    next2: ;
-	    }
-
-
-	  stored_sock = current_sock;
-	}
+	io_dispatch(events);
     }
 }
 
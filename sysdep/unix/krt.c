@@ -600,6 +600,7 @@ krt_flush_routes(struct krt_proto *p)
 	  /* FIXME: this does not work if gw is changed in export filter */
 	  krt_replace_rte(p, e->net, NULL, e, NULL);
 	  n->n.flags &= ~KRF_INSTALLED;
+	  p->installed--;
 	}
     }
   FIB_WALK_END;
@@ -647,6 +648,36 @@ reject:
   return NULL;
 }
 
+/*
+ * Calico-BIRD specific: the export filter may name a tunnel device in the
+ * krt_tunnel attribute. We resolve it once per exported route and prepend
+ * the result as a temporary EA_KRT_TUNNEL_INDEX attribute (stored in @l,
+ * which must have room for KRT_TUNNEL_EA_SIZE bytes), so the sysdep code
+ * does not have to look the interface up again for each message it builds.
+ */
+#define KRT_TUNNEL_EA_SIZE	(sizeof(ea_list) + sizeof(eattr))
+
+static ea_list *
+krt_resolve_tunnel(ea_list *eattrs, ea_list *l)
+{
+  eattr *ea = ea_find(eattrs, EA_KRT_TUNNEL);
+  struct iface *i;
+
+  if (!ea || !(i = if_find_by_name(ea->u.ptr->data)))
+    return eattrs;
+
+  l->next = eattrs;
+  l->flags = EALF_SORTED;
+  l->count = 1;
+
+  l->attrs[0].id = EA_KRT_TUNNEL_INDEX;
+  l->attrs[0].flags = 0;
+  l->attrs[0].type = EAF_TYPE_INT | EAF_TEMP;
+  l->attrs[0].u.data = i->index;
+
+  return l;
+}
+
 static int
 krt_same_dest(rte *k, rte *e)
 {
@@ -677,6 +708,174 @@ krt_same_dest(rte *k, rte *e)
     }
 }
 
+/*
+ *	Shadow table
+ *
+ *  In async scan mode, we keep our routes from the kernel table in a shadow
+ *  table, which is updated from asynchronous notifications. Regular scans then
+ *  just reconcile nets changed in the shadow table or in the routing table (the
+ *  dirty set) instead of dumping the kernel table. The kernel table is dumped
+ *  (and the shadow table rebuilt) only on startup, periodic audit and when the
+ *  kernel reports lost notifications.
+ */
+
+static void
+krt_shadow_init(struct fib_node *N)
+{
+  struct krt_shadow *s = (struct krt_shadow *) N;
+  s->attrs = NULL;
+}
+
+static void
+krt_shadow_flush(struct krt_proto *p)
+{
+  FIB_WALK(&p->shadow, f)
+    {
+      struct krt_shadow *s = (struct krt_shadow *) f;
+      rta_free(s->attrs);
+    }
+  FIB_WALK_END;
+
+  fib_free(&p->shadow);
+  fib_init(&p->shadow, p->p.pool, sizeof(struct krt_shadow), 0, krt_shadow_init);
+}
+
+#ifdef IPV6
+static void
+krt_shadow_add_nexthops(struct mpnh **nhs, rta *a)
+{
+  struct mpnh *nh, *x;
+
+  if (a->dest == RTD_ROUTER)
+    {
+      x = lp_allocz(krt_filter_lp, sizeof(struct mpnh));
+      x->gw = a->gw;
+      x->iface = a->iface;
+      mpnh_insert(nhs, x);
+    }
+
+  if (a->dest == RTD_MULTIPATH)
+    for (nh = a->nexthops; nh; nh = nh->next)
+      {
+	x = lp_alloc(krt_filter_lp, sizeof(struct mpnh));
+	*x = *nh;
+	x->next = NULL;
+	mpnh_insert(nhs, x);
+      }
+}
+
+/*
+ * Older Linux kernels announce IPv6 ECMP routes as a sequence of routes for
+ * the same prefix, so we merge their next hops to the stored route.
+ */
+static int
+krt_shadow_merge(rta *a, rta *o)
+{
+  struct mpnh *nhs = NULL;
+
+  if (((a->dest != RTD_ROUTER) && (a->dest != RTD_MULTIPATH)) ||
+      ((o->dest != RTD_ROUTER) && (o->dest != RTD_MULTIPATH)))
+    return 0;
+
+  krt_shadow_add_nexthops(&nhs, o);
+  krt_shadow_add_nexthops(&nhs, a);
+
+  a->dest = RTD_MULTIPATH;
+  a->nexthops = nhs;
+  return 1;
+}
+#endif
+
+static void
+krt_shadow_update(struct krt_proto *p, rte *e, int new)
+{
+  net *n = e->net;
+  struct krt_shadow *s;
+
+  if (!new)
+    {
+      s = fib_find(&p->shadow, &n->n.prefix, n->n.pxlen);
+      if (s)
+	{
+	  rta_free(s->attrs);
+	  fib_delete(&p->shadow, s);
+	}
+    }
+  else
+    {
+      /* We must not touch the original attributes, they may be used later */
+      rta a = *e->attrs;
+      int merged = 0;
+
+      a.source = RTS_DUMMY;
+      s = fib_get(&p->shadow, &n->n.prefix, n->n.pxlen);
+
+#ifdef IPV6
+      if (s->attrs && (s->metric == e->u.krt.metric))
+	merged = krt_shadow_merge(&a, s->attrs);
+#endif
+
+      rta *old = s->attrs;
+      s->attrs = rta_lookup(&a);
+      s->metric = e->u.krt.metric;
+      s->proto = e->u.krt.proto;
+      rta_free(old);
+
+      if (merged)
+	lp_flush(krt_filter_lp);
+    }
+
+  fib_get(&p->dirty, &n->n.prefix, n->n.pxlen);
+}
+
+static void krt_prune(struct krt_proto *p);
+
+static void
+krt_async_scan(struct krt_proto *p)
+{
+  KRT_TRACE(p, D_EVENTS, "Reconciling with shadow table");
+
+  FIB_WALK(&p->dirty, f)
+    {
+      struct krt_shadow *s = fib_find(&p->shadow, &f->prefix, f->pxlen);
+      if (!s)
+	continue;
+
+      /* Prepare a temporary route just like from the kernel scan */
+      rta a = *s->attrs;
+      a.aflags = 0;
+
+      rte *e = rte_get_temp(&a);
+      e->net = net_get(p->p.table, f->prefix, f->pxlen);
+      e->u.krt.src = KRT_SRC_BIRD;
+      e->u.krt.proto = s->proto;
+      e->u.krt.seen = 0;
+      e->u.krt.best = 0;
+      e->u.krt.metric = s->metric;
+
+      krt_got_route(p, e);
+    }
+  FIB_WALK_END;
+
+  krt_prune(p);
+}
+
+/**
+ * krt_async_overflow - notify about lost notifications
+ *
+ * The back end calls krt_async_overflow() when the kernel drops some of the
+ * asynchronous notifications. Shadow tables are no longer reliable then, so
+ * the next scan has to dump the kernel tables.
+ */
+void
+krt_async_overflow(void)
+{
+  node *n;
+
+  WALK_LIST(n, krt_proto_list)
+    SKIP_BACK(struct krt_proto, krt_node, n)->resync = 1;
+}
+
 /*
  *  This gets called back when the low-level scanning code discovers a route.
  *  We expect that the route is a temporary rte and its attributes are uncached.
@@ -688,6 +887,10 @@ krt_got_route(struct krt_proto *p, rte *e)
   net *net = e->net;
   int verdict;
 
+  /* Dump of the kernel table rebuilds the shadow table */
+  if (KRT_CF->async_scan && !p->async && (e->u.krt.src == KRT_SRC_BIRD))
+    krt_shadow_update(p, e, 1);
+
 #ifdef KRT_ALLOW_LEARN
   switch (e->u.krt.src)
     {
@@ -734,6 +937,16 @@ krt_got_route(struct krt_proto *p, rte *e)
       eattr *ea = NULL;
       struct iface* i = NULL;
 
+      p->seen++;
+
+      if (!p->audit && !(net->n.flags & KRF_SYNC_ERROR) &&
+	  !fib_find(&p->dirty, &net->n.prefix, net->n.pxlen))
+	{
+	  /* Not changed since the last scan, no need to run export filter */
+	  verdict = KRF_SEEN;
+	  goto sentenced;
+	}
+
       new = krt_export_net(p, net, &rt_free, &tmpa);
 
       /* TODO: There also may be changes in route eattrs, we ignore that for now. */
@@ -774,6 +987,7 @@ krt_got_route(struct krt_proto *p, rte *e)
  sentenced:
   krt_trace_in(p, e, ((char *[]) { "?", "seen", "will be updated", "will be removed", "ignored" }) [verdict]);
   net->n.flags = (net->n.flags & ~KRF_VERDICT_MASK) | verdict;
+  BUFFER_PUSH(p->scanned) = net;
   if (verdict == KRF_UPDATE || verdict == KRF_DELETE)
     {
       /* Get a cached copy of attributes and temporarily link the route */
@@ -787,77 +1001,185 @@ krt_got_route(struct krt_proto *p, rte *e)
     rte_free(e);
 }
 
+static void
+krt_prune_net(struct krt_proto *p, net *n)
+{
+  struct fib_node *f = &n->n;
+  int verdict = f->flags & KRF_VERDICT_MASK;
+  rte *new, *old, *rt_free = NULL;
+  ea_list *tmpa = NULL;
+
+  if (verdict == KRF_UPDATE || verdict == KRF_DELETE)
+    {
+      /* Get a dummy route from krt_got_route() */
+      old = n->routes;
+      n->routes = old->next;
+    }
+  else
+    old = NULL;
+
+  if (verdict == KRF_CREATE || verdict == KRF_UPDATE)
+    {
+      /* We have to run export filter to get proper 'new' route */
+      new = krt_export_net(p, n, &rt_free, &tmpa);
+
+      if (!new)
+	verdict = (verdict == KRF_CREATE) ? KRF_IGNORE : KRF_DELETE;
+      else
+	tmpa = krt_resolve_tunnel(ea_append(tmpa, new->attrs->eattrs),
+				  lp_alloc(krt_filter_lp, KRT_TUNNEL_EA_SIZE));
+    }
+  else
+    new = NULL;
+
+  switch (verdict)
+    {
+    case KRF_CREATE:
+      if (new && (f->flags & KRF_INSTALLED))
+	{
+	  krt_trace_in(p, new, "reinstalling");
+	  krt_replace_rte(p, n, new, NULL, tmpa);
+	}
+      break;
+    case KRF_SEEN:
+    case KRF_IGNORE:
+      /* Nothing happens */
+      break;
+    case KRF_UPDATE:
+      krt_trace_in(p, new, "updating");
+      krt_replace_rte(p, n, new, old, tmpa);
+      break;
+    case KRF_DELETE:
+      krt_trace_in(p, old, "deleting");
+      krt_replace_rte(p, n, NULL, old, NULL);
+      break;
+    default:
+      bug("krt_prune: invalid route status");
+    }
+
+  if (old)
+    rte_free(old);
+  if (rt_free)
+    rte_free(rt_free);
+  lp_flush(krt_filter_lp);
+  f->flags &= ~KRF_VERDICT_MASK;
+}
+
+static inline net *
+krt_dirty_net(struct krt_proto *p, struct fib_node *f)
+{
+  return net_find(p->p.table, f->prefix, f->pxlen);
+}
+
+static void
+krt_dirty_flush(struct krt_proto *p)
+{
+  fib_free(&p->dirty);
+  fib_init(&p->dirty, p->p.pool, sizeof(struct fib_node), 0, NULL);
+}
+
+/*
+ * In incremental mode, only nets that were seen in the kernel table during the
+ * scan and nets changed since the last scan (the dirty set) are reconciled. It
+ * is possible only if all installed nets missing in the kernel table are in the
+ * dirty set, which we check by counting them. Otherwise (or during a periodic
+ * audit) we fall back to the full walk through the routing table.
+ */
+static int
+krt_prune_incremental(struct krt_proto *p)
+{
+  u32 missing = 0;
+  uint i, keep;
+  net *n;
+
+  if (p->audit)
+    return 0;
+
+  FIB_WALK(&p->dirty, f)
+    {
+      n = krt_dirty_net(p, f);
+      if (n && (n->n.flags & KRF_INSTALLED) && !(n->n.flags & KRF_VERDICT_MASK))
+	missing++;
+    }
+  FIB_WALK_END;
+
+  /* With the shadow table, all missing nets are in the dirty set */
+  if (!p->async && (p->seen + missing != p->installed))
+    {
+      KRT_TRACE(p, D_EVENTS, "Missing routes, falling back to full prune");
+      return 0;
+    }
+
+  /* Reinstall changed nets missing in the kernel table */
+  FIB_WALK(&p->dirty, f)
+    {
+      n = krt_dirty_net(p, f);
+      if (n && (n->n.flags & KRF_INSTALLED) && !(n->n.flags & KRF_VERDICT_MASK))
+	krt_prune_net(p, n);
+    }
+  FIB_WALK_END;
+
+  for (i = 0; i < p->scanned.used; i++)
+    krt_prune_net(p, p->scanned.data[i]);
+
+  /* Nets with failed synchronization are kept dirty for the next scan */
+  for (i = keep = 0; i < p->scanned.used; i++)
+    if (p->scanned.data[i]->n.flags & KRF_SYNC_ERROR)
+      p->scanned.data[keep++] = p->scanned.data[i];
+  BUFFER_SET(p->scanned, keep);
+
+  FIB_WALK(&p->dirty, f)
+    {
+      n = krt_dirty_net(p, f);
+      if (n && (n->n.flags & KRF_SYNC_ERROR))
+	BUFFER_PUSH(p->scanned) = n;
+    }
+  FIB_WALK_END;
+
+  krt_dirty_flush(p);
+  for (i = 0; i < p->scanned.used; i++)
+    fib_get(&p->dirty, &p->scanned.data[i]->n.prefix, p->scanned.data[i]->n.pxlen);
+
+  return 1;
+}
+
 static void
 krt_prune(struct krt_proto *p)
 {
   struct rtable *t = p->p.table;
 
   KRT_TRACE(p, D_EVENTS, "Pruning table %s", t->name);
-  FIB_WALK(&t->fib, f)
+
+  if (!krt_prune_incremental(p))
     {
-      net *n = (net *) f;
-      int verdict = f->flags & KRF_VERDICT_MASK;
-      rte *new, *old, *rt_free = NULL;
-      ea_list *tmpa = NULL;
+      u32 installed = 0;
 
-      if (verdict == KRF_UPDATE || verdict == KRF_DELETE)
+      krt_dirty_flush(p);
+      FIB_WALK(&t->fib, f)
 	{
-	  /* Get a dummy route from krt_got_route() */
-	  old = n->routes;
-	  n->routes = old->next;
-	}
-      else
-	old = NULL;
+	  net *n = (net *) f;
 
-      if (verdict == KRF_CREATE || verdict == KRF_UPDATE)
-	{
-	  /* We have to run export filter to get proper 'new' route */
-	  new = krt_export_net(p, n, &rt_free, &tmpa);
+	  krt_prune_net(p, n);
 
-	  if (!new)
-	    verdict = (verdict == KRF_CREATE) ? KRF_IGNORE : KRF_DELETE;
-	  else
-	    tmpa = ea_append(tmpa, new->attrs->eattrs);
-	}
-      else
-	new = NULL;
+	  if (f->flags & KRF_INSTALLED)
+	    installed++;
 
-      switch (verdict)
-	{
-	case KRF_CREATE:
-	  if (new && (f->flags & KRF_INSTALLED))
-	    {
-	      krt_trace_in(p, new, "reinstalling");
-	      krt_replace_rte(p, n, new, NULL, tmpa);
-	    }
-	  break;
-	case KRF_SEEN:
-	case KRF_IGNORE:
-	  /* Nothing happens */
-	  break;
-	case KRF_UPDATE:
-	  krt_trace_in(p, new, "updating");
-	  krt_replace_rte(p, n, new, old, tmpa);
-	  break;
-	case KRF_DELETE:
-	  krt_trace_in(p, old, "deleting");
-	  krt_replace_rte(p, n, NULL, old, NULL);
-	  break;
-	default:
-	  bug("krt_prune: invalid route status");
+	  if (f->flags & KRF_SYNC_ERROR)
+	    fib_get(&p->dirty, &f->prefix, f->pxlen);
 	}
+      FIB_WALK_END;
 
-      if (old)
-	rte_free(old);
-      if (rt_free)
-	rte_free(rt_free);
-      lp_flush(krt_filter_lp);
-      f->flags &= ~KRF_VERDICT_MASK;
+      p->installed = installed;
+      p->last_audit = now;
+      p->resync = 0;
     }
-  FIB_WALK_END;
+
+  BUFFER_FLUSH(p->scanned);
+  p->seen = 0;
 
 #ifdef KRT_ALLOW_LEARN
-  if (KRT_CF->learn)
+  /* Learned routes are pruned only after a real scan */
+  if (KRT_CF->learn && !p->async)
     krt_learn_prune(p);
 #endif
 
@@ -865,6 +1187,24 @@ krt_prune(struct krt_proto *p)
     p->initialized = 1;
 }
 
+/*
+ * krt_scan_begin() decides whether the following scan will be a full one. It
+ * is needed before the first pruning, in regular mode, periodically as a safety
+ * net, and on reload. In async scan mode, only full scans dump the kernel table.
+ */
+static void
+krt_scan_begin(struct krt_proto *p)
+{
+  int audit = !p->initialized || p->reload ||
+    (KRT_CF->audit_time && ((now - p->last_audit) >= KRT_CF->audit_time));
+
+  p->async = KRT_CF->async_scan && !audit && !p->resync;
+  p->audit = !p->async && (audit || KRT_CF->async_scan || !KRT_CF->incremental);
+
+  if (KRT_CF->async_scan && !p->async)
+    krt_shadow_flush(p);
+}
+
 void
 krt_got_route_async(struct krt_proto *p, rte *e, int new)
 {
@@ -873,7 +1213,10 @@ krt_got_route_async(struct krt_proto *p, rte *e, int new)
   switch (e->u.krt.src)
     {
     case KRT_SRC_BIRD:
-      ASSERT(0);			/* Should be filtered by the back end */
+      /* Should be filtered by the back end unless we keep the shadow table */
+      ASSERT(KRT_CF->async_scan);
+      krt_shadow_update(p, e, new);
+      break;
 
     case KRT_SRC_REDIRECT:
       if (new)
@@ -917,9 +1260,39 @@ krt_scan(timer *t UNUSED)
   p = SKIP_BACK(struct krt_proto, krt_node, HEAD(krt_proto_list));
   KRT_TRACE(p, D_EVENTS, "Scanning routing table");
 
+  void *q;
+  int dump = 0;
+  WALK_LIST(q, krt_proto_list)
+  {
+    p = SKIP_BACK(struct krt_proto, krt_node, q);
+    krt_scan_begin(p);
+    dump |= !p->async;
+  }
+
+  if (!dump)
+  {
+    /* Shadow tables must be up to date with our recent changes */
+    krt_sys_drain_async();
+
+    WALK_LIST(q, krt_proto_list)
+      krt_async_scan(SKIP_BACK(struct krt_proto, krt_node, q));
+    return;
+  }
+
+  /* The kernel table dump is shared, so all protocols use it */
+  WALK_LIST(q, krt_proto_list)
+  {
+    p = SKIP_BACK(struct krt_proto, krt_node, q);
+    if (p->async)
+    {
+      p->async = 0;
+      p->audit = 1;
+      krt_shadow_flush(p);
+    }
+  }
+
   krt_do_scan(NULL);
 
-  void *q;
   WALK_LIST(q, krt_proto_list)
   {
     p = SKIP_BACK(struct krt_proto, krt_node, q);
@@ -966,6 +1339,15 @@ krt_scan(timer *t)
   kif_force_scan();
 
   KRT_TRACE(p, D_EVENTS, "Scanning routing table");
+  krt_scan_begin(p);
+
+  if (p->async)
+  {
+    krt_sys_drain_async();
+    krt_async_scan(p);
+    return;
+  }
+
   krt_do_scan(p);
   krt_prune(p);
 }
@@ -1045,8 +1427,11 @@ krt_import_control(struct proto *P, rte **new, ea_list **attrs UNUSED, struct li
      * We will remove KRT_INSTALLED flag, which stops such withdraw to be
      * processed in krt_rt_notify() and krt_replace_rte().
      */
-    if (e == e->net->routes)
+    if ((e == e->net->routes) && (e->net->n.flags & KRF_INSTALLED))
+    {
       e->net->n.flags &= ~KRF_INSTALLED;
+      p->installed--;
+    }
 #endif
     return -1;
   }
@@ -1072,12 +1457,24 @@ krt_rt_notify(struct proto *P, struct rtable *table UNUSED, net *net,
     return;
   if (!(net->n.flags & KRF_INSTALLED))
     old = NULL;
+  else
+    p->installed--;
   if (new)
-    net->n.flags |= KRF_INSTALLED;
+    {
+      net->n.flags |= KRF_INSTALLED;
+      p->installed++;
+    }
   else
     net->n.flags &= ~KRF_INSTALLED;
-  if (p->initialized)		/* Before first scan we don't touch the routes */
-    krt_replace_rte(p, net, new, old, eattrs);
+  if (KRT_CF->incremental)
+    fib_get(&p->dirty, &net->n.prefix, net->n.pxlen);
+  if (!p->initialized)		/* Before first scan we don't touch the routes */
+    return;
+
+  if (new)
+    eattrs = krt_resolve_tunnel(eattrs, alloca(KRT_TUNNEL_EA_SIZE));
+
+  krt_replace_rte(p, net, new, old, eattrs);
 }
 
 static void
@@ -1169,6 +1566,12 @@ krt_start(struct proto *P)
   krt_learn_init(p);
 #endif
 
+  fib_init(&p->dirty, p->p.pool, sizeof(struct fib_node), 0, NULL);
+  fib_init(&p->shadow, p->p.pool, sizeof(struct krt_shadow), 0, krt_shadow_init);
+  BUFFER_INIT(p->scanned, p->p.pool, 64);
+  p->installed = p->seen = 0;
+  p->last_audit = 0;
+
   if (!krt_sys_start(p))
   {
     rem_node(&p->krt_node);
@@ -1194,6 +1597,8 @@ krt_shutdown(struct proto *P)
   if (p->initialized && !KRT_CF->persist)
     krt_flush_routes(p);
 
+  krt_shadow_flush(p);
+
   p->ready = 0;
   p->initialized = 0;
 
@@ -1217,7 +1622,8 @@ krt_reconfigure(struct proto *p, struct proto_config *new)
 
   /* persist, graceful restart need not be the same */
   return o->scan_time == n->scan_time && o->learn == n->learn &&
-    o->devroutes == n->devroutes && o->merge_paths == n->merge_paths;
+    o->devroutes == n->devroutes && o->merge_paths == n->merge_paths &&
+    o->incremental == n->incremental && o->async_scan == n->async_scan;
 }
 
 static void
@@ -1253,6 +1659,7 @@ krt_init_config(int class)
 
   krt_cf = (struct krt_config *) proto_config_new(&proto_unix_kernel, class);
   krt_cf->scan_time = 60;
+  krt_cf->audit_time = KRT_DEFAULT_AUDIT_TIME;
 
   krt_sys_init_config(krt_cf);
   return (struct proto_config *) krt_cf;
@@ -16,6 +16,7 @@ struct kif_config;
 struct kif_proto;
 
 #include "lib/krt-sys.h"
+#include "lib/buffer.h"
 
 /* Flags stored in net->n.flags, rest are in nest/route.h */
 
@@ -27,6 +28,7 @@ struct kif_proto;
 #define KRF_IGNORE 4			/* To be ignored */
 
 #define KRT_DEFAULT_ECMP_LIMIT	16
+#define KRT_DEFAULT_AUDIT_TIME	600
 
 #define EA_KRT_SOURCE	EA_CODE(EAP_KRT, 0)
 #define EA_KRT_METRIC	EA_CODE(EAP_KRT, 1)
@@ -50,6 +52,9 @@ struct krt_config {
   int devroutes;		/* Allow export of device routes */
   int graceful_restart;		/* Regard graceful restart recovery */
   int merge_paths;		/* Exported routes are merged for ECMP */
+  int incremental;		/* Reconcile only changed routes during scans */
+  int async_scan;		/* Track kernel routes using async notifications */
+  int audit_time;		/* How often we do a full scan in incremental mode */
 };
 
 struct krt_proto {
@@ -68,6 +73,23 @@ struct krt_proto {
   byte ready;			/* Initial feed has been finished */
   byte initialized;		/* First scan has been finished */
   byte reload;			/* Next scan is doing reload */
+  byte audit;			/* Current scan is a full scan */
+  byte async;			/* Current scan uses the shadow table instead of a dump */
+  byte resync;			/* Shadow table is not reliable, dump is needed */
+
+  struct fib dirty;		/* Nets changed since the last scan */
+  BUFFER(net *) scanned;	/* Nets with a verdict from the current scan */
+  u32 installed;		/* Number of nets with KRF_INSTALLED */
+  u32 seen;			/* Number of them seen in the current scan */
+  bird_clock_t last_audit;	/* Time of the last full scan */
+  struct fib shadow;		/* Our routes in the kernel table (struct krt_shadow) */
+};
+
+struct krt_shadow {
+  struct fib_node n;
+  rta *attrs;			/* Cached attributes of the kernel route */
+  u32 metric;			/* Kernel metric of the route */
+  byte proto;			/* Kernel protocol of the route */
 };
 
 extern pool *krt_pool;
@@ -83,6 +105,7 @@ struct proto_config * kif_init_config(int class);
 void kif_request_scan(void);
 void krt_got_route(struct krt_proto *p, struct rte *e);
 void krt_got_route_async(struct krt_proto *p, struct rte *e, int new);
+void krt_async_overflow(void);
 
 /* Values for rte->u.krt_sync.src */
 #define KRT_SRC_UNKNOWN	-1	/* Nobody knows */
@@ -134,6 +157,7 @@ void krt_sys_copy_config(struct krt_config *, struct krt_config *);
 
 int  krt_capable(rte *e);
 void krt_do_scan(struct krt_proto *);
+void krt_sys_drain_async(void);
 void krt_replace_rte(struct krt_proto *p, net *n, rte *new, rte *old, struct ea_list *eattrs);
 int krt_sys_get_attr(eattr *a, byte *buf, int buflen);
 
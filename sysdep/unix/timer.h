@@ -23,12 +23,15 @@ typedef struct timer {
   uint recurrent;			/* Timer recurrence */
   node n;				/* Internal link */
   bird_clock_t expires;			/* 0=inactive */
+  btime when;				/* Exact expiration time in usec, valid if active */
 } timer;
 
 timer *tm_new(pool *);
 void tm_start(timer *, uint after);
+void tm_start_btime(timer *, btime after);
 void tm_stop(timer *);
 void tm_dump_all(void);
+btime tm_monotonic_time(void);
 
 extern bird_clock_t now; 		/* Relative, monotonic time in seconds */
 extern bird_clock_t now_real;		/* Time in seconds since fixed known epoch */